@@ -0,0 +1,15 @@
+/*  see copyright notice in squirrel.h */
+#ifndef _SQSTD_HEAP_H_
+#define _SQSTD_HEAP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+SQUIRREL_API SQRESULT sqstd_writeheapreport(HSQUIRRELVM v,const SQChar *snapshot,const SQChar *filename,SQInteger top);
+
+#ifdef __cplusplus
+} /*extern "C"*/
+#endif
+
+#endif /*_SQSTD_HEAP_H_*/
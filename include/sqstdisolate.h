@@ -0,0 +1,25 @@
+/*  see copyright notice in squirrel.h */
+#ifndef _SQSTD_ISOLATE_H_
+#define _SQSTD_ISOLATE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SQIsolatePool* HSQISOLATEPOOL;
+typedef SQRESULT (*SQISOLATEINIT)(HSQUIRRELVM v,SQInteger id,SQUserPointer up);
+
+SQUIRREL_API HSQISOLATEPOOL sqstd_isolate_newpool(SQInteger nworkers,SQInteger stacksize,SQISOLATEINIT init,SQUserPointer up);
+SQUIRREL_API void sqstd_isolate_closepool(HSQISOLATEPOOL pool);
+SQUIRREL_API SQInteger sqstd_isolate_getsize(HSQISOLATEPOOL pool);
+SQUIRREL_API SQRESULT sqstd_isolate_post(HSQISOLATEPOOL pool,SQInteger target,HSQUIRRELVM v,SQInteger idx);
+SQUIRREL_API SQRESULT sqstd_isolate_submit(HSQISOLATEPOOL pool,HSQUIRRELVM v,SQInteger idx);
+SQUIRREL_API SQRESULT sqstd_isolate_recv(HSQISOLATEPOOL pool,HSQUIRRELVM v,SQBool wait,SQInteger *from);
+
+SQUIRREL_API SQRESULT sqstd_register_isolatelib(HSQUIRRELVM v,HSQISOLATEPOOL pool,SQInteger id);
+
+#ifdef __cplusplus
+} /*extern "C"*/
+#endif
+
+#endif /*_SQSTD_ISOLATE_H_*/
@@ -0,0 +1,22 @@
+/*  see copyright notice in squirrel.h */
+#ifndef _SQSTD_PROFILER_H_
+#define _SQSTD_PROFILER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SQProfiler* HSQPROFILER;
+
+SQUIRREL_API HSQPROFILER sqstd_profiler_start(HSQUIRRELVM v,SQInteger interval);
+SQUIRREL_API void sqstd_profiler_stop(HSQPROFILER p);
+SQUIRREL_API void sqstd_profiler_release(HSQPROFILER p);
+SQUIRREL_API SQInteger sqstd_profiler_getsamples(HSQPROFILER p);
+SQUIRREL_API SQRESULT sqstd_profiler_writefolded(HSQPROFILER p,const SQChar *filename);
+SQUIRREL_API SQRESULT sqstd_profiler_writereport(HSQPROFILER p,const SQChar *filename);
+
+#ifdef __cplusplus
+} /*extern "C"*/
+#endif
+
+#endif /*_SQSTD_PROFILER_H_*/
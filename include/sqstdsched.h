@@ -0,0 +1,18 @@
+/*  see copyright notice in squirrel.h */
+#ifndef _SQSTD_SCHED_H_
+#define _SQSTD_SCHED_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+SQUIRREL_API SQRESULT sqstd_sched_spawn(HSQUIRRELVM v,SQInteger nargs);
+SQUIRREL_API SQRESULT sqstd_sched_run(HSQUIRRELVM v);
+
+SQUIRREL_API SQRESULT sqstd_register_schedlib(HSQUIRRELVM v);
+
+#ifdef __cplusplus
+} /*extern "C"*/
+#endif
+
+#endif /*_SQSTD_SCHED_H_*/
@@ -74,8 +74,15 @@ struct SQOuter;
 #define SQ_VMSTATE_RUNNING      1
 #define SQ_VMSTATE_SUSPENDED    2
 
+#define SQ_THREAD_LIGHTWEIGHT   0x00000001
+
+#define SQ_BUDGET_NONE          0
+#define SQ_BUDGET_THROW         1
+#define SQ_BUDGET_SUSPEND       2
+
 #define SQUIRREL_EOB 0
 #define SQ_BYTECODE_STREAM_TAG  0xFAFA
+#define SQ_MAPPED_STREAM_TAG    0xFAFB
 
 #define SQOBJECT_REF_COUNTED    0x08000000
 #define SQOBJECT_NUMERIC        0x04000000
@@ -172,6 +179,9 @@ typedef struct tagSQStackInfos{
 }SQStackInfos;
 
 typedef struct SQVM* HSQUIRRELVM;
+typedef struct SQFrozenProto* HSQFROZENPROTO;
+typedef struct SQFrozenData* HSQFROZENDATA;
+typedef struct SQVMTemplate* HSQVMTEMPLATE;
 typedef SQObject HSQOBJECT;
 typedef SQMemberHandle HSQMEMBERHANDLE;
 typedef SQInteger (*SQFUNCTION)(HSQUIRRELVM);
@@ -179,6 +189,8 @@ typedef SQInteger (*SQRELEASEHOOK)(SQUserPointer,SQInteger size);
 typedef void (*SQCOMPILERERROR)(HSQUIRRELVM,const SQChar * /*desc*/,const SQChar * /*source*/,SQInteger /*line*/,SQInteger /*column*/);
 typedef void (*SQPRINTFUNCTION)(HSQUIRRELVM,const SQChar * ,...);
 typedef void (*SQDEBUGHOOK)(HSQUIRRELVM /*v*/, SQInteger /*type*/, const SQChar * /*sourcename*/, SQInteger /*line*/, const SQChar * /*funcname*/);
+typedef void (*SQSAMPLEHOOK)(HSQUIRRELVM /*v*/, SQUserPointer /*up*/);
+typedef void (*SQBREAKHOOK)(HSQUIRRELVM /*v*/, SQInteger /*id*/, SQUserPointer /*up*/);
 typedef SQInteger (*SQWRITEFUNC)(SQUserPointer,SQUserPointer,SQInteger);
 typedef SQInteger (*SQREADFUNC)(SQUserPointer,SQUserPointer,SQInteger);
 
@@ -198,11 +210,21 @@ typedef struct tagSQFunctionInfo {
     SQInteger line;
 }SQFunctionInfo;
 
+typedef struct tagSQOpcodeStat {
+    const SQChar *name;
+    SQUnsignedInteger count;
+    SQUnsignedInteger cycles;
+}SQOpcodeStat;
+
 /*vm*/
 SQUIRREL_API HSQUIRRELVM sq_open(SQInteger initialstacksize);
 SQUIRREL_API HSQUIRRELVM sq_newthread(HSQUIRRELVM friendvm, SQInteger initialstacksize);
+SQUIRREL_API HSQUIRRELVM sq_newthreadex(HSQUIRRELVM friendvm, SQInteger initialstacksize, SQInteger flags);
 SQUIRREL_API void sq_seterrorhandler(HSQUIRRELVM v);
 SQUIRREL_API void sq_close(HSQUIRRELVM v);
+SQUIRREL_API SQRESULT sq_maketemplate(HSQUIRRELVM v,HSQVMTEMPLATE *tpl);
+SQUIRREL_API HSQUIRRELVM sq_openfromtemplate(HSQVMTEMPLATE tpl,SQInteger initialstacksize);
+SQUIRREL_API void sq_releasetemplate(HSQVMTEMPLATE tpl);
 SQUIRREL_API void sq_setforeignptr(HSQUIRRELVM v,SQUserPointer p);
 SQUIRREL_API SQUserPointer sq_getforeignptr(HSQUIRRELVM v);
 SQUIRREL_API void sq_setsharedforeignptr(HSQUIRRELVM v,SQUserPointer p);
@@ -217,12 +239,18 @@ SQUIRREL_API SQPRINTFUNCTION sq_geterrorfunc(HSQUIRRELVM v);
 SQUIRREL_API SQRESULT sq_suspendvm(HSQUIRRELVM v);
 SQUIRREL_API SQRESULT sq_wakeupvm(HSQUIRRELVM v,SQBool resumedret,SQBool retval,SQBool raiseerror,SQBool throwerror);
 SQUIRREL_API SQInteger sq_getvmstate(HSQUIRRELVM v);
+SQUIRREL_API void sq_setbudget(HSQUIRRELVM v,SQInteger ticks,SQInteger mode);
+SQUIRREL_API SQInteger sq_getbudget(HSQUIRRELVM v);
+SQUIRREL_API SQRESULT sq_suspendbudget(HSQUIRRELVM v);
+SQUIRREL_API SQRESULT sq_shrinkthread(HSQUIRRELVM v);
 SQUIRREL_API SQInteger sq_getversion();
 
 /*compiler*/
 SQUIRREL_API SQRESULT sq_compile(HSQUIRRELVM v,SQLEXREADFUNC read,SQUserPointer p,const SQChar *sourcename,SQBool raiseerror);
 SQUIRREL_API SQRESULT sq_compilebuffer(HSQUIRRELVM v,const SQChar *s,SQInteger size,const SQChar *sourcename,SQBool raiseerror);
 SQUIRREL_API void sq_enabledebuginfo(HSQUIRRELVM v, SQBool enable);
+SQUIRREL_API SQBool sq_isdebuginfoenabled(HSQUIRRELVM v);
+SQUIRREL_API void sq_enablelazycompilation(HSQUIRRELVM v, SQBool enable);
 SQUIRREL_API void sq_notifyallexceptions(HSQUIRRELVM v, SQBool enable);
 SQUIRREL_API void sq_setcompilererrorhandler(HSQUIRRELVM v,SQCOMPILERERROR f);
 
@@ -322,6 +350,10 @@ SQUIRREL_API SQRESULT sq_setfreevariable(HSQUIRRELVM v,SQInteger idx,SQUnsignedI
 SQUIRREL_API SQRESULT sq_next(HSQUIRRELVM v,SQInteger idx);
 SQUIRREL_API SQRESULT sq_getweakrefval(HSQUIRRELVM v,SQInteger idx);
 SQUIRREL_API SQRESULT sq_clear(HSQUIRRELVM v,SQInteger idx);
+SQUIRREL_API SQRESULT sq_freeze(HSQUIRRELVM v,SQInteger idx,HSQFROZENDATA *fd);
+SQUIRREL_API void sq_pushfrozendata(HSQUIRRELVM v,HSQFROZENDATA fd);
+SQUIRREL_API void sq_releasefrozendata(HSQFROZENDATA fd);
+SQUIRREL_API SQBool sq_isfrozen(HSQUIRRELVM v,SQInteger idx);
 
 /*calls*/
 SQUIRREL_API SQRESULT sq_call(HSQUIRRELVM v,SQInteger params,SQBool retval,SQBool raiseerror);
@@ -357,6 +389,14 @@ SQUIRREL_API SQRESULT sq_resurrectunreachable(HSQUIRRELVM v);
 /*serialization*/
 SQUIRREL_API SQRESULT sq_writeclosure(HSQUIRRELVM vm,SQWRITEFUNC writef,SQUserPointer up);
 SQUIRREL_API SQRESULT sq_readclosure(HSQUIRRELVM vm,SQREADFUNC readf,SQUserPointer up);
+SQUIRREL_API void sq_newpermanents(HSQUIRRELVM v,SQBool byname);
+SQUIRREL_API SQRESULT sq_writeheap(HSQUIRRELVM vm,SQWRITEFUNC writef,SQUserPointer up);
+SQUIRREL_API SQRESULT sq_readheap(HSQUIRRELVM vm,SQREADFUNC readf,SQUserPointer up);
+SQUIRREL_API SQRESULT sq_freezeclosure(HSQUIRRELVM vm,HSQFROZENPROTO *fp);
+SQUIRREL_API SQRESULT sq_thawclosure(HSQUIRRELVM vm,HSQFROZENPROTO fp);
+SQUIRREL_API void sq_releasefrozenproto(HSQFROZENPROTO fp);
+SQUIRREL_API SQRESULT sq_writefrozenproto(HSQUIRRELVM vm,HSQFROZENPROTO fp,SQWRITEFUNC writef,SQUserPointer up);
+SQUIRREL_API SQRESULT sq_mapfrozenproto(HSQUIRRELVM vm,SQUserPointer buf,SQInteger size,SQRELEASEHOOK hook,HSQFROZENPROTO *fp);
 
 /*mem allocation*/
 SQUIRREL_API void *sq_malloc(SQUnsignedInteger size);
@@ -367,6 +407,20 @@ SQUIRREL_API void sq_free(void *p,SQUnsignedInteger size);
 SQUIRREL_API SQRESULT sq_stackinfos(HSQUIRRELVM v,SQInteger level,SQStackInfos *si);
 SQUIRREL_API void sq_setdebughook(HSQUIRRELVM v);
 SQUIRREL_API void sq_setnativedebughook(HSQUIRRELVM v,SQDEBUGHOOK hook);
+SQUIRREL_API void sq_setsamplehook(HSQUIRRELVM v,SQSAMPLEHOOK hook,SQUserPointer up);
+SQUIRREL_API void sq_requestsample(HSQUIRRELVM v);
+SQUIRREL_API SQInteger sq_getopcodestats(HSQUIRRELVM v,SQOpcodeStat *stats,SQInteger size);
+SQUIRREL_API void sq_resetopcodestats(HSQUIRRELVM v);
+SQUIRREL_API void sq_setbreakhook(HSQUIRRELVM v,SQBREAKHOOK hook,SQUserPointer up);
+SQUIRREL_API SQRESULT sq_setbreakpoint(HSQUIRRELVM v,SQInteger idx,SQInteger line,SQInteger *id);
+SQUIRREL_API SQRESULT sq_removebreakpoint(HSQUIRRELVM v,SQInteger id);
+SQUIRREL_API void sq_enablecoverage(HSQUIRRELVM v,SQBool enable);
+SQUIRREL_API SQRESULT sq_writecoverage(HSQUIRRELVM v,SQWRITEFUNC writef,SQUserPointer up);
+SQUIRREL_API SQRESULT sq_readcoverage(HSQUIRRELVM v,SQREADFUNC readf,SQUserPointer up);
+SQUIRREL_API void sq_starttrace(HSQUIRRELVM v,SQInteger size);
+SQUIRREL_API void sq_stoptrace(HSQUIRRELVM v);
+SQUIRREL_API SQRESULT sq_writetrace(HSQUIRRELVM v,SQWRITEFUNC writef,SQUserPointer up);
+SQUIRREL_API SQRESULT sq_writeheapsnapshot(HSQUIRRELVM v,SQWRITEFUNC writef,SQUserPointer up);
 
 /*UTILITY MACRO*/
 #define sq_isnumeric(o) ((o)._type&SQOBJECT_NUMERIC)
@@ -16,6 +16,10 @@
 #include <sqstdmath.h>
 #include <sqstdstring.h>
 #include <sqstdaux.h>
+#include <sqstdsched.h>
+#include <sqstdaio.h>
+#include <sqstdprofiler.h>
+#include <sqstdheap.h>
 
 #ifdef SQUNICODE
 #define scfprintf fwprintf
@@ -67,6 +71,42 @@ void PrintVersionInfos()
     scfprintf(stdout,_SC("%s %s (%d bits)\n"),SQUIRREL_VERSION,SQUIRREL_COPYRIGHT,((int)(sizeof(SQInteger)*8)));
 }
 
+static int CompareOpcodeStats(const void *a,const void *b)
+{
+    const SQOpcodeStat *sa = (const SQOpcodeStat *)a, *sb = (const SQOpcodeStat *)b;
+    if(sa->count == sb->count) return 0;
+    return sa->count < sb->count ? 1 : -1;
+}
+
+//prints the opcode histogram of VMs built with SQ_OPCODE_STATS
+void PrintOpcodeStats(HSQUIRRELVM v)
+{
+    SQOpcodeStat stats[256];
+    SQUnsignedInteger total = 0, cycles = 0;
+    SQInteger i, n = sq_getopcodestats(v,stats,256);
+    int w = 6;
+    for(i = 0; i < n; i++) {
+        total += stats[i].count;
+        cycles += stats[i].cycles;
+        if((int)scstrlen(stats[i].name) > w) w = (int)scstrlen(stats[i].name);
+    }
+    if(!total) return;
+    qsort(stats,(size_t)n,sizeof(SQOpcodeStat),CompareOpcodeStats);
+    if(!cycles) {
+        scfprintf(stderr,_SC("%-*s %14s %7s\n"),w,_SC("opcode"),_SC("count"),_SC("%"));
+        for(i = 0; i < n && stats[i].count; i++)
+            scfprintf(stderr,_SC("%-*s %14.0f %6.2f%%\n"),w,stats[i].name,(double)stats[i].count,100.0*stats[i].count/total);
+        return;
+    }
+    scfprintf(stderr,_SC("%-*s %14s %7s %16s %7s %9s\n"),w,_SC("opcode"),_SC("count"),_SC("%"),_SC("cycles"),_SC("%"),_SC("cyc/op"));
+    for(i = 0; i < n && stats[i].count; i++) {
+        scfprintf(stderr,_SC("%-*s %14.0f %6.2f%% %16.0f %6.2f%% %9.1f\n"),w,stats[i].name,
+            (double)stats[i].count,100.0*stats[i].count/total,
+            (double)stats[i].cycles,100.0*stats[i].cycles/cycles,
+            (double)stats[i].cycles/stats[i].count);
+    }
+}
+
 void PrintUsage()
 {
     scfprintf(stderr,_SC("usage: sq <options> <scriptpath [args]>.\n")
@@ -74,7 +114,15 @@ void PrintUsage()
         _SC("   -c              compiles the file to bytecode(default output 'out.cnut')\n")
         _SC("   -o              specifies output file for the -c option\n")
         _SC("   -c              compiles only\n")
+        _SC("   -m              compiles the file to a memory-mappable bytecode image (default output 'out.cnut')\n")
         _SC("   -d              generates debug infos\n")
+        _SC("   -l              compiles the functions on their first call\n")
+        _SC("   -k <dir>        caches the compiled scripts in dir\n")
+        _SC("   -p <file>       profiles the script, writes the folded stacks to file and the functions to stderr\n")
+        _SC("   -C <file>       generates debug infos and adds the lines executed to the lcov file\n")
+        _SC("   -t <file>       writes a Chrome trace of the calls, compiles and collections to the file\n")
+        _SC("   -s <file>       writes a snapshot of the heap to the file when the script ends\n")
+        _SC("   -H <file>       prints the objects and the classes that retain the most memory in a heap snapshot\n")
         _SC("   -v              displays version infos\n")
         _SC("   -h              prints help\n"));
 }
@@ -91,6 +139,10 @@ int getargs(HSQUIRRELVM v,int argc, char* argv[],SQInteger *retval)
     static SQChar temp[500];
 #endif
     char * output = NULL;
+    char * profile = NULL;
+    char * coverage = NULL;
+    char * trace = NULL;
+    char * snapshot = NULL;
     *retval = 0;
     if(argc>1)
     {
@@ -106,15 +158,84 @@ int getargs(HSQUIRRELVM v,int argc, char* argv[],SQInteger *retval)
                 case 'd': //DEBUG(debug infos)
                     sq_enabledebuginfo(v,1);
                     break;
+                case 'l':
+                    sq_enablelazycompilation(v,1);
+                    break;
                 case 'c':
                     compiles_only = 1;
                     break;
+                case 'm':
+                    compiles_only = 2;
+                    break;
                 case 'o':
                     if(arg < argc) {
                         arg++;
                         output = argv[arg];
                     }
                     break;
+                case 'k':
+                    if(arg+1 < argc) {
+                        const SQChar *err;
+                        arg++;
+#ifdef SQUNICODE
+                        mbstowcs(temp,argv[arg],strlen(argv[arg])+1);
+                        if(SQ_FAILED(sqstd_setcompilecache(v,temp))) {
+#else
+                        if(SQ_FAILED(sqstd_setcompilecache(v,argv[arg]))) {
+#endif
+                            sq_getlasterror(v);
+                            if(SQ_SUCCEEDED(sq_getstring(v,-1,&err)))
+                                scprintf(_SC("Error [%s]\n"),err);
+                            *retval = -1;
+                            return _ERROR;
+                        }
+                    }
+                    break;
+                case 'p':
+                    if(arg+1 < argc) {
+                        arg++;
+                        profile = argv[arg];
+                    }
+                    break;
+                case 'C':
+                    if(arg+1 < argc) {
+                        arg++;
+                        coverage = argv[arg];
+                        sq_enabledebuginfo(v,1);
+                        sq_enablecoverage(v,1);
+                    }
+                    break;
+                case 't':
+                    if(arg+1 < argc) {
+                        arg++;
+                        trace = argv[arg];
+                        sq_starttrace(v,65536);
+                    }
+                    break;
+                case 's':
+                    if(arg+1 < argc) {
+                        arg++;
+                        snapshot = argv[arg];
+                    }
+                    break;
+                case 'H':
+                    if(arg+1 < argc) {
+                        const SQChar *err;
+                        arg++;
+#ifdef SQUNICODE
+                        mbstowcs(temp,argv[arg],strlen(argv[arg])+1);
+                        if(SQ_SUCCEEDED(sqstd_writeheapreport(v,temp,NULL,0)))
+#else
+                        if(SQ_SUCCEEDED(sqstd_writeheapreport(v,argv[arg],NULL,0)))
+#endif
+                            return _DONE;
+                        sq_getlasterror(v);
+                        if(SQ_SUCCEEDED(sq_getstring(v,-1,&err)))
+                            scprintf(_SC("Error [%s]\n"),err);
+                        *retval = -1;
+                        return _ERROR;
+                    }
+                    break;
                 case 'v':
                     PrintVersionInfos();
                     return _DONE;
@@ -164,7 +285,11 @@ int getargs(HSQUIRRELVM v,int argc, char* argv[],SQInteger *retval)
                         outfile = output;
 #endif
                     }
-                    if(SQ_SUCCEEDED(sqstd_writeclosuretofile(v,outfile)))
+                    if(compiles_only == 2) {
+                        if(SQ_SUCCEEDED(sqstd_writemappedclosuretofile(v,outfile)))
+                            return _DONE;
+                    }
+                    else if(SQ_SUCCEEDED(sqstd_writeclosuretofile(v,outfile)))
                         return _DONE;
                 }
             }
@@ -190,17 +315,66 @@ int getargs(HSQUIRRELVM v,int argc, char* argv[],SQInteger *retval)
                         callargs++;
                         //sq_arrayappend(v,-2);
                     }
-                    if(SQ_SUCCEEDED(sq_call(v,callargs,SQTrue,SQTrue))) {
+                    HSQPROFILER prof = profile ? sqstd_profiler_start(v,0) : NULL;
+                    SQRESULT res = sq_call(v,callargs,SQTrue,SQTrue);
+                    int called = SQ_SUCCEEDED(res);
+                    if(called) {
                         SQObjectType type = sq_gettype(v,-1);
                         if(type == OT_INTEGER) {
                             *retval = type;
                             sq_getinteger(v,-1,retval);
                         }
-                        return _DONE;
+                        //runs the tasks spawned by the script
+                        res = sqstd_sched_run(v);
                     }
-                    else{
-                        return _ERROR;
+                    if(prof) {
+                        sqstd_profiler_stop(prof);
+#ifdef SQUNICODE
+                        mbstowcs(temp,profile,strlen(profile)+1);
+                        sqstd_profiler_writefolded(prof,temp);
+#else
+                        sqstd_profiler_writefolded(prof,profile);
+#endif
+                        sqstd_profiler_writereport(prof,NULL);
+                        sqstd_profiler_release(prof);
                     }
+                    if(coverage) {
+                        const SQChar *covfile;
+                        FILE *f = fopen(coverage,"rb");
+#ifdef SQUNICODE
+                        mbstowcs(temp,coverage,strlen(coverage)+1);
+                        covfile = temp;
+#else
+                        covfile = coverage;
+#endif
+                        //merges the lines of the previous runs
+                        if(f) fclose(f);
+                        if(f && SQ_FAILED(sqstd_readcoveragefromfile(v,covfile)))
+                            scfprintf(stderr,_SC("cannot merge the coverage file\n"));
+                        else
+                            sqstd_writecoveragetofile(v,covfile);
+                    }
+                    if(trace) {
+                        sq_stoptrace(v);
+#ifdef SQUNICODE
+                        mbstowcs(temp,trace,strlen(trace)+1);
+                        sqstd_writetracetofile(v,temp);
+#else
+                        sqstd_writetracetofile(v,trace);
+#endif
+                    }
+                    if(snapshot) {
+#ifdef SQUNICODE
+                        mbstowcs(temp,snapshot,strlen(snapshot)+1);
+                        sqstd_writeheapsnapshottofile(v,temp);
+#else
+                        sqstd_writeheapsnapshottofile(v,snapshot);
+#endif
+                    }
+                    if(SQ_SUCCEEDED(res))
+                        return _DONE;
+                    if(!called)
+                        return _ERROR;
 
                 }
             }
@@ -321,6 +495,8 @@ int main(int argc, char* argv[])
     sqstd_register_systemlib(v);
     sqstd_register_mathlib(v);
     sqstd_register_stringlib(v);
+    sqstd_register_schedlib(v);
+    sqstd_register_aiolib(v);
 
     //aux library
     //sets error handlers
@@ -338,6 +514,7 @@ int main(int argc, char* argv[])
         break;
     }
 
+    PrintOpcodeStats(v);
     sq_close(v);
 
 #if defined(_MSC_VER) && defined(_DEBUG)
@@ -0,0 +1,441 @@
+/* see copyright notice in squirrel.h */
+#include <squirrel.h>
+#include <string.h>
+#include <sqstdaio.h>
+
+#if defined(__linux__) && !defined(SQUNICODE)
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include "sqstdschedimpl.h"
+
+#define SQSTD_AIO_TYPE_TAG 0x80000300
+#define SQSTD_AIO_REGKEY _SC("std_aio")
+#define AIO_READSIZE 4096
+#define AIO_MAXEVENTS 64
+
+#define AIO_STREAM 0
+#define AIO_LISTENER 1
+#define AIO_TIMER 2
+
+struct SQAioHandle {
+    int fd;
+    SQInteger kind;
+    SQSchedTask *reader;
+    SQInteger readsize;
+    SQSchedTask *writer;
+    //what is left of a write that would have blocked
+    char *wbuf;
+    SQInteger wsize;
+    SQInteger wdone;
+};
+
+struct SQAio {
+    int epfd;
+};
+
+static SQInteger _aio_error(HSQUIRRELVM v)
+{
+    return sq_throwerror(v,strerror(errno));
+}
+
+static bool _aio_wouldblock()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static void _aio_freewbuf(SQAioHandle *h)
+{
+    if(h->wbuf) sq_free(h->wbuf,h->wsize);
+    h->wbuf = NULL;
+    h->wsize = h->wdone = 0;
+}
+
+static SQInteger _aio_releasehook(SQUserPointer p,SQInteger SQ_UNUSED_ARG(size))
+{
+    SQAioHandle *h = (SQAioHandle *)p;
+    //closing the fd also removes it from the epoll set
+    if(h->fd != -1) close(h->fd);
+    _aio_freewbuf(h);
+    sq_free(h,sizeof(SQAioHandle));
+    return 1;
+}
+
+//pushes a new handle that owns fd
+static SQRESULT _aio_pushhandle(HSQUIRRELVM v,int fd,SQInteger kind)
+{
+    SQAio *a = (SQAio *)_sched_get(v)->pollup;
+    sq_pushregistrytable(v);
+    sq_pushstring(v,SQSTD_AIO_REGKEY,-1);
+    sq_rawget(v,-2);
+    sq_remove(v,-2);
+    if(SQ_FAILED(sq_createinstance(v,-1))) {
+        sq_pop(v,1);
+        close(fd);
+        return SQ_ERROR;
+    }
+    sq_remove(v,-2);
+    SQAioHandle *h = (SQAioHandle *)sq_malloc(sizeof(SQAioHandle));
+    memset(h,0,sizeof(SQAioHandle));
+    h->fd = fd;
+    h->kind = kind;
+    sq_setinstanceup(v,-1,h);
+    sq_setreleasehook(v,-1,_aio_releasehook);
+    //edge triggered, every operation is tried before waiting
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = h;
+    if(epoll_ctl(a->epfd,EPOLL_CTL_ADD,fd,&ev) == -1) {
+        SQInteger ret = _aio_error(v);
+        sq_pop(v,1);
+        return ret;
+    }
+    return SQ_OK;
+}
+
+//returns 1 if a result was pushed, 0 if it would block or SQ_ERROR
+static SQInteger _aio_tryread(HSQUIRRELVM v,SQAioHandle *h)
+{
+    switch(h->kind) {
+    case AIO_LISTENER: {
+        int fd = accept4(h->fd,NULL,NULL,SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd == -1) return _aio_wouldblock() ? 0 : _aio_error(v);
+        return SQ_SUCCEEDED(_aio_pushhandle(v,fd,AIO_STREAM)) ? 1 : SQ_ERROR;
+    }
+    case AIO_TIMER: {
+        uint64_t n;
+        if(read(h->fd,&n,sizeof(n)) != (ssize_t)sizeof(n))
+            return _aio_wouldblock() ? 0 : _aio_error(v);
+        sq_pushinteger(v,(SQInteger)n);
+        return 1;
+    }
+    default: {
+        SQChar *buf = sq_getscratchpad(v,h->readsize);
+        ssize_t n;
+        while((n = read(h->fd,buf,h->readsize)) == -1 && errno == EINTR);
+        if(n == -1) return _aio_wouldblock() ? 0 : _aio_error(v);
+        if(n == 0) sq_pushnull(v);
+        else sq_pushstring(v,buf,n);
+        return 1;
+    }
+    }
+}
+
+//returns 1 once the pending buffer is written, 0 if it would block or SQ_ERROR
+static SQInteger _aio_trywrite(HSQUIRRELVM v,SQAioHandle *h)
+{
+    while(h->wdone < h->wsize) {
+        ssize_t n = write(h->fd,h->wbuf + h->wdone,h->wsize - h->wdone);
+        if(n == -1) {
+            if(errno == EINTR) continue;
+            if(_aio_wouldblock()) return 0;
+            SQInteger ret = _aio_error(v);
+            _aio_freewbuf(h);
+            return ret;
+        }
+        h->wdone += n;
+    }
+    _aio_freewbuf(h);
+    return 1;
+}
+
+static void _aio_poll(SQSched *s,SQInteger timeout)
+{
+    SQAio *a = (SQAio *)s->pollup;
+    struct epoll_event events[AIO_MAXEVENTS];
+    int n = epoll_wait(a->epfd,events,AIO_MAXEVENTS,timeout > INT_MAX ? INT_MAX : (int)timeout);
+    for(int i = 0; i < n; i++) {
+        SQAioHandle *h = (SQAioHandle *)events[i].data.ptr;
+        uint32_t ev = events[i].events;
+        if(h->reader && (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+            SQSchedTask *t = h->reader;
+            sq_reservestack(t->thread,4);
+            SQInteger ret = _aio_tryread(t->thread,h);
+            if(ret != 0) {
+                h->reader = NULL;
+                _sched_wake(s,t,ret == SQ_ERROR ? WAKE_THROW : WAKE_VALUE);
+            }
+        }
+        if(h->writer && (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+            SQSchedTask *t = h->writer;
+            SQInteger ret = _aio_trywrite(t->thread,h);
+            if(ret != 0) {
+                h->writer = NULL;
+                _sched_wake(s,t,ret == SQ_ERROR ? WAKE_THROW : 0);
+            }
+        }
+    }
+}
+
+static void _aio_pollrelease(SQSched *s)
+{
+    SQAio *a = (SQAio *)s->pollup;
+    close(a->epfd);
+    sq_free(a,sizeof(SQAio));
+    s->pollup = NULL;
+}
+
+#define SETUP_AIO(v) \
+    SQAioHandle *self = NULL; \
+    { if(SQ_FAILED(sq_getinstanceup(v,1,(SQUserPointer*)&self,(SQUserPointer)SQSTD_AIO_TYPE_TAG))) \
+        return sq_throwerror(v,_SC("invalid type tag"));  } \
+    if(!self || self->fd == -1) \
+        return sq_throwerror(v,_SC("the handle is closed"));
+
+static SQInteger _aio_read(HSQUIRRELVM v)
+{
+    SETUP_AIO(v);
+    SQSched *s = _sched_get(v);
+    if(self->reader) return sq_throwerror(v,_SC("another task is reading"));
+    SQInteger size = AIO_READSIZE;
+    if(sq_gettop(v) > 1) sq_getinteger(v,2,&size);
+    if(size <= 0) return sq_throwerror(v,_SC("invalid size"));
+    self->readsize = size;
+    SQInteger ret = _aio_tryread(v,self);
+    if(ret != 0) return ret;
+    SQSchedTask *t = _sched_task(s,v);
+    if(!t) return sq_throwerror(v,_SC("cannot block outside a task"));
+    ret = _sched_wait_io(v,s,t);
+    if(ret != SQ_ERROR) self->reader = t;
+    return ret;
+}
+
+static SQInteger _aio_write(HSQUIRRELVM v)
+{
+    SETUP_AIO(v);
+    SQSched *s = _sched_get(v);
+    if(self->kind != AIO_STREAM) return sq_throwerror(v,_SC("the handle is not writable"));
+    if(self->writer) return sq_throwerror(v,_SC("another task is writing"));
+    const SQChar *str;
+    sq_getstring(v,2,&str);
+    SQInteger len = sq_getsize(v,2);
+    SQInteger done = 0;
+    while(done < len) {
+        ssize_t n = write(self->fd,str + done,len - done);
+        if(n == -1) {
+            if(errno == EINTR) continue;
+            if(!_aio_wouldblock()) return _aio_error(v);
+            break;
+        }
+        done += n;
+    }
+    if(done == len) return 0;
+    SQSchedTask *t = _sched_task(s,v);
+    if(!t) return sq_throwerror(v,_SC("cannot block outside a task"));
+    SQInteger ret = _sched_wait_io(v,s,t);
+    if(ret != SQ_ERROR) {
+        self->wsize = len - done;
+        self->wbuf = (char *)sq_malloc(self->wsize);
+        memcpy(self->wbuf,str + done,self->wsize);
+        self->writer = t;
+    }
+    return ret;
+}
+
+static SQInteger _aio_close(HSQUIRRELVM v)
+{
+    SETUP_AIO(v);
+    SQSched *s = _sched_get(v);
+    close(self->fd);
+    self->fd = -1;
+    _aio_freewbuf(self);
+    SQSchedTask *waiting[2] = { self->reader, self->writer };
+    self->reader = self->writer = NULL;
+    for(SQInteger i = 0; i < 2; i++) {
+        if(waiting[i]) {
+            sq_throwerror(waiting[i]->thread,_SC("the handle was closed"));
+            _sched_wake(s,waiting[i],WAKE_THROW);
+        }
+    }
+    return 0;
+}
+
+static SQInteger _aio_fileno(HSQUIRRELVM v)
+{
+    SETUP_AIO(v);
+    sq_pushinteger(v,self->fd);
+    return 1;
+}
+
+#define _DECL_AIO_FUNC(name,nparams,typecheck) {_SC(#name),_aio_##name,nparams,typecheck}
+static const SQRegFunction _aio_methods[] = {
+    _DECL_AIO_FUNC(read,-1,_SC("xn")),
+    {_SC("accept"),_aio_read,1,_SC("x")},
+    _DECL_AIO_FUNC(write,2,_SC("xs")),
+    _DECL_AIO_FUNC(close,1,_SC("x")),
+    _DECL_AIO_FUNC(fileno,1,_SC("x")),
+    {NULL,(SQFUNCTION)0,0,NULL}
+};
+#undef _DECL_AIO_FUNC
+
+static SQInteger _g_aio_pipe(HSQUIRRELVM v)
+{
+    int fds[2];
+    if(pipe2(fds,O_NONBLOCK | O_CLOEXEC) == -1) return _aio_error(v);
+    sq_newarray(v,0);
+    if(SQ_FAILED(_aio_pushhandle(v,fds[0],AIO_STREAM))) {
+        close(fds[1]);
+        return SQ_ERROR;
+    }
+    sq_arrayappend(v,-2);
+    if(SQ_FAILED(_aio_pushhandle(v,fds[1],AIO_STREAM))) return SQ_ERROR;
+    sq_arrayappend(v,-2);
+    return 1;
+}
+
+static SQInteger _g_aio_fdopen(HSQUIRRELVM v)
+{
+    SQInteger fd;
+    sq_getinteger(v,2,&fd);
+    int flags = fcntl((int)fd,F_GETFL);
+    if(flags == -1 || fcntl((int)fd,F_SETFL,flags | O_NONBLOCK) == -1) return _aio_error(v);
+    return SQ_SUCCEEDED(_aio_pushhandle(v,(int)fd,AIO_STREAM)) ? 1 : SQ_ERROR;
+}
+
+static void _aio_setms(struct timespec *ts,SQInteger ms)
+{
+    ts->tv_sec = (time_t)(ms / 1000);
+    ts->tv_nsec = (long)(ms % 1000) * 1000000;
+}
+
+static SQInteger _g_aio_timer(HSQUIRRELVM v)
+{
+    SQInteger ms,interval = 0;
+    sq_getinteger(v,2,&ms);
+    if(sq_gettop(v) > 2) sq_getinteger(v,3,&interval);
+    if(ms < 0 || interval < 0) return sq_throwerror(v,_SC("negative time"));
+    int fd = timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK | TFD_CLOEXEC);
+    if(fd == -1) return _aio_error(v);
+    struct itimerspec its;
+    _aio_setms(&its.it_value,ms);
+    _aio_setms(&its.it_interval,interval);
+    //a zero value would disarm the timer
+    if(ms == 0) its.it_value.tv_nsec = 1;
+    if(timerfd_settime(fd,0,&its,NULL) == -1) {
+        SQInteger ret = _aio_error(v);
+        close(fd);
+        return ret;
+    }
+    return SQ_SUCCEEDED(_aio_pushhandle(v,fd,AIO_TIMER)) ? 1 : SQ_ERROR;
+}
+
+static SQInteger _aio_unixsocket(HSQUIRRELVM v,struct sockaddr_un *addr)
+{
+    const SQChar *path;
+    sq_getstring(v,2,&path);
+    if((size_t)sq_getsize(v,2) >= sizeof(addr->sun_path))
+        return sq_throwerror(v,_SC("path too long"));
+    memset(addr,0,sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path,path);
+    int fd = socket(AF_UNIX,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+    if(fd == -1) return _aio_error(v);
+    return fd;
+}
+
+static SQInteger _g_aio_listen(HSQUIRRELVM v)
+{
+    struct sockaddr_un addr;
+    SQInteger backlog = 128;
+    if(sq_gettop(v) > 2) sq_getinteger(v,3,&backlog);
+    SQInteger fd = _aio_unixsocket(v,&addr);
+    if(fd < 0) return SQ_ERROR;
+    if(bind((int)fd,(struct sockaddr *)&addr,sizeof(addr)) == -1 || listen((int)fd,(int)backlog) == -1) {
+        SQInteger ret = _aio_error(v);
+        close((int)fd);
+        return ret;
+    }
+    return SQ_SUCCEEDED(_aio_pushhandle(v,(int)fd,AIO_LISTENER)) ? 1 : SQ_ERROR;
+}
+
+static SQInteger _g_aio_connect(HSQUIRRELVM v)
+{
+    struct sockaddr_un addr;
+    SQInteger fd = _aio_unixsocket(v,&addr);
+    if(fd < 0) return SQ_ERROR;
+    //local sockets connect at once or fail
+    if(connect((int)fd,(struct sockaddr *)&addr,sizeof(addr)) == -1) {
+        SQInteger ret = _aio_error(v);
+        close((int)fd);
+        return ret;
+    }
+    return SQ_SUCCEEDED(_aio_pushhandle(v,(int)fd,AIO_STREAM)) ? 1 : SQ_ERROR;
+}
+
+#define _DECL_GLOBALAIO_FUNC(name,nparams,typecheck) {_SC(#name),_g_aio_##name,nparams,typecheck}
+static const SQRegFunction aiolib_funcs[]={
+    _DECL_GLOBALAIO_FUNC(pipe,1,NULL),
+    _DECL_GLOBALAIO_FUNC(fdopen,2,_SC(".n")),
+    _DECL_GLOBALAIO_FUNC(timer,-2,_SC(".nn")),
+    _DECL_GLOBALAIO_FUNC(listen,-2,_SC(".sn")),
+    _DECL_GLOBALAIO_FUNC(connect,2,_SC(".s")),
+    {NULL,(SQFUNCTION)0,0,NULL}
+};
+#undef _DECL_GLOBALAIO_FUNC
+
+static void _aio_regfuncs(HSQUIRRELVM v,const SQRegFunction *funcs)
+{
+    SQInteger i = 0;
+    while(funcs[i].name != 0) {
+        const SQRegFunction &f = funcs[i];
+        sq_pushstring(v,f.name,-1);
+        sq_newclosure(v,f.f,0);
+        sq_setparamscheck(v,f.nparamscheck,f.typemask);
+        sq_setnativeclosurename(v,-1,f.name);
+        sq_newslot(v,-3,SQFalse);
+        i++;
+    }
+}
+
+SQRESULT sqstd_register_aiolib(HSQUIRRELVM v)
+{
+    SQSched *s = _sched_get(v);
+    if(!s) return sq_throwerror(v,_SC("the scheduler library is not registered"));
+    if(!s->poll) {
+        int epfd = epoll_create1(EPOLL_CLOEXEC);
+        if(epfd == -1) return _aio_error(v);
+        SQAio *a = (SQAio *)sq_malloc(sizeof(SQAio));
+        a->epfd = epfd;
+        s->pollup = a;
+        s->poll = _aio_poll;
+        s->pollrelease = _aio_pollrelease;
+        sq_pushregistrytable(v);
+        sq_pushstring(v,SQSTD_AIO_REGKEY,-1);
+        sq_newclass(v,SQFalse);
+        sq_settypetag(v,-1,(SQUserPointer)SQSTD_AIO_TYPE_TAG);
+        _aio_regfuncs(v,_aio_methods);
+        sq_rawset(v,-3);
+        sq_pop(v,1);
+        //a peer closing a pipe must not kill the process
+        struct sigaction sa;
+        if(sigaction(SIGPIPE,NULL,&sa) == 0 && sa.sa_handler == SIG_DFL)
+            signal(SIGPIPE,SIG_IGN);
+    }
+    sq_pushstring(v,_SC("aio"),-1);
+    sq_newtable(v);
+    _aio_regfuncs(v,aiolib_funcs);
+    sq_pushstring(v,_SC("handle"),-1);
+    sq_pushregistrytable(v);
+    sq_pushstring(v,SQSTD_AIO_REGKEY,-1);
+    sq_rawget(v,-2);
+    sq_remove(v,-2);
+    sq_newslot(v,-3,SQFalse);
+    sq_newslot(v,-3,SQFalse);
+    return SQ_OK;
+}
+
+#else
+
+SQRESULT sqstd_register_aiolib(HSQUIRRELVM v)
+{
+    return sq_throwerror(v,_SC("async i/o is not supported on this platform"));
+}
+
+#endif
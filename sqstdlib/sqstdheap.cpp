@@ -0,0 +1,503 @@
+/* see copyright notice in squirrel.h */
+#include <squirrel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqstdio.h>
+#include <sqstdheap.h>
+
+#define HEAP_DEFAULT_TOP 20
+#define HEAP_PATHMAX 12
+#define HEAP_GROUP_BUCKETS 1024
+#define HEAP_LINE 512
+
+//an object of the snapshot; the strings point into the text of the snapshot
+struct SQHeapNode {
+    const SQChar *type;
+    const SQChar *label;
+    SQInteger size;
+    SQInteger retained;
+    SQInteger idom;
+    SQInteger order; //postorder number, -1 if not reachable from the roots
+    SQInteger parent; //edge from the node that first reached it
+    SQInteger cls; //class of an instance
+};
+
+struct SQHeapEdge {
+    SQInteger from;
+    SQInteger to;
+    SQChar kind;
+    const SQChar *name;
+};
+
+//objects of the same class or created by the same function
+struct SQHeapGroup {
+    SQHeapGroup *next;
+    SQUnsignedInteger hash;
+    SQInteger count;
+    SQInteger size;
+    SQInteger retained;
+    bool onpath; //an object of the group is on the dominator path being walked
+    SQChar key[1];
+};
+
+struct SQHeap {
+    HSQUIRRELVM vm;
+    SQFILE out;
+    SQChar *text;
+    SQInteger textsize;
+    SQHeapNode *nodes;
+    SQInteger nnodes;
+    SQHeapEdge *edges;
+    SQInteger nedges;
+    SQInteger *succ; //edges by source, succ[sstart[n]..sstart[n+1]]
+    SQInteger *sstart;
+    SQInteger *pred; //source nodes by target
+    SQInteger *pstart;
+    SQInteger *rpo; //reachable nodes in reverse postorder
+    SQInteger nreachable;
+    SQHeapGroup *buckets[HEAP_GROUP_BUCKETS];
+    SQHeapGroup **groups;
+    SQInteger ngroups;
+};
+
+#define _heap_alloc(type,n) ((type *)sq_malloc((n) * sizeof(type)))
+#define _heap_free(p,type,n) { if(p) sq_free(p,(n) * sizeof(type)); }
+
+static void _heap_write(SQHeap *h,const SQChar *s)
+{
+    if(h->out) {
+        sqstd_fwrite(const_cast<SQChar *>(s),sizeof(SQChar),(SQInteger)scstrlen(s),h->out);
+    }
+    else {
+        SQPRINTFUNCTION pf = sq_getprintfunc(h->vm);
+        if(pf) pf(h->vm,_SC("%s"),s);
+    }
+}
+
+static void _heap_release(SQHeap *h)
+{
+    _heap_free(h->text,SQChar,h->textsize + 1);
+    _heap_free(h->nodes,SQHeapNode,h->nnodes);
+    _heap_free(h->edges,SQHeapEdge,h->nedges);
+    _heap_free(h->succ,SQInteger,h->nedges);
+    _heap_free(h->sstart,SQInteger,h->nnodes + 1);
+    _heap_free(h->pred,SQInteger,h->nedges);
+    _heap_free(h->pstart,SQInteger,h->nnodes + 1);
+    _heap_free(h->rpo,SQInteger,h->nnodes);
+    _heap_free(h->groups,SQHeapGroup *,h->ngroups);
+    for(SQInteger i = 0; i < HEAP_GROUP_BUCKETS; i++) {
+        SQHeapGroup *g = h->buckets[i];
+        while(g) {
+            SQHeapGroup *next = g->next;
+            sq_free(g,sizeof(SQHeapGroup) + scstrlen(g->key) * sizeof(SQChar));
+            g = next;
+        }
+    }
+    if(h->out) sqstd_fclose(h->out);
+}
+
+static SQRESULT _heap_read(SQHeap *h,const SQChar *filename)
+{
+    SQFILE f = sqstd_fopen(filename,_SC("rb"));
+    if(!f) return sq_throwerror(h->vm,_SC("cannot open the file"));
+    sqstd_fseek(f,0,SQ_SEEK_END);
+    SQInteger size = sqstd_ftell(f) / sizeof(SQChar);
+    sqstd_fseek(f,0,SQ_SEEK_SET);
+    h->text = _heap_alloc(SQChar,size + 1);
+    h->textsize = size;
+    SQInteger n = sqstd_fread(h->text,sizeof(SQChar),size,f);
+    sqstd_fclose(f);
+    if(n != size) return sq_throwerror(h->vm,_SC("io error"));
+    h->text[size] = _SC('\0');
+    return SQ_OK;
+}
+
+static SQInteger _heap_number(SQChar **p)
+{
+    SQInteger n = -1;
+    SQChar *s = *p;
+    if(*s >= _SC('0') && *s <= _SC('9')) {
+        n = 0;
+        while(*s >= _SC('0') && *s <= _SC('9')) n = n * 10 + (*s++ - _SC('0'));
+    }
+    if(*s == _SC(' ')) s++;
+    *p = s;
+    return n;
+}
+
+static SQChar *_heap_word(SQChar **p)
+{
+    SQChar *s = *p,*w = s;
+    while(*s && *s != _SC(' ')) s++;
+    if(*s) *s++ = _SC('\0');
+    *p = s;
+    return w;
+}
+
+//splits the text in lines and fills the nodes and the edges
+static SQRESULT _heap_parse(SQHeap *h)
+{
+    static const SQChar header[] = _SC("sqheap 1\n");
+    SQInteger hlen = (SQInteger)scstrlen(header),i;
+    if(h->textsize < hlen || memcmp(h->text,header,hlen * sizeof(SQChar)) != 0)
+        return sq_throwerror(h->vm,_SC("not a heap snapshot"));
+    SQInteger nnodes = 0,nedges = 0;
+    for(i = hlen; i < h->textsize; i++) {
+        if(h->text[i] == _SC('\n')) h->text[i] = _SC('\0');
+        if(i == hlen || h->text[i - 1] == _SC('\0')) {
+            if(h->text[i] == _SC('n')) nnodes++;
+            else if(h->text[i] == _SC('e')) nedges++;
+        }
+    }
+    if(nnodes < 2) return sq_throwerror(h->vm,_SC("invalid heap snapshot"));
+    h->nnodes = nnodes;
+    h->nedges = nedges;
+    h->nodes = _heap_alloc(SQHeapNode,nnodes);
+    h->edges = _heap_alloc(SQHeapEdge,nedges);
+    for(i = 0; i < nnodes; i++) {
+        SQHeapNode &n = h->nodes[i];
+        n.type = NULL;
+        n.label = _SC("");
+        n.size = n.retained = 0;
+        n.idom = n.order = n.parent = n.cls = -1;
+    }
+    nedges = 0;
+    for(SQChar *line = h->text + hlen; line < h->text + h->textsize; line += scstrlen(line) + 1) {
+        SQChar *p = line + 2;
+        if(line[0] == _SC('n') && line[1] == _SC(' ')) {
+            SQInteger id = _heap_number(&p);
+            if(id < 0 || id >= nnodes) return sq_throwerror(h->vm,_SC("invalid heap snapshot"));
+            SQHeapNode &n = h->nodes[id];
+            n.type = _heap_word(&p);
+            n.size = _heap_number(&p);
+            n.label = p;
+        }
+        else if(line[0] == _SC('e') && line[1] == _SC(' ')) {
+            SQHeapEdge &e = h->edges[nedges++];
+            e.from = _heap_number(&p);
+            e.to = _heap_number(&p);
+            e.kind = *p ? *p++ : _SC('i');
+            if(*p == _SC(' ')) p++;
+            e.name = p;
+            if(e.from < 0 || e.from >= nnodes || e.to < 0 || e.to >= nnodes)
+                return sq_throwerror(h->vm,_SC("invalid heap snapshot"));
+        }
+    }
+    for(i = 0; i < nnodes; i++) {
+        if(!h->nodes[i].type) return sq_throwerror(h->vm,_SC("invalid heap snapshot"));
+    }
+    return SQ_OK;
+}
+
+static void _heap_link(SQHeap *h)
+{
+    SQInteger i;
+    SQInteger *spos = _heap_alloc(SQInteger,h->nnodes);
+    SQInteger *ppos = _heap_alloc(SQInteger,h->nnodes);
+    h->sstart = _heap_alloc(SQInteger,h->nnodes + 1);
+    h->pstart = _heap_alloc(SQInteger,h->nnodes + 1);
+    h->succ = _heap_alloc(SQInteger,h->nedges);
+    h->pred = _heap_alloc(SQInteger,h->nedges);
+    memset(h->sstart,0,(h->nnodes + 1) * sizeof(SQInteger));
+    memset(h->pstart,0,(h->nnodes + 1) * sizeof(SQInteger));
+    for(i = 0; i < h->nedges; i++) {
+        h->sstart[h->edges[i].from + 1]++;
+        h->pstart[h->edges[i].to + 1]++;
+    }
+    for(i = 0; i < h->nnodes; i++) {
+        h->sstart[i + 1] += h->sstart[i];
+        h->pstart[i + 1] += h->pstart[i];
+        spos[i] = h->sstart[i];
+        ppos[i] = h->pstart[i];
+    }
+    //the edges of a node keep the order of the snapshot
+    for(i = 0; i < h->nedges; i++) {
+        SQHeapEdge &e = h->edges[i];
+        h->succ[spos[e.from]++] = i;
+        h->pred[ppos[e.to]++] = e.from;
+        if(e.kind == _SC('i') && scstrcmp(e.name,_SC("class")) == 0) h->nodes[e.from].cls = e.to;
+    }
+    _heap_free(spos,SQInteger,h->nnodes);
+    _heap_free(ppos,SQInteger,h->nnodes);
+}
+
+//numbers the nodes reachable from the roots in postorder, without recursion
+static void _heap_order(SQHeap *h)
+{
+    SQInteger *stack = _heap_alloc(SQInteger,h->nnodes);
+    SQInteger *next = _heap_alloc(SQInteger,h->nnodes);
+    SQInteger top = 0,count = 0;
+    for(SQInteger i = 0; i < h->nnodes; i++) next[i] = -1;
+    h->rpo = _heap_alloc(SQInteger,h->nnodes);
+    stack[top++] = 0;
+    next[0] = h->sstart[0];
+    while(top) {
+        SQInteger n = stack[top - 1];
+        if(next[n] < h->sstart[n + 1]) {
+            SQInteger to = h->edges[h->succ[next[n]++]].to;
+            if(next[to] == -1) {
+                next[to] = h->sstart[to];
+                stack[top++] = to;
+            }
+        }
+        else {
+            h->nodes[n].order = count++;
+            top--;
+        }
+    }
+    h->nreachable = count;
+    for(SQInteger j = 0; j < h->nnodes; j++) {
+        if(h->nodes[j].order >= 0) h->rpo[count - 1 - h->nodes[j].order] = j;
+    }
+    //the first edge that reaches a node gives the shortest path from the roots
+    SQInteger head = 0,tail = 0;
+    for(SQInteger k = 0; k < h->nnodes; k++) next[k] = 0;
+    stack[tail++] = 0;
+    next[0] = 1;
+    while(head < tail) {
+        SQInteger n = stack[head++];
+        for(SQInteger e = h->sstart[n]; e < h->sstart[n + 1]; e++) {
+            SQInteger to = h->edges[h->succ[e]].to;
+            if(next[to]) continue;
+            next[to] = 1;
+            h->nodes[to].parent = h->succ[e];
+            stack[tail++] = to;
+        }
+    }
+    _heap_free(stack,SQInteger,h->nnodes);
+    _heap_free(next,SQInteger,h->nnodes);
+}
+
+//immediate dominators with the iterative algorithm of Cooper, Harvey and Kennedy
+static void _heap_dominators(SQHeap *h)
+{
+    SQHeapNode *nodes = h->nodes;
+    bool changed = true;
+    nodes[0].idom = 0;
+    while(changed) {
+        changed = false;
+        for(SQInteger i = 1; i < h->nreachable; i++) {
+            SQInteger n = h->rpo[i],idom = -1;
+            for(SQInteger j = h->pstart[n]; j < h->pstart[n + 1]; j++) {
+                SQInteger p = h->pred[j];
+                if(nodes[p].idom < 0) continue;
+                if(idom < 0) { idom = p; continue; }
+                SQInteger a = p,b = idom;
+                while(a != b) {
+                    while(nodes[a].order < nodes[b].order) a = nodes[a].idom;
+                    while(nodes[b].order < nodes[a].order) b = nodes[b].idom;
+                }
+                idom = a;
+            }
+            if(nodes[n].idom != idom) {
+                nodes[n].idom = idom;
+                changed = true;
+            }
+        }
+    }
+    for(SQInteger k = 0; k < h->nreachable; k++) nodes[h->rpo[k]].retained = nodes[h->rpo[k]].size;
+    for(SQInteger r = h->nreachable - 1; r > 0; r--) {
+        SQHeapNode &n = nodes[h->rpo[r]];
+        nodes[n.idom].retained += n.retained;
+    }
+}
+
+static SQHeapGroup *_heap_group(SQHeap *h,const SQChar *key)
+{
+    SQUnsignedInteger hash = 5381;
+    SQInteger len = (SQInteger)scstrlen(key);
+    for(SQInteger i = 0; i < len; i++) hash = hash * 33 + (SQUnsignedInteger)key[i];
+    SQHeapGroup **bucket = &h->buckets[hash % HEAP_GROUP_BUCKETS];
+    for(SQHeapGroup *g = *bucket; g; g = g->next) {
+        if(g->hash == hash && scstrcmp(g->key,key) == 0) return g;
+    }
+    SQHeapGroup *g = (SQHeapGroup *)sq_malloc(sizeof(SQHeapGroup) + len * sizeof(SQChar));
+    g->next = *bucket;
+    g->hash = hash;
+    g->count = g->size = g->retained = 0;
+    g->onpath = false;
+    memcpy(g->key,key,(len + 1) * sizeof(SQChar));
+    *bucket = g;
+    h->ngroups++;
+    return g;
+}
+
+//the name of the slot that holds a class is the closest thing to its name
+static const SQChar *_heap_classname(SQHeap *h,SQInteger cls)
+{
+    SQInteger e = cls >= 0 ? h->nodes[cls].parent : -1;
+    if(e >= 0 && h->edges[e].kind == _SC('p')) return h->edges[e].name;
+    return _SC("(anonymous)");
+}
+
+//instances are grouped by class and functions by the place where they are defined
+static void _heap_groups(SQHeap *h)
+{
+    SQChar key[HEAP_LINE];
+    SQHeapGroup **bynode = _heap_alloc(SQHeapGroup *,h->nnodes);
+    SQInteger i;
+    for(i = 0; i < h->nreachable; i++) {
+        SQHeapNode &n = h->nodes[h->rpo[i]];
+        if(h->rpo[i] < 2) {
+            bynode[h->rpo[i]] = NULL;
+            continue;
+        }
+        if(scstrcmp(n.type,_SC("instance")) == 0)
+            scsprintf(key,HEAP_LINE,_SC("instance of %.200s"),_heap_classname(h,n.cls));
+        else if(*n.label && scstrcmp(n.type,_SC("string")) != 0)
+            scsprintf(key,HEAP_LINE,_SC("%s %.200s"),n.type,n.label);
+        else
+            scsprintf(key,HEAP_LINE,_SC("%s"),n.type);
+        bynode[h->rpo[i]] = _heap_group(h,key);
+    }
+    h->groups = _heap_alloc(SQHeapGroup *,h->ngroups);
+    SQInteger ng = 0;
+    for(i = 0; i < HEAP_GROUP_BUCKETS; i++) {
+        for(SQHeapGroup *g = h->buckets[i]; g; g = g->next) h->groups[ng++] = g;
+    }
+    //a group retains what its objects dominate, without counting twice the objects
+    //that are dominated by another object of the same group
+    SQInteger *children = _heap_alloc(SQInteger,h->nnodes);
+    SQInteger *cstart = _heap_alloc(SQInteger,h->nnodes + 1);
+    SQInteger *stack = _heap_alloc(SQInteger,h->nnodes);
+    bool *saved = _heap_alloc(bool,h->nnodes);
+    memset(cstart,0,(h->nnodes + 1) * sizeof(SQInteger));
+    for(i = 1; i < h->nreachable; i++) cstart[h->nodes[h->rpo[i]].idom + 1]++;
+    for(i = 0; i < h->nnodes; i++) cstart[i + 1] += cstart[i];
+    for(i = 1; i < h->nreachable; i++) {
+        SQInteger n = h->rpo[i];
+        children[cstart[h->nodes[n].idom]++] = n;
+    }
+    for(i = h->nnodes; i > 0; i--) cstart[i] = cstart[i - 1];
+    cstart[0] = 0;
+    SQInteger top = 0;
+    stack[top++] = 0;
+    while(top) {
+        SQInteger n = stack[top - 1];
+        if(n >= 0) {
+            SQHeapGroup *g = bynode[n];
+            stack[top - 1] = -1 - n;
+            if(g) {
+                g->count++;
+                g->size += h->nodes[n].size;
+                if(!g->onpath) g->retained += h->nodes[n].retained;
+                saved[n] = g->onpath;
+                g->onpath = true;
+            }
+            for(SQInteger c = cstart[n]; c < cstart[n + 1]; c++) stack[top++] = children[c];
+        }
+        else {
+            n = -1 - n;
+            if(bynode[n]) bynode[n]->onpath = saved[n];
+            top--;
+        }
+    }
+    _heap_free(children,SQInteger,h->nnodes);
+    _heap_free(cstart,SQInteger,h->nnodes + 1);
+    _heap_free(stack,SQInteger,h->nnodes);
+    _heap_free(saved,bool,h->nnodes);
+    _heap_free(bynode,SQHeapGroup *,h->nnodes);
+}
+
+static void _heap_path(SQHeap *h,SQInteger n)
+{
+    SQInteger path[HEAP_PATHMAX],len = 0;
+    while(n > 1 && h->nodes[n].parent >= 0) {
+        SQInteger e = h->nodes[n].parent;
+        if(len == HEAP_PATHMAX) {
+            memmove(path,path + 1,(HEAP_PATHMAX - 1) * sizeof(SQInteger));
+            len--;
+        }
+        path[len++] = e;
+        n = h->edges[e].from;
+    }
+    if(n > 1) _heap_write(h,_SC("..."));
+    for(SQInteger i = len - 1; i >= 0; i--) {
+        SQHeapEdge &e = h->edges[path[i]];
+        const SQChar *fmt = e.kind == _SC('p') ? _SC(".%s") : e.kind == _SC('e') ? _SC("[%s]") : _SC("<%s>");
+        if(e.from < 2) fmt = _SC("%s");
+        SQChar line[HEAP_LINE];
+        scsprintf(line,HEAP_LINE,fmt,e.name);
+        _heap_write(h,line);
+    }
+}
+
+static SQHeapNode *_heap_sortnodes;
+
+static int _heap_cmpnode(const void *a,const void *b)
+{
+    SQInteger ra = _heap_sortnodes[*(const SQInteger *)a].retained,rb = _heap_sortnodes[*(const SQInteger *)b].retained;
+    if(ra == rb) return *(const SQInteger *)a < *(const SQInteger *)b ? -1 : 1;
+    return ra < rb ? 1 : -1;
+}
+
+static int _heap_cmpgroup(const void *a,const void *b)
+{
+    const SQHeapGroup *ga = *(const SQHeapGroup * const *)a;
+    const SQHeapGroup *gb = *(const SQHeapGroup * const *)b;
+    if(ga->retained == gb->retained) return scstrcmp(ga->key,gb->key);
+    return ga->retained < gb->retained ? 1 : -1;
+}
+
+static void _heap_report(SQHeap *h,SQInteger top)
+{
+    SQChar line[HEAP_LINE];
+    SQHeapNode *nodes = h->nodes;
+    SQInteger total = 0,i;
+    for(i = 0; i < h->nnodes; i++) total += nodes[i].size;
+    scsprintf(line,HEAP_LINE,_SC("objects: %.0f  references: %.0f  size: %.0f  reachable: %.0f  garbage: %.0f\n"),
+        (double)(h->nnodes - 2),(double)h->nedges,(double)total,(double)(nodes[0].retained - nodes[1].retained),(double)nodes[1].retained);
+    _heap_write(h,line);
+
+    SQInteger *rows = _heap_alloc(SQInteger,h->nreachable);
+    SQInteger nrows = 0;
+    for(i = 0; i < h->nreachable; i++) {
+        if(h->rpo[i] > 1) rows[nrows++] = h->rpo[i];
+    }
+    _heap_sortnodes = nodes;
+    qsort(rows,nrows,sizeof(SQInteger),_heap_cmpnode);
+    _heap_write(h,_SC("\ntop objects by retained size:\n  retained   shallow  object\n"));
+    for(i = 0; i < nrows && i < top; i++) {
+        SQHeapNode &n = nodes[rows[i]];
+        const SQChar *label = scstrcmp(n.type,_SC("instance")) == 0 ? _heap_classname(h,n.cls) : n.label;
+        scsprintf(line,HEAP_LINE,_SC("%10.0f %9.0f  #%.0f %s%s%.200s\n            path: "),
+            (double)n.retained,(double)n.size,(double)rows[i],n.type,*label ? _SC(" ") : _SC(""),label);
+        _heap_write(h,line);
+        _heap_path(h,rows[i]);
+        SQHeapNode &d = nodes[n.idom];
+        scsprintf(line,HEAP_LINE,_SC("\n            dominator: #%.0f %s%s%.200s\n"),(double)n.idom,d.type,*d.label ? _SC(" ") : _SC(""),d.label);
+        _heap_write(h,line);
+    }
+    _heap_free(rows,SQInteger,h->nreachable);
+
+    qsort(h->groups,h->ngroups,sizeof(SQHeapGroup *),_heap_cmpgroup);
+    _heap_write(h,_SC("\ntop retainers by class and function:\n  retained   shallow     count  group\n"));
+    for(i = 0; i < h->ngroups && i < top; i++) {
+        SQHeapGroup *g = h->groups[i];
+        scsprintf(line,HEAP_LINE,_SC("%10.0f %9.0f %9.0f  %.400s\n"),(double)g->retained,(double)g->size,(double)g->count,g->key);
+        _heap_write(h,line);
+    }
+}
+
+SQRESULT sqstd_writeheapreport(HSQUIRRELVM v,const SQChar *snapshot,const SQChar *filename,SQInteger top)
+{
+    SQHeap h;
+    memset(&h,0,sizeof(h));
+    h.vm = v;
+    if(SQ_FAILED(_heap_read(&h,snapshot)) || SQ_FAILED(_heap_parse(&h))) {
+        _heap_release(&h);
+        return SQ_ERROR;
+    }
+    if(filename && !(h.out = sqstd_fopen(filename,_SC("wb")))) {
+        _heap_release(&h);
+        return sq_throwerror(v,_SC("cannot open the file"));
+    }
+    _heap_link(&h);
+    _heap_order(&h);
+    _heap_dominators(&h);
+    _heap_groups(&h);
+    _heap_report(&h,top > 0 ? top : HEAP_DEFAULT_TOP);
+    _heap_release(&h);
+    return SQ_OK;
+}
@@ -1,9 +1,20 @@
 /* see copyright notice in squirrel.h */
 #include <new>
 #include <stdio.h>
+#include <string.h>
 #include <squirrel.h>
 #include <sqstdio.h>
 #include "sqstdstream.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SQSTD_MMAP
+#ifndef SQUNICODE
+#define SQSTD_COMPILECACHE
+#endif
+#endif
 
 #define SQSTD_FILE_TYPE_TAG (SQSTD_STREAM_TYPE_TAG | 0x00000001)
 //basic API
@@ -265,46 +276,6 @@ static SQInteger _io_file_lexfeed_PLAIN(SQUserPointer iobuf)
 
 }
 
-#ifdef SQUNICODE
-static SQInteger _io_file_lexfeed_UTF8(SQUserPointer iobuf)
-{
-    IOBuffer *iobuffer = (IOBuffer *)iobuf;
-#define READ(iobuf) \
-    if((inchar = (unsigned char)_read_byte(iobuf)) == 0) \
-        return 0;
-
-    static const SQInteger utf8_lengths[16] =
-    {
-        1,1,1,1,1,1,1,1,        /* 0000 to 0111 : 1 byte (plain ASCII) */
-        0,0,0,0,                /* 1000 to 1011 : not valid */
-        2,2,                    /* 1100, 1101 : 2 bytes */
-        3,                      /* 1110 : 3 bytes */
-        4                       /* 1111 :4 bytes */
-    };
-    static const unsigned char byte_masks[5] = {0,0,0x1f,0x0f,0x07};
-    unsigned char inchar;
-    SQInteger c = 0;
-    READ(iobuffer);
-    c = inchar;
-    //
-    if(c >= 0x80) {
-        SQInteger tmp;
-        SQInteger codelen = utf8_lengths[c>>4];
-        if(codelen == 0)
-            return 0;
-            //"invalid UTF-8 stream";
-        tmp = c&byte_masks[codelen];
-        for(SQInteger n = 0; n < codelen-1; n++) {
-            tmp<<=6;
-            READ(iobuffer);
-            tmp |= inchar & 0x3F;
-        }
-        c = tmp;
-    }
-    return c;
-}
-#endif
-
 static SQInteger _io_file_lexfeed_UCS2_LE(SQUserPointer iobuf)
 {
     SQInteger ret;
@@ -325,6 +296,85 @@ static SQInteger _io_file_lexfeed_UCS2_BE(SQUserPointer iobuf)
     return 0;
 }
 
+//a whole script in memory, mapped where possible
+struct SQScriptSource
+{
+    unsigned char *data;
+    SQInteger size;
+    bool mapped;
+};
+
+static bool _load_source(SQFILE file,SQScriptSource *src)
+{
+    src->data = NULL;
+    src->mapped = false;
+    if(sqstd_fseek(file,0,SQ_SEEK_END) != 0)
+        return false;
+    src->size = sqstd_ftell(file);
+    if(src->size < 0 || sqstd_fseek(file,0,SQ_SEEK_SET) != 0)
+        return false;
+    if(src->size == 0)
+        return true;
+#ifdef SQSTD_MMAP
+    void *p = mmap(NULL,(size_t)src->size,PROT_READ,MAP_PRIVATE,fileno((FILE*)file),0);
+    if(p != MAP_FAILED) {
+        src->data = (unsigned char *)p;
+        src->mapped = true;
+        return true;
+    }
+#endif
+    src->data = (unsigned char *)sq_malloc(src->size);
+    if(sqstd_fread(src->data,1,src->size,file) != src->size) {
+        sq_free(src->data,src->size);
+        src->data = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void _release_source(SQScriptSource *src)
+{
+    if(!src->data)
+        return;
+#ifdef SQSTD_MMAP
+    if(src->mapped) {
+        munmap(src->data,(size_t)src->size);
+        return;
+    }
+#endif
+    sq_free(src->data,src->size);
+}
+
+//compiles a plain or UTF-8 script from memory, the lexer reads it in place
+static SQRESULT _compile_source(HSQUIRRELVM v,SQScriptSource *src,SQInteger skip,bool utf8,const SQChar *filename,SQBool printerror)
+{
+#ifdef SQUNICODE
+    static const SQInteger utf8_lengths[16] = { 1,1,1,1,1,1,1,1,0,0,0,0,2,2,3,4 };
+    static const unsigned char byte_masks[5] = {0,0,0x1f,0x0f,0x07};
+    SQInteger n = 0,alloc = sq_rsl(src->size - skip + 1);
+    SQChar *buf = (SQChar *)sq_malloc(alloc);
+    const unsigned char *p = src->data + skip,*end = src->data + src->size;
+    //decoded in a single pass, an invalid sequence ends the script like the stream readers do
+    while(p < end && *p) {
+        SQInteger c = *p++;
+        if(utf8 && c >= 0x80) {
+            SQInteger codelen = utf8_lengths[c>>4];
+            if(codelen == 0 || end - p < codelen - 1)
+                break;
+            c &= byte_masks[codelen];
+            for(SQInteger i = 0; i < codelen-1; i++) c = (c<<6) | (*p++ & 0x3F);
+        }
+        buf[n++] = (SQChar)c;
+    }
+    SQRESULT res = sq_compilebuffer(v,buf,n,filename,printerror);
+    sq_free(buf,alloc);
+    return res;
+#else
+    (void)utf8;
+    return sq_compilebuffer(v,(const SQChar *)(src->data + skip),src->size - skip,filename,printerror);
+#endif
+}
+
 SQInteger file_read(SQUserPointer file,SQUserPointer buf,SQInteger size)
 {
     SQInteger ret;
@@ -337,13 +387,140 @@ SQInteger file_write(SQUserPointer file,SQUserPointer p,SQInteger size)
     return sqstd_fwrite(p,1,size,(SQFILE)file);
 }
 
+SQRESULT sqstd_setcompilecache(HSQUIRRELVM v,const SQChar *dir)
+{
+#ifdef SQSTD_COMPILECACHE
+    //creates the directory itself, its parent must exist
+    struct stat st;
+    if(dir && ((mkdir(dir,0777) != 0 && errno != EEXIST) || stat(dir,&st) != 0 || !S_ISDIR(st.st_mode)))
+        return sq_throwerror(v,_SC("cannot create the compile cache directory"));
+#endif
+    sq_pushregistrytable(v);
+    sq_pushstring(v,_SC("std_compilecache"),-1);
+    if(dir) sq_pushstring(v,dir,-1);
+    else sq_pushnull(v);
+    SQRESULT res = sq_newslot(v,-3,SQFalse);
+    sq_pop(v,1);
+    return res;
+}
+
+#ifdef SQSTD_COMPILECACHE
+//compile cache: a compiled script is kept as a mappable bytecode image in <dir>/<hash of the path>.cnut,
+//after a header that describes the source it was compiled from; any mismatch recompiles the script
+#define SQSTD_CACHE_TAG (('S'<<24)|('Q'<<16)|('C'<<8)|('C'))
+#define SQSTD_CACHE_DEBUGINFO 0x00000001
+#define SQSTD_FNV_OFFSET 14695981039346656037ULL
+
+struct SQCacheHead
+{
+    SQUnsignedInteger32 tag;
+    SQUnsignedInteger32 flags;
+    unsigned long long pathhash;
+    unsigned long long size;
+    unsigned long long mtime;
+    unsigned long long hash;
+};
+
+struct SQCacheKey
+{
+    SQCacheHead head;
+    SQChar path[1024];
+};
+
+static unsigned long long _fnv1a(unsigned long long h,const unsigned char *p,size_t n)
+{
+    while(n--) { h ^= *p++; h *= 1099511628211ULL; }
+    return h;
+}
+
+static SQInteger _unmap_cached(SQUserPointer p,SQInteger size)
+{
+    munmap((unsigned char *)p - sizeof(SQCacheHead),(size_t)size + sizeof(SQCacheHead));
+    return 1;
+}
+
+//fills the key of a script hashing the whole source; false if the cache is disabled
+static bool _cache_key(HSQUIRRELVM v,const SQChar *filename,SQFILE file,SQScriptSource *src,SQCacheKey *key)
+{
+    const SQChar *dir;
+    struct stat st;
+    SQInteger top = sq_gettop(v);
+    sq_pushregistrytable(v);
+    sq_pushstring(v,_SC("std_compilecache"),-1);
+    bool enabled = SQ_SUCCEEDED(sq_rawget(v,-2)) && SQ_SUCCEEDED(sq_getstring(v,-1,&dir))
+        && fstat(fileno((FILE*)file),&st) == 0;
+    if(enabled) {
+        memset(&key->head,0,sizeof(key->head));
+        key->head.tag = SQSTD_CACHE_TAG;
+        key->head.flags = sq_isdebuginfoenabled(v) ? SQSTD_CACHE_DEBUGINFO : 0;
+        key->head.pathhash = _fnv1a(SQSTD_FNV_OFFSET,(const unsigned char *)filename,scstrlen(filename)*sizeof(SQChar));
+        key->head.size = (unsigned long long)st.st_size;
+        key->head.mtime = (unsigned long long)st.st_mtime;
+        SQInteger len = scsprintf(key->path,sizeof(key->path)/sizeof(SQChar),_SC("%s/%016llx.cnut"),dir,key->head.pathhash);
+        enabled = len > 0 && len < (SQInteger)(sizeof(key->path)/sizeof(SQChar));
+    }
+    sq_settop(v,top);
+    if(!enabled)
+        return false;
+    key->head.hash = _fnv1a(SQSTD_FNV_OFFSET,src->data,(size_t)src->size);
+    return true;
+}
+
+//pushes the cached closure of a script if the cache has an entry that matches its key
+static bool _cache_load(HSQUIRRELVM v,SQCacheKey *key)
+{
+    SQCacheHead head;
+    struct stat st;
+    SQFILE file = sqstd_fopen(key->path,_SC("rb"));
+    if(!file)
+        return false;
+    if(sqstd_fread(&head,1,sizeof(head),file) != sizeof(head) || memcmp(&head,&key->head,sizeof(head)) != 0
+        || fstat(fileno((FILE*)file),&st) != 0 || st.st_size <= (off_t)sizeof(head)) {
+        sqstd_fclose(file);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    unsigned char *buf = (unsigned char *)mmap(NULL,size,PROT_READ,MAP_PRIVATE,fileno((FILE*)file),0);
+    sqstd_fclose(file);
+    if(buf == MAP_FAILED)
+        return false;
+    HSQFROZENPROTO fp;
+    if(SQ_FAILED(sq_mapfrozenproto(v,buf + sizeof(head),(SQInteger)(size - sizeof(head)),_unmap_cached,&fp))) {
+        //a damaged entry, it is written again after compiling
+        munmap(buf,size);
+        return false;
+    }
+    sq_thawclosure(v,fp);
+    sq_releasefrozenproto(fp);
+    return true;
+}
+
+//writes the closure on top of the stack in the cache, failures are ignored. The entry is
+//replaced with a rename so concurrent processes never map a partial file
+static void _cache_store(HSQUIRRELVM v,SQCacheKey *key)
+{
+    HSQFROZENPROTO fp;
+    SQChar tmp[sizeof(key->path)/sizeof(SQChar) + 32];
+    if(SQ_FAILED(sq_freezeclosure(v,&fp)))
+        return;
+    scsprintf(tmp,sizeof(tmp)/sizeof(SQChar),_SC("%s.%d.tmp"),key->path,(int)getpid());
+    SQFILE file = sqstd_fopen(tmp,_SC("wb"));
+    if(file) {
+        bool ok = sqstd_fwrite(&key->head,1,sizeof(key->head),file) == sizeof(key->head)
+            && SQ_SUCCEEDED(sq_writefrozenproto(v,fp,file_write,file));
+        ok = sqstd_fclose(file) == 0 && ok;
+        if(!ok || rename(tmp,key->path) != 0) remove(tmp);
+    }
+    sq_releasefrozenproto(fp);
+}
+#endif
+
 SQRESULT sqstd_loadfile(HSQUIRRELVM v,const SQChar *filename,SQBool printerror)
 {
     SQFILE file = sqstd_fopen(filename,_SC("rb"));
 
     SQInteger ret;
     unsigned short us;
-    unsigned char uc;
     SQLEXREADFUNC func = _io_file_lexfeed_PLAIN;
     if(file){
         ret = sqstd_fread(&us,1,2,file);
@@ -351,6 +528,10 @@ SQRESULT sqstd_loadfile(HSQUIRRELVM v,const SQChar *filename,SQBool printerror)
             //probably an empty file
             us = 0;
         }
+        if(us == SQ_MAPPED_STREAM_TAG) { //MAPPED BYTECODE
+            sqstd_fclose(file);
+            return sqstd_mapclosurefromfile(v,filename);
+        }
         if(us == SQ_BYTECODE_STREAM_TAG) { //BYTECODE
             sqstd_fseek(file,0,SQ_SEEK_SET);
             if(SQ_SUCCEEDED(sq_readclosure(v,file_read,file))) {
@@ -359,35 +540,61 @@ SQRESULT sqstd_loadfile(HSQUIRRELVM v,const SQChar *filename,SQBool printerror)
             }
         }
         else { //SCRIPT
-
+            SQScriptSource src;
+            if(!_load_source(file,&src)) {
+                sqstd_fclose(file);
+                return sq_throwerror(v,_SC("io error"));
+            }
+#ifdef SQSTD_COMPILECACHE
+            SQCacheKey key;
+            bool cached = _cache_key(v,filename,file,&src,&key);
+            if(cached && _cache_load(v,&key)) {
+                _release_source(&src);
+                sqstd_fclose(file);
+                return SQ_OK;
+            }
+#endif
+            SQInteger skip = 0;
+            bool utf8 = false;
             switch(us)
             {
                 //gotta swap the next 2 lines on BIG endian machines
                 case 0xFFFE: func = _io_file_lexfeed_UCS2_BE; break;//UTF-16 little endian;
                 case 0xFEFF: func = _io_file_lexfeed_UCS2_LE; break;//UTF-16 big endian;
                 case 0xBBEF:
-                    if(sqstd_fread(&uc,1,sizeof(uc),file) == 0) {
+                    if(src.size < 3) {
+                        _release_source(&src);
                         sqstd_fclose(file);
                         return sq_throwerror(v,_SC("io error"));
                     }
-                    if(uc != 0xBF) {
+                    if(src.data[2] != 0xBF) {
+                        _release_source(&src);
                         sqstd_fclose(file);
                         return sq_throwerror(v,_SC("Unrecognized encoding"));
                     }
-#ifdef SQUNICODE
-                    func = _io_file_lexfeed_UTF8;
-#else
-                    func = _io_file_lexfeed_PLAIN;
-#endif
+                    skip = 3;
+                    utf8 = true;
                     break;//UTF-8 ;
-                default: sqstd_fseek(file,0,SQ_SEEK_SET); break; // ascii
+                default: break; // ascii
+            }
+            SQRESULT res;
+            if(func == _io_file_lexfeed_PLAIN) {
+                res = _compile_source(v,&src,skip,utf8,filename,printerror);
             }
-            IOBuffer buffer;
-            buffer.ptr = 0;
-            buffer.size = 0;
-            buffer.file = file;
-            if(SQ_SUCCEEDED(sq_compile(v,func,&buffer,filename,printerror))){
+            else {
+                IOBuffer buffer;
+                buffer.ptr = 0;
+                buffer.size = 0;
+                buffer.file = file;
+                sqstd_fseek(file,2,SQ_SEEK_SET);
+                res = sq_compile(v,func,&buffer,filename,printerror);
+            }
+            _release_source(&src);
+            if(SQ_SUCCEEDED(res)){
                 sqstd_fclose(file);
+#ifdef SQSTD_COMPILECACHE
+                if(cached) _cache_store(v,&key);
+#endif
                 return SQ_OK;
             }
         }
@@ -426,6 +633,152 @@ SQRESULT sqstd_writeclosuretofile(HSQUIRRELVM v,const SQChar *filename)
     return SQ_ERROR; //forward the error
 }
 
+SQRESULT sqstd_writemappedclosuretofile(HSQUIRRELVM v,const SQChar *filename)
+{
+    HSQFROZENPROTO fp;
+    if(SQ_FAILED(sq_freezeclosure(v,&fp)))
+        return SQ_ERROR;
+    SQFILE file = sqstd_fopen(filename,_SC("wb+"));
+    if(!file) {
+        sq_releasefrozenproto(fp);
+        return sq_throwerror(v,_SC("cannot open the file"));
+    }
+    SQRESULT res = sq_writefrozenproto(v,fp,file_write,file);
+    sq_releasefrozenproto(fp);
+    sqstd_fclose(file);
+    return res;
+}
+
+#ifdef SQSTD_MMAP
+static SQInteger _unmap_image(SQUserPointer p,SQInteger size)
+{
+    munmap(p,(size_t)size);
+    return 1;
+}
+#else
+static SQInteger _free_image(SQUserPointer p,SQInteger size)
+{
+    sq_free(p,size);
+    return 1;
+}
+#endif
+
+SQRESULT sqstd_mapclosurefromfile(HSQUIRRELVM v,const SQChar *filename)
+{
+    SQFILE file = sqstd_fopen(filename,_SC("rb"));
+    if(!file) return sq_throwerror(v,_SC("cannot open the file"));
+    SQUserPointer buf;
+    SQInteger size;
+    SQRELEASEHOOK hook;
+#ifdef SQSTD_MMAP
+    //the pages are mapped read-only, so they are shared by every process that maps the file
+    struct stat st;
+    if(fstat(fileno((FILE*)file),&st) != 0 || st.st_size == 0) {
+        sqstd_fclose(file);
+        return sq_throwerror(v,_SC("io error"));
+    }
+    size = (SQInteger)st.st_size;
+    buf = mmap(NULL,(size_t)size,PROT_READ,MAP_PRIVATE,fileno((FILE*)file),0);
+    sqstd_fclose(file);
+    if(buf == MAP_FAILED)
+        return sq_throwerror(v,_SC("cannot map the file"));
+    hook = _unmap_image;
+#else
+    sqstd_fseek(file,0,SQ_SEEK_END);
+    size = sqstd_ftell(file);
+    sqstd_fseek(file,0,SQ_SEEK_SET);
+    buf = size > 0 ? sq_malloc(size) : NULL;
+    if(!buf || sqstd_fread(buf,1,size,file) != size) {
+        if(buf) sq_free(buf,size);
+        sqstd_fclose(file);
+        return sq_throwerror(v,_SC("io error"));
+    }
+    sqstd_fclose(file);
+    hook = _free_image;
+#endif
+    HSQFROZENPROTO fp;
+    if(SQ_FAILED(sq_mapfrozenproto(v,buf,size,hook,&fp))) {
+        hook(buf,size);
+        return SQ_ERROR;
+    }
+    //the closure keeps the image alive
+    sq_thawclosure(v,fp);
+    sq_releasefrozenproto(fp);
+    return SQ_OK;
+}
+
+SQRESULT sqstd_writeheaptofile(HSQUIRRELVM v,const SQChar *filename)
+{
+    SQFILE file = sqstd_fopen(filename,_SC("wb+"));
+    if(!file) return sq_throwerror(v,_SC("cannot open the file"));
+    if(SQ_SUCCEEDED(sq_writeheap(v,file_write,file))) {
+        sqstd_fclose(file);
+        return SQ_OK;
+    }
+    sqstd_fclose(file);
+    return SQ_ERROR; //forward the error
+}
+
+SQRESULT sqstd_readheapfromfile(HSQUIRRELVM v,const SQChar *filename)
+{
+    SQFILE file = sqstd_fopen(filename,_SC("rb"));
+    if(!file) return sq_throwerror(v,_SC("cannot open the file"));
+    if(SQ_SUCCEEDED(sq_readheap(v,file_read,file))) {
+        sqstd_fclose(file);
+        return SQ_OK;
+    }
+    sqstd_fclose(file);
+    return SQ_ERROR; //forward the error
+}
+
+SQRESULT sqstd_writecoveragetofile(HSQUIRRELVM v,const SQChar *filename)
+{
+    SQFILE file = sqstd_fopen(filename,_SC("wb+"));
+    if(!file) return sq_throwerror(v,_SC("cannot open the file"));
+    if(SQ_SUCCEEDED(sq_writecoverage(v,file_write,file))) {
+        sqstd_fclose(file);
+        return SQ_OK;
+    }
+    sqstd_fclose(file);
+    return SQ_ERROR; //forward the error
+}
+
+SQRESULT sqstd_readcoveragefromfile(HSQUIRRELVM v,const SQChar *filename)
+{
+    SQFILE file = sqstd_fopen(filename,_SC("rb"));
+    if(!file) return sq_throwerror(v,_SC("cannot open the file"));
+    if(SQ_SUCCEEDED(sq_readcoverage(v,file_read,file))) {
+        sqstd_fclose(file);
+        return SQ_OK;
+    }
+    sqstd_fclose(file);
+    return SQ_ERROR; //forward the error
+}
+
+SQRESULT sqstd_writetracetofile(HSQUIRRELVM v,const SQChar *filename)
+{
+    SQFILE file = sqstd_fopen(filename,_SC("wb+"));
+    if(!file) return sq_throwerror(v,_SC("cannot open the file"));
+    if(SQ_SUCCEEDED(sq_writetrace(v,file_write,file))) {
+        sqstd_fclose(file);
+        return SQ_OK;
+    }
+    sqstd_fclose(file);
+    return SQ_ERROR; //forward the error
+}
+
+SQRESULT sqstd_writeheapsnapshottofile(HSQUIRRELVM v,const SQChar *filename)
+{
+    SQFILE file = sqstd_fopen(filename,_SC("wb+"));
+    if(!file) return sq_throwerror(v,_SC("cannot open the file"));
+    if(SQ_SUCCEEDED(sq_writeheapsnapshot(v,file_write,file))) {
+        sqstd_fclose(file);
+        return SQ_OK;
+    }
+    sqstd_fclose(file);
+    return SQ_ERROR; //forward the error
+}
+
 SQInteger _g_io_loadfile(HSQUIRRELVM v)
 {
     const SQChar *filename;
@@ -0,0 +1,558 @@
+/* see copyright notice in squirrel.h */
+#include <squirrel.h>
+#include <string.h>
+#include <sqstdisolate.h>
+
+#if defined(__GNUC__) && !defined(_WIN32)
+#include <pthread.h>
+#include <sched.h>
+
+#define ISOLATE_HOST -1
+#define ISOLATE_MAXDEPTH 64
+#define ISOLATE_QUIT -1
+
+//a serialized value travelling between isolates
+struct SQIsolateMsg {
+    SQIsolateMsg *next;
+    SQInteger from;
+    SQInteger size;
+    unsigned char data[1];
+};
+
+//intrusive multi producer single consumer queue, producers never lock
+struct SQIsolateInbox {
+    SQIsolateMsg *head;
+    SQIsolateMsg *tail;
+    SQIsolateMsg stub;
+    int waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct SQIsolate {
+    SQIsolatePool *pool;
+    SQInteger id;
+    HSQUIRRELVM vm;
+    pthread_t thread;
+    SQIsolateInbox inbox;
+    SQBool quit;
+};
+
+struct SQIsolatePool {
+    SQInteger nworkers;
+    SQIsolate *workers;
+    SQIsolateInbox host;
+    SQUnsignedInteger next;
+};
+
+static void _inbox_init(SQIsolateInbox *q)
+{
+    memset(&q->stub,0,sizeof(SQIsolateMsg));
+    q->head = q->tail = &q->stub;
+    q->waiting = 0;
+    pthread_mutex_init(&q->lock,NULL);
+    pthread_cond_init(&q->cond,NULL);
+}
+
+static void _inbox_link(SQIsolateInbox *q,SQIsolateMsg *m)
+{
+    __atomic_store_n(&m->next,(SQIsolateMsg *)NULL,__ATOMIC_RELAXED);
+    SQIsolateMsg *prev = __atomic_exchange_n(&q->head,m,__ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next,m,__ATOMIC_RELEASE);
+}
+
+static void _inbox_push(SQIsolateInbox *q,SQIsolateMsg *m)
+{
+    _inbox_link(q,m);
+    if(__atomic_load_n(&q->waiting,__ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+//consumer side only, returns NULL when the inbox is empty
+static SQIsolateMsg *_inbox_pop(SQIsolateInbox *q)
+{
+    SQIsolateMsg *tail = q->tail;
+    SQIsolateMsg *next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+    if(tail == &q->stub) {
+        if(!next) {
+            if(__atomic_load_n(&q->head,__ATOMIC_SEQ_CST) == tail) return NULL;
+            //a producer is between the exchange and the link
+            while(!(next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE))) sched_yield();
+        }
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+    }
+    if(next) {
+        q->tail = next;
+        return tail;
+    }
+    if(__atomic_load_n(&q->head,__ATOMIC_SEQ_CST) != tail) {
+        while(!(next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE))) sched_yield();
+        q->tail = next;
+        return tail;
+    }
+    _inbox_link(q,&q->stub);
+    while(!(next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE))) sched_yield();
+    q->tail = next;
+    return tail;
+}
+
+static SQIsolateMsg *_inbox_wait(SQIsolateInbox *q)
+{
+    SQIsolateMsg *m = _inbox_pop(q);
+    if(m) return m;
+    pthread_mutex_lock(&q->lock);
+    __atomic_store_n(&q->waiting,1,__ATOMIC_SEQ_CST);
+    while(!(m = _inbox_pop(q)))
+        pthread_cond_wait(&q->cond,&q->lock);
+    __atomic_store_n(&q->waiting,0,__ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->lock);
+    return m;
+}
+
+static void _isolate_freemsg(SQIsolateMsg *m)
+{
+    sq_free(m,sizeof(SQIsolateMsg) + (m->size > 0 ? m->size : 0));
+}
+
+static void _inbox_free(SQIsolateInbox *q)
+{
+    SQIsolateMsg *m;
+    while((m = _inbox_pop(q)))
+        _isolate_freemsg(m);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+}
+
+static SQIsolateMsg *_isolate_newmsg(SQInteger from,SQInteger size)
+{
+    SQIsolateMsg *m = (SQIsolateMsg *)sq_malloc(sizeof(SQIsolateMsg) + size);
+    m->next = NULL;
+    m->from = from;
+    m->size = size;
+    return m;
+}
+
+static SQIsolateInbox *_isolate_inbox(SQIsolatePool *pool,SQInteger id)
+{
+    if(id == ISOLATE_HOST) return &pool->host;
+    if(id < 0 || id >= pool->nworkers) return NULL;
+    return &pool->workers[id].inbox;
+}
+
+//Serialization
+
+struct SQIsolateBuf {
+    unsigned char *data;
+    SQInteger size;
+    SQInteger alloc;
+};
+
+static void _buf_write(SQIsolateBuf *b,const void *p,SQInteger n)
+{
+    if(b->size + n > b->alloc) {
+        SQInteger newalloc = (b->size + n) << 1;
+        b->data = (unsigned char *)sq_realloc(b->data,b->alloc,newalloc);
+        b->alloc = newalloc;
+    }
+    memcpy(b->data + b->size,p,n);
+    b->size += n;
+}
+
+static void _buf_writetag(SQIsolateBuf *b,unsigned char tag)
+{
+    _buf_write(b,&tag,1);
+}
+
+static SQRESULT _isolate_pack(HSQUIRRELVM v,SQInteger idx,SQIsolateBuf *b,SQInteger depth)
+{
+    if(depth > ISOLATE_MAXDEPTH) return sq_throwerror(v,_SC("the value is nested too deeply"));
+    switch(sq_gettype(v,idx)) {
+    case OT_NULL:
+        _buf_writetag(b,'n');
+        break;
+    case OT_BOOL: {
+        SQBool bval;
+        sq_getbool(v,idx,&bval);
+        _buf_writetag(b,bval ? 't' : 'f');
+        }
+        break;
+    case OT_INTEGER: {
+        SQInteger i;
+        sq_getinteger(v,idx,&i);
+        _buf_writetag(b,'i');
+        _buf_write(b,&i,sizeof(i));
+        }
+        break;
+    case OT_FLOAT: {
+        SQFloat f;
+        sq_getfloat(v,idx,&f);
+        _buf_writetag(b,'d');
+        _buf_write(b,&f,sizeof(f));
+        }
+        break;
+    case OT_STRING: {
+        const SQChar *s;
+        sq_getstring(v,idx,&s);
+        SQInteger len = sq_getsize(v,idx);
+        _buf_writetag(b,'s');
+        _buf_write(b,&len,sizeof(len));
+        _buf_write(b,s,len * sizeof(SQChar));
+        }
+        break;
+    case OT_ARRAY:
+    case OT_TABLE: {
+        SQBool istable = sq_gettype(v,idx) == OT_TABLE;
+        SQInteger n = sq_getsize(v,idx);
+        _buf_writetag(b,istable ? 'h' : 'a');
+        _buf_write(b,&n,sizeof(n));
+        if(SQ_FAILED(sq_reservestack(v,4))) return SQ_ERROR;
+        sq_push(v,idx);
+        sq_pushnull(v);
+        SQInteger top = sq_gettop(v);
+        while(SQ_SUCCEEDED(sq_next(v,-2))) {
+            if((istable && SQ_FAILED(_isolate_pack(v,top + 1,b,depth + 1)))
+                || SQ_FAILED(_isolate_pack(v,top + 2,b,depth + 1))) {
+                sq_pop(v,4);
+                return SQ_ERROR;
+            }
+            sq_pop(v,2);
+        }
+        sq_pop(v,2);
+        }
+        break;
+    default:
+        return sq_throwerror(v,_SC("only null, bool, numbers, strings, arrays and tables can be sent"));
+    }
+    return SQ_OK;
+}
+
+static SQRESULT _isolate_unpack(HSQUIRRELVM v,const unsigned char **p)
+{
+    unsigned char tag = *(*p)++;
+    if(SQ_FAILED(sq_reservestack(v,3))) return SQ_ERROR;
+    switch(tag) {
+    case 'n': sq_pushnull(v); break;
+    case 't': sq_pushbool(v,SQTrue); break;
+    case 'f': sq_pushbool(v,SQFalse); break;
+    case 'i': {
+        SQInteger i;
+        memcpy(&i,*p,sizeof(i));
+        *p += sizeof(i);
+        sq_pushinteger(v,i);
+        }
+        break;
+    case 'd': {
+        SQFloat f;
+        memcpy(&f,*p,sizeof(f));
+        *p += sizeof(f);
+        sq_pushfloat(v,f);
+        }
+        break;
+    case 's': {
+        SQInteger len;
+        memcpy(&len,*p,sizeof(len));
+        *p += sizeof(len);
+        sq_pushstring(v,(const SQChar *)*p,len);
+        *p += len * sizeof(SQChar);
+        }
+        break;
+    case 'a':
+    case 'h': {
+        SQInteger n;
+        memcpy(&n,*p,sizeof(n));
+        *p += sizeof(n);
+        if(tag == 'a') sq_newarray(v,0);
+        else sq_newtableex(v,n);
+        for(SQInteger i = 0; i < n; i++) {
+            if(tag == 'h' && SQ_FAILED(_isolate_unpack(v,p))) return SQ_ERROR;
+            if(SQ_FAILED(_isolate_unpack(v,p))) return SQ_ERROR;
+            if(tag == 'a') sq_arrayappend(v,-2);
+            else sq_newslot(v,-3,SQFalse);
+        }
+        }
+        break;
+    default:
+        return sq_throwerror(v,_SC("corrupted message"));
+    }
+    return SQ_OK;
+}
+
+static SQRESULT _isolate_send(SQIsolatePool *pool,SQInteger from,SQInteger target,HSQUIRRELVM v,SQInteger idx)
+{
+    SQIsolateInbox *q = _isolate_inbox(pool,target);
+    if(!q) return sq_throwerror(v,_SC("invalid isolate id"));
+    if(idx < 0) idx = sq_gettop(v) + idx + 1;
+    SQIsolateBuf b = { NULL, 0, 0 };
+    if(SQ_FAILED(_isolate_pack(v,idx,&b,0))) {
+        if(b.data) sq_free(b.data,b.alloc);
+        return SQ_ERROR;
+    }
+    SQIsolateMsg *m = _isolate_newmsg(from,b.size);
+    memcpy(m->data,b.data,b.size);
+    sq_free(b.data,b.alloc);
+    _inbox_push(q,m);
+    return SQ_OK;
+}
+
+//pushes the message value, a quit request pushes null and flags the isolate
+static SQRESULT _isolate_deliver(SQIsolatePool *pool,SQInteger id,HSQUIRRELVM v,SQIsolateMsg *m)
+{
+    if(m->size == ISOLATE_QUIT) {
+        pool->workers[id].quit = SQTrue;
+        _isolate_freemsg(m);
+        sq_pushnull(v);
+        return SQ_OK;
+    }
+    const unsigned char *p = m->data;
+    SQInteger top = sq_gettop(v);
+    SQRESULT r = _isolate_unpack(v,&p);
+    _isolate_freemsg(m);
+    if(SQ_FAILED(r)) sq_settop(v,top);
+    return r;
+}
+
+static SQRESULT _isolate_take(SQIsolatePool *pool,SQInteger id,HSQUIRRELVM v,SQBool wait,SQInteger *from)
+{
+    SQIsolateInbox *q = _isolate_inbox(pool,id);
+    SQIsolateMsg *m = NULL;
+    if(id == ISOLATE_HOST || !pool->workers[id].quit)
+        m = wait ? _inbox_wait(q) : _inbox_pop(q);
+    if(!m) {
+        if(from) *from = ISOLATE_HOST;
+        sq_pushnull(v);
+        return SQ_OK;
+    }
+    if(from) *from = m->from;
+    return _isolate_deliver(pool,id,v,m);
+}
+
+static void *_isolate_worker(void *p)
+{
+    SQIsolate *w = (SQIsolate *)p;
+    HSQUIRRELVM v = w->vm;
+    while(!w->quit) {
+        SQIsolateMsg *m = _inbox_wait(&w->inbox);
+        if(m->size == ISOLATE_QUIT) {
+            w->quit = SQTrue;
+            _isolate_freemsg(m);
+            break;
+        }
+        SQInteger from = m->from;
+        SQInteger top = sq_gettop(v);
+        //messages are handled by the global function onmessage(value,from)
+        sq_pushroottable(v);
+        sq_pushstring(v,_SC("onmessage"),-1);
+        if(SQ_SUCCEEDED(sq_get(v,-2))) {
+            sq_pushroottable(v);
+            if(SQ_SUCCEEDED(_isolate_deliver(w->pool,w->id,v,m)) && !w->quit) {
+                sq_pushinteger(v,from);
+                sq_call(v,3,SQFalse,SQTrue);
+            }
+        }
+        else {
+            _isolate_freemsg(m);
+        }
+        sq_settop(v,top);
+    }
+    return NULL;
+}
+
+HSQISOLATEPOOL sqstd_isolate_newpool(SQInteger nworkers,SQInteger stacksize,SQISOLATEINIT init,SQUserPointer up)
+{
+    if(nworkers <= 0) return NULL;
+    SQIsolatePool *pool = (SQIsolatePool *)sq_malloc(sizeof(SQIsolatePool));
+    pool->nworkers = nworkers;
+    pool->next = 0;
+    _inbox_init(&pool->host);
+    pool->workers = (SQIsolate *)sq_malloc(nworkers * sizeof(SQIsolate));
+    //every isolate is initialized on this thread before any worker starts
+    for(SQInteger i = 0; i < nworkers; i++) {
+        SQIsolate *w = &pool->workers[i];
+        w->pool = pool;
+        w->id = i;
+        w->quit = SQFalse;
+        _inbox_init(&w->inbox);
+        w->vm = sq_open(stacksize);
+        sq_pushroottable(w->vm);
+        sqstd_register_isolatelib(w->vm,pool,i);
+        sq_pop(w->vm,1);
+        if(init && SQ_FAILED(init(w->vm,i,up))) {
+            for(SQInteger j = 0; j <= i; j++) {
+                sq_close(pool->workers[j].vm);
+                _inbox_free(&pool->workers[j].inbox);
+            }
+            sq_free(pool->workers,nworkers * sizeof(SQIsolate));
+            _inbox_free(&pool->host);
+            sq_free(pool,sizeof(SQIsolatePool));
+            return NULL;
+        }
+    }
+    for(SQInteger i = 0; i < nworkers; i++)
+        pthread_create(&pool->workers[i].thread,NULL,_isolate_worker,&pool->workers[i]);
+    return pool;
+}
+
+void sqstd_isolate_closepool(HSQISOLATEPOOL pool)
+{
+    //the workers handle what is already queued, then stop
+    for(SQInteger i = 0; i < pool->nworkers; i++) {
+        SQIsolateMsg *m = _isolate_newmsg(ISOLATE_HOST,0);
+        m->size = ISOLATE_QUIT;
+        _inbox_push(&pool->workers[i].inbox,m);
+    }
+    for(SQInteger i = 0; i < pool->nworkers; i++) {
+        SQIsolate *w = &pool->workers[i];
+        pthread_join(w->thread,NULL);
+        sq_close(w->vm);
+        _inbox_free(&w->inbox);
+    }
+    sq_free(pool->workers,pool->nworkers * sizeof(SQIsolate));
+    _inbox_free(&pool->host);
+    sq_free(pool,sizeof(SQIsolatePool));
+}
+
+SQInteger sqstd_isolate_getsize(HSQISOLATEPOOL pool)
+{
+    return pool->nworkers;
+}
+
+SQRESULT sqstd_isolate_post(HSQISOLATEPOOL pool,SQInteger target,HSQUIRRELVM v,SQInteger idx)
+{
+    return _isolate_send(pool,ISOLATE_HOST,target,v,idx);
+}
+
+SQRESULT sqstd_isolate_submit(HSQISOLATEPOOL pool,HSQUIRRELVM v,SQInteger idx)
+{
+    SQUnsignedInteger n = __atomic_fetch_add(&pool->next,1,__ATOMIC_RELAXED);
+    return _isolate_send(pool,ISOLATE_HOST,(SQInteger)(n % pool->nworkers),v,idx);
+}
+
+SQRESULT sqstd_isolate_recv(HSQISOLATEPOOL pool,HSQUIRRELVM v,SQBool wait,SQInteger *from)
+{
+    return _isolate_take(pool,ISOLATE_HOST,v,wait,from);
+}
+
+//the isolate id and the pool are the free variables of every function
+#define SETUP_ISOLATE(v) \
+    SQIsolatePool *pool; \
+    SQInteger id; \
+    sq_getinteger(v,-2,&id); \
+    sq_getuserpointer(v,-1,(SQUserPointer *)&pool);
+
+static SQInteger _isolate_id(HSQUIRRELVM v)
+{
+    SETUP_ISOLATE(v);
+    sq_pushinteger(v,id);
+    return 1;
+}
+
+static SQInteger _isolate_workers(HSQUIRRELVM v)
+{
+    SETUP_ISOLATE(v);
+    sq_pushinteger(v,pool->nworkers);
+    return 1;
+}
+
+static SQInteger _isolate_post(HSQUIRRELVM v)
+{
+    SETUP_ISOLATE(v);
+    SQInteger target;
+    sq_getinteger(v,2,&target);
+    if(SQ_FAILED(_isolate_send(pool,id,target,v,3)))
+        return SQ_ERROR;
+    return 0;
+}
+
+static SQInteger _isolate_submit(HSQUIRRELVM v)
+{
+    SETUP_ISOLATE(v);
+    SQUnsignedInteger n = __atomic_fetch_add(&pool->next,1,__ATOMIC_RELAXED);
+    if(SQ_FAILED(_isolate_send(pool,id,(SQInteger)(n % pool->nworkers),v,2)))
+        return SQ_ERROR;
+    return 0;
+}
+
+static SQInteger _isolate_recv(HSQUIRRELVM v)
+{
+    SETUP_ISOLATE(v);
+    SQBool wait = SQTrue;
+    if(sq_gettop(v) > 3) sq_getbool(v,2,&wait);
+    if(SQ_FAILED(_isolate_take(pool,id,v,wait,NULL)))
+        return SQ_ERROR;
+    return 1;
+}
+
+#define _DECL_ISOLATE_FUNC(name,nparams,typecheck) {_SC(#name),_isolate_##name,nparams,typecheck}
+static const SQRegFunction isolatelib_funcs[]={
+    _DECL_ISOLATE_FUNC(id,1,NULL),
+    _DECL_ISOLATE_FUNC(workers,1,NULL),
+    _DECL_ISOLATE_FUNC(post,3,_SC(".n.")),
+    _DECL_ISOLATE_FUNC(submit,2,NULL),
+    _DECL_ISOLATE_FUNC(recv,-1,_SC(".b")),
+    {NULL,(SQFUNCTION)0,0,NULL}
+};
+#undef _DECL_ISOLATE_FUNC
+
+SQRESULT sqstd_register_isolatelib(HSQUIRRELVM v,HSQISOLATEPOOL pool,SQInteger id)
+{
+    sq_pushstring(v,_SC("isolate"),-1);
+    sq_newtable(v);
+    SQInteger i = 0;
+    while(isolatelib_funcs[i].name != 0) {
+        const SQRegFunction &f = isolatelib_funcs[i];
+        sq_pushstring(v,f.name,-1);
+        sq_pushuserpointer(v,pool);
+        sq_pushinteger(v,id);
+        //free variables are stored in reverse order
+        sq_newclosure(v,f.f,2);
+        sq_setparamscheck(v,f.nparamscheck,f.typemask);
+        sq_setnativeclosurename(v,-1,f.name);
+        sq_newslot(v,-3,SQFalse);
+        i++;
+    }
+    sq_newslot(v,-3,SQFalse);
+    return SQ_OK;
+}
+
+#else
+
+HSQISOLATEPOOL sqstd_isolate_newpool(SQInteger SQ_UNUSED_ARG(nworkers),SQInteger SQ_UNUSED_ARG(stacksize),SQISOLATEINIT SQ_UNUSED_ARG(init),SQUserPointer SQ_UNUSED_ARG(up))
+{
+    return NULL;
+}
+
+void sqstd_isolate_closepool(HSQISOLATEPOOL SQ_UNUSED_ARG(pool))
+{
+}
+
+SQInteger sqstd_isolate_getsize(HSQISOLATEPOOL SQ_UNUSED_ARG(pool))
+{
+    return 0;
+}
+
+SQRESULT sqstd_isolate_post(HSQISOLATEPOOL SQ_UNUSED_ARG(pool),SQInteger SQ_UNUSED_ARG(target),HSQUIRRELVM v,SQInteger SQ_UNUSED_ARG(idx))
+{
+    return sq_throwerror(v,_SC("isolates are not supported on this platform"));
+}
+
+SQRESULT sqstd_isolate_submit(HSQISOLATEPOOL SQ_UNUSED_ARG(pool),HSQUIRRELVM v,SQInteger SQ_UNUSED_ARG(idx))
+{
+    return sq_throwerror(v,_SC("isolates are not supported on this platform"));
+}
+
+SQRESULT sqstd_isolate_recv(HSQISOLATEPOOL SQ_UNUSED_ARG(pool),HSQUIRRELVM v,SQBool SQ_UNUSED_ARG(wait),SQInteger *SQ_UNUSED_ARG(from))
+{
+    return sq_throwerror(v,_SC("isolates are not supported on this platform"));
+}
+
+SQRESULT sqstd_register_isolatelib(HSQUIRRELVM v,HSQISOLATEPOOL SQ_UNUSED_ARG(pool),SQInteger SQ_UNUSED_ARG(id))
+{
+    return sq_throwerror(v,_SC("isolates are not supported on this platform"));
+}
+
+#endif
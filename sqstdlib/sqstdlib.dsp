@@ -114,6 +114,26 @@ SOURCE=.\sqstdaux.cpp
 
 SOURCE=.\sqstdsystem.cpp
 # End Source File
+# Begin Source File
+
+SOURCE=.\sqstdsched.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\sqstdaio.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\sqstdisolate.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\sqstdprofiler.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\sqstdheap.cpp
+# End Source File
 # End Group
 # Begin Group "Header Files"
 
@@ -124,6 +144,10 @@ SOURCE=.\sqstdblobimpl.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\sqstdschedimpl.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\sqstdstream.h
 # End Source File
 # End Group
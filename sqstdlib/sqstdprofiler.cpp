@@ -0,0 +1,351 @@
+/* see copyright notice in squirrel.h */
+#include <squirrel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqstdio.h>
+#include <sqstdprofiler.h>
+
+#if defined(__GNUC__) && !defined(_WIN32)
+#include <signal.h>
+#include <sys/time.h>
+
+#define PROF_DEFAULT_INTERVAL 1000 //microseconds
+#define PROF_MAXDEPTH 256 //frames kept in a sample, half from each end of the stack
+#define PROF_LABEL 256
+#define PROF_BUCKETS 64
+
+//a folded stack or a function with its sample counts
+struct SQProfEntry {
+    SQProfEntry *next;
+    SQUnsignedInteger hash;
+    SQInteger len;
+    SQInteger self;
+    SQInteger total;
+    SQInteger lastsample;
+    SQChar key[1];
+};
+
+struct SQProfTable {
+    SQProfEntry **buckets;
+    SQInteger nbuckets;
+    SQInteger count;
+};
+
+struct SQProfiler {
+    HSQUIRRELVM vm;
+    SQInteger nsamples;
+    SQProfTable stacks;
+    SQProfTable funcs;
+    SQChar *buf; //the folded stack of the current sample
+    SQInteger buflen;
+    SQInteger bufsize;
+    SQBool running;
+    struct sigaction oldaction;
+    struct itimerval oldtimer;
+};
+
+//the timer is per process, only one profiler runs at a time
+static SQProfiler *volatile _prof_active = NULL;
+
+static void _table_init(SQProfTable *t)
+{
+    t->nbuckets = PROF_BUCKETS;
+    t->count = 0;
+    t->buckets = (SQProfEntry **)sq_malloc(t->nbuckets * sizeof(SQProfEntry *));
+    memset(t->buckets,0,t->nbuckets * sizeof(SQProfEntry *));
+}
+
+static void _table_free(SQProfTable *t)
+{
+    for(SQInteger i = 0; i < t->nbuckets; i++) {
+        SQProfEntry *e = t->buckets[i];
+        while(e) {
+            SQProfEntry *next = e->next;
+            sq_free(e,sizeof(SQProfEntry) + e->len * sizeof(SQChar));
+            e = next;
+        }
+    }
+    sq_free(t->buckets,t->nbuckets * sizeof(SQProfEntry *));
+}
+
+static void _table_grow(SQProfTable *t)
+{
+    SQInteger nbuckets = t->nbuckets * 2;
+    SQProfEntry **buckets = (SQProfEntry **)sq_malloc(nbuckets * sizeof(SQProfEntry *));
+    memset(buckets,0,nbuckets * sizeof(SQProfEntry *));
+    for(SQInteger i = 0; i < t->nbuckets; i++) {
+        SQProfEntry *e = t->buckets[i];
+        while(e) {
+            SQProfEntry *next = e->next;
+            SQInteger b = (SQInteger)(e->hash & (nbuckets - 1));
+            e->next = buckets[b];
+            buckets[b] = e;
+            e = next;
+        }
+    }
+    sq_free(t->buckets,t->nbuckets * sizeof(SQProfEntry *));
+    t->buckets = buckets;
+    t->nbuckets = nbuckets;
+}
+
+//finds the entry of a key, creating it if needed
+static SQProfEntry *_table_get(SQProfTable *t,const SQChar *key,SQInteger len)
+{
+    SQUnsignedInteger h = 2166136261u;
+    for(SQInteger i = 0; i < len; i++) h = (h ^ (SQUnsignedInteger)key[i]) * 16777619u;
+    SQInteger b = (SQInteger)(h & (t->nbuckets - 1));
+    for(SQProfEntry *e = t->buckets[b]; e; e = e->next) {
+        if(e->hash == h && e->len == len && memcmp(e->key,key,len * sizeof(SQChar)) == 0)
+            return e;
+    }
+    if(t->count >= t->nbuckets) {
+        _table_grow(t);
+        b = (SQInteger)(h & (t->nbuckets - 1));
+    }
+    SQProfEntry *e = (SQProfEntry *)sq_malloc(sizeof(SQProfEntry) + len * sizeof(SQChar));
+    e->hash = h;
+    e->len = len;
+    e->self = e->total = 0;
+    e->lastsample = -1;
+    memcpy(e->key,key,len * sizeof(SQChar));
+    e->key[len] = _SC('\0');
+    e->next = t->buckets[b];
+    t->buckets[b] = e;
+    t->count++;
+    return e;
+}
+
+static void _prof_append(SQProfiler *p,const SQChar *s,SQInteger len)
+{
+    if(p->buflen + len > p->bufsize) {
+        SQInteger size = (p->buflen + len) * 2;
+        p->buf = (SQChar *)sq_realloc(p->buf,p->bufsize * sizeof(SQChar),size * sizeof(SQChar));
+        p->bufsize = size;
+    }
+    memcpy(p->buf + p->buflen,s,len * sizeof(SQChar));
+    p->buflen += len;
+}
+
+//counts the frames of the call stack with an exponential then a binary search
+static SQInteger _prof_depth(HSQUIRRELVM v)
+{
+    SQStackInfos si;
+    SQInteger lo = 0, hi = 1;
+    while(SQ_SUCCEEDED(sq_stackinfos(v,hi - 1,&si))) {
+        lo = hi;
+        hi <<= 1;
+    }
+    while(hi - lo > 1) {
+        SQInteger mid = lo + ((hi - lo) >> 1);
+        if(SQ_SUCCEEDED(sq_stackinfos(v,mid - 1,&si))) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+//called by the VM at a call or a loop back edge after the timer fired
+static void _prof_sample(HSQUIRRELVM v,SQUserPointer up)
+{
+    SQProfiler *p = (SQProfiler *)up;
+    SQStackInfos si;
+    SQChar label[PROF_LABEL];
+    SQInteger depth = _prof_depth(v);
+    //a deeper stack keeps its outermost and innermost frames, the middle becomes a single marker
+    SQInteger cut = depth > PROF_MAXDEPTH ? (PROF_MAXDEPTH >> 1) : 0;
+    p->nsamples++;
+    p->buflen = 0;
+    for(SQInteger level = depth - 1; level >= 0; level--) {
+        if(cut && level == depth - 1 - cut) {
+            _prof_append(p,_SC(";[truncated]"),12);
+            level = cut - 1;
+        }
+        sq_stackinfos(v,level,&si);
+        const SQChar *name = si.funcname ? si.funcname : _SC("unknown");
+        const SQChar *src = si.source ? si.source : _SC("?");
+        //a recursive function is counted once per sample in its total
+        scsprintf(label,PROF_LABEL,_SC("%s (%s)"),name,src);
+        SQProfEntry *f = _table_get(&p->funcs,label,(SQInteger)scstrlen(label));
+        if(f->lastsample != p->nsamples) {
+            f->lastsample = p->nsamples;
+            f->total++;
+        }
+        if(level == 0) f->self++;
+        if(si.line >= 0)
+            scsprintf(label,PROF_LABEL,_SC("%s (%s:") _PRINT_INT_FMT _SC(")"),name,src,si.line);
+        if(level != depth - 1) _prof_append(p,_SC(";"),1);
+        _prof_append(p,label,(SQInteger)scstrlen(label));
+    }
+    _table_get(&p->stacks,p->buf,p->buflen)->self++;
+}
+
+static void _prof_signal(int)
+{
+    SQProfiler *p = _prof_active;
+    if(p) sq_requestsample(p->vm);
+}
+
+HSQPROFILER sqstd_profiler_start(HSQUIRRELVM v,SQInteger interval)
+{
+    if(_prof_active)
+        return NULL;
+    SQProfiler *p = (SQProfiler *)sq_malloc(sizeof(SQProfiler));
+    memset(p,0,sizeof(SQProfiler));
+    p->vm = v;
+    _table_init(&p->stacks);
+    _table_init(&p->funcs);
+    if(interval <= 0) interval = PROF_DEFAULT_INTERVAL;
+    sq_setsamplehook(v,_prof_sample,p);
+    _prof_active = p;
+    struct sigaction sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = _prof_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF,&sa,&p->oldaction);
+    struct itimerval it;
+    it.it_interval.tv_sec = interval / 1000000;
+    it.it_interval.tv_usec = interval % 1000000;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF,&it,&p->oldtimer);
+    p->running = SQTrue;
+    return p;
+}
+
+void sqstd_profiler_stop(HSQPROFILER p)
+{
+    if(!p->running)
+        return;
+    struct itimerval off;
+    memset(&off,0,sizeof(off));
+    setitimer(ITIMER_PROF,&off,NULL);
+    //ignoring the signal discards one that is still pending, the default action would kill the process
+    struct sigaction sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF,&sa,NULL);
+    sigaction(SIGPROF,&p->oldaction,NULL);
+    setitimer(ITIMER_PROF,&p->oldtimer,NULL);
+    _prof_active = NULL;
+    sq_setsamplehook(p->vm,NULL,NULL);
+    p->running = SQFalse;
+}
+
+void sqstd_profiler_release(HSQPROFILER p)
+{
+    sqstd_profiler_stop(p);
+    _table_free(&p->stacks);
+    _table_free(&p->funcs);
+    if(p->buf) sq_free(p->buf,p->bufsize * sizeof(SQChar));
+    sq_free(p,sizeof(SQProfiler));
+}
+
+SQInteger sqstd_profiler_getsamples(HSQPROFILER p)
+{
+    return p->nsamples;
+}
+
+//writes to the file or, if there is none, through the error function of the VM
+static void _prof_write(SQProfiler *p,SQFILE f,const SQChar *s)
+{
+    if(f) {
+        sqstd_fwrite(const_cast<SQChar *>(s),sizeof(SQChar),(SQInteger)scstrlen(s),f);
+    }
+    else {
+        SQPRINTFUNCTION ef = sq_geterrorfunc(p->vm);
+        if(ef) ef(p->vm,_SC("%s"),s);
+    }
+}
+
+static SQRESULT _prof_open(HSQUIRRELVM v,const SQChar *filename,SQFILE *f)
+{
+    *f = NULL;
+    if(filename && !(*f = sqstd_fopen(filename,_SC("wb"))))
+        return sq_throwerror(v,_SC("cannot open the file"));
+    return SQ_OK;
+}
+
+SQRESULT sqstd_profiler_writefolded(HSQPROFILER p,const SQChar *filename)
+{
+    SQFILE f;
+    SQChar count[32];
+    if(SQ_FAILED(_prof_open(p->vm,filename,&f)))
+        return SQ_ERROR;
+    for(SQInteger i = 0; i < p->stacks.nbuckets; i++) {
+        for(SQProfEntry *e = p->stacks.buckets[i]; e; e = e->next) {
+            _prof_write(p,f,e->key);
+            scsprintf(count,32,_SC(" ") _PRINT_INT_FMT _SC("\n"),e->self);
+            _prof_write(p,f,count);
+        }
+    }
+    if(f) sqstd_fclose(f);
+    return SQ_OK;
+}
+
+static int _prof_cmp(const void *a,const void *b)
+{
+    const SQProfEntry *ea = *(const SQProfEntry * const *)a;
+    const SQProfEntry *eb = *(const SQProfEntry * const *)b;
+    if(ea->self != eb->self) return ea->self < eb->self ? 1 : -1;
+    if(ea->total != eb->total) return ea->total < eb->total ? 1 : -1;
+    return 0;
+}
+
+SQRESULT sqstd_profiler_writereport(HSQPROFILER p,const SQChar *filename)
+{
+    SQFILE f;
+    SQChar line[128];
+    if(SQ_FAILED(_prof_open(p->vm,filename,&f)))
+        return SQ_ERROR;
+    SQInteger n = 0;
+    SQProfEntry **rows = (SQProfEntry **)sq_malloc((p->funcs.count + 1) * sizeof(SQProfEntry *));
+    for(SQInteger i = 0; i < p->funcs.nbuckets; i++) {
+        for(SQProfEntry *e = p->funcs.buckets[i]; e; e = e->next) rows[n++] = e;
+    }
+    qsort(rows,n,sizeof(SQProfEntry *),_prof_cmp);
+    double scale = p->nsamples ? 100.0 / (double)p->nsamples : 0;
+    scsprintf(line,128,_SC("samples: %d\n  self%%  total%%     self    total  function\n"),(int)p->nsamples);
+    _prof_write(p,f,line);
+    for(SQInteger j = 0; j < n; j++) {
+        scsprintf(line,128,_SC("%6.2f  %6.2f %8d %8d  "),rows[j]->self * scale,rows[j]->total * scale,(int)rows[j]->self,(int)rows[j]->total);
+        _prof_write(p,f,line);
+        _prof_write(p,f,rows[j]->key);
+        _prof_write(p,f,_SC("\n"));
+    }
+    sq_free(rows,(p->funcs.count + 1) * sizeof(SQProfEntry *));
+    if(f) sqstd_fclose(f);
+    return SQ_OK;
+}
+
+#else
+
+HSQPROFILER sqstd_profiler_start(HSQUIRRELVM SQ_UNUSED_ARG(v),SQInteger SQ_UNUSED_ARG(interval))
+{
+    return NULL;
+}
+
+void sqstd_profiler_stop(HSQPROFILER SQ_UNUSED_ARG(p))
+{
+}
+
+void sqstd_profiler_release(HSQPROFILER SQ_UNUSED_ARG(p))
+{
+}
+
+SQInteger sqstd_profiler_getsamples(HSQPROFILER SQ_UNUSED_ARG(p))
+{
+    return 0;
+}
+
+SQRESULT sqstd_profiler_writefolded(HSQPROFILER SQ_UNUSED_ARG(p),const SQChar *SQ_UNUSED_ARG(filename))
+{
+    return SQ_ERROR;
+}
+
+SQRESULT sqstd_profiler_writereport(HSQPROFILER SQ_UNUSED_ARG(p),const SQChar *SQ_UNUSED_ARG(filename))
+{
+    return SQ_ERROR;
+}
+
+#endif
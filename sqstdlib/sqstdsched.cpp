@@ -0,0 +1,753 @@
+/* see copyright notice in squirrel.h */
+#include <squirrel.h>
+#include <string.h>
+#include <sqstdsched.h>
+#include "sqstdschedimpl.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define SQSTD_SCHED_REGKEY _SC("std_sched")
+#define SQSTD_CHANNEL_TYPE_TAG 0x80000100
+#define SQSTD_WAITGROUP_TYPE_TAG 0x80000200
+#define SQSTD_TASK_STACKSIZE 32
+
+static void _list_push(SQSchedList *l,SQSchedTask *t)
+{
+    t->next = NULL;
+    if(l->tail) l->tail->next = t;
+    else l->head = t;
+    l->tail = t;
+}
+
+static SQSchedTask *_list_pop(SQSchedList *l)
+{
+    SQSchedTask *t = l->head;
+    if(t) {
+        l->head = t->next;
+        if(!l->head) l->tail = NULL;
+        t->next = NULL;
+    }
+    return t;
+}
+
+static void _list_remove(SQSchedList *l,SQSchedTask *t)
+{
+    SQSchedTask *prev = NULL;
+    for(SQSchedTask *c = l->head; c; prev = c, c = c->next) {
+        if(c != t) continue;
+        if(prev) prev->next = t->next;
+        else l->head = t->next;
+        if(l->tail == t) l->tail = prev;
+        t->next = NULL;
+        return;
+    }
+}
+
+static SQUnsignedInteger _sched_epoch()
+{
+#ifdef _WIN32
+    return (SQUnsignedInteger)GetTickCount();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (SQUnsignedInteger)ts.tv_sec;
+#endif
+}
+
+//milliseconds elapsed since the scheduler was created
+static SQInteger _sched_clock(SQSched *s)
+{
+#ifdef _WIN32
+    return (SQInteger)(DWORD)(GetTickCount() - (DWORD)s->epoch);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (SQInteger)((SQUnsignedInteger)ts.tv_sec - s->epoch) * 1000 + (SQInteger)(ts.tv_nsec / 1000000);
+#endif
+}
+
+static void _sched_wait(SQInteger ms)
+{
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = (time_t)(ms / 1000);
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    nanosleep(&ts,NULL);
+#endif
+}
+
+static bool _timer_less(SQSchedTask *a,SQSchedTask *b)
+{
+    return a->wakeat < b->wakeat || (a->wakeat == b->wakeat && a->seq < b->seq);
+}
+
+static void _timer_push(SQSched *s,SQSchedTask *t)
+{
+    if(s->ntimers == s->timerscap) {
+        SQInteger newcap = s->timerscap ? s->timerscap << 1 : 16;
+        s->timers = (SQSchedTask **)sq_realloc(s->timers,s->timerscap * sizeof(SQSchedTask *),newcap * sizeof(SQSchedTask *));
+        s->timerscap = newcap;
+    }
+    SQInteger i = s->ntimers++;
+    while(i > 0) {
+        SQInteger parent = (i - 1) >> 1;
+        if(!_timer_less(t,s->timers[parent])) break;
+        s->timers[i] = s->timers[parent];
+        i = parent;
+    }
+    s->timers[i] = t;
+}
+
+static SQSchedTask *_timer_pop(SQSched *s)
+{
+    SQSchedTask *top = s->timers[0];
+    SQSchedTask *last = s->timers[--s->ntimers];
+    SQInteger i = 0;
+    for(;;) {
+        SQInteger child = (i << 1) + 1;
+        if(child >= s->ntimers) break;
+        if(child + 1 < s->ntimers && _timer_less(s->timers[child + 1],s->timers[child])) child++;
+        if(!_timer_less(s->timers[child],last)) break;
+        s->timers[i] = s->timers[child];
+        i = child;
+    }
+    if(s->ntimers) s->timers[i] = last;
+    return top;
+}
+
+SQSched *_sched_get(HSQUIRRELVM v)
+{
+    SQSched *s = NULL;
+    sq_pushregistrytable(v);
+    sq_pushstring(v,SQSTD_SCHED_REGKEY,-1);
+    if(SQ_SUCCEEDED(sq_rawget(v,-2))) {
+        sq_getuserdata(v,-1,(SQUserPointer *)&s,NULL);
+        sq_pop(v,1);
+    }
+    sq_pop(v,1);
+    return s;
+}
+
+static SQInteger _sched_releasehook(SQUserPointer p,SQInteger SQ_UNUSED_ARG(size))
+{
+    SQSched *s = (SQSched *)p;
+    if(s->pollrelease) s->pollrelease(s);
+    if(s->timers) sq_free(s->timers,s->timerscap * sizeof(SQSchedTask *));
+    return 1;
+}
+
+static SQInteger _task_releasehook(SQUserPointer p,SQInteger SQ_UNUSED_ARG(size))
+{
+    sq_free(p,sizeof(SQSchedTask));
+    return 1;
+}
+
+//returns the task running on v or NULL if v is not a task
+SQSchedTask *_sched_task(SQSched *s,HSQUIRRELVM v)
+{
+    return (s->current && s->current->thread == v) ? s->current : NULL;
+}
+
+static SQSchedTask *_sched_gettask(HSQUIRRELVM v,SQInteger idx)
+{
+    HSQUIRRELVM thread;
+    if(SQ_FAILED(sq_getthread(v,idx,&thread)) || sq_getvmreleasehook(thread) != _task_releasehook)
+        return NULL;
+    return (SQSchedTask *)sq_getforeignptr(thread);
+}
+
+static void _sched_unblock(SQSched *s,SQSchedTask *t)
+{
+    if(t->blockprev) t->blockprev->blocknext = t->blocknext;
+    else s->blocked = t->blocknext;
+    if(t->blocknext) t->blocknext->blockprev = t->blockprev;
+    t->blockprev = t->blocknext = NULL;
+    t->waitlist = NULL;
+    s->nblocked--;
+}
+
+void _sched_wake(SQSched *s,SQSchedTask *t,SQInteger flags)
+{
+    if(t->state == TASK_BLOCKED) _sched_unblock(s,t);
+    else if(t->state == TASK_POLLING) s->npolling--;
+    t->state = TASK_READY;
+    t->wakeflags = flags;
+    _list_push(&s->ready,t);
+}
+
+//sq_suspendvm() only flags the suspension, the task is queued once it cannot fail anymore
+SQInteger _sched_block(HSQUIRRELVM v,SQSched *s,SQSchedTask *t,SQSchedList *l)
+{
+    SQInteger ret = sq_suspendvm(v);
+    if(ret != SQ_ERROR) {
+        t->state = TASK_BLOCKED;
+        t->waitlist = l;
+        t->blockprev = NULL;
+        t->blocknext = s->blocked;
+        if(s->blocked) s->blocked->blockprev = t;
+        s->blocked = t;
+        s->nblocked++;
+        _list_push(l,t);
+    }
+    return ret;
+}
+
+//the blocked tasks can never wake up, they are detached from what they wait on
+//and released so that the next run() starts clean
+static void _sched_dropblocked(HSQUIRRELVM v,SQSched *s)
+{
+    SQSchedTask *t;
+    //releasing a task can free the channels the others are waiting on
+    for(t = s->blocked; t; t = t->blocknext) {
+        _list_remove(t->waitlist,t);
+        t->waitlist = NULL;
+        t->joiners.head = t->joiners.tail = NULL;
+        t->state = TASK_DEADLOCKED;
+    }
+    t = s->blocked;
+    s->blocked = NULL;
+    s->nblocked = 0;
+    while(t) {
+        SQSchedTask *next = t->blocknext;
+        t->blockprev = t->blocknext = NULL;
+        //can free t
+        HSQOBJECT obj = t->obj;
+        sq_release(v,&obj);
+        t = next;
+    }
+}
+
+//the poller wakes the task, it is not kept in any list
+SQInteger _sched_wait_io(HSQUIRRELVM v,SQSched *s,SQSchedTask *t)
+{
+    SQInteger ret = sq_suspendvm(v);
+    if(ret != SQ_ERROR) {
+        t->state = TASK_POLLING;
+        s->npolling++;
+    }
+    return ret;
+}
+
+static void _sched_finish(HSQUIRRELVM v,SQSched *s,SQSchedTask *t,SQBool failed)
+{
+    HSQUIRRELVM thread = t->thread;
+    //the return value or the error is kept alone on the task stack for join()
+    if(failed) sq_getlasterror(thread);
+    while(sq_gettop(thread) > 1) sq_remove(thread,1);
+    t->state = TASK_DONE;
+    t->failed = failed;
+    SQSchedTask *j;
+    while((j = _list_pop(&t->joiners))) {
+        sq_move(j->thread,thread,1);
+        if(failed) {
+            sq_throwobject(j->thread);
+            _sched_wake(s,j,WAKE_THROW);
+        }
+        else {
+            _sched_wake(s,j,WAKE_VALUE);
+        }
+    }
+    //can free t
+    HSQOBJECT obj = t->obj;
+    sq_release(v,&obj);
+}
+
+static void _sched_resume(HSQUIRRELVM v,SQSched *s,SQSchedTask *t)
+{
+    HSQUIRRELVM thread = t->thread;
+    SQRESULT res;
+    t->state = TASK_RUNNING;
+    s->current = t;
+    if(!t->started) {
+        t->started = SQTrue;
+        res = sq_call(thread,t->nargs,SQTrue,SQTrue);
+    }
+    else {
+        res = sq_wakeupvm(thread,(t->wakeflags & WAKE_VALUE)?SQTrue:SQFalse,SQTrue,SQTrue,(t->wakeflags & WAKE_THROW)?SQTrue:SQFalse);
+    }
+    s->current = NULL;
+    if(SQ_FAILED(res)) {
+        _sched_finish(v,s,t,SQTrue);
+    }
+    else if(sq_getvmstate(thread) == SQ_VMSTATE_SUSPENDED) {
+        sq_pop(thread,1);
+        //a plain suspend() behaves like sched.yieldtask()
+        if(t->state == TASK_RUNNING) _sched_wake(s,t,0);
+    }
+    else {
+        _sched_finish(v,s,t,SQFalse);
+    }
+}
+
+SQRESULT sqstd_sched_spawn(HSQUIRRELVM v,SQInteger nargs)
+{
+    SQSched *s = _sched_get(v);
+    if(!s) return sq_throwerror(v,_SC("the scheduler is not registered"));
+    SQInteger func = sq_gettop(v) - nargs;
+    SQObjectType type = sq_gettype(v,func);
+    if(func < 1 || (type != OT_CLOSURE && type != OT_NATIVECLOSURE))
+        return sq_throwerror(v,_SC("function expected"));
+    HSQUIRRELVM thread = sq_newthread(v,SQSTD_TASK_STACKSIZE);
+    if(!thread) return sq_throwerror(v,_SC("cannot create the task"));
+    sq_reservestack(thread,nargs + 2);
+    sq_move(thread,v,func);
+    sq_pushroottable(thread);
+    for(SQInteger i = 1; i <= nargs; i++)
+        sq_move(thread,v,func + i);
+    SQSchedTask *t = (SQSchedTask *)sq_malloc(sizeof(SQSchedTask));
+    memset(t,0,sizeof(SQSchedTask));
+    t->thread = thread;
+    t->nargs = nargs + 1;
+    sq_resetobject(&t->obj);
+    sq_getstackobj(v,-1,&t->obj);
+    sq_addref(v,&t->obj);
+    sq_setforeignptr(thread,t);
+    sq_setvmreleasehook(thread,_task_releasehook);
+    _sched_wake(s,t,0);
+    //leaves only the task on the stack
+    for(SQInteger i = 0; i <= nargs; i++)
+        sq_remove(v,func);
+    return SQ_OK;
+}
+
+SQRESULT sqstd_sched_run(HSQUIRRELVM v)
+{
+    SQSched *s = _sched_get(v);
+    if(!s) return sq_throwerror(v,_SC("the scheduler is not registered"));
+    if(s->running) return sq_throwerror(v,_SC("the scheduler is already running"));
+    SQInteger ticks = 0;
+    s->running = SQTrue;
+    for(;;) {
+        SQInteger now = 0;
+        if(s->ntimers) {
+            now = _sched_clock(s);
+            while(s->ntimers && s->timers[0]->wakeat <= now)
+                _sched_wake(s,_timer_pop(s),0);
+        }
+        SQSchedTask *t = _list_pop(&s->ready);
+        if(t) {
+            _sched_resume(v,s,t);
+            //the tasks spend the budget of v, a task stopped by it is ready again
+            if(sq_getbudget(v) == 0) {
+                s->running = SQFalse;
+                return sq_suspendbudget(v);
+            }
+            //keeps i/o flowing while there are always ready tasks
+            if(s->npolling && (++ticks & 0x3F) == 0) s->poll(s,0);
+            continue;
+        }
+        if(!s->ntimers && !s->npolling) break;
+        SQInteger timeout = s->ntimers ? s->timers[0]->wakeat - now : -1;
+        if(s->npolling) s->poll(s,timeout);
+        else _sched_wait(timeout);
+    }
+    s->running = SQFalse;
+    if(s->nblocked) {
+        _sched_dropblocked(v,s);
+        return sq_throwerror(v,_SC("deadlock, all tasks are blocked"));
+    }
+    return SQ_OK;
+}
+
+#define SETUP_SCHED(v) \
+    SQSched *s = _sched_get(v); \
+    if(!s) return sq_throwerror(v,_SC("the scheduler is not registered"));
+
+#define SETUP_TASK(v) \
+    SETUP_SCHED(v) \
+    SQSchedTask *t = _sched_task(s,v); \
+    if(!t) return sq_throwerror(v,_SC("cannot block outside a task"));
+
+static SQInteger _sched_spawn(HSQUIRRELVM v)
+{
+    if(SQ_FAILED(sqstd_sched_spawn(v,sq_gettop(v) - 2)))
+        return SQ_ERROR;
+    return 1;
+}
+
+static SQInteger _sched_yieldtask(HSQUIRRELVM v)
+{
+    SETUP_TASK(v);
+    SQInteger ret = sq_suspendvm(v);
+    if(ret != SQ_ERROR) _sched_wake(s,t,0);
+    return ret;
+}
+
+static SQInteger _sched_sleep(HSQUIRRELVM v)
+{
+    SETUP_TASK(v);
+    SQInteger ms;
+    sq_getinteger(v,2,&ms);
+    SQInteger ret = sq_suspendvm(v);
+    if(ret != SQ_ERROR) {
+        t->state = TASK_SLEEPING;
+        t->wakeat = _sched_clock(s) + (ms > 0 ? ms : 0);
+        t->seq = s->seq++;
+        _timer_push(s,t);
+    }
+    return ret;
+}
+
+static SQInteger _sched_join(HSQUIRRELVM v)
+{
+    SETUP_SCHED(v);
+    SQSchedTask *target = _sched_gettask(v,2);
+    if(!target) return sq_throwerror(v,_SC("task expected"));
+    if(target->state == TASK_DONE) {
+        sq_move(v,target->thread,1);
+        if(target->failed) return sq_throwobject(v);
+        return 1;
+    }
+    if(target->state == TASK_DEADLOCKED) return sq_throwerror(v,_SC("the task was dropped by a deadlock"));
+    SQSchedTask *t = _sched_task(s,v);
+    if(!t) return sq_throwerror(v,_SC("cannot block outside a task"));
+    if(t == target) return sq_throwerror(v,_SC("a task cannot join itself"));
+    return _sched_block(v,s,t,&target->joiners);
+}
+
+static SQInteger _sched_now(HSQUIRRELVM v)
+{
+    SETUP_SCHED(v);
+    sq_pushinteger(v,_sched_clock(s));
+    return 1;
+}
+
+static SQInteger _sched_run(HSQUIRRELVM v)
+{
+    SQRESULT res = sqstd_sched_run(v);
+    //an error or the suspension of sq_suspendbudget()
+    if(SQ_FAILED(res))
+        return res;
+    return 0;
+}
+
+#define _DECL_SCHED_FUNC(name,nparams,typecheck) {_SC(#name),_sched_##name,nparams,typecheck}
+static const SQRegFunction schedlib_funcs[]={
+    _DECL_SCHED_FUNC(spawn,-2,_SC(".c")),
+    _DECL_SCHED_FUNC(yieldtask,1,NULL),
+    _DECL_SCHED_FUNC(sleep,2,_SC(".n")),
+    _DECL_SCHED_FUNC(join,2,_SC(".v")),
+    _DECL_SCHED_FUNC(now,1,NULL),
+    _DECL_SCHED_FUNC(run,1,NULL),
+    {NULL,(SQFUNCTION)0,0,NULL}
+};
+#undef _DECL_SCHED_FUNC
+
+//Channel
+
+struct SQSchedChannel {
+    SQSchedList recvq;
+    SQSchedList sendq;
+    SQInteger capacity;
+    //ring buffer over the _queue array
+    SQInteger head;
+    SQInteger count;
+    SQInteger size;
+    SQBool closed;
+};
+
+#define SETUP_CHANNEL(v) \
+    SQSchedChannel *self = NULL; \
+    { if(SQ_FAILED(sq_getinstanceup(v,1,(SQUserPointer*)&self,(SQUserPointer)SQSTD_CHANNEL_TYPE_TAG))) \
+        return sq_throwerror(v,_SC("invalid type tag"));  } \
+    if(!self) return sq_throwerror(v,_SC("the channel is invalid")); \
+    SETUP_SCHED(v)
+
+static void _channel_pushqueue(HSQUIRRELVM v)
+{
+    sq_pushstring(v,_SC("_queue"),-1);
+    sq_get(v,1);
+}
+
+static void _channel_put(HSQUIRRELVM v,SQSchedChannel *c,SQInteger idx)
+{
+    _channel_pushqueue(v);
+    if(c->count == c->size) {
+        SQInteger newsize = c->size ? c->size << 1 : 4;
+        sq_arrayresize(v,-1,newsize);
+        //moves the wrapped part after the old end
+        for(SQInteger i = 0; i < c->head; i++) {
+            sq_pushinteger(v,c->size + i);
+            sq_pushinteger(v,i);
+            sq_rawget(v,-3);
+            sq_rawset(v,-3);
+            sq_pushinteger(v,i);
+            sq_pushnull(v);
+            sq_rawset(v,-3);
+        }
+        c->size = newsize;
+    }
+    sq_pushinteger(v,(c->head + c->count) % c->size);
+    sq_push(v,idx);
+    sq_rawset(v,-3);
+    c->count++;
+    sq_pop(v,1);
+}
+
+static void _channel_take(HSQUIRRELVM v,SQSchedChannel *c)
+{
+    _channel_pushqueue(v);
+    sq_pushinteger(v,c->head);
+    sq_rawget(v,-2);
+    sq_pushinteger(v,c->head);
+    sq_pushnull(v);
+    sq_rawset(v,-4);
+    sq_remove(v,-2);
+    c->head = (c->head + 1) % c->size;
+    c->count--;
+}
+
+static SQInteger _channel_releasehook(SQUserPointer p,SQInteger SQ_UNUSED_ARG(size))
+{
+    sq_free(p,sizeof(SQSchedChannel));
+    return 1;
+}
+
+static SQInteger _channel_constructor(HSQUIRRELVM v)
+{
+    SQInteger capacity = 0;
+    if(sq_gettop(v) > 1) sq_getinteger(v,2,&capacity);
+    if(capacity < 0) return sq_throwerror(v,_SC("cannot create channel with negative capacity"));
+    SQSchedChannel *c = (SQSchedChannel *)sq_malloc(sizeof(SQSchedChannel));
+    memset(c,0,sizeof(SQSchedChannel));
+    c->capacity = capacity;
+    if(SQ_FAILED(sq_setinstanceup(v,1,c))) {
+        sq_free(c,sizeof(SQSchedChannel));
+        return sq_throwerror(v,_SC("cannot create channel"));
+    }
+    sq_setreleasehook(v,1,_channel_releasehook);
+    sq_pushstring(v,_SC("_queue"),-1);
+    sq_newarray(v,0);
+    sq_set(v,1);
+    return 0;
+}
+
+static SQInteger _channel_send(HSQUIRRELVM v)
+{
+    SETUP_CHANNEL(v);
+    if(self->closed) return sq_throwerror(v,_SC("send on a closed channel"));
+    SQSchedTask *r = _list_pop(&self->recvq);
+    if(r) {
+        sq_move(r->thread,v,2);
+        _sched_wake(s,r,WAKE_VALUE);
+        return 0;
+    }
+    SQInteger ret = 0;
+    if(self->count >= self->capacity) {
+        //the value is queued anyway, the sender waits until a receiver takes it
+        SQSchedTask *t = _sched_task(s,v);
+        if(!t) return sq_throwerror(v,_SC("cannot block outside a task"));
+        ret = _sched_block(v,s,t,&self->sendq);
+        if(ret == SQ_ERROR) return ret;
+    }
+    _channel_put(v,self,2);
+    return ret;
+}
+
+static SQInteger _channel_recv(HSQUIRRELVM v)
+{
+    SETUP_CHANNEL(v);
+    if(self->count) {
+        _channel_take(v,self);
+        SQSchedTask *w = _list_pop(&self->sendq);
+        if(w) _sched_wake(s,w,0);
+        return 1;
+    }
+    if(self->closed) return 0;
+    SQSchedTask *t = _sched_task(s,v);
+    if(!t) return sq_throwerror(v,_SC("cannot block outside a task"));
+    return _sched_block(v,s,t,&self->recvq);
+}
+
+static SQInteger _channel_close(HSQUIRRELVM v)
+{
+    SETUP_CHANNEL(v);
+    if(self->closed) return 0;
+    self->closed = SQTrue;
+    SQSchedTask *r;
+    while((r = _list_pop(&self->recvq)))
+        _sched_wake(s,r,0);
+    //the values past the capacity belong to the blocked senders, their send fails
+    if(self->sendq.head) {
+        _channel_pushqueue(v);
+        for(SQInteger i = self->capacity; i < self->count; i++) {
+            sq_pushinteger(v,(self->head + i) % self->size);
+            sq_pushnull(v);
+            sq_rawset(v,-3);
+        }
+        sq_pop(v,1);
+        if(self->count > self->capacity) self->count = self->capacity;
+        SQSchedTask *w;
+        while((w = _list_pop(&self->sendq))) {
+            sq_pushstring(w->thread,_SC("send on a closed channel"),-1);
+            sq_throwobject(w->thread);
+            _sched_wake(s,w,WAKE_THROW);
+        }
+    }
+    return 0;
+}
+
+static SQInteger _channel_len(HSQUIRRELVM v)
+{
+    SETUP_CHANNEL(v);
+    sq_pushinteger(v,self->count < self->capacity ? self->count : self->capacity);
+    return 1;
+}
+
+static SQInteger _channel_isclosed(HSQUIRRELVM v)
+{
+    SETUP_CHANNEL(v);
+    sq_pushbool(v,self->closed);
+    return 1;
+}
+
+#define _DECL_CHANNEL_FUNC(name,nparams,typecheck) {_SC(#name),_channel_##name,nparams,typecheck}
+static const SQRegFunction _channel_methods[] = {
+    _DECL_CHANNEL_FUNC(constructor,-1,_SC("xn")),
+    _DECL_CHANNEL_FUNC(send,2,_SC("x.")),
+    _DECL_CHANNEL_FUNC(recv,1,_SC("x")),
+    _DECL_CHANNEL_FUNC(close,1,_SC("x")),
+    _DECL_CHANNEL_FUNC(len,1,_SC("x")),
+    _DECL_CHANNEL_FUNC(isclosed,1,_SC("x")),
+    {NULL,(SQFUNCTION)0,0,NULL}
+};
+#undef _DECL_CHANNEL_FUNC
+
+//WaitGroup
+
+struct SQSchedWaitGroup {
+    SQSchedList waiters;
+    SQInteger count;
+};
+
+#define SETUP_WAITGROUP(v) \
+    SQSchedWaitGroup *self = NULL; \
+    { if(SQ_FAILED(sq_getinstanceup(v,1,(SQUserPointer*)&self,(SQUserPointer)SQSTD_WAITGROUP_TYPE_TAG))) \
+        return sq_throwerror(v,_SC("invalid type tag"));  } \
+    if(!self) return sq_throwerror(v,_SC("the waitgroup is invalid")); \
+    SETUP_SCHED(v)
+
+static SQInteger _waitgroup_releasehook(SQUserPointer p,SQInteger SQ_UNUSED_ARG(size))
+{
+    sq_free(p,sizeof(SQSchedWaitGroup));
+    return 1;
+}
+
+static SQInteger _waitgroup_constructor(HSQUIRRELVM v)
+{
+    SQSchedWaitGroup *wg = (SQSchedWaitGroup *)sq_malloc(sizeof(SQSchedWaitGroup));
+    memset(wg,0,sizeof(SQSchedWaitGroup));
+    if(SQ_FAILED(sq_setinstanceup(v,1,wg))) {
+        sq_free(wg,sizeof(SQSchedWaitGroup));
+        return sq_throwerror(v,_SC("cannot create waitgroup"));
+    }
+    sq_setreleasehook(v,1,_waitgroup_releasehook);
+    return 0;
+}
+
+static SQInteger _waitgroup_update(HSQUIRRELVM v,SQInteger delta)
+{
+    SETUP_WAITGROUP(v);
+    if(self->count + delta < 0) return sq_throwerror(v,_SC("negative waitgroup counter"));
+    self->count += delta;
+    if(self->count == 0) {
+        SQSchedTask *w;
+        while((w = _list_pop(&self->waiters)))
+            _sched_wake(s,w,0);
+    }
+    return 0;
+}
+
+static SQInteger _waitgroup_add(HSQUIRRELVM v)
+{
+    SQInteger delta = 1;
+    if(sq_gettop(v) > 1) sq_getinteger(v,2,&delta);
+    return _waitgroup_update(v,delta);
+}
+
+static SQInteger _waitgroup_done(HSQUIRRELVM v)
+{
+    return _waitgroup_update(v,-1);
+}
+
+static SQInteger _waitgroup_wait(HSQUIRRELVM v)
+{
+    SETUP_WAITGROUP(v);
+    if(self->count == 0) return 0;
+    SQSchedTask *t = _sched_task(s,v);
+    if(!t) return sq_throwerror(v,_SC("cannot block outside a task"));
+    return _sched_block(v,s,t,&self->waiters);
+}
+
+static SQInteger _waitgroup_count(HSQUIRRELVM v)
+{
+    SETUP_WAITGROUP(v);
+    sq_pushinteger(v,self->count);
+    return 1;
+}
+
+#define _DECL_WAITGROUP_FUNC(name,nparams,typecheck) {_SC(#name),_waitgroup_##name,nparams,typecheck}
+static const SQRegFunction _waitgroup_methods[] = {
+    _DECL_WAITGROUP_FUNC(constructor,1,_SC("x")),
+    _DECL_WAITGROUP_FUNC(add,-1,_SC("xn")),
+    _DECL_WAITGROUP_FUNC(done,1,_SC("x")),
+    _DECL_WAITGROUP_FUNC(wait,1,_SC("x")),
+    _DECL_WAITGROUP_FUNC(count,1,_SC("x")),
+    {NULL,(SQFUNCTION)0,0,NULL}
+};
+#undef _DECL_WAITGROUP_FUNC
+
+static void _sched_regfuncs(HSQUIRRELVM v,const SQRegFunction *funcs)
+{
+    SQInteger i = 0;
+    while(funcs[i].name != 0) {
+        const SQRegFunction &f = funcs[i];
+        sq_pushstring(v,f.name,-1);
+        sq_newclosure(v,f.f,0);
+        sq_setparamscheck(v,f.nparamscheck,f.typemask);
+        sq_setnativeclosurename(v,-1,f.name);
+        sq_newslot(v,-3,SQFalse);
+        i++;
+    }
+}
+
+SQRESULT sqstd_register_schedlib(HSQUIRRELVM v)
+{
+    //one scheduler per shared state
+    if(!_sched_get(v)) {
+        sq_pushregistrytable(v);
+        sq_pushstring(v,SQSTD_SCHED_REGKEY,-1);
+        SQSched *s = (SQSched *)sq_newuserdata(v,sizeof(SQSched));
+        memset(s,0,sizeof(SQSched));
+        s->epoch = _sched_epoch();
+        sq_setreleasehook(v,-1,_sched_releasehook);
+        sq_rawset(v,-3);
+        sq_pop(v,1);
+    }
+    sq_pushstring(v,_SC("sched"),-1);
+    sq_newtable(v);
+    _sched_regfuncs(v,schedlib_funcs);
+
+    sq_pushstring(v,_SC("channel"),-1);
+    sq_newclass(v,SQFalse);
+    sq_settypetag(v,-1,(SQUserPointer)SQSTD_CHANNEL_TYPE_TAG);
+    sq_pushstring(v,_SC("_queue"),-1);
+    sq_pushnull(v);
+    sq_newslot(v,-3,SQFalse);
+    _sched_regfuncs(v,_channel_methods);
+    sq_newslot(v,-3,SQFalse);
+
+    sq_pushstring(v,_SC("waitgroup"),-1);
+    sq_newclass(v,SQFalse);
+    sq_settypetag(v,-1,(SQUserPointer)SQSTD_WAITGROUP_TYPE_TAG);
+    _sched_regfuncs(v,_waitgroup_methods);
+    sq_newslot(v,-3,SQFalse);
+
+    sq_newslot(v,-3,SQFalse);
+    return SQ_OK;
+}
@@ -0,0 +1,68 @@
+/*  see copyright notice in squirrel.h */
+#ifndef _SQSTD_SCHEDIMPL_H_
+#define _SQSTD_SCHEDIMPL_H_
+
+#define TASK_READY 0
+#define TASK_RUNNING 1
+#define TASK_SLEEPING 2
+#define TASK_BLOCKED 3
+#define TASK_POLLING 4
+#define TASK_DONE 5
+#define TASK_DEADLOCKED 6
+
+#define WAKE_VALUE 0x01
+#define WAKE_THROW 0x02
+
+struct SQSchedTask;
+struct SQSched;
+
+struct SQSchedList {
+    SQSchedTask *head;
+    SQSchedTask *tail;
+};
+
+struct SQSchedTask {
+    HSQUIRRELVM thread;
+    HSQOBJECT obj; //keeps the thread alive until the task is done
+    SQSchedTask *next;
+    SQSchedList joiners;
+    SQSchedList *waitlist; //the list the task is blocked in
+    SQSchedTask *blockprev; //links all the blocked tasks of the scheduler
+    SQSchedTask *blocknext;
+    SQInteger state;
+    SQInteger wakeflags;
+    SQInteger wakeat;
+    SQInteger seq;
+    SQInteger nargs;
+    SQBool started;
+    SQBool failed;
+};
+
+//waits up to timeout ms (-1 forever) for i/o and wakes the tasks that can proceed
+typedef void (*SQSCHEDPOLL)(SQSched *s,SQInteger timeout);
+typedef void (*SQSCHEDPOLLRELEASE)(SQSched *s);
+
+struct SQSched {
+    SQSchedList ready;
+    SQSchedTask **timers; //binary heap ordered by wakeat
+    SQInteger ntimers;
+    SQInteger timerscap;
+    SQSchedTask *current;
+    SQSchedTask *blocked;
+    SQInteger nblocked;
+    SQInteger npolling;
+    SQInteger seq;
+    SQUnsignedInteger epoch;
+    SQBool running;
+    SQSCHEDPOLL poll;
+    SQSCHEDPOLLRELEASE pollrelease;
+    SQUserPointer pollup;
+};
+
+SQSched *_sched_get(HSQUIRRELVM v);
+SQSchedTask *_sched_task(SQSched *s,HSQUIRRELVM v);
+void _sched_wake(SQSched *s,SQSchedTask *t,SQInteger flags);
+SQInteger _sched_block(HSQUIRRELVM v,SQSched *s,SQSchedTask *t,SQSchedList *l);
+SQInteger _sched_wait_io(HSQUIRRELVM v,SQSched *s,SQSchedTask *t);
+
+#endif /*_SQSTD_SCHEDIMPL_H_*/
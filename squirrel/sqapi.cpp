@@ -58,6 +58,11 @@ HSQUIRRELVM sq_open(SQInteger initialstacksize)
 }
 
 HSQUIRRELVM sq_newthread(HSQUIRRELVM friendvm, SQInteger initialstacksize)
+{
+    return sq_newthreadex(friendvm, initialstacksize, 0);
+}
+
+HSQUIRRELVM sq_newthreadex(HSQUIRRELVM friendvm, SQInteger initialstacksize, SQInteger flags)
 {
     SQSharedState *ss;
     SQVM *v;
@@ -67,6 +72,7 @@ HSQUIRRELVM sq_newthread(HSQUIRRELVM friendvm, SQInteger initialstacksize)
     new (v) SQVM(ss);
 
     if(v->Init(friendvm, initialstacksize)) {
+        v->_lightweight = (flags & SQ_THREAD_LIGHTWEIGHT) != 0;
         friendvm->Push(v);
         return v;
     } else {
@@ -85,6 +91,13 @@ SQInteger sq_getvmstate(HSQUIRRELVM v)
     }
 }
 
+SQRESULT sq_shrinkthread(HSQUIRRELVM v)
+{
+    if(!v->ShrinkStack())
+        return sq_throwerror(v,_SC("cannot shrink a running thread"));
+    return SQ_OK;
+}
+
 void sq_seterrorhandler(HSQUIRRELVM v)
 {
     SQObject o = stack_get(v, -1);
@@ -101,6 +114,50 @@ void sq_setnativedebughook(HSQUIRRELVM v,SQDEBUGHOOK hook)
     v->_debughook = hook?true:false;
 }
 
+void sq_setsamplehook(HSQUIRRELVM v,SQSAMPLEHOOK hook,SQUserPointer up)
+{
+    _ss(v)->_samplehook = hook;
+    _ss(v)->_samplehookup = up;
+    _ss(v)->_samplepending = 0;
+}
+
+//only sets a flag, can be called from a signal handler
+void sq_requestsample(HSQUIRRELVM v)
+{
+    _ss(v)->_samplepending = 1;
+}
+
+#ifdef SQ_OPCODE_STATS
+extern SQInstructionDesc g_InstrDesc[];
+
+SQInteger sq_getopcodestats(HSQUIRRELVM v,SQOpcodeStat *stats,SQInteger size)
+{
+    SQSharedState *ss = _ss(v);
+    for(SQInteger i = 0; i < size && i < SQ_NUM_OPCODES; i++) {
+        stats[i].name = g_InstrDesc[i].name;
+        stats[i].count = ss->_opcount[i];
+        stats[i].cycles = ss->_opcycles[i];
+    }
+    return SQ_NUM_OPCODES;
+}
+
+void sq_resetopcodestats(HSQUIRRELVM v)
+{
+    memset(_ss(v)->_opcount,0,sizeof(_ss(v)->_opcount));
+    memset(_ss(v)->_opcycles,0,sizeof(_ss(v)->_opcycles));
+}
+#else
+//the VM was built without SQ_OPCODE_STATS
+SQInteger sq_getopcodestats(HSQUIRRELVM SQ_UNUSED_ARG(v),SQOpcodeStat *,SQInteger SQ_UNUSED_ARG(size))
+{
+    return 0;
+}
+
+void sq_resetopcodestats(HSQUIRRELVM SQ_UNUSED_ARG(v))
+{
+}
+#endif
+
 void sq_setdebughook(HSQUIRRELVM v)
 {
     SQObject o = stack_get(v,-1);
@@ -119,6 +176,41 @@ void sq_close(HSQUIRRELVM v)
     sq_delete(ss, SQSharedState);
 }
 
+SQRESULT sq_maketemplate(HSQUIRRELVM v,HSQVMTEMPLATE *tpl)
+{
+    if(_thread(_ss(v)->_root_vm) != v || v->_callsstacksize != 0)
+        return sq_throwerror(v,_SC("only an idle root vm can be made a template"));
+    SQVMTemplate *t = SQVMTemplate::Create(v);
+    if(!t)
+        return SQ_ERROR;
+    *tpl = t;
+    return SQ_OK;
+}
+
+HSQUIRRELVM sq_openfromtemplate(HSQVMTEMPLATE tpl,SQInteger initialstacksize)
+{
+    SQSharedState *ss;
+    SQVM *v;
+    sq_new(ss, SQSharedState);
+    tpl->AddRef();
+    ss->_template = tpl;
+    ss->Init();
+    v = (SQVM *)SQ_MALLOC(sizeof(SQVM));
+    new (v) SQVM(ss);
+    ss->_root_vm = v;
+    if(v->Init(NULL, initialstacksize)) {
+        return v;
+    } else {
+        sq_delete(v, SQVM);
+        return NULL;
+    }
+}
+
+void sq_releasetemplate(HSQVMTEMPLATE tpl)
+{
+    tpl->Release();
+}
+
 SQInteger sq_getversion()
 {
     return SQUIRREL_VERSION_NUMBER;
@@ -143,6 +235,16 @@ void sq_enabledebuginfo(HSQUIRRELVM v, SQBool enable)
     _ss(v)->_debuginfo = enable?true:false;
 }
 
+SQBool sq_isdebuginfoenabled(HSQUIRRELVM v)
+{
+    return _ss(v)->_debuginfo?SQTrue:SQFalse;
+}
+
+void sq_enablelazycompilation(HSQUIRRELVM v, SQBool enable)
+{
+    _ss(v)->_lazycompilation = enable?true:false;
+}
+
 void sq_notifyallexceptions(HSQUIRRELVM v, SQBool enable)
 {
     _ss(v)->_notifyallexceptions = enable?true:false;
@@ -314,6 +416,7 @@ SQRESULT sq_arrayappend(HSQUIRRELVM v,SQInteger idx)
     sq_aux_paramscheck(v,2);
     SQObjectPtr *arr;
     _GETSAFE_OBJ(v, idx, OT_ARRAY,arr);
+    _CHECK_NOT_FROZEN(v,*arr);
     _array(*arr)->Append(v->GetUp(-1));
     v->Pop();
     return SQ_OK;
@@ -324,6 +427,7 @@ SQRESULT sq_arraypop(HSQUIRRELVM v,SQInteger idx,SQBool pushval)
     sq_aux_paramscheck(v, 1);
     SQObjectPtr *arr;
     _GETSAFE_OBJ(v, idx, OT_ARRAY,arr);
+    _CHECK_NOT_FROZEN(v,*arr);
     if(_array(*arr)->Size() > 0) {
         if(pushval != 0){ v->Push(_array(*arr)->Top()); }
         _array(*arr)->Pop();
@@ -337,6 +441,7 @@ SQRESULT sq_arrayresize(HSQUIRRELVM v,SQInteger idx,SQInteger newsize)
     sq_aux_paramscheck(v,1);
     SQObjectPtr *arr;
     _GETSAFE_OBJ(v, idx, OT_ARRAY,arr);
+    _CHECK_NOT_FROZEN(v,*arr);
     if(newsize >= 0) {
         _array(*arr)->Resize(newsize);
         return SQ_OK;
@@ -350,6 +455,7 @@ SQRESULT sq_arrayreverse(HSQUIRRELVM v,SQInteger idx)
     sq_aux_paramscheck(v, 1);
     SQObjectPtr *o;
     _GETSAFE_OBJ(v, idx, OT_ARRAY,o);
+    _CHECK_NOT_FROZEN(v,*o);
     SQArray *arr = _array(*o);
     if(arr->Size() > 0) {
         SQObjectPtr t;
@@ -370,6 +476,7 @@ SQRESULT sq_arrayremove(HSQUIRRELVM v,SQInteger idx,SQInteger itemidx)
     sq_aux_paramscheck(v, 1);
     SQObjectPtr *arr;
     _GETSAFE_OBJ(v, idx, OT_ARRAY,arr);
+    _CHECK_NOT_FROZEN(v,*arr);
     return _array(*arr)->Remove(itemidx) ? SQ_OK : sq_throwerror(v,_SC("index out of range"));
 }
 
@@ -378,6 +485,7 @@ SQRESULT sq_arrayinsert(HSQUIRRELVM v,SQInteger idx,SQInteger destpos)
     sq_aux_paramscheck(v, 1);
     SQObjectPtr *arr;
     _GETSAFE_OBJ(v, idx, OT_ARRAY,arr);
+    _CHECK_NOT_FROZEN(v,*arr);
     SQRESULT ret = _array(*arr)->Insert(destpos, v->GetUp(-1)) ? SQ_OK : sq_throwerror(v,_SC("index out of range"));
     v->Pop();
     return ret;
@@ -425,6 +533,7 @@ SQRESULT sq_setnativeclosurename(HSQUIRRELVM v,SQInteger idx,const SQChar *name)
 {
     SQObject o = stack_get(v, idx);
     if(sq_isnativeclosure(o)) {
+        _CHECK_NOT_FROZEN(v,o);
         SQNativeClosure *nc = _nativeclosure(o);
         nc->_name = SQString::Create(_ss(v),name);
         return SQ_OK;
@@ -437,6 +546,7 @@ SQRESULT sq_setparamscheck(HSQUIRRELVM v,SQInteger nparamscheck,const SQChar *ty
     SQObject o = stack_get(v, -1);
     if(!sq_isnativeclosure(o))
         return sq_throwerror(v, _SC("native closure expected"));
+    _CHECK_NOT_FROZEN(v,o);
     SQNativeClosure *nc = _nativeclosure(o);
     nc->_nparamscheck = nparamscheck;
     if(typemask) {
@@ -480,7 +590,7 @@ SQRESULT sq_bindenv(HSQUIRRELVM v,SQInteger idx)
         ret = c;
     }
     else { //then must be a native closure
-        SQNativeClosure *c = _nativeclosure(o)->Clone();
+        SQNativeClosure *c = _nativeclosure(o)->Clone(_ss(v));
         __ObjRelease(c->_env);
         c->_env = w;
         __ObjAddRef(c->_env);
@@ -531,6 +641,7 @@ SQRESULT sq_getclosureroot(HSQUIRRELVM v,SQInteger idx)
 SQRESULT sq_clear(HSQUIRRELVM v,SQInteger idx)
 {
     SQObject &o=stack_get(v,idx);
+    _CHECK_NOT_FROZEN(v,o);
     switch(type(o)) {
         case OT_TABLE: _table(o)->Clear();  break;
         case OT_ARRAY: _array(o)->Resize(0); break;
@@ -542,6 +653,32 @@ SQRESULT sq_clear(HSQUIRRELVM v,SQInteger idx)
     return SQ_OK;
 }
 
+SQRESULT sq_freeze(HSQUIRRELVM v,SQInteger idx,HSQFROZENDATA *fd)
+{
+    SQObjectPtr &o = stack_get(v,idx);
+    SQFrozenData *data = SQFrozenData::Create(v,o);
+    if(!data)
+        return SQ_ERROR;
+    *fd = data;
+    return SQ_OK;
+}
+
+void sq_pushfrozendata(HSQUIRRELVM v,HSQFROZENDATA fd)
+{
+    v->Push(fd->_root);
+}
+
+void sq_releasefrozendata(HSQFROZENDATA fd)
+{
+    fd->Release();
+}
+
+SQBool sq_isfrozen(HSQUIRRELVM v,SQInteger idx)
+{
+    SQObjectPtr &o = stack_get(v,idx);
+    return is_frozen(o)?SQTrue:SQFalse;
+}
+
 void sq_pushroottable(HSQUIRRELVM v)
 {
     v->Push(v->_roottable);
@@ -918,8 +1055,14 @@ SQRESULT sq_rawset(HSQUIRRELVM v,SQInteger idx)
         v->Pop(2);
         return sq_throwerror(v, _SC("null key"));
     }
+    if(is_frozen(self)) {
+        v->Pop(2);
+        v->Raise_FrozenError(self);
+        return SQ_ERROR;
+    }
     switch(type(self)) {
     case OT_TABLE:
+        if(is_frozenstring(key)) key = SQString::Create(_ss(v),_stringval(key),_string(key)->_len);
         _table(self)->NewSlot(key, v->GetUp(-1));
         v->Pop(2);
         return SQ_OK;
@@ -975,6 +1118,7 @@ SQRESULT sq_setdelegate(HSQUIRRELVM v,SQInteger idx)
     SQObjectPtr &self = stack_get(v, idx);
     SQObjectPtr &mt = v->GetUp(-1);
     SQObjectType type = type(self);
+    _CHECK_NOT_FROZEN(v,self);
     switch(type) {
     case OT_TABLE:
         if(type(mt) == OT_TABLE) {
@@ -1002,6 +1146,7 @@ SQRESULT sq_rawdeleteslot(HSQUIRRELVM v,SQInteger idx,SQBool pushval)
     sq_aux_paramscheck(v, 2);
     SQObjectPtr *self;
     _GETSAFE_OBJ(v, idx, OT_TABLE,self);
+    _CHECK_NOT_FROZEN(v,*self);
     SQObjectPtr &key = v->GetUp(-1);
     SQObjectPtr t;
     if(_table(*self)->Get(key,t)) {
@@ -1100,6 +1245,7 @@ const SQChar *sq_getlocal(HSQUIRRELVM v,SQUnsignedInteger level,SQUnsignedIntege
             return NULL;
         SQClosure *c=_closure(ci._closure);
         SQFunctionProto *func=c->_function;
+        if(ci._stackvargv) v->BuildVargv(ci,stackbase);
         if(func->_noutervalues > (SQInteger)idx) {
             v->Push(*_outer(c->_outervalues[idx])->_valptr);
             return _stringval(func->_outervalues[idx]._name);
@@ -1151,6 +1297,7 @@ SQRESULT sq_reservestack(HSQUIRRELVM v,SQInteger nsize)
             return sq_throwerror(v,_SC("cannot resize stack while in a metamethod"));
         }
         v->_stack.resize(v->_stack.size() + ((v->_top + nsize) - v->_stack.size()));
+        v->RelocateOuters();
     }
     return SQ_OK;
 }
@@ -1191,6 +1338,27 @@ SQRESULT sq_call(HSQUIRRELVM v,SQInteger params,SQBool retval,SQBool raiseerror)
     return sq_throwerror(v,_SC("call failed"));
 }
 
+void sq_setbudget(HSQUIRRELVM v,SQInteger ticks,SQInteger mode)
+{
+    if(mode == SQ_BUDGET_NONE) ticks = SQ_BUDGET_MAXTICKS;
+    v->_budget = ticks;
+    v->_budgetmode = mode;
+}
+
+SQInteger sq_getbudget(HSQUIRRELVM v)
+{
+    if(v->_budgetmode == SQ_BUDGET_NONE) return -1;
+    return v->_budget > 0 ? v->_budget : 0;
+}
+
+SQRESULT sq_suspendbudget(HSQUIRRELVM v)
+{
+    if(v->_budgetmode != SQ_BUDGET_SUSPEND || v->_suspended || v->_nnativecalls != 2)
+        return sq_throwerror(v,_SC("execution budget exhausted"));
+    v->_suspended_budget = SQTrue;
+    return SQ_SUSPEND_FLAG;
+}
+
 SQRESULT sq_suspendvm(HSQUIRRELVM v)
 {
     return v->Suspend();
@@ -1208,6 +1376,8 @@ SQRESULT sq_wakeupvm(HSQUIRRELVM v,SQBool wakeupret,SQBool retval,SQBool raiseer
         }
         v->Pop();
     } else if(target != -1) { v->GetAt(v->_stackbase+v->_suspended_target).Null(); }
+    //a thread trimmed while suspended gets its headroom back
+    if(SQ_FAILED(sq_reservestack(v,MIN_STACK_HEADROOM))) return SQ_ERROR;
     SQObjectPtr dummy;
     if(!v->Execute(dummy,-1,-1,ret,raiseerror,throwerror?SQVM::ET_RESUME_THROW_VM : SQVM::ET_RESUME_VM)) {
         return SQ_ERROR;
@@ -1273,6 +1443,72 @@ SQRESULT sq_readclosure(HSQUIRRELVM v,SQREADFUNC r,SQUserPointer up)
     return SQ_OK;
 }
 
+void sq_newpermanents(HSQUIRRELVM v,SQBool byname)
+{
+    SQObjectPtr perms = SQTable::Create(_ss(v),0);
+    CollectPermanents(v,_table(perms),byname?true:false);
+    v->Push(perms);
+}
+
+SQRESULT sq_writeheap(HSQUIRRELVM v,SQWRITEFUNC w,SQUserPointer up)
+{
+    SQObjectPtr *o = NULL;
+    _GETSAFE_OBJ(v, -1, OT_TABLE,o);
+    if(!WriteHeap(v,_table(*o),up,w))
+        return SQ_ERROR;
+    return SQ_OK;
+}
+
+SQRESULT sq_readheap(HSQUIRRELVM v,SQREADFUNC r,SQUserPointer up)
+{
+    SQObjectPtr *o = NULL;
+    _GETSAFE_OBJ(v, -1, OT_TABLE,o);
+    if(!ReadHeap(v,_table(*o),up,r))
+        return SQ_ERROR;
+    return SQ_OK;
+}
+
+SQRESULT sq_freezeclosure(HSQUIRRELVM v,HSQFROZENPROTO *fp)
+{
+    SQObjectPtr *o = NULL;
+    _GETSAFE_OBJ(v, -1, OT_CLOSURE,o);
+    if(_closure(*o)->_function->_noutervalues)
+        return sq_throwerror(v,_SC("a closure with free variables bound cannot be frozen"));
+    SQFrozenProto *img = SQFrozenProto::Create(v,_closure(*o)->_function);
+    if(!img)
+        return SQ_ERROR;
+    *fp = img;
+    return SQ_OK;
+}
+
+SQRESULT sq_thawclosure(HSQUIRRELVM v,HSQFROZENPROTO fp)
+{
+    SQFunctionProto *func = fp->Thaw(_ss(v));
+    v->Push(SQClosure::Create(_ss(v),func,_table(v->_roottable)->GetWeakRef(OT_TABLE)));
+    return SQ_OK;
+}
+
+void sq_releasefrozenproto(HSQFROZENPROTO fp)
+{
+    fp->Release();
+}
+
+SQRESULT sq_writefrozenproto(HSQUIRRELVM v,HSQFROZENPROTO fp,SQWRITEFUNC w,SQUserPointer up)
+{
+    if(!fp->Write(v,up,w))
+        return SQ_ERROR;
+    return SQ_OK;
+}
+
+SQRESULT sq_mapfrozenproto(HSQUIRRELVM v,SQUserPointer buf,SQInteger size,SQRELEASEHOOK hook,HSQFROZENPROTO *fp)
+{
+    SQFrozenProto *img = SQFrozenProto::Map(v,buf,size,hook);
+    if(!img)
+        return SQ_ERROR;
+    *fp = img;
+    return SQ_OK;
+}
+
 SQChar *sq_getscratchpad(HSQUIRRELVM v,SQInteger minsize)
 {
     return _ss(v)->GetScratchPad(minsize);
@@ -1350,6 +1586,7 @@ SQRESULT sq_setfreevariable(HSQUIRRELVM v,SQInteger idx,SQUnsignedInteger nval)
                     }
         break;
     case OT_NATIVECLOSURE:
+        _CHECK_NOT_FROZEN(v,self);
         if(_nativeclosure(self)->_noutervalues > nval){
             _nativeclosure(self)->_outervalues[nval] = stack_get(v,-1);
         }
@@ -1558,26 +1795,18 @@ SQRESULT sq_next(HSQUIRRELVM v,SQInteger idx)
     return SQ_ERROR;
 }
 
-struct BufState{
-    const SQChar *buf;
-    SQInteger ptr;
-    SQInteger size;
-};
-
-SQInteger buf_lexfeed(SQUserPointer file)
-{
-    BufState *buf=(BufState*)file;
-    if(buf->size<(buf->ptr+1))
-        return 0;
-    return buf->buf[buf->ptr++];
-}
-
 SQRESULT sq_compilebuffer(HSQUIRRELVM v,const SQChar *s,SQInteger size,const SQChar *sourcename,SQBool raiseerror) {
-    BufState buf;
-    buf.buf = s;
-    buf.size = size;
-    buf.ptr = 0;
-    return sq_compile(v, buf_lexfeed, &buf, sourcename, raiseerror);
+    SQObjectPtr o;
+#ifndef NO_COMPILER
+    //the lexer reads the buffer in place
+    if(CompileBuffer(v, s, size, sourcename, o, raiseerror?true:false, _ss(v)->_debuginfo)) {
+        v->Push(SQClosure::Create(_ss(v), _funcproto(o), _table(v->_roottable)->GetWeakRef(OT_TABLE)));
+        return SQ_OK;
+    }
+    return SQ_ERROR;
+#else
+    return sq_throwerror(v,_SC("this is a no compiler build"));
+#endif
 }
 
 void sq_move(HSQUIRRELVM dest,HSQUIRRELVM src,SQInteger idx)
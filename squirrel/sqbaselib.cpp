@@ -229,9 +229,8 @@ static SQInteger base_compilestring(HSQUIRRELVM v)
 
 static SQInteger base_newthread(HSQUIRRELVM v)
 {
-    SQObjectPtr &func = stack_get(v,2);
-    SQInteger stksize = (_closure(func)->_function->_stacksize << 1) +2;
-    HSQUIRRELVM newv = sq_newthread(v, (stksize < MIN_STACK_OVERHEAD + 2)? MIN_STACK_OVERHEAD + 2 : stksize);
+    //starts small, the stack grows on the first call
+    HSQUIRRELVM newv = sq_newthreadex(v, MIN_STACK_OVERHEAD + 2, SQ_THREAD_LIGHTWEIGHT);
     sq_move(newv,v,-2);
     return 1;
 }
@@ -263,6 +262,16 @@ static SQInteger base_type(HSQUIRRELVM v)
     return 1;
 }
 
+static SQInteger base_freeze(HSQUIRRELVM v)
+{
+    HSQFROZENDATA fd;
+    if(SQ_FAILED(sq_freeze(v,2,&fd)))
+        return SQ_ERROR;
+    sq_pushfrozendata(v,fd);
+    sq_releasefrozendata(fd);
+    return 1;
+}
+
 static SQInteger base_callee(HSQUIRRELVM v)
 {
     if(v->_callsstacksize > 1)
@@ -291,6 +300,7 @@ static const SQRegFunction base_funcs[]={
     {_SC("suspend"),base_suspend,-1, NULL},
     {_SC("array"),base_array,-2, _SC(".n")},
     {_SC("type"),base_type,2, NULL},
+    {_SC("freeze"),base_freeze,2, NULL},
     {_SC("callee"),base_callee,0,NULL},
     {_SC("dummy"),base_dummy,0,NULL},
 #ifndef NO_GARBAGE_COLLECTOR
@@ -409,6 +419,12 @@ static SQInteger obj_clear(HSQUIRRELVM v)
     return sq_clear(v,-1);
 }
 
+static SQInteger obj_isfrozen(HSQUIRRELVM v)
+{
+    sq_pushbool(v,sq_isfrozen(v,1));
+    return 1;
+}
+
 
 static SQInteger number_delegate_tochar(HSQUIRRELVM v)
 {
@@ -476,6 +492,7 @@ const SQRegFunction SQSharedState::_table_default_delegate_funcz[]={
     {_SC("clear"),obj_clear,1, _SC(".")},
     {_SC("setdelegate"),table_setdelegate,2, _SC(".t|o")},
     {_SC("getdelegate"),table_getdelegate,1, _SC(".")},
+    {_SC("isfrozen"),obj_isfrozen,1, _SC("t")},
     {NULL,(SQFUNCTION)0,0,NULL}
 };
 
@@ -488,6 +505,7 @@ static SQInteger array_append(HSQUIRRELVM v)
 
 static SQInteger array_extend(HSQUIRRELVM v)
 {
+    _CHECK_NOT_FROZEN(v,stack_get(v,1));
     _array(stack_get(v,1))->Extend(_array(stack_get(v,2)));
     return 0;
 }
@@ -517,6 +535,7 @@ static SQInteger array_insert(HSQUIRRELVM v)
     SQObject &o=stack_get(v,1);
     SQObject &idx=stack_get(v,2);
     SQObject &val=stack_get(v,3);
+    _CHECK_NOT_FROZEN(v,o);
     if(!_array(o)->Insert(tointeger(idx),val))
         return sq_throwerror(v,_SC("index out of range"));
     return 0;
@@ -526,6 +545,7 @@ static SQInteger array_remove(HSQUIRRELVM v)
 {
     SQObject &o = stack_get(v, 1);
     SQObject &idx = stack_get(v, 2);
+    _CHECK_NOT_FROZEN(v,o);
     if(!sq_isnumeric(idx)) return sq_throwerror(v, _SC("wrong type"));
     SQObjectPtr val;
     if(_array(o)->Get(tointeger(idx), val)) {
@@ -540,6 +560,7 @@ static SQInteger array_resize(HSQUIRRELVM v)
 {
     SQObject &o = stack_get(v, 1);
     SQObject &nsize = stack_get(v, 2);
+    _CHECK_NOT_FROZEN(v,o);
     SQObjectPtr fill;
     if(sq_isnumeric(nsize)) {
         if(sq_gettop(v) > 2)
@@ -580,6 +601,7 @@ static SQInteger array_map(HSQUIRRELVM v)
 static SQInteger array_apply(HSQUIRRELVM v)
 {
     SQObject &o = stack_get(v,1);
+    _CHECK_NOT_FROZEN(v,o);
     if(SQ_FAILED(__map_array(_array(o),_array(o),v)))
         return SQ_ERROR;
     return 0;
@@ -743,6 +765,7 @@ static SQInteger array_sort(HSQUIRRELVM v)
 {
     SQInteger func = -1;
     SQObjectPtr &o = stack_get(v,1);
+    _CHECK_NOT_FROZEN(v,o);
     if(_array(o)->Size() > 1) {
         if(sq_gettop(v) == 2) func = 2;
         if(!_hsort(v, o, 0, _array(o)->Size()-1, func))
@@ -795,6 +818,7 @@ const SQRegFunction SQSharedState::_array_default_delegate_funcz[]={
     {_SC("reduce"),array_reduce,2, _SC("ac")},
     {_SC("filter"),array_filter,2, _SC("ac")},
     {_SC("find"),array_find,2, _SC("a.")},
+    {_SC("isfrozen"),obj_isfrozen,1, _SC("a")},
     {NULL,(SQFUNCTION)0,0,NULL}
 };
 
@@ -949,7 +973,7 @@ static SQInteger closure_getinfos(HSQUIRRELVM v) {
         res->NewSlot(SQString::Create(_ss(v),_SC("name"),-1),f->_name);
         res->NewSlot(SQString::Create(_ss(v),_SC("src"),-1),f->_sourcename);
         res->NewSlot(SQString::Create(_ss(v),_SC("parameters"),-1),params);
-        res->NewSlot(SQString::Create(_ss(v),_SC("varargs"),-1),f->_varparams);
+        res->NewSlot(SQString::Create(_ss(v),_SC("varargs"),-1),(SQInteger)(f->_varparams?1:0));
     res->NewSlot(SQString::Create(_ss(v),_SC("defparams"),-1),defparams);
     }
     else { //OT_NATIVECLOSURE
@@ -1007,18 +1031,46 @@ const SQRegFunction SQSharedState::_generator_default_delegate_funcz[]={
 };
 
 //THREAD DEFAULT DELEGATE
+static SQInteger _thread_return(HSQUIRRELVM v,SQVM *thread)
+{
+    sq_move(v,thread,-1);
+    sq_pop(thread,1); //pop retval
+    if(sq_getvmstate(thread) == SQ_VMSTATE_IDLE) {
+        sq_settop(thread,1); //pop roottable
+    }
+    if(thread->_lightweight) thread->ShrinkStack();
+    //the thread spent the budget of v, v stops too and calls again on wakeup
+    if(thread->_suspended_budget) return sq_suspendbudget(v);
+    return 1;
+}
+
+//call(), wakeup() and wakeupthrow() resume a thread stopped by the budget
+//where it stopped, their arguments were already passed
+static SQInteger _thread_resumebudget(HSQUIRRELVM v,SQVM *thread)
+{
+    if(SQ_SUCCEEDED(sq_wakeupvm(thread,SQFalse,SQTrue,SQTrue,SQFalse))) {
+        return _thread_return(v,thread);
+    }
+    sq_settop(thread,1);
+    v->_lasterror = thread->_lasterror;
+    return SQ_ERROR;
+}
+
 static SQInteger thread_call(HSQUIRRELVM v)
 {
     SQObjectPtr o = stack_get(v,1);
     if(type(o) == OT_THREAD) {
+        if(_thread(o)->_suspended_budget) return _thread_resumebudget(v,_thread(o));
         SQInteger nparams = sq_gettop(v);
+        if(SQ_FAILED(sq_reservestack(_thread(o),nparams))) {
+            v->_lasterror = _thread(o)->_lasterror;
+            return SQ_ERROR;
+        }
         _thread(o)->Push(_thread(o)->_roottable);
         for(SQInteger i = 2; i<(nparams+1); i++)
             sq_move(_thread(o),v,i);
         if(SQ_SUCCEEDED(sq_call(_thread(o),nparams,SQTrue,SQTrue))) {
-            sq_move(v,_thread(o),-1);
-            sq_pop(_thread(o),1);
-            return 1;
+            return _thread_return(v,_thread(o));
         }
         v->_lasterror = _thread(o)->_lasterror;
         return SQ_ERROR;
@@ -1031,6 +1083,7 @@ static SQInteger thread_wakeup(HSQUIRRELVM v)
     SQObjectPtr o = stack_get(v,1);
     if(type(o) == OT_THREAD) {
         SQVM *thread = _thread(o);
+        if(thread->_suspended_budget) return _thread_resumebudget(v,thread);
         SQInteger state = sq_getvmstate(thread);
         if(state != SQ_VMSTATE_SUSPENDED) {
             switch(state) {
@@ -1048,12 +1101,7 @@ static SQInteger thread_wakeup(HSQUIRRELVM v)
             sq_move(thread,v,2);
         }
         if(SQ_SUCCEEDED(sq_wakeupvm(thread,wakeupret,SQTrue,SQTrue,SQFalse))) {
-            sq_move(v,thread,-1);
-            sq_pop(thread,1); //pop retval
-            if(sq_getvmstate(thread) == SQ_VMSTATE_IDLE) {
-                sq_settop(thread,1); //pop roottable
-            }
-            return 1;
+            return _thread_return(v,thread);
         }
         sq_settop(thread,1);
         v->_lasterror = thread->_lasterror;
@@ -1067,6 +1115,7 @@ static SQInteger thread_wakeupthrow(HSQUIRRELVM v)
     SQObjectPtr o = stack_get(v,1);
     if(type(o) == OT_THREAD) {
         SQVM *thread = _thread(o);
+        if(thread->_suspended_budget) return _thread_resumebudget(v,thread);
         SQInteger state = sq_getvmstate(thread);
         if(state != SQ_VMSTATE_SUSPENDED) {
             switch(state) {
@@ -1086,12 +1135,7 @@ static SQInteger thread_wakeupthrow(HSQUIRRELVM v)
             sq_getbool(v,3,&rethrow_error);
         }
         if(SQ_SUCCEEDED(sq_wakeupvm(thread,SQFalse,SQTrue,SQTrue,SQTrue))) {
-            sq_move(v,thread,-1);
-            sq_pop(thread,1); //pop retval
-            if(sq_getvmstate(thread) == SQ_VMSTATE_IDLE) {
-                sq_settop(thread,1); //pop roottable
-            }
-            return 1;
+            return _thread_return(v,thread);
         }
         sq_settop(thread,1);
         if(rethrow_error) {
@@ -109,7 +109,7 @@ struct SQGenerator : public CHAINABLE_OBJ
 {
     enum SQGeneratorState{eRunning,eSuspended,eDead};
 private:
-    SQGenerator(SQSharedState *ss,SQClosure *closure){_closure=closure;_state=eRunning;_ci._generator=NULL;INIT_CHAIN();ADD_TO_CHAIN(&_ss(this)->_gc_chain,this);}
+    SQGenerator(SQSharedState *ss,SQClosure *closure){if(closure) _closure=closure;_state=eRunning;_ci._generator=NULL;INIT_CHAIN();ADD_TO_CHAIN(&_ss(this)->_gc_chain,this);}
 public:
     static SQGenerator *Create(SQSharedState *ss,SQClosure *closure){
         SQGenerator *nc=(SQGenerator*)SQ_MALLOC(sizeof(SQGenerator));
@@ -159,9 +159,10 @@ public:
         _CONSTRUCT_VECTOR(SQObjectPtr,nc->_noutervalues,nc->_outervalues);
         return nc;
     }
-    SQNativeClosure *Clone()
+    SQNativeClosure *Clone(SQSharedState *ss)
     {
-        SQNativeClosure * ret = SQNativeClosure::Create(_opt_ss(this),_function,_noutervalues);
+        //takes the state explicitly, the closure can be shared by the states spawned from a template
+        SQNativeClosure * ret = SQNativeClosure::Create(ss,_function,_noutervalues);
         ret->_env = _env;
         if(ret->_env) __ObjAddRef(ret->_env);
         ret->_name = _name;
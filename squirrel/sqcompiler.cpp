@@ -72,12 +72,23 @@ struct SQScope {
 class SQCompiler
 {
 public:
-    SQCompiler(SQVM *v, SQLEXREADFUNC rg, SQUserPointer up, const SQChar* sourcename, bool raiseerror, bool lineinfo)
+    SQCompiler(SQVM *v, SQLEXREADFUNC rg, SQUserPointer up, const SQChar* sourcename, bool raiseerror, bool lineinfo) : _lex(&_arena)
     {
         _vm=v;
         _lex.Init(_ss(v), rg, up,ThrowError,this);
-        _sourcename = SQString::Create(_ss(v), sourcename);
+        Setup(sourcename, raiseerror, lineinfo);
+    }
+    SQCompiler(SQVM *v, const SQChar *buf, SQInteger size, const SQChar* sourcename, bool raiseerror, bool lineinfo) : _lex(&_arena)
+    {
+        _vm=v;
+        _lex.Init(_ss(v), buf, size,ThrowError,this);
+        Setup(sourcename, raiseerror, lineinfo);
+    }
+    void Setup(const SQChar* sourcename, bool raiseerror, bool lineinfo)
+    {
+        _sourcename = SQString::Create(_ss(_vm), sourcename);
         _lineinfo = lineinfo;_raiseerror = raiseerror;
+        _lazy = _ss(_vm)->_lazycompilation;
         _scope.outers = 0;
         _scope.stacksize = 0;
         _compilererror[0] = _SC('\0');
@@ -131,7 +142,7 @@ public:
         switch(tok)
         {
         case TK_IDENTIFIER:
-            ret = _fs->CreateString(_lex._svalue);
+            ret = _fs->CreateString(_lex._svalue,_lex._longstr.size()-1,_lex._hvalue);
             break;
         case TK_STRING_LITERAL:
             ret = _fs->CreateString(_lex._svalue,_lex._longstr.size()-1);
@@ -166,7 +177,7 @@ public:
         _debugline = 1;
         _debugop = 0;
 
-        SQFuncState funcstate(_ss(_vm), NULL,ThrowError,this);
+        SQFuncState funcstate(_ss(_vm), NULL,&_arena,ThrowError,this);
         funcstate._name = SQString::Create(_ss(_vm), _SC("main"));
         _fs = &funcstate;
         _fs->AddParameter(_fs->CreateString(_SC("this")));
@@ -190,15 +201,54 @@ public:
 #endif
         }
         else {
-            if(_raiseerror && _ss(_vm)->_compilererrorhandler) {
-                _ss(_vm)->_compilererrorhandler(_vm, _compilererror, type(_sourcename) == OT_STRING?_stringval(_sourcename):_SC("unknown"),
-                    _lex._currentline, _lex._currentcolumn);
-            }
-            _vm->_lasterror = SQString::Create(_ss(_vm), _compilererror, -1);
-            return false;
+            return Failed();
+        }
+        return true;
+    }
+    //compiles the body of a lazy function; the enclosing functions are gone, the names it
+    //takes from them are the outers captured when the body was scanned
+    bool CompileBody(SQFunctionProto *func,SQObjectPtr &o)
+    {
+        SQLazyBody *body = func->_lazy;
+        _debugline = 1;
+        _debugop = 0;
+        _lex._currentline = _lex._lasttokenline = body->_line;
+        _lex._currentcolumn = body->_column;
+
+        //an empty parent stands for the enclosing function, it makes tail calls possible
+        SQFuncState parent(_ss(_vm), NULL,&_arena,ThrowError,this);
+        SQFuncState funcstate(_ss(_vm), &parent,&_arena,ThrowError,this);
+        funcstate._name = func->_name;
+        _fs = &funcstate;
+        for(SQInteger i = 0; i < func->_nparameters; i++) _fs->AddParameter(func->_parameters[i]);
+        for(SQInteger j = 0; j < func->_noutervalues; j++) _fs->_outervalues.push_back(func->_outervalues[j]);
+        _fs->_varparams = func->_varparams != vpNONE;
+        _fs->_sourcename = _sourcename;
+        if(setjmp(_errorjmp) == 0) {
+            Lex();
+            Statement(false);
+            _fs->AddLineInfos(_lex._prevtoken == _SC('\n')?_lex._lasttokenline:_lex._currentline, _lineinfo, true);
+            _fs->AddInstruction(_OP_RETURN, -1);
+            _fs->SetStackSize(0);
+            o = _fs->BuildProto();
+#ifdef _DEBUG_DUMP
+            _fs->Dump(_funcproto(o));
+#endif
+        }
+        else {
+            return Failed();
         }
         return true;
     }
+    bool Failed()
+    {
+        if(_raiseerror && _ss(_vm)->_compilererrorhandler) {
+            _ss(_vm)->_compilererrorhandler(_vm, _compilererror, type(_sourcename) == OT_STRING?_stringval(_sourcename):_SC("unknown"),
+                _lex._currentline, _lex._currentcolumn);
+        }
+        _vm->_lasterror = SQString::Create(_ss(_vm), _compilererror, -1);
+        return false;
+    }
     void Statements()
     {
         while(_token != _SC('}') && _token != TK_DEFAULT && _token != TK_CASE) {
@@ -611,12 +661,22 @@ public:
     void PrefixedExpr()
     {
         SQInteger pos = Factor();
+        SQInteger vargv = (_es.etype == LOCAL && _fs->IsVargv(_es.epos) && (_token == _SC('.') || _token == _SC('['))) ? _es.epos : -1;
+        SQInteger vargvlen = -1;
         for(;;) {
             switch(_token) {
             case _SC('.'):
                 pos = -1;
+                vargvlen = -1;
                 Lex();
-
+                if(vargv != -1) {
+                    /* patched into _OP_VARGC if this turns out to be 'vargv.len()' */
+                    _fs->AddInstruction(_OP_VARGV, vargv);
+                    if(_token == TK_IDENTIFIER && scstrcmp(_lex._svalue, _SC("len")) == 0) {
+                        vargvlen = _fs->GetCurrentPos();
+                    }
+                    vargv = -1;
+                }
                 _fs->AddInstruction(_OP_LOAD, _fs->PushTarget(), _fs->GetConstant(Expect(TK_IDENTIFIER)));
                 if(_es.etype==BASE) {
                     Emit2ArgsOP(_OP_GET);
@@ -635,6 +695,7 @@ public:
                 if(_lex._prevtoken == _SC('\n')) Error(_SC("cannot brake deref/or comma needed after [exp]=exp slot declaration"));
                 Lex(); Expression(); Expect(_SC(']'));
                 pos = -1;
+                vargvlen = -1;
                 if(_es.etype==BASE) {
                     Emit2ArgsOP(_OP_GET);
                     pos = _fs->TopTarget();
@@ -643,10 +704,15 @@ public:
                 }
                 else {
                     if(NeedGet()) {
-                        Emit2ArgsOP(_OP_GET);
+                        /* 'vargv[i]' reads the argument straight from the stack */
+                        Emit2ArgsOP(vargv != -1 ? _OP_GETVARG : _OP_GET);
+                    }
+                    else if(vargv != -1) {
+                        _fs->AddInstruction(_OP_VARGV, vargv);
                     }
                     _es.etype = OBJECT;
                 }
+                vargv = -1;
                 break;
             case TK_MINUSMINUS:
             case TK_PLUSPLUS:
@@ -702,7 +768,16 @@ public:
                 }
                 _es.etype = EXPR;
                 Lex();
+                if(vargvlen != -1 && _token != _SC(')')) vargvlen = -1;
                 FunctionCallArgs();
+                if(vargvlen != -1) {
+                    /* 'vargv.len()' skips the call while the args are still on the stack */
+                    SQInstruction &vargc = _fs->GetInstruction(vargvlen);
+                    vargc.op = _OP_VARGC;
+                    vargc._arg0 = (unsigned char)_fs->TopTarget();
+                    vargc._arg1 = (SQInt32)(_fs->GetCurrentPos() - vargvlen);
+                    vargvlen = -1;
+                }
                 break;
             default: return;
             }
@@ -731,7 +806,7 @@ public:
                 SQObject constant;
 
                 switch(_token) {
-                    case TK_IDENTIFIER:  id = _fs->CreateString(_lex._svalue);       break;
+                    case TK_IDENTIFIER:  id = _fs->CreateString(_lex._svalue,_lex._longstr.size()-1,_lex._hvalue); break;
                     case TK_THIS:        id = _fs->CreateString(_SC("this"),4);        break;
                     case TK_CONSTRUCTOR: id = _fs->CreateString(_SC("constructor"),11); break;
                 }
@@ -740,6 +815,10 @@ public:
                 Lex();
                 if((pos = _fs->GetLocalVariable(id)) != -1) {
                     /* Handle a local variable (includes 'this') */
+                    if(_fs->IsVargv(pos) && _token != _SC('.') && _token != _SC('[')) {
+                        /* vargv escapes, build the array; 'vargv.' and 'vargv[' are resolved in PrefixedExpr */
+                        _fs->AddInstruction(_OP_VARGV, pos);
+                    }
                     _fs->PushTarget(pos);
                     _es.etype  = LOCAL;
                     _es.epos   = pos;
@@ -1520,23 +1599,85 @@ public:
 
         SQFuncState *currchunk = _fs;
         _fs = funcstate;
-        if(lambda) {
-            Expression();
-            _fs->AddInstruction(_OP_RETURN, 1, _fs->PopTarget());}
-        else {
-            Statement(false);
+        SQFunctionProto *func;
+        bool lazy = !lambda && _lazy && _token == _SC('{');
+        bool declares = false;
+        if(lazy) {
+            func = LazyFunction(funcstate,declares);
         }
-        funcstate->AddLineInfos(_lex._prevtoken == _SC('\n')?_lex._lasttokenline:_lex._currentline, _lineinfo, true);
-        funcstate->AddInstruction(_OP_RETURN, -1);
-        funcstate->SetStackSize(0);
+        else {
+            if(lambda) {
+                Expression();
+                _fs->AddInstruction(_OP_RETURN, 1, _fs->PopTarget());}
+            else {
+                Statement(false);
+            }
+            funcstate->AddLineInfos(_lex._prevtoken == _SC('\n')?_lex._lasttokenline:_lex._currentline, _lineinfo, true);
+            funcstate->AddInstruction(_OP_RETURN, -1);
+            funcstate->SetStackSize(0);
 
-        SQFunctionProto *func = funcstate->BuildProto();
+            func = funcstate->BuildProto();
 #ifdef _DEBUG_DUMP
-        funcstate->Dump(func);
+            funcstate->Dump(func);
 #endif
+        }
         _fs = currchunk;
         _fs->_functions.push_back(func);
         _fs->PopChildState();
+        if(declares && !func->LoadBody(_vm,_raiseerror)) {
+            //already reported by the compiler of the body
+            _raiseerror = false;
+            Error(_SC("%s"), _stringval(_vm->_lasterror));
+        }
+    }
+    //scans the body of a function without compiling it, the source is kept and compiled on
+    //the first call. Every name of the enclosing functions that appears in the body is captured
+    //now as an outer; one that turns out to be a local of the body or a member is never used.
+    //A body declaring consts or enums is compiled right away (declares is set), the code that
+    //follows it can use them
+    SQFunctionProto *LazyFunction(SQFuncState *funcstate,bool &declares)
+    {
+        sqvector<SQChar> source;
+        SQInteger line = _lex._currentline, column = _lex._currentcolumn - 1;
+        SQInteger depth = 1, prev = _token;
+        //a source read in place is not copied while scanning, the brace is before the current character
+        const SQChar *start = _lex._bufpos ? _lex._bufpos - 1 : NULL;
+        if(!start) {
+            source.push_back(_SC('{'));
+            if(_lex._currdata != SQUIRREL_EOB) source.push_back((SQChar)_lex._currdata);
+            _lex._record = &source;
+        }
+        while(depth > 0) {
+            Lex();
+            switch(_token) {
+            case _SC('{'): depth++; break;
+            case _SC('}'): depth--; break;
+            case TK_CONST: case TK_ENUM: declares = true; break;
+            case TK_IDENTIFIER:
+                if(prev != _SC('.') && prev != TK_DOUBLE_COLON) {
+                    SQObject id = funcstate->CreateString(_lex._svalue,_lex._longstr.size()-1,_lex._hvalue);
+                    if(funcstate->GetLocalVariable(id) == -1) funcstate->GetOuterVariable(id);
+                }
+                break;
+            case SQUIRREL_EOB:
+                _lex._record = NULL;
+                Error(_SC("expected '}'"));
+                break;
+            }
+            prev = _token;
+        }
+        SQFunctionProto *func = funcstate->BuildProto();
+        if(start) {
+            func->_lazy = SQLazyBody::Create(_ss(_vm),start,_lex._bufpos - start,line,column,_lineinfo);
+        }
+        else {
+            _lex._record = NULL;
+            //the character after the closing brace was already read
+            if(_lex._currdata != SQUIRREL_EOB) source.pop_back();
+            func->_lazy = SQLazyBody::Create(_ss(_vm),&source[0],source.size(),line,column,_lineinfo);
+        }
+        Lex();
+        return func;
     }
     void ResolveBreaks(SQFuncState *funcstate, SQInteger ntoresolve)
     {
@@ -1562,9 +1703,12 @@ private:
     SQInteger _token;
     SQFuncState *_fs;
     SQObjectPtr _sourcename;
+    //the working memory of the lexer and of the function states, released when the compiler is destroyed
+    SQArena _arena;
     SQLexer _lex;
     bool _lineinfo;
     bool _raiseerror;
+    bool _lazy;
     SQInteger _debugline;
     SQInteger _debugop;
     SQExpState   _es;
@@ -1574,10 +1718,41 @@ private:
     SQVM *_vm;
 };
 
+static void TraceCompile(SQVM *vm,const SQChar *name,const SQChar *sourcename,SQInteger line)
+{
+    if(_ss(vm)->_tracing) {
+        SQSharedState *ss = _ss(vm);
+        ss->TraceBegin(vm,SQ_TRACE_COMPILE,SQString::Create(ss,name),SQString::Create(ss,sourcename),line);
+    }
+}
+
+static bool TraceCompileEnd(SQVM *vm,bool ret)
+{
+    if(_ss(vm)->_tracing) _ss(vm)->TraceEnd(vm,SQ_TRACE_COMPILE);
+    return ret;
+}
+
 bool Compile(SQVM *vm,SQLEXREADFUNC rg, SQUserPointer up, const SQChar *sourcename, SQObjectPtr &out, bool raiseerror, bool lineinfo)
 {
+    TraceCompile(vm,_SC("compile"),sourcename,0);
     SQCompiler p(vm, rg, up, sourcename, raiseerror, lineinfo);
-    return p.Compile(out);
+    return TraceCompileEnd(vm,p.Compile(out));
+}
+
+bool CompileBuffer(SQVM *vm,const SQChar *s, SQInteger size, const SQChar *sourcename, SQObjectPtr &out, bool raiseerror, bool lineinfo)
+{
+    TraceCompile(vm,_SC("compile"),sourcename,0);
+    SQCompiler p(vm, s, size, sourcename, raiseerror, lineinfo);
+    return TraceCompileEnd(vm,p.Compile(out));
+}
+
+bool CompileBody(SQVM *vm, SQFunctionProto *func, SQObjectPtr &out, bool raiseerror)
+{
+    SQLazyBody *body = func->_lazy;
+    const SQChar *sourcename = type(func->_sourcename) == OT_STRING?_stringval(func->_sourcename):_SC("unknown");
+    TraceCompile(vm,_SC("compilebody"),sourcename,body->_line);
+    SQCompiler p(vm, body->_source, body->_size, sourcename, raiseerror, body->_lineinfo);
+    return TraceCompileEnd(vm,p.CompileBody(func, out));
 }
 
 #endif
@@ -76,4 +76,6 @@ struct SQVM;
 
 typedef void(*CompilerErrorFunc)(void *ud, const SQChar *s);
 bool Compile(SQVM *vm, SQLEXREADFUNC rg, SQUserPointer up, const SQChar *sourcename, SQObjectPtr &out, bool raiseerror, bool lineinfo);
+bool CompileBuffer(SQVM *vm, const SQChar *s, SQInteger size, const SQChar *sourcename, SQObjectPtr &out, bool raiseerror, bool lineinfo);
+bool CompileBody(SQVM *vm, SQFunctionProto *func, SQObjectPtr &out, bool raiseerror);
 #endif //_SQCOMPILER_H_
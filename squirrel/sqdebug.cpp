@@ -7,6 +7,15 @@
 #include "sqfuncproto.h"
 #include "sqclosure.h"
 #include "sqstring.h"
+#include "sqtable.h"
+#include "sqarray.h"
+#include "sqclass.h"
+#include "squserdata.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 SQRESULT sq_getfunctioninfo(HSQUIRRELVM v,SQInteger level,SQFunctionInfo *fi)
 {
@@ -56,6 +65,757 @@ SQRESULT sq_stackinfos(HSQUIRRELVM v, SQInteger level, SQStackInfos *si)
     return SQ_ERROR;
 }
 
+void sq_setbreakhook(HSQUIRRELVM v,SQBREAKHOOK hook,SQUserPointer up)
+{
+    _ss(v)->_breakhook = hook;
+    _ss(v)->_breakhookup = up;
+}
+
+//the smallest line >= 'line' that starts some code of f or of its nested functions
+static bool FindBreakLine(SQVM *v,SQFunctionProto *f,SQInteger line,SQInteger &best)
+{
+    if(!f->LoadFunctions(v)) return false;
+    for(SQInteger i = 0; i < f->_nlineinfos; i++) {
+        SQLineInfo &li = f->_lineinfos[i];
+        if(li._line >= line && li._op < f->_ninstructions && (best < 0 || li._line < best)) best = li._line;
+    }
+    for(SQInteger i = 0; i < f->_nfunctions; i++) {
+        if(!FindBreakLine(v,_funcproto(f->_functions[i]),line,best)) return false;
+    }
+    return true;
+}
+
+static void PatchBreakLine(SQSharedState *ss,SQFunctionProto *f,SQInteger line,SQInteger id)
+{
+    for(SQInteger i = 0; i < f->_nlineinfos; i++) {
+        SQInteger op = f->_lineinfos[i]._op;
+        if(f->_lineinfos[i]._line != line || op >= f->_ninstructions || f->_instructions[op].op == _OP_BREAK) continue;
+        if(f->_frozen && !f->_patchedcode) {
+            //the frozen code can be shared or mapped read only
+            f->_patchedcode = (SQInstruction *)SQ_MALLOC(f->_ninstructions * sizeof(SQInstruction));
+            memcpy(f->_patchedcode,f->_instructions,f->_ninstructions * sizeof(SQInstruction));
+            f->_instructions = f->_patchedcode;
+        }
+        SQBreakpoint bp;
+        bp._id = id;
+        bp._proto = f;
+        __ObjAddRef(f);
+        bp._op = op;
+        bp._origop = f->_instructions[op].op;
+        ss->_breakpoints.push_back(bp);
+        f->_instructions[op].op = _OP_BREAK;
+    }
+    for(SQInteger i = 0; i < f->_nfunctions; i++) {
+        PatchBreakLine(ss,_funcproto(f->_functions[i]),line,id);
+    }
+}
+
+SQRESULT sq_setbreakpoint(HSQUIRRELVM v,SQInteger idx,SQInteger line,SQInteger *id)
+{
+    SQObjectPtr &o = stack_get(v,idx);
+    if(type(o) != OT_CLOSURE) return sq_throwerror(v,_SC("the object is not a closure"));
+    SQFunctionProto *f = _closure(o)->_function;
+    if(_istemplate(f)) return sq_throwerror(v,_SC("cannot set a breakpoint in a function of a template"));
+    SQInteger best = -1;
+    if(!f->LoadFunctions(v) || !FindBreakLine(v,f,line,best)) return SQ_ERROR;
+    if(best < 0) return sq_throwerror(v,_SC("no code at or after the line"));
+    SQSharedState *ss = _ss(v);
+    SQInteger n = ss->_breakpoints.size();
+    PatchBreakLine(ss,f,best,ss->_nextbreakpointid);
+    if((SQInteger)ss->_breakpoints.size() == n) return sq_throwerror(v,_SC("a breakpoint is already set at the line"));
+    *id = ss->_nextbreakpointid++;
+    return SQ_OK;
+}
+
+SQRESULT sq_removebreakpoint(HSQUIRRELVM v,SQInteger id)
+{
+    SQBreakpointVec &bps = _ss(v)->_breakpoints;
+    bool found = false;
+    for(SQInteger i = (SQInteger)bps.size() - 1; i >= 0; i--) {
+        SQBreakpoint &bp = bps[i];
+        if(bp._id != id) continue;
+        bp._proto->_instructions[bp._op].op = bp._origop;
+        __ObjRelease(bp._proto);
+        bps.remove(i);
+        found = true;
+    }
+    if(!found) return sq_throwerror(v,_SC("invalid breakpoint id"));
+    return SQ_OK;
+}
+
+void sq_enablecoverage(HSQUIRRELVM v,SQBool enable)
+{
+    _ss(v)->_coverageenabled = enable?true:false;
+}
+
+//the functions of a template are shared by the threads of many states, they aren't tracked
+bool SQSharedState::StartCoverage(SQFunctionProto *f)
+{
+    if(_istemplate(f)) return false;
+    SQInteger size = (f->_ninstructions + 7) / 8;
+    f->_coverage = (unsigned char *)SQ_MALLOC(size);
+    memset(f->_coverage,0,size);
+    _coverageprotos.push_back(f);
+    return true;
+}
+
+SQCoverageFile *SQSharedState::GetCoverageFile(const SQObjectPtr &name)
+{
+    for(SQUnsignedInteger i = 0; i < _coveragefiles.size(); i++) {
+        SQCoverageFile *file = _coveragefiles[i];
+        if(_string(file->_name)->_len == _string(name)->_len
+            && memcmp(_stringval(file->_name),_stringval(name),sq_rsl(_string(name)->_len)) == 0) return file;
+    }
+    SQCoverageFile *file;
+    sq_new(file,SQCoverageFile);
+    file->_name = name;
+    _coveragefiles.push_back(file);
+    return file;
+}
+
+//adds the lines of f and of its nested functions to the file, with no hits
+static void AddCoverageLines(SQSharedState *ss,SQFunctionProto *f,SQCoverageFile *file,const SQInstruction *code)
+{
+    for(SQInteger i = 0; i < f->_ninstructions; i++) {
+        if(code[i].op != _OP_LINE) continue;
+        SQInteger line = code[i]._arg1;
+        if(line < 0) continue;
+        if((SQInteger)file->_hits.size() <= line) file->_hits.resize(line + 1,-1);
+        if(file->_hits[line] < 0) file->_hits[line] = 0;
+    }
+    for(SQInteger i = 0; i < f->_nfunctions; i++) {
+        if(type(f->_functions[i]) != OT_FUNCPROTO) continue;
+        SQFunctionProto *nested = _funcproto(f->_functions[i]);
+        if(nested->_coverage || type(nested->_sourcename) != OT_STRING) continue;
+        SQInstructionVec copy;
+        AddCoverageLines(ss,nested,ss->GetCoverageFile(nested->_sourcename),ss->GetOriginalCode(nested,copy));
+    }
+}
+
+//moves the bits of f to the hits of its file, a line is counted once however many
+//_OP_LINE it has
+void SQSharedState::FlushCoverage(SQFunctionProto *f)
+{
+    if(type(f->_sourcename) != OT_STRING) return;
+    SQCoverageFile *file = GetCoverageFile(f->_sourcename);
+    SQInstructionVec copy;
+    const SQInstruction *code = GetOriginalCode(f,copy);
+    AddCoverageLines(this,f,file,code);
+    //the hits of the lines found are first negated to count them once
+    for(SQInteger pass = 0; pass < 2; pass++) {
+        for(SQInteger i = 0; i < f->_ninstructions; i++) {
+            if(code[i].op != _OP_LINE || !(f->_coverage[i >> 3] & (1 << (i & 7)))) continue;
+            SQInteger &hits = file->_hits[code[i]._arg1];
+            if(pass == 0 && hits >= 0) hits = -hits - 2;
+            else if(pass == 1 && hits <= -2) hits = -hits - 1;
+        }
+    }
+    memset(f->_coverage,0,(f->_ninstructions + 7) / 8);
+}
+
+void SQSharedState::ReleaseCoverage(SQFunctionProto *f)
+{
+    FlushCoverage(f);
+    for(SQUnsignedInteger i = 0; i < _coverageprotos.size(); i++) {
+        if(_coverageprotos[i] == f) { _coverageprotos.remove(i); break; }
+    }
+    SQ_FREE(f->_coverage,(f->_ninstructions + 7) / 8);
+    f->_coverage = NULL;
+}
+
+static bool WriteText(HSQUIRRELVM v,SQWRITEFUNC write,SQUserPointer up,const SQChar *s,SQInteger len)
+{
+    return SafeWrite(v,write,up,s,sq_rsl(len));
+}
+
+//writes the coverage in the lcov tracefile format
+SQRESULT sq_writecoverage(HSQUIRRELVM v,SQWRITEFUNC write,SQUserPointer up)
+{
+    SQSharedState *ss = _ss(v);
+    for(SQUnsignedInteger i = 0; i < ss->_coverageprotos.size(); i++) ss->FlushCoverage(ss->_coverageprotos[i]);
+    SQChar buf[NUMBER_MAX_CHAR * 2 + 16];
+    for(SQUnsignedInteger i = 0; i < ss->_coveragefiles.size(); i++) {
+        SQCoverageFile *file = ss->_coveragefiles[i];
+        SQInteger found = 0, hit = 0;
+        if(!WriteText(v,write,up,_SC("SF:"),3)
+            || !WriteText(v,write,up,_stringval(file->_name),_string(file->_name)->_len)
+            || !WriteText(v,write,up,_SC("\n"),1)) return SQ_ERROR;
+        for(SQUnsignedInteger line = 0; line < file->_hits.size(); line++) {
+            SQInteger hits = file->_hits[line];
+            if(hits < 0) continue;
+            found++;
+            if(hits > 0) hit++;
+            scsprintf(buf,sizeof(buf)/sizeof(SQChar),_SC("DA:") _PRINT_INT_FMT _SC(",") _PRINT_INT_FMT _SC("\n"),(SQInteger)line,hits);
+            if(!WriteText(v,write,up,buf,(SQInteger)scstrlen(buf))) return SQ_ERROR;
+        }
+        scsprintf(buf,sizeof(buf)/sizeof(SQChar),_SC("LF:") _PRINT_INT_FMT _SC("\nLH:") _PRINT_INT_FMT _SC("\nend_of_record\n"),found,hit);
+        if(!WriteText(v,write,up,buf,(SQInteger)scstrlen(buf))) return SQ_ERROR;
+    }
+    return SQ_OK;
+}
+
+//adds the hits of an lcov tracefile, only the SF and DA records are read
+SQRESULT sq_readcoverage(HSQUIRRELVM v,SQREADFUNC read,SQUserPointer up)
+{
+    SQSharedState *ss = _ss(v);
+    sqvector<SQChar> text;
+    SQInteger n;
+    do {
+        SQInteger at = text.size();
+        text.resize(at + 4096);
+        n = read(up,&text[at],sq_rsl(4096));
+        if(n < 0) n = 0; //the end of the stream can also be -1
+        text.resize(at + n / sizeof(SQChar));
+    } while(n > 0);
+    text.push_back(_SC('\n'));
+    SQCoverageFile *file = NULL;
+    SQInteger start = 0;
+    for(SQUnsignedInteger i = 0; i < text.size(); i++) {
+        if(text[i] != _SC('\n')) continue;
+        SQChar *s = &text[start];
+        SQInteger len = (SQInteger)i - start;
+        start = i + 1;
+        if(len > 0 && s[len - 1] == _SC('\r')) len--;
+        s[len] = _SC('\0');
+        if(len > 3 && memcmp(s,_SC("SF:"),sq_rsl(3)) == 0) {
+            file = ss->GetCoverageFile(SQString::Create(ss,s + 3,len - 3));
+        }
+        else if(len > 3 && memcmp(s,_SC("DA:"),sq_rsl(3)) == 0) {
+            SQChar *end;
+            SQInteger line = scstrtol(s + 3,&end,10);
+            if(!file || *end != _SC(',') || line < 0 || line > SQ_COVERAGE_MAXLINE) return sq_throwerror(v,_SC("invalid coverage data"));
+            SQInteger hits = scstrtol(end + 1,&end,10);
+            if(hits < 0 || (*end != _SC('\0') && *end != _SC(','))) return sq_throwerror(v,_SC("invalid coverage data"));
+            if((SQInteger)file->_hits.size() <= line) file->_hits.resize(line + 1,-1);
+            if(file->_hits[line] < 0) file->_hits[line] = 0;
+            file->_hits[line] += hits;
+        }
+        else if(scstrcmp(s,_SC("end_of_record")) == 0) {
+            file = NULL;
+        }
+    }
+    return SQ_OK;
+}
+
+//microseconds from an arbitrary point
+static double TraceClock()
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq,now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart * 1000000.0 / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec * 1000000.0 + (double)ts.tv_nsec / 1000.0;
+#endif
+}
+
+void SQSharedState::TraceBegin(SQVM *v,SQInteger cat,const SQObjectPtr &name,const SQObjectPtr &source,SQInteger line)
+{
+    SQTraceEvent &e = _trace[_tracecount++ % _trace.size()];
+    e._time = TraceClock() - _tracestart;
+    e._thread = v;
+    e._name = name;
+    e._source = source;
+    e._line = line;
+    e._cat = (unsigned char)cat;
+    e._phase = 'B';
+}
+
+void SQSharedState::TraceEnd(SQVM *v,SQInteger cat)
+{
+    SQTraceEvent &e = _trace[_tracecount++ % _trace.size()];
+    e._time = TraceClock() - _tracestart;
+    e._thread = v;
+    e._name.Null();
+    e._source.Null();
+    e._cat = (unsigned char)cat;
+    e._phase = 'E';
+}
+
+void sq_starttrace(HSQUIRRELVM v,SQInteger size)
+{
+    SQSharedState *ss = _ss(v);
+    ss->_tracing = false;
+    ss->_trace.resize(0);
+    ss->_trace.shrinktofit();
+    ss->_tracecount = 0;
+    if(size <= 0) return;
+    SQTraceEvent e;
+    e._time = 0.0;
+    e._thread = NULL;
+    e._line = 0;
+    e._cat = 0;
+    e._phase = 0;
+    ss->_trace.resize(size,e);
+    ss->_tracestart = TraceClock();
+    ss->_tracing = true;
+}
+
+void sq_stoptrace(HSQUIRRELVM v)
+{
+    _ss(v)->_tracing = false;
+}
+
+static const SQChar *g_tracecategories[] = { _SC("call"), _SC("native"), _SC("gc"), _SC("compile") };
+
+//a JSON string, without the control characters
+static bool WriteTraceString(HSQUIRRELVM v,SQWRITEFUNC write,SQUserPointer up,const SQObjectPtr &o,const SQChar *def)
+{
+    const SQChar *s = type(o) == OT_STRING ? _stringval(o) : def;
+    SQInteger len = type(o) == OT_STRING ? _string(o)->_len : (SQInteger)scstrlen(def);
+    SQInteger start = 0;
+    if(!WriteText(v,write,up,_SC("\""),1)) return false;
+    for(SQInteger i = 0; i <= len; i++) {
+        if(i < len && s[i] != _SC('"') && s[i] != _SC('\\') && (SQUnsignedInteger)s[i] >= 0x20) continue;
+        if(!WriteText(v,write,up,s + start,i - start)) return false;
+        if(i < len && (s[i] == _SC('"') || s[i] == _SC('\\'))) {
+            if(!WriteText(v,write,up,_SC("\\"),1) || !WriteText(v,write,up,s + i,1)) return false;
+        }
+        start = i + 1;
+    }
+    return WriteText(v,write,up,_SC("\""),1);
+}
+
+//writes the events in the ring as a Chrome trace, the end events whose begin
+//was overwritten are skipped
+SQRESULT sq_writetrace(HSQUIRRELVM v,SQWRITEFUNC write,SQUserPointer up)
+{
+    SQSharedState *ss = _ss(v);
+    SQUnsignedInteger size = ss->_trace.size();
+    SQUnsignedInteger first = ss->_tracecount > size ? ss->_tracecount - size : 0;
+    sqvector<SQVM *> threads;
+    sqvector<SQInteger> depths;
+    SQChar buf[NUMBER_MAX_CHAR * 4 + 64];
+    if(!WriteText(v,write,up,_SC("{\"traceEvents\":["),16)) return SQ_ERROR;
+    bool comma = false;
+    for(SQUnsignedInteger n = first; n < ss->_tracecount; n++) {
+        SQTraceEvent &e = ss->_trace[n % size];
+        SQUnsignedInteger tid;
+        for(tid = 0; tid < threads.size() && threads[tid] != e._thread; tid++);
+        if(tid == threads.size()) {
+            threads.push_back(e._thread);
+            depths.push_back(0);
+            scsprintf(buf,sizeof(buf)/sizeof(SQChar),_SC("%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":") _PRINT_INT_FMT _SC(",\"args\":{\"name\":"),
+                comma ? _SC(",") : _SC(""),(SQInteger)tid + 1);
+            if(!WriteText(v,write,up,buf,(SQInteger)scstrlen(buf))) return SQ_ERROR;
+            if(e._thread == _thread(ss->_root_vm)) scsprintf(buf,sizeof(buf)/sizeof(SQChar),_SC("\"main\"}}"));
+            else scsprintf(buf,sizeof(buf)/sizeof(SQChar),_SC("\"thread ") _PRINT_INT_FMT _SC("\"}}"),(SQInteger)tid + 1);
+            if(!WriteText(v,write,up,buf,(SQInteger)scstrlen(buf))) return SQ_ERROR;
+            comma = true;
+        }
+        if(e._phase == 'E') {
+            if(depths[tid] == 0) continue;
+            depths[tid]--;
+        }
+        else depths[tid]++;
+        scsprintf(buf,sizeof(buf)/sizeof(SQChar),_SC("%s\n{\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":") _PRINT_INT_FMT _SC(",\"cat\":\"%s\""),
+            comma ? _SC(",") : _SC(""),(int)e._phase,e._time,(SQInteger)tid + 1,g_tracecategories[e._cat]);
+        if(!WriteText(v,write,up,buf,(SQInteger)scstrlen(buf))) return SQ_ERROR;
+        comma = true;
+        if(e._phase == 'B') {
+            if(!WriteText(v,write,up,_SC(",\"name\":"),8) || !WriteTraceString(v,write,up,e._name,_SC("unknown"))) return SQ_ERROR;
+            if(type(e._source) == OT_STRING) {
+                if(!WriteText(v,write,up,_SC(",\"args\":{\"source\":"),18) || !WriteTraceString(v,write,up,e._source,NULL)) return SQ_ERROR;
+                scsprintf(buf,sizeof(buf)/sizeof(SQChar),_SC(",\"line\":") _PRINT_INT_FMT _SC("}"),e._line);
+                if(!WriteText(v,write,up,buf,(SQInteger)scstrlen(buf))) return SQ_ERROR;
+            }
+        }
+        if(!WriteText(v,write,up,_SC("}"),1)) return SQ_ERROR;
+    }
+    if(!WriteText(v,write,up,_SC("\n]}\n"),4)) return SQ_ERROR;
+    return SQ_OK;
+}
+
+#define SQ_HEAPLABEL_MAX 64
+
+//writes the objects reachable from the roots, following the references the Mark() methods
+//follow, as one line per object and one per reference:
+//  n <id> <type> <shallow size> <label>
+//  e <from> <to> <kind> <name>
+//the kind is 'p' for a named slot, 'e' for an index and 'i' for an internal reference.
+//Node 0 holds the roots and node 1 the objects that only a collection would free
+struct SQHeapSnapshot
+{
+    SQHeapSnapshot(SQVM *v,SQWRITEFUNC write,SQUserPointer up);
+    bool Write();
+    SQInteger Id(const SQObject &o);
+    bool Text(const SQChar *s,SQInteger len);
+    bool Text(const SQChar *s) { return Text(s,(SQInteger)scstrlen(s)); }
+    bool Flush();
+    bool Escaped(const SQChar *s,SQInteger len);
+    bool Edge(SQInteger from,const SQObject &to,SQChar kind,const SQChar *name,SQInteger len);
+    bool Edge(SQInteger from,const SQObject &to,const SQChar *name) { return Edge(from,to,_SC('i'),name,(SQInteger)scstrlen(name)); }
+    bool Edge(SQInteger from,const SQObject &to,const SQObject &name);
+    bool Slot(SQInteger from,const SQObject &to,const SQChar *name,SQInteger idx);
+    bool WriteNode(SQInteger id);
+    bool WriteEdges(SQInteger id);
+    bool WriteClassMembers(SQInteger id,SQClass *c,SQObjectPtr *values);
+    SQVM *_v;
+    SQWRITEFUNC _write;
+    SQUserPointer _up;
+    SQObjectPtr _ids;
+    sqvector<SQObject> _objects;
+    sqvector<SQChar> _buf;
+};
+
+SQHeapSnapshot::SQHeapSnapshot(SQVM *v,SQWRITEFUNC write,SQUserPointer up)
+{
+    SQObject null;
+    null._type = OT_NULL;
+    null._unVal.nInteger = 0;
+    _v = v;
+    _write = write;
+    _up = up;
+    _ids = SQTable::Create(_ss(v),0);
+    _objects.push_back(null);
+    _objects.push_back(null);
+}
+
+//the snapshot is made of many short pieces, they are written in blocks
+bool SQHeapSnapshot::Text(const SQChar *s,SQInteger len)
+{
+    for(SQInteger i = 0; i < len; i++) _buf.push_back(s[i]);
+    return _buf.size() < 4096 || Flush();
+}
+
+bool SQHeapSnapshot::Flush()
+{
+    bool ok = WriteText(_v,_write,_up,_buf._vals,(SQInteger)_buf.size());
+    _buf.resize(0);
+    return ok;
+}
+
+SQInteger SQHeapSnapshot::Id(const SQObject &o)
+{
+    SQObjectPtr id;
+    if(!ISREFCOUNTED(type(o))) return -1;
+    if(_table(_ids)->Get(o,id)) return _integer(id);
+    id = (SQInteger)_objects.size();
+    _table(_ids)->NewSlot(o,id);
+    _objects.push_back(o);
+    return _integer(id);
+}
+
+//names and labels are cut and kept on one line
+bool SQHeapSnapshot::Escaped(const SQChar *s,SQInteger len)
+{
+    SQInteger start = 0,n = len < SQ_HEAPLABEL_MAX ? len : SQ_HEAPLABEL_MAX;
+    for(SQInteger i = 0; i < n; i++) {
+        const SQChar *esc = s[i] == _SC('\\') ? _SC("\\\\") : s[i] == _SC('\n') ? _SC("\\n") : s[i] == _SC('\r') ? _SC("\\r") : NULL;
+        if(!esc) continue;
+        if(!Text(s + start,i - start) || !Text(esc)) return false;
+        start = i + 1;
+    }
+    if(!Text(s + start,n - start)) return false;
+    return n == len || Text(_SC("..."));
+}
+
+bool SQHeapSnapshot::Edge(SQInteger from,const SQObject &to,SQChar kind,const SQChar *name,SQInteger len)
+{
+    SQChar buf[NUMBER_MAX_CHAR * 2 + 16];
+    SQInteger id = Id(to);
+    if(id < 0) return true;
+    scsprintf(buf,sizeof(buf)/sizeof(SQChar),_SC("e ") _PRINT_INT_FMT _SC(" ") _PRINT_INT_FMT _SC(" %c "),from,id,(int)kind);
+    return Text(buf) && Escaped(name,len) && Text(_SC("\n"));
+}
+
+//a slot of a table or of a class
+bool SQHeapSnapshot::Edge(SQInteger from,const SQObject &to,const SQObject &name)
+{
+    SQChar buf[NUMBER_MAX_CHAR + 1];
+    switch(type(name)) {
+    case OT_STRING:
+        return Edge(from,to,_SC('p'),_stringval(name),_string(name)->_len);
+    case OT_INTEGER:
+        scsprintf(buf,sizeof(buf)/sizeof(SQChar),_PRINT_INT_FMT,_integer(name));
+        return Edge(from,to,_SC('e'),buf,(SQInteger)scstrlen(buf));
+    case OT_FLOAT:
+        scsprintf(buf,sizeof(buf)/sizeof(SQChar),_SC("%.14g"),(double)_float(name));
+        return Edge(from,to,_SC('e'),buf,(SQInteger)scstrlen(buf));
+    case OT_BOOL:
+        return Edge(from,to,_SC('e'),_integer(name) ? _SC("true") : _SC("false"),_integer(name) ? 4 : 5);
+    default:
+        //the key is an object, it is kept alive by the table too
+        return Edge(from,name,_SC("key")) && Edge(from,to,_SC("value"));
+    }
+}
+
+bool SQHeapSnapshot::Slot(SQInteger from,const SQObject &to,const SQChar *name,SQInteger idx)
+{
+    SQChar buf[NUMBER_MAX_CHAR + 32];
+    scsprintf(buf,sizeof(buf)/sizeof(SQChar),_SC("%s[") _PRINT_INT_FMT _SC("]"),name,idx);
+    return Edge(from,to,_SC('i'),buf,(SQInteger)scstrlen(buf));
+}
+
+static SQInteger FunctionSize(SQFunctionProto *f)
+{
+    SQInteger size;
+    if(f->_lazy || type(f->_body) == OT_FUNCPROTO) {
+        size = _FUNC_SIZE(0,0,f->_nparameters,0,f->_noutervalues,0,0,f->_ndefaultparams);
+        if(f->_lazy) size += sizeof(SQLazyBody) + sq_rsl(f->_lazy->_size);
+    }
+    else if(f->_frozen) {
+        size = _FUNC_SIZE(0,f->_nliterals,f->_nparameters,f->_nfunctions,f->_noutervalues,0,f->_nlocalvarinfos,0);
+        if(f->_patchedcode) size += f->_ninstructions * sizeof(SQInstruction);
+    }
+    else {
+        size = _FUNC_SIZE(f->_ninstructions,f->_nliterals,f->_nparameters,f->_nfunctions,f->_noutervalues,f->_nlineinfos,f->_nlocalvarinfos,f->_ndefaultparams);
+    }
+    if(f->_coverage) size += (f->_ninstructions + 7) / 8;
+    return size;
+}
+
+static SQInteger FunctionLine(SQFunctionProto *f)
+{
+    if(f->_lazy) return f->_lazy->_line;
+    return f->_nlineinfos ? f->_lineinfos[0]._line : 0;
+}
+
+bool SQHeapSnapshot::WriteNode(SQInteger id)
+{
+    SQObject &o = _objects[id];
+    SQChar buf[NUMBER_MAX_CHAR * 3 + 32];
+    const SQChar *typen = IdType2Name(type(o));
+    SQInteger size = 0;
+    SQFunctionProto *f = NULL;
+    const SQObject *name = NULL;
+    switch(type(o)) {
+    case OT_STRING: size = sizeof(SQString) + sq_rsl(_string(o)->_len); name = &o; break;
+    case OT_TABLE: size = sizeof(SQTable) + _table(o)->NodesSize(); break;
+    case OT_ARRAY: size = sizeof(SQArray) + _array(o)->_values.capacity() * sizeof(SQObjectPtr); break;
+    case OT_USERDATA: size = sq_aligning(sizeof(SQUserData)) + _userdata(o)->_size; break;
+    case OT_CLOSURE:
+        typen = _SC("closure");
+        f = _closure(o)->_function;
+        size = _CALC_CLOSURE_SIZE(f);
+        break;
+    case OT_NATIVECLOSURE:
+        typen = _SC("native");
+        size = _CALC_NATVIVECLOSURE_SIZE(_nativeclosure(o)->_noutervalues) + _nativeclosure(o)->_typecheck.capacity() * sizeof(SQInteger);
+        name = &_nativeclosure(o)->_name;
+        break;
+    case OT_FUNCPROTO:
+        typen = _SC("funcproto");
+        f = _funcproto(o);
+        size = FunctionSize(f);
+        break;
+    case OT_GENERATOR:
+        size = sizeof(SQGenerator) + _generator(o)->_stack.capacity() * sizeof(SQObjectPtr)
+            + _generator(o)->_etraps.capacity() * sizeof(SQExceptionTrap);
+        break;
+    case OT_THREAD:
+        size = sizeof(SQVM) + _thread(o)->_stack.capacity() * sizeof(SQObjectPtr)
+            + _thread(o)->_alloccallsstacksize * sizeof(SQVM::CallInfo);
+        break;
+    case OT_CLASS:
+        size = sizeof(SQClass) + (_class(o)->_defaultvalues.capacity() + _class(o)->_methods.capacity()) * sizeof(SQClassMember);
+        break;
+    case OT_INSTANCE: size = _instance(o)->_memsize; break;
+    case OT_WEAKREF: size = sizeof(SQWeakRef); break;
+    case OT_OUTER: size = sizeof(SQOuter); break;
+    default: break;
+    }
+    scsprintf(buf,sizeof(buf)/sizeof(SQChar),_SC("n ") _PRINT_INT_FMT _SC(" %s ") _PRINT_INT_FMT,id,typen,size);
+    if(!Text(buf)) return false;
+    if(f) {
+        //functions are labelled with the place where they are defined
+        if(!Text(_SC(" "))) return false;
+        if(type(f->_name) == OT_STRING && !Escaped(_stringval(f->_name),_string(f->_name)->_len)) return false;
+        if(type(f->_sourcename) == OT_STRING) {
+            if(!Text(_SC(" ")) || !Escaped(_stringval(f->_sourcename),_string(f->_sourcename)->_len)) return false;
+            scsprintf(buf,sizeof(buf)/sizeof(SQChar),_SC(":") _PRINT_INT_FMT,FunctionLine(f));
+            if(!Text(buf)) return false;
+        }
+    }
+    else if(name && type(*name) == OT_STRING) {
+        if(!Text(_SC(" ")) || !Escaped(_stringval(*name),_string(*name)->_len)) return false;
+    }
+    return Text(_SC("\n"));
+}
+
+bool SQHeapSnapshot::WriteClassMembers(SQInteger id,SQClass *c,SQObjectPtr *values)
+{
+    SQObjectPtr key,val;
+    SQInteger ridx = 0;
+    while((ridx = c->_members->Next(false,ridx,key,val)) != -1) {
+        if(values) {
+            if(_isfield(val) && !Edge(id,values[_member_idx(val)],key)) return false;
+        }
+        else {
+            SQClassMember &m = _isfield(val) ? c->_defaultvalues[_member_idx(val)] : c->_methods[_member_idx(val)];
+            if(!Edge(id,m.val,key) || !Edge(id,m.attrs,_SC("attributes"))) return false;
+        }
+    }
+    return true;
+}
+
+bool SQHeapSnapshot::WriteEdges(SQInteger id)
+{
+    SQObject o = _objects[id]; //a copy, _objects grows while the edges are written
+    SQInteger i;
+    switch(type(o)) {
+    case OT_TABLE: {
+        SQObjectPtr key,val;
+        SQInteger ridx = 0;
+        if(_table(o)->_delegate && !Edge(id,SQObjectPtr(_table(o)->_delegate),_SC("delegate"))) return false;
+        while((ridx = _table(o)->Next(true,ridx,key,val)) != -1) {
+            if(!Edge(id,val,key)) return false;
+        }
+        }
+        break;
+    case OT_ARRAY:
+        for(i = 0; i < _array(o)->Size(); i++) {
+            if(!Edge(id,_array(o)->_values[i],SQObjectPtr(i))) return false;
+        }
+        break;
+    case OT_CLOSURE: {
+        SQClosure *c = _closure(o);
+        SQFunctionProto *f = c->_function;
+        if(!Edge(id,SQObjectPtr(f),_SC("function"))) return false;
+        if(c->_base && !Edge(id,SQObjectPtr(c->_base),_SC("base"))) return false;
+        for(i = 0; i < f->_noutervalues; i++) {
+            if(!Edge(id,c->_outervalues[i],f->_outervalues[i]._name)) return false;
+        }
+        for(i = 0; i < f->_ndefaultparams; i++) {
+            if(!Slot(id,c->_defaultparams[i],_SC("default"),i)) return false;
+        }
+        }
+        break;
+    case OT_NATIVECLOSURE: {
+        SQNativeClosure *c = _nativeclosure(o);
+        if(!Edge(id,c->_name,_SC("name"))) return false;
+        for(i = 0; i < (SQInteger)c->_noutervalues; i++) {
+            if(!Slot(id,c->_outervalues[i],_SC("outer"),i)) return false;
+        }
+        }
+        break;
+    case OT_OUTER:
+        //an open outer points into a stack, the value belongs to the thread
+        if(_outer(o)->_valptr == &_outer(o)->_value && !Edge(id,_outer(o)->_value,_SC("value"))) return false;
+        break;
+    case OT_USERDATA:
+        if(_userdata(o)->_delegate && !Edge(id,SQObjectPtr(_userdata(o)->_delegate),_SC("delegate"))) return false;
+        break;
+    case OT_CLASS: {
+        SQClass *c = _class(o);
+        if(!Edge(id,SQObjectPtr(c->_members),_SC("members"))) return false;
+        if(c->_base && !Edge(id,SQObjectPtr(c->_base),_SC("base"))) return false;
+        if(!Edge(id,c->_attributes,_SC("attributes")) || !WriteClassMembers(id,c,NULL)) return false;
+        for(i = 0; i < MT_LAST; i++) {
+            if(!Edge(id,c->_metamethods[i],(*_ss(_v)->_metamethods)[i])) return false;
+        }
+        }
+        break;
+    case OT_INSTANCE:
+        if(!Edge(id,SQObjectPtr(_instance(o)->_class),_SC("class"))
+            || !WriteClassMembers(id,_instance(o)->_class,_instance(o)->_values)) return false;
+        break;
+    case OT_GENERATOR: {
+        SQGenerator *g = _generator(o);
+        if(!Edge(id,g->_closure,_SC("closure"))) return false;
+        for(i = 0; i < (SQInteger)g->_stack.size(); i++) {
+            if(!Slot(id,g->_stack[i],_SC("stack"),i)) return false;
+        }
+        }
+        break;
+    case OT_THREAD: {
+        SQVM *t = _thread(o);
+        if(!Edge(id,t->_lasterror,_SC("lasterror")) || !Edge(id,t->_errorhandler,_SC("errorhandler"))
+            || !Edge(id,t->_debughook_closure,_SC("debughook")) || !Edge(id,t->_roottable,_SC("roottable"))
+            || !Edge(id,t->temp_reg,_SC("temp_reg"))) return false;
+        for(i = 0; i < (SQInteger)t->_stack.size(); i++) {
+            if(!Slot(id,t->_stack[i],_SC("stack"),i)) return false;
+        }
+        for(i = 0; i < t->_callsstacksize; i++) {
+            if(!Slot(id,t->_callsstack[i]._closure,_SC("frame"),i)) return false;
+        }
+        }
+        break;
+    case OT_FUNCPROTO: {
+        SQFunctionProto *f = _funcproto(o);
+        if(!Edge(id,f->_name,_SC("name")) || !Edge(id,f->_sourcename,_SC("sourcename")) || !Edge(id,f->_body,_SC("body"))) return false;
+        for(i = 0; i < f->_nliterals; i++) {
+            if(!Slot(id,f->_literals[i],_SC("literal"),i)) return false;
+        }
+        for(i = 0; i < f->_nfunctions; i++) {
+            if(!Slot(id,f->_functions[i],_SC("function"),i)) return false;
+        }
+        for(i = 0; i < f->_nparameters; i++) {
+            if(!Slot(id,f->_parameters[i],_SC("parameter"),i)) return false;
+        }
+        for(i = 0; i < f->_noutervalues; i++) {
+            if(!Slot(id,f->_outervalues[i]._name,_SC("outer"),i)) return false;
+        }
+        for(i = 0; i < f->_nlocalvarinfos; i++) {
+            if(!Slot(id,f->_localvarinfos[i]._name,_SC("local"),i)) return false;
+        }
+        }
+        break;
+    default: break; //strings have no references and weak references are not followed
+    }
+    return true;
+}
+
+bool SQHeapSnapshot::Write()
+{
+    SQSharedState *ss = _ss(_v);
+    SQUnsignedInteger n;
+    if(!Text(_SC("sqheap 1\nn 0 root 0 (roots)\n"))
+        || !Edge(0,ss->_root_vm,_SC("root_vm"))
+        || !Edge(0,ss->_registry,_SC("registry"))
+        || !Edge(0,ss->_consts,_SC("consts"))
+        || !Edge(0,ss->_metamethodsmap,_SC("metamethodsmap"))
+        || !Edge(0,ss->_table_default_delegate,_SC("table_default_delegate"))
+        || !Edge(0,ss->_array_default_delegate,_SC("array_default_delegate"))
+        || !Edge(0,ss->_string_default_delegate,_SC("string_default_delegate"))
+        || !Edge(0,ss->_number_default_delegate,_SC("number_default_delegate"))
+        || !Edge(0,ss->_generator_default_delegate,_SC("generator_default_delegate"))
+        || !Edge(0,ss->_thread_default_delegate,_SC("thread_default_delegate"))
+        || !Edge(0,ss->_closure_default_delegate,_SC("closure_default_delegate"))
+        || !Edge(0,ss->_class_default_delegate,_SC("class_default_delegate"))
+        || !Edge(0,ss->_instance_default_delegate,_SC("instance_default_delegate"))
+        || !Edge(0,ss->_weakref_default_delegate,_SC("weakref_default_delegate"))) return false;
+    for(n = 0; n < ss->_breakpoints.size(); n++) {
+        if(!Edge(0,SQObjectPtr(ss->_breakpoints[n]._proto),_SC("breakpoint"))) return false;
+    }
+    sqvector<SQObject> refs;
+    ss->_refs_table.GetObjects(refs);
+    for(n = 0; n < refs.size(); n++) {
+        if(!Edge(0,refs[n],_SC("ref"))) return false;
+    }
+    if(!Text(_SC("e 0 1 i garbage\n"))) return false;
+    for(n = 2; n < _objects.size(); n++) {
+        if(!WriteNode(n) || !WriteEdges(n)) return false;
+    }
+#ifndef NO_GARBAGE_COLLECTOR
+    //everything else on the chain is only kept alive by cycles; the oldest objects come
+    //first, they are usually the containers of the younger ones
+    SQObjectPtr tmp;
+    SQCollectable *last = ss->_gc_chain;
+    while(last && last->_next) last = last->_next;
+    for(SQCollectable *t = last; t; t = t->_prev) {
+        SQObject o;
+        o._type = t->GetType();
+        o._unVal.pRefCounted = t;
+        if(t == _table(_ids) || _table(_ids)->Get(o,tmp)) continue;
+        if(!Edge(1,o,_SC("cycle"))) return false;
+        for(; n < _objects.size(); n++) {
+            if(!WriteNode(n) || !WriteEdges(n)) return false;
+        }
+    }
+#endif
+    return Text(_SC("n 1 root 0 (garbage)\n")) && Flush();
+}
+
+SQRESULT sq_writeheapsnapshot(HSQUIRRELVM v,SQWRITEFUNC write,SQUserPointer up)
+{
+    SQHeapSnapshot s(v,write,up);
+    return s.Write() ? SQ_OK : SQ_ERROR;
+}
+
 void SQVM::Raise_Error(const SQChar *s, ...)
 {
     va_list vl;
@@ -94,6 +854,11 @@ void SQVM::Raise_IdxError(const SQObjectPtr &o)
     Raise_Error(_SC("the index '%.50s' does not exist"), _stringval(oval));
 }
 
+void SQVM::Raise_FrozenError(const SQObjectPtr &o)
+{
+    Raise_Error(_SC("cannot modify a frozen %s"), GetTypeName(o));
+}
+
 void SQVM::Raise_CompareError(const SQObject &o1, const SQObject &o2)
 {
     SQObjectPtr oval1 = PrintObjVal(o1), oval2 = PrintObjVal(o2);
@@ -9,6 +9,12 @@ enum SQOuterType {
     otOUTER = 1
 };
 
+enum SQVarParamsType {
+    vpNONE = 0,
+    vpARRAY = 1, //vargv is built on every call
+    vpSTACK = 2  //extra args stay on the stack, vargv is built on demand
+};
+
 struct SQOuterVar
 {
 
@@ -52,8 +58,104 @@ typedef sqvector<SQOuterVar> SQOuterVarVec;
 typedef sqvector<SQLocalVarInfo> SQLocalVarInfoVec;
 typedef sqvector<SQLineInfo> SQLineInfoVec;
 
+//a value of a frozen prototype, strings are indexes in the string pool of the image
+struct SQFrozenObject
+{
+    SQObjectType _type;
+    union {
+        SQInteger _nval;
+        SQFloat _fval;
+    };
+};
+
+struct SQFrozenString { SQInteger _offset;SQInteger _len; };
+struct SQFrozenOuterVar { SQOuterType _type;SQFrozenObject _name;SQFrozenObject _src; };
+struct SQFrozenLocalVarInfo { SQFrozenObject _name;SQUnsignedInteger _start_op;SQUnsignedInteger _end_op;SQUnsignedInteger _pos; };
+
+struct SQFrozenFunc
+{
+    SQFrozenObject _sourcename;
+    SQFrozenObject _name;
+    SQInteger _stacksize;
+    bool _bgenerator;
+    SQInteger _varparams;
+    SQInteger _ninstructions;
+    SQInstruction *_instructions;
+    SQInteger _nlineinfos;
+    SQLineInfo *_lineinfos;
+    SQInteger _ndefaultparams;
+    SQInteger *_defaultparams;
+    SQInteger _nliterals;
+    SQFrozenObject *_literals;
+    SQInteger _nparameters;
+    SQFrozenObject *_parameters;
+    SQInteger _noutervalues;
+    SQFrozenOuterVar *_outervalues;
+    SQInteger _nlocalvarinfos;
+    SQFrozenLocalVarInfo *_localvarinfos;
+    SQInteger _nfunctions;
+    SQFrozenFunc *_functions;
+};
+
+//read-only image of a function prototype tree that any number of shared states
+//(and threads) can reference at once; the code, line infos and default params
+//are used in place, the objects are rebuilt in every state that thaws it
+struct SQFrozenProto
+{
+    static SQFrozenProto *Create(SQVM *v,SQFunctionProto *func);
+    static SQFrozenProto *Map(SQVM *v,SQUserPointer buf,SQInteger size,SQRELEASEHOOK hook);
+    bool Write(SQVM *v,SQUserPointer up,SQWRITEFUNC write);
+    SQFunctionProto *Thaw(SQSharedState *ss);
+    void AddRef();
+    void Release();
+
+    long _refcount;
+    sqvector<SQFrozenString> _strings;
+    sqvector<SQChar> _chars;
+    //string pool in use, the vectors above or a mapped buffer
+    SQInteger _nstrings;
+    const SQFrozenString *_strtab;
+    const SQChar *_chartab;
+    //a mapped image points into _buf, that is released by _hook with the last reference
+    SQUserPointer _buf;
+    SQInteger _bufsize;
+    SQRELEASEHOOK _hook;
+    SQFrozenFunc _main;
+};
+
+//the payload of a bytecode stream (version 2); it is kept while the prototypes read from
+//it still have nested functions that were not loaded, every such function holds a reference
+struct SQBytecodeImage
+{
+    static bool Load(SQVM *v,SQUserPointer up,SQREADFUNC read,SQObjectPtr &ret);
+    bool LoadFunction(SQVM *v,SQInteger idx,SQObjectPtr &ret);
+    void AddRef() { _refcount++; }
+    void Release();
+
+    SQInteger _refcount;
+    SQSharedState *_ss;
+    sqvector<unsigned char> _data;
+    //offsets in _data of the string pool and of the body of every function
+    sqvector<SQFrozenString> _strings;
+    sqvector<SQInteger> _functions;
+};
+
+//source of a function body that is compiled on its first call (lazy compilation)
+struct SQLazyBody
+{
+    static SQLazyBody *Create(SQSharedState *ss,const SQChar *source,SQInteger size,SQInteger line,SQInteger column,bool lineinfo);
+    void Release(SQSharedState *ss);
+
+    SQInteger _size;
+    //position of the opening brace in the script
+    SQInteger _line;
+    SQInteger _column;
+    bool _lineinfo;
+    SQChar *_source;
+};
+
 #define _FUNC_SIZE(ni,nl,nparams,nfuncs,nouters,nlineinf,localinf,defparams) (sizeof(SQFunctionProto) \
-        +((ni-1)*sizeof(SQInstruction))+(nl*sizeof(SQObjectPtr)) \
+        +(ni*sizeof(SQInstruction))+(nl*sizeof(SQObjectPtr)) \
         +(nparams*sizeof(SQObjectPtr))+(nfuncs*sizeof(SQObjectPtr)) \
         +(nouters*sizeof(SQOuterVar))+(nlineinf*sizeof(SQLineInfo)) \
         +(localinf*sizeof(SQLocalVarInfo))+(defparams*sizeof(SQInteger)))
@@ -76,6 +178,7 @@ public:
         f = (SQFunctionProto *)sq_vm_malloc(_FUNC_SIZE(ninstructions,nliterals,nparameters,nfunctions,noutervalues,nlineinfos,nlocalvarinfos,ndefaultparams));
         new (f) SQFunctionProto(ss);
         f->_ninstructions = ninstructions;
+        f->_instructions = (SQInstruction*)(f + 1);
         f->_literals = (SQObjectPtr*)&f->_instructions[ninstructions];
         f->_nliterals = nliterals;
         f->_parameters = (SQObjectPtr*)&f->_literals[nliterals];
@@ -100,21 +203,48 @@ public:
         return f;
     }
     void Release(){
+        if(_coverage) _sharedstate->ReleaseCoverage(this);
+        if(_image) {
+            for(SQInteger i = 0; i < _nfunctions; i++) {
+                if(type(_functions[i]) == OT_INTEGER) _image->Release();
+            }
+        }
+        SQInteger size;
+        if(_lazy || type(_body) == OT_FUNCPROTO) {
+            //a lazy function owns only its parameters, outers and default params
+            if(_lazy) _lazy->Release(_sharedstate);
+            _DESTRUCT_VECTOR(SQObjectPtr,_nparameters,_parameters);
+            _DESTRUCT_VECTOR(SQOuterVar,_noutervalues,_outervalues);
+            size = _FUNC_SIZE(0,0,_nparameters,0,_noutervalues,0,0,_ndefaultparams);
+            this->~SQFunctionProto();
+            sq_vm_free(this,size);
+            return;
+        }
         _DESTRUCT_VECTOR(SQObjectPtr,_nliterals,_literals);
         _DESTRUCT_VECTOR(SQObjectPtr,_nparameters,_parameters);
         _DESTRUCT_VECTOR(SQObjectPtr,_nfunctions,_functions);
         _DESTRUCT_VECTOR(SQOuterVar,_noutervalues,_outervalues);
         //_DESTRUCT_VECTOR(SQLineInfo,_nlineinfos,_lineinfos); //not required are 2 integers
         _DESTRUCT_VECTOR(SQLocalVarInfo,_nlocalvarinfos,_localvarinfos);
-        SQInteger size = _FUNC_SIZE(_ninstructions,_nliterals,_nparameters,_nfunctions,_noutervalues,_nlineinfos,_nlocalvarinfos,_ndefaultparams);
+        if(_frozen) {
+            //code, line infos and default params belong to the frozen image
+            if(_patchedcode) SQ_FREE(_patchedcode,_ninstructions * sizeof(SQInstruction));
+            size = _FUNC_SIZE(0,_nliterals,_nparameters,_nfunctions,_noutervalues,0,_nlocalvarinfos,0);
+            _frozen->Release();
+        }
+        else {
+            size = _FUNC_SIZE(_ninstructions,_nliterals,_nparameters,_nfunctions,_noutervalues,_nlineinfos,_nlocalvarinfos,_ndefaultparams);
+        }
         this->~SQFunctionProto();
         sq_vm_free(this,size);
     }
 
     const SQChar* GetLocal(SQVM *v,SQUnsignedInteger stackbase,SQUnsignedInteger nseq,SQUnsignedInteger nop);
     SQInteger GetLine(SQInstruction *curr);
-    bool Save(SQVM *v,SQUserPointer up,SQWRITEFUNC write);
     static bool Load(SQVM *v,SQUserPointer up,SQREADFUNC read,SQObjectPtr &ret);
+    bool LoadBody(SQVM *v,bool raiseerror = true);
+    bool LoadFunction(SQVM *v,SQInteger i);
+    bool LoadFunctions(SQVM *v);
 #ifndef NO_GARBAGE_COLLECTOR
     void Mark(SQCollectable **chain);
     void Finalize(){ _NULL_SQOBJECT_VECTOR(_literals,_nliterals); }
@@ -147,8 +277,20 @@ public:
     SQInteger _ndefaultparams;
     SQInteger *_defaultparams;
 
+    SQFrozenProto *_frozen;
+    //private copy of the frozen code, made by the first breakpoint set in it
+    SQInstruction *_patchedcode;
+    //a bit per instruction, set by the _OP_LINEs executed while the coverage is enabled
+    unsigned char *_coverage;
+    //nested functions that are not loaded yet are the integer index of their body in _image
+    SQBytecodeImage *_image;
+    //a lazy function has no code until its first call; the code, literals, nested functions
+    //and debug infos compiled from _lazy are then used in place from _body
+    SQLazyBody *_lazy;
+    SQObjectPtr _body;
+
     SQInteger _ninstructions;
-    SQInstruction _instructions[1];
+    SQInstruction *_instructions;
 };
 
 #endif //_SQFUNCTION_H_
@@ -10,7 +10,7 @@
 #include "sqopcodes.h"
 #include "sqfuncstate.h"
 
-#ifdef _DEBUG_DUMP
+#if defined(_DEBUG_DUMP) || defined(SQ_OPCODE_STATS)
 SQInstructionDesc g_InstrDesc[]={
     {_SC("_OP_LINE")},
     {_SC("_OP_LOAD")},
@@ -73,6 +73,15 @@ SQInstructionDesc g_InstrDesc[]={
     {_SC("_OP_NEWSLOTA")},
     {_SC("_OP_GETBASE")},
     {_SC("_OP_CLOSE")},
+    {_SC("_OP_VARGC")},
+    {_SC("_OP_GETVARG")},
+    {_SC("_OP_VARGV")},
+    {_SC("_OP_LOADINT_JCMP")},
+    {_SC("_OP_LOADINT_ADD")},
+    {_SC("_OP_LOADINT_SUB")},
+    {_SC("_OP_PINCL_JMP")},
+    {_SC("_OP_PREPCALLK_CALL")},
+    {_SC("_OP_BREAK")},
 };
 #endif
 void DumpLiteral(SQObjectPtr &o)
@@ -86,7 +95,11 @@ void DumpLiteral(SQObjectPtr &o)
     }
 }
 
-SQFuncState::SQFuncState(SQSharedState *ss,SQFuncState *parent,CompilerErrorFunc efunc,void *ed)
+SQFuncState::SQFuncState(SQSharedState *ss,SQFuncState *parent,SQArena *arena,CompilerErrorFunc efunc,void *ed)
+    : _vlocals(arena),_targetstack(arena),_unresolvedbreaks(arena),_unresolvedcontinues(arena),
+    _functions(arena),_parameters(arena),_outervalues(arena),_instructions(arena),_localvarinfos(arena),
+    _lineinfos(arena),_scope_blocks(arena),_breaktargets(arena),_continuetargets(arena),_defaultparams(arena),
+    _childstates(arena)
 {
         _nliterals = 0;
         _literals = SQTable::Create(ss,0);
@@ -104,7 +117,7 @@ SQFuncState::SQFuncState(SQSharedState *ss,SQFuncState *parent,CompilerErrorFunc
         _bgenerator = false;
         _outers = 0;
         _ss = ss;
-
+        _arena = arena;
 }
 
 void SQFuncState::Error(const SQChar *err)
@@ -162,7 +175,7 @@ void SQFuncState::Dump(SQFunctionProto *func)
     n=0;
     for(i=0;i<_instructions.size();i++){
         SQInstruction &inst=_instructions[i];
-        if(inst.op==_OP_LOAD || inst.op==_OP_DLOAD || inst.op==_OP_PREPCALLK || inst.op==_OP_GETK ){
+        if(inst.op==_OP_LOAD || inst.op==_OP_DLOAD || inst.op==_OP_PREPCALLK || inst.op==_OP_PREPCALLK_CALL || inst.op==_OP_GETK ){
 
             SQInteger lidx = inst._arg1;
             scprintf(_SC("[%03d] %15s %d "),n,g_InstrDesc[inst.op].name,inst._arg0);
@@ -350,6 +363,11 @@ bool SQFuncState::IsLocal(SQUnsignedInteger stkpos)
     return false;
 }
 
+bool SQFuncState::IsVargv(SQInteger stkpos)
+{
+    return _varparams && stkpos == (SQInteger)_parameters.size() - 1;
+}
+
 SQInteger SQFuncState::PushLocalVariable(const SQObject &name)
 {
     SQInteger pos=_vlocals.size();
@@ -579,6 +597,30 @@ void SQFuncState::AddInstruction(SQInstruction &i)
     _instructions.push_back(i);
 }
 
+//the second instruction of a pair is left in place, so a jump landing on it
+//still runs it alone. none of them starts a pair itself
+void SQFuncState::FuseInstructions()
+{
+    SQInteger size = _instructions.size();
+    for(SQInteger n = 0; n < size - 1; n++) {
+        SQInstruction &i = _instructions[n];
+        unsigned char next = _instructions[n+1].op;
+        switch(i.op) {
+        case _OP_LOADINT:
+            if(next == _OP_JCMP) i.op = _OP_LOADINT_JCMP;
+            else if(next == _OP_ADD) i.op = _OP_LOADINT_ADD;
+            else if(next == _OP_SUB) i.op = _OP_LOADINT_SUB;
+            break;
+        case _OP_PINCL:
+            if(next == _OP_JMP) i.op = _OP_PINCL_JMP;
+            break;
+        case _OP_PREPCALLK:
+            if(next == _OP_CALL) i.op = _OP_PREPCALLK_CALL;
+            break;
+        }
+    }
+}
+
 SQObject SQFuncState::CreateString(const SQChar *s,SQInteger len)
 {
     SQObjectPtr ns(SQString::Create(_sharedstate,s,len));
@@ -586,6 +628,13 @@ SQObject SQFuncState::CreateString(const SQChar *s,SQInteger len)
     return ns;
 }
 
+SQObject SQFuncState::CreateString(const SQChar *s,SQInteger len,SQHash hash)
+{
+    SQObjectPtr ns(SQString::Create(_sharedstate,s,len,hash));
+    _table(_strings)->NewSlot(ns,(SQInteger)1);
+    return ns;
+}
+
 SQObject SQFuncState::CreateTable()
 {
     SQObjectPtr nt(SQTable::Create(_sharedstate,0));
@@ -595,6 +644,7 @@ SQObject SQFuncState::CreateTable()
 
 SQFunctionProto *SQFuncState::BuildProto()
 {
+    FuseInstructions();
 
     SQFunctionProto *f=SQFunctionProto::Create(_ss,_instructions.size(),
         _nliterals,_parameters.size(),_functions.size(),_outervalues.size(),
@@ -620,17 +670,18 @@ SQFunctionProto *SQFuncState::BuildProto()
     for(SQUnsignedInteger ni = 0; ni < _lineinfos.size(); ni++) f->_lineinfos[ni] = _lineinfos[ni];
     for(SQUnsignedInteger nd = 0; nd < _defaultparams.size(); nd++) f->_defaultparams[nd] = _defaultparams[nd];
 
-    memcpy(f->_instructions,&_instructions[0],_instructions.size()*sizeof(SQInstruction));
+    //a lazy function has no code yet
+    if(_instructions.size()) memcpy(f->_instructions,&_instructions[0],_instructions.size()*sizeof(SQInstruction));
 
-    f->_varparams = _varparams;
+    f->_varparams = _varparams?vpSTACK:vpNONE;
 
     return f;
 }
 
 SQFuncState *SQFuncState::PushChildState(SQSharedState *ss)
 {
-    SQFuncState *child = (SQFuncState *)sq_malloc(sizeof(SQFuncState));
-    new (child) SQFuncState(ss,this,_errfunc,_errtarget);
+    SQFuncState *child = (SQFuncState *)_arena->Alloc(sizeof(SQFuncState));
+    new (child) SQFuncState(ss,this,_arena,_errfunc,_errtarget);
     _childstates.push_back(child);
     return child;
 }
@@ -638,7 +689,8 @@ SQFuncState *SQFuncState::PushChildState(SQSharedState *ss)
 void SQFuncState::PopChildState()
 {
     SQFuncState *child = _childstates.back();
-    sq_delete(child,SQFuncState);
+    child->~SQFuncState();
+    _arena->Free(child,sizeof(SQFuncState));
     _childstates.pop_back();
 }
 
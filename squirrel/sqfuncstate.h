@@ -4,9 +4,12 @@
 ///////////////////////////////////
 #include "squtils.h"
 
+//the working vectors of a function state live in the arena of the compiler
+typedef sqvector<SQInteger,sqarenaallocator> SQArenaIntVec;
+
 struct SQFuncState
 {
-    SQFuncState(SQSharedState *ss,SQFuncState *parent,CompilerErrorFunc efunc,void *ed);
+    SQFuncState(SQSharedState *ss,SQFuncState *parent,SQArena *arena,CompilerErrorFunc efunc,void *ed);
     ~SQFuncState();
 #ifdef _DEBUG_DUMP
     void Dump(SQFunctionProto *func);
@@ -23,6 +26,7 @@ struct SQFuncState
     void SetStackSize(SQInteger n);
     SQInteger CountOuters(SQInteger stacksize);
     void SnoozeOpt(){_optimization=false;}
+    void FuseInstructions();
     void AddDefaultParam(SQInteger trg) { _defaultparams.push_back(trg); }
     SQInteger GetDefaultParamCount() { return _defaultparams.size(); }
     SQInteger GetCurrentPos(){return _instructions.size()-1;}
@@ -46,44 +50,47 @@ struct SQFuncState
     SQInteger GetUpTarget(SQInteger n);
     void DiscardTarget();
     bool IsLocal(SQUnsignedInteger stkpos);
+    bool IsVargv(SQInteger stkpos);
     SQObject CreateString(const SQChar *s,SQInteger len = -1);
+    SQObject CreateString(const SQChar *s,SQInteger len,SQHash hash);
     SQObject CreateTable();
     bool IsConstant(const SQObject &name,SQObject &e);
     SQInteger _returnexp;
-    SQLocalVarInfoVec _vlocals;
-    SQIntVec _targetstack;
+    sqvector<SQLocalVarInfo,sqarenaallocator> _vlocals;
+    SQArenaIntVec _targetstack;
     SQInteger _stacksize;
     bool _varparams;
     bool _bgenerator;
-    SQIntVec _unresolvedbreaks;
-    SQIntVec _unresolvedcontinues;
-    SQObjectPtrVec _functions;
-    SQObjectPtrVec _parameters;
-    SQOuterVarVec _outervalues;
-    SQInstructionVec _instructions;
-    SQLocalVarInfoVec _localvarinfos;
+    SQArenaIntVec _unresolvedbreaks;
+    SQArenaIntVec _unresolvedcontinues;
+    sqvector<SQObjectPtr,sqarenaallocator> _functions;
+    sqvector<SQObjectPtr,sqarenaallocator> _parameters;
+    sqvector<SQOuterVar,sqarenaallocator> _outervalues;
+    sqvector<SQInstruction,sqarenaallocator> _instructions;
+    sqvector<SQLocalVarInfo,sqarenaallocator> _localvarinfos;
     SQObjectPtr _literals;
     SQObjectPtr _strings;
     SQObjectPtr _name;
     SQObjectPtr _sourcename;
     SQInteger _nliterals;
-    SQLineInfoVec _lineinfos;
+    sqvector<SQLineInfo,sqarenaallocator> _lineinfos;
     SQFuncState *_parent;
-    SQIntVec _scope_blocks;
-    SQIntVec _breaktargets;
-    SQIntVec _continuetargets;
-    SQIntVec _defaultparams;
+    SQArenaIntVec _scope_blocks;
+    SQArenaIntVec _breaktargets;
+    SQArenaIntVec _continuetargets;
+    SQArenaIntVec _defaultparams;
     SQInteger _lastline;
     SQInteger _traps; //contains number of nested exception traps
     SQInteger _outers;
     bool _optimization;
     SQSharedState *_sharedstate;
-    sqvector<SQFuncState*> _childstates;
+    sqvector<SQFuncState*,sqarenaallocator> _childstates;
     SQInteger GetConstant(const SQObject &cons);
 private:
     CompilerErrorFunc _errfunc;
     void *_errtarget;
     SQSharedState *_ss;
+    SQArena *_arena;
 };
 
 
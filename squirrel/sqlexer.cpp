@@ -4,7 +4,9 @@
 #include "sqpcheader.h"
 #include <ctype.h>
 #include <stdlib.h>
-#include "sqtable.h"
+#ifdef SQUNICODE
+#include <wchar.h>
+#endif
 #include "sqstring.h"
 #include "sqcompiler.h"
 #include "sqlexer.h"
@@ -16,67 +18,117 @@
 #define INIT_TEMP_STRING() { _longstr.resize(0);}
 #define APPEND_CHAR(c) { _longstr.push_back(c);}
 #define TERMINATE_BUFFER() {_longstr.push_back(_SC('\0'));}
-#define ADD_KEYWORD(key,id) _keywords->NewSlot( SQString::Create(ss, _SC(#key)) ,SQInteger(id))
 
-SQLexer::SQLexer(){}
-SQLexer::~SQLexer()
+struct SQKeyword
 {
-    _keywords->Release();
+    const SQChar *name;
+    SQInteger len;
+    SQInteger token;
+};
+
+#define KEYWORD(key,id) { _SC(#key), (SQInteger)(sizeof(#key) - 1), id }
+static const SQKeyword keywords[] = {
+    KEYWORD(while, TK_WHILE),
+    KEYWORD(do, TK_DO),
+    KEYWORD(if, TK_IF),
+    KEYWORD(else, TK_ELSE),
+    KEYWORD(break, TK_BREAK),
+    KEYWORD(continue, TK_CONTINUE),
+    KEYWORD(return, TK_RETURN),
+    KEYWORD(null, TK_NULL),
+    KEYWORD(function, TK_FUNCTION),
+    KEYWORD(local, TK_LOCAL),
+    KEYWORD(for, TK_FOR),
+    KEYWORD(foreach, TK_FOREACH),
+    KEYWORD(in, TK_IN),
+    KEYWORD(typeof, TK_TYPEOF),
+    KEYWORD(base, TK_BASE),
+    KEYWORD(delete, TK_DELETE),
+    KEYWORD(try, TK_TRY),
+    KEYWORD(catch, TK_CATCH),
+    KEYWORD(throw, TK_THROW),
+    KEYWORD(clone, TK_CLONE),
+    KEYWORD(yield, TK_YIELD),
+    KEYWORD(resume, TK_RESUME),
+    KEYWORD(switch, TK_SWITCH),
+    KEYWORD(case, TK_CASE),
+    KEYWORD(default, TK_DEFAULT),
+    KEYWORD(this, TK_THIS),
+    KEYWORD(class,TK_CLASS),
+    KEYWORD(extends,TK_EXTENDS),
+    KEYWORD(constructor,TK_CONSTRUCTOR),
+    KEYWORD(instanceof,TK_INSTANCEOF),
+    KEYWORD(true,TK_TRUE),
+    KEYWORD(false,TK_FALSE),
+    KEYWORD(static,TK_STATIC),
+    KEYWORD(enum,TK_ENUM),
+    KEYWORD(const,TK_CONST),
+    KEYWORD(__LINE__,TK___LINE__),
+    KEYWORD(__FILE__,TK___FILE__),
+    KEYWORD(rawcall, TK_RAWCALL),
+};
+
+//perfect hash of the keywords on their length and their first, middle and last character;
+//adding a keyword means finding new factors and regenerating keywordslots
+#define KEYWORD_HASH(s,len) ((SQUnsignedInteger)((s)[0]*2 + (s)[(len)>>1]*9 + (s)[(len)-1]*24 + (len)) & 127)
+//1 + the index in keywords[] of the keyword hashed to each slot, 0 if empty
+static const unsigned char keywordslots[128] = {
+     0,31,13,29, 0, 0,38, 0, 0,35, 0,14, 0, 0, 0, 0,
+     0, 0, 0, 0, 0,32, 0,19,25, 2, 0, 0, 1, 0, 0,18,
+    12, 0, 0,34, 0, 0,28, 0, 0, 0,20, 0, 0, 0, 0, 0,
+     0, 0, 0, 0, 0, 0, 0, 0, 9, 0, 0, 0, 0, 0, 0, 0,
+    23, 0, 0, 0, 0,17, 0, 0,33, 0,30,15, 8,24, 0, 0,
+     0, 4, 0,16, 0, 0, 0, 7, 0, 0,37, 0, 0, 0, 5, 0,
+     0, 0, 0, 0,21,26,11, 0, 0, 0, 0, 0,36, 0, 0, 0,
+     0, 0, 0, 0, 0, 0, 0, 6,10, 0, 3, 0,27, 0, 0,22,
+};
+
+SQLexer::SQLexer(SQArena *arena) : _longstr(arena) {}
+SQLexer::~SQLexer(){}
+
+#ifdef SQUNICODE
+#define FIND_CHAR(p,c,n) wmemchr((p),(c),(n))
+#else
+#define FIND_CHAR(p,c,n) memchr((p),(c),(n))
+#endif
+
+static inline bool IsIDChar(SQInteger c)
+{
+    return (c >= _SC('a') && c <= _SC('z')) || (c >= _SC('A') && c <= _SC('Z')) || (c >= _SC('0') && c <= _SC('9')) || c == _SC('_');
 }
 
 void SQLexer::Init(SQSharedState *ss, SQLEXREADFUNC rg, SQUserPointer up,CompilerErrorFunc efunc,void *ed)
+{
+    InitState(ss,efunc,ed);
+    _readf = rg;
+    _up = up;
+    _bufpos = _bufend = NULL;
+    Next();
+}
+
+//the source is read in place, it ends at the first '\0' like a stream
+void SQLexer::Init(SQSharedState *ss, const SQChar *buf, SQInteger size,CompilerErrorFunc efunc,void *ed)
+{
+    InitState(ss,efunc,ed);
+    _readf = NULL;
+    _up = NULL;
+    if(!buf) buf = _SC("");
+    const SQChar *nul = (const SQChar *)FIND_CHAR(buf,0,size);
+    _bufpos = buf;
+    _bufend = nul ? nul : buf + size;
+    SetPos(buf);
+}
+
+void SQLexer::InitState(SQSharedState *ss,CompilerErrorFunc efunc,void *ed)
 {
     _errfunc = efunc;
     _errtarget = ed;
     _sharedstate = ss;
-    _keywords = SQTable::Create(ss, 37);
-    ADD_KEYWORD(while, TK_WHILE);
-    ADD_KEYWORD(do, TK_DO);
-    ADD_KEYWORD(if, TK_IF);
-    ADD_KEYWORD(else, TK_ELSE);
-    ADD_KEYWORD(break, TK_BREAK);
-    ADD_KEYWORD(continue, TK_CONTINUE);
-    ADD_KEYWORD(return, TK_RETURN);
-    ADD_KEYWORD(null, TK_NULL);
-    ADD_KEYWORD(function, TK_FUNCTION);
-    ADD_KEYWORD(local, TK_LOCAL);
-    ADD_KEYWORD(for, TK_FOR);
-    ADD_KEYWORD(foreach, TK_FOREACH);
-    ADD_KEYWORD(in, TK_IN);
-    ADD_KEYWORD(typeof, TK_TYPEOF);
-    ADD_KEYWORD(base, TK_BASE);
-    ADD_KEYWORD(delete, TK_DELETE);
-    ADD_KEYWORD(try, TK_TRY);
-    ADD_KEYWORD(catch, TK_CATCH);
-    ADD_KEYWORD(throw, TK_THROW);
-    ADD_KEYWORD(clone, TK_CLONE);
-    ADD_KEYWORD(yield, TK_YIELD);
-    ADD_KEYWORD(resume, TK_RESUME);
-    ADD_KEYWORD(switch, TK_SWITCH);
-    ADD_KEYWORD(case, TK_CASE);
-    ADD_KEYWORD(default, TK_DEFAULT);
-    ADD_KEYWORD(this, TK_THIS);
-    ADD_KEYWORD(class,TK_CLASS);
-    ADD_KEYWORD(extends,TK_EXTENDS);
-    ADD_KEYWORD(constructor,TK_CONSTRUCTOR);
-    ADD_KEYWORD(instanceof,TK_INSTANCEOF);
-    ADD_KEYWORD(true,TK_TRUE);
-    ADD_KEYWORD(false,TK_FALSE);
-    ADD_KEYWORD(static,TK_STATIC);
-    ADD_KEYWORD(enum,TK_ENUM);
-    ADD_KEYWORD(const,TK_CONST);
-    ADD_KEYWORD(__LINE__,TK___LINE__);
-    ADD_KEYWORD(__FILE__,TK___FILE__);
-    ADD_KEYWORD(rawcall, TK_RAWCALL);
-    
-
-    _readf = rg;
-    _up = up;
     _lasttokenline = _currentline = 1;
     _currentcolumn = 0;
     _prevtoken = -1;
     _reached_eof = SQFalse;
-    Next();
+    _record = NULL;
 }
 
 void SQLexer::Error(const SQChar *err)
@@ -86,30 +138,71 @@ void SQLexer::Error(const SQChar *err)
 
 void SQLexer::Next()
 {
+    if(_bufpos) {
+        if(_bufpos < _bufend && ++_bufpos < _bufend) {
+            _currdata = (LexChar)*_bufpos;
+            return;
+        }
+        _currdata = SQUIRREL_EOB;
+        _reached_eof = SQTrue;
+        return;
+    }
     SQInteger t = _readf(_up);
     if(t > MAX_CHAR) Error(_SC("Invalid character"));
     if(t != 0) {
         _currdata = (LexChar)t;
+        if(_record) _record->push_back((SQChar)t);
         return;
     }
     _currdata = SQUIRREL_EOB;
     _reached_eof = SQTrue;
 }
 
+//buffer mode: makes p the current character, the characters skipped count as columns
+void SQLexer::SetPos(const SQChar *p)
+{
+    _currentcolumn += p - _bufpos;
+    _bufpos = p;
+    if(p < _bufend) {
+        _currdata = (LexChar)*p;
+    }
+    else {
+        _currdata = SQUIRREL_EOB;
+        _reached_eof = SQTrue;
+    }
+}
+
+//buffer mode: appends the characters from the current one to end to the temp string
+void SQLexer::AppendRun(const SQChar *end)
+{
+    SQInteger n = end - _bufpos, size = _longstr.size();
+    _longstr.resize(size + n);
+    memcpy(&_longstr[size],_bufpos,sq_rsl(n));
+    SetPos(end);
+}
+
 const SQChar *SQLexer::Tok2Str(SQInteger tok)
 {
-    SQObjectPtr itr, key, val;
-    SQInteger nitr;
-    while((nitr = _keywords->Next(false,itr, key, val)) != -1) {
-        itr = (SQInteger)nitr;
-        if(((SQInteger)_integer(val)) == tok)
-            return _stringval(key);
+    for(SQUnsignedInteger i = 0; i < sizeof(keywords)/sizeof(keywords[0]); i++) {
+        if(keywords[i].token == tok)
+            return keywords[i].name;
     }
     return NULL;
 }
 
 void SQLexer::LexBlockComment()
 {
+    if(_bufpos) {
+        for(const SQChar *p = _bufpos; p < _bufend; p++) {
+            if(*p == _SC('\n')) _currentline++;
+            else if(*p == _SC('*') && p + 1 < _bufend && p[1] == _SC('/')) {
+                SetPos(p + 2);
+                return;
+            }
+        }
+        SetPos(_bufend);
+        Error(_SC("missing \"*/\" in comment"));
+    }
     bool done = false;
     while(!done) {
         switch(CUR_CHAR) {
@@ -122,6 +215,12 @@ void SQLexer::LexBlockComment()
 }
 void SQLexer::LexLineComment()
 {
+    if(_bufpos && _bufpos < _bufend) {
+        const SQChar *p = _bufpos + 1;
+        const SQChar *nl = (const SQChar *)FIND_CHAR(p,_SC('\n'),_bufend - p);
+        SetPos(nl ? nl : _bufend);
+        return;
+    }
     do { NEXT(); } while (CUR_CHAR != _SC('\n') && (!IS_EOB()));
 }
 
@@ -130,7 +229,14 @@ SQInteger SQLexer::Lex()
     _lasttokenline = _currentline;
     while(CUR_CHAR != SQUIRREL_EOB) {
         switch(CUR_CHAR){
-        case _SC('\t'): case _SC('\r'): case _SC(' '): NEXT(); continue;
+        case _SC('\t'): case _SC('\r'): case _SC(' '):
+            if(_bufpos) {
+                const SQChar *p = _bufpos + 1;
+                while(p < _bufend && (*p == _SC(' ') || *p == _SC('\t') || *p == _SC('\r'))) p++;
+                SetPos(p);
+            }
+            else NEXT();
+            continue;
         case _SC('\n'):
             _currentline++;
             _prevtoken=_curtoken;
@@ -282,10 +388,9 @@ SQInteger SQLexer::Lex()
 
 SQInteger SQLexer::GetIDType(const SQChar *s,SQInteger len)
 {
-    SQObjectPtr t;
-    if(_keywords->GetStr(s,len, t)) {
-        return SQInteger(_integer(t));
-    }
+    SQInteger k = keywordslots[KEYWORD_HASH(s,len)];
+    if(k && keywords[k-1].len == len && memcmp(keywords[k-1].name,s,sq_rsl(len)) == 0)
+        return keywords[k-1].token;
     return TK_IDENTIFIER;
 }
 
@@ -416,8 +521,15 @@ SQInteger SQLexer::ReadString(SQInteger ndelim,bool verbatim)
                 }
                 break;
             default:
-                APPEND_CHAR(CUR_CHAR);
-                NEXT();
+                if(_bufpos) {
+                    const SQChar *p = _bufpos + 1;
+                    while(p < _bufend && *p != ndelim && *p != _SC('\\') && *p != _SC('\n')) p++;
+                    AppendRun(p);
+                }
+                else {
+                    APPEND_CHAR(CUR_CHAR);
+                    NEXT();
+                }
             }
         }
         NEXT();
@@ -550,14 +662,24 @@ SQInteger SQLexer::ReadID()
 {
     SQInteger res;
     INIT_TEMP_STRING();
-    do {
+    if(_bufpos) {
+        const SQChar *p = _bufpos + 1;
+        while(p < _bufend && IsIDChar(*p)) p++;
+        AppendRun(p);
+    }
+    else {
         APPEND_CHAR(CUR_CHAR);
         NEXT();
-    } while(scisalnum(CUR_CHAR) || CUR_CHAR == _SC('_'));
+    }
+    while(scisalnum(CUR_CHAR) || CUR_CHAR == _SC('_')) {
+        APPEND_CHAR(CUR_CHAR);
+        NEXT();
+    }
     TERMINATE_BUFFER();
     res = GetIDType(&_longstr[0],_longstr.size() - 1);
     if(res == TK_IDENTIFIER || res == TK_CONSTRUCTOR) {
         _svalue = &_longstr[0];
+        _hvalue = _hashstr(_svalue,_longstr.size() - 1);
     }
     return res;
 }
@@ -10,9 +10,10 @@ typedef unsigned char LexChar;
 
 struct SQLexer
 {
-    SQLexer();
+    SQLexer(SQArena *arena);
     ~SQLexer();
     void Init(SQSharedState *ss,SQLEXREADFUNC rg,SQUserPointer up,CompilerErrorFunc efunc,void *ed);
+    void Init(SQSharedState *ss,const SQChar *buf,SQInteger size,CompilerErrorFunc efunc,void *ed);
     void Error(const SQChar *err);
     SQInteger Lex();
     const SQChar *Tok2Str(SQInteger tok);
@@ -24,6 +25,9 @@ private:
     void LexLineComment();
     SQInteger ReadID();
     void Next();
+    void SetPos(const SQChar *p);
+    void AppendRun(const SQChar *end);
+    void InitState(SQSharedState *ss,CompilerErrorFunc efunc,void *ed);
 #ifdef SQUNICODE
 #if WCHAR_SIZE == 2
     SQInteger AddUTF16(SQUnsignedInteger ch);
@@ -33,7 +37,6 @@ private:
 #endif
     SQInteger ProcessStringHexEscape(SQChar *dest, SQInteger maxdigits);
     SQInteger _curtoken;
-    SQTable *_keywords;
     SQBool _reached_eof;
 public:
     SQInteger _prevtoken;
@@ -41,13 +44,20 @@ public:
     SQInteger _lasttokenline;
     SQInteger _currentcolumn;
     const SQChar *_svalue;
+    //string hash of an identifier token, passed to the string table when it is interned
+    SQHash _hvalue;
     SQInteger _nvalue;
     SQFloat _fvalue;
     SQLEXREADFUNC _readf;
     SQUserPointer _up;
+    //buffer mode: _bufpos points to the current character, NULL when reading from _readf
+    const SQChar *_bufpos;
+    const SQChar *_bufend;
     LexChar _currdata;
     SQSharedState *_sharedstate;
-    sqvector<SQChar> _longstr;
+    sqvector<SQChar,sqarenaallocator> _longstr;
+    //if not NULL receives every character read from the stream
+    sqvector<SQChar> *_record;
     CompilerErrorFunc _errfunc;
     void *_errtarget;
 };
@@ -9,3 +9,72 @@ void *sq_vm_realloc(void *p, SQUnsignedInteger SQ_UNUSED_ARG(oldsize), SQUnsigne
 
 void sq_vm_free(void *p, SQUnsignedInteger SQ_UNUSED_ARG(size)){ free(p); }
 #endif
+
+#define SQ_ARENA_CHUNK 8192
+#define SQ_ARENA_MINBLOCK 16
+
+static SQInteger ArenaBucket(SQUnsignedInteger size)
+{
+    SQInteger k = 0;
+    while(((SQUnsignedInteger)SQ_ARENA_MINBLOCK << k) < size) k++;
+    return k;
+}
+
+SQArena::SQArena()
+{
+    _chunks = NULL;
+    _top = _end = NULL;
+    for(SQInteger i = 0; i < SQ_ARENA_BUCKETS; i++) _free[i] = NULL;
+}
+
+SQArena::~SQArena()
+{
+    while(_chunks) {
+        Chunk *next = _chunks->_next;
+        sq_vm_free(_chunks,_chunks->_size);
+        _chunks = next;
+    }
+}
+
+void *SQArena::Alloc(SQUnsignedInteger size)
+{
+    SQInteger k = ArenaBucket(size);
+    if(_free[k]) {
+        FreeBlock *b = _free[k];
+        _free[k] = b->_next;
+        return b;
+    }
+    size = (SQUnsignedInteger)SQ_ARENA_MINBLOCK << k;
+    if((SQUnsignedInteger)(_end - _top) < size) {
+        SQUnsignedInteger csize = sizeof(Chunk) + (size > SQ_ARENA_CHUNK ? size : SQ_ARENA_CHUNK);
+        Chunk *c = (Chunk *)sq_vm_malloc(csize);
+        c->_next = _chunks;
+        c->_size = csize;
+        _chunks = c;
+        _top = (char *)(c + 1);
+        _end = (char *)c + csize;
+    }
+    void *p = _top;
+    _top += size;
+    return p;
+}
+
+void *SQArena::Realloc(void *p,SQUnsignedInteger oldsize,SQUnsignedInteger size)
+{
+    if(p && ArenaBucket(size) == ArenaBucket(oldsize))
+        return p;
+    void *n = Alloc(size);
+    if(p) {
+        memcpy(n,p,oldsize < size ? oldsize : size);
+        Free(p,oldsize);
+    }
+    return n;
+}
+
+void SQArena::Free(void *p,SQUnsignedInteger size)
+{
+    SQInteger k = ArenaBucket(size);
+    FreeBlock *b = (FreeBlock *)p;
+    b->_next = _free[k];
+    _free[k] = b;
+}
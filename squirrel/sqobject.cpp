@@ -10,6 +10,7 @@
 #include "sqfuncproto.h"
 #include "sqclass.h"
 #include "sqclosure.h"
+#include "sqcompiler.h"
 
 
 const SQChar *IdType2Name(SQObjectType type)
@@ -52,6 +53,11 @@ SQString *SQString::Create(SQSharedState *ss,const SQChar *s,SQInteger len)
     return str;
 }
 
+SQString *SQString::Create(SQSharedState *ss,const SQChar *s,SQInteger len,SQHash hash)
+{
+    return ss->_stringtable->Add(s,len,hash);
+}
+
 void SQString::Release()
 {
     REMOVE_STRING(_sharedstate,this);
@@ -84,6 +90,19 @@ SQUnsignedInteger TranslateIndex(const SQObjectPtr &idx)
 
 SQWeakRef *SQRefCounted::GetWeakRef(SQObjectType type)
 {
+    if(_isimmortal(this)) {
+        //frozen objects are shared between states, their weak references are not cached
+        SQWeakRef *w;
+        sq_new(w,SQWeakRef);
+#if defined(SQUSEDOUBLE) && !defined(_SQ64)
+        w->_obj._unVal.raw = 0;
+#endif
+        w->_obj._type = type;
+        w->_obj._unVal.pRefCounted = this;
+        //keeps the graph alive, a weak reference to a frozen object never becomes null
+        ImmortalAddRef(this);
+        return w;
+    }
     if(!_weakref) {
         sq_new(_weakref,SQWeakRef);
 #if defined(SQUSEDOUBLE) && !defined(_SQ64)
@@ -104,10 +123,13 @@ SQRefCounted::~SQRefCounted()
 }
 
 void SQWeakRef::Release() {
+    SQRefCounted *immortal = NULL;
     if(ISREFCOUNTED(_obj._type)) {
-        _obj._unVal.pRefCounted->_weakref = NULL;
+        if(!_isimmortal(_obj._unVal.pRefCounted)) _obj._unVal.pRefCounted->_weakref = NULL;
+        else immortal = _obj._unVal.pRefCounted;
     }
     sq_delete(this,SQWeakRef);
+    if(immortal) ImmortalRelease(immortal);
 }
 
 bool SQDelegable::GetMetaMethod(SQVM *v,SQMetaMethod mm,SQObjectPtr &res) {
@@ -135,17 +157,15 @@ bool SQGenerator::Yield(SQVM *v,SQInteger target)
 {
     if(_state==eSuspended) { v->Raise_Error(_SC("internal vm error, yielding dead generator"));  return false;}
     if(_state==eDead) { v->Raise_Error(_SC("internal vm error, yielding a dead generator")); return false; }
-    SQInteger size = v->_top-v->_stackbase;
-
-    _stack.resize(size);
-    SQObject _this = v->_stack[v->_stackbase];
+    //only the live locals are kept, the temporaries are released by LeaveFrame()
+    _stack.resize(target);
+    SQObjectPtr *src = &v->_stack._vals[v->_stackbase];
+    SQObject _this = src[0];
     _stack._vals[0] = ISREFCOUNTED(type(_this)) ? SQObjectPtr(_refcounted(_this)->GetWeakRef(type(_this))) : _this;
+    src[0].Null();
+    //the slots of the generator are null, swapping moves the locals without refcounting
     for(SQInteger n =1; n<target; n++) {
-        _stack._vals[n] = v->_stack[v->_stackbase+n];
-    }
-    for(SQInteger j =0; j < size; j++)
-    {
-        v->_stack[v->_stackbase+j].Null();
+        _Swap(_stack._vals[n],src[n]);
     }
 
     _ci = *v->ci;
@@ -170,7 +190,7 @@ bool SQGenerator::Resume(SQVM *v,SQObjectPtr &dest)
     SQInteger target = &dest - &(v->_stack._vals[v->_stackbase]);
     assert(target>=0 && target<=255);
     SQInteger newbase = v->_top;
-    if(!v->EnterFrame(v->_top, v->_top + size, false))
+    if(!v->EnterFrame(v->_top, v->_top + _closure(_ci._closure)->_function->_stacksize, false))
         return false;
     v->ci->_generator   = this;
     v->ci->_target      = (SQInt32)target;
@@ -180,6 +200,10 @@ bool SQGenerator::Resume(SQVM *v,SQObjectPtr &dest)
     v->ci->_ncalls      = _ci._ncalls;
     v->ci->_etraps      = _ci._etraps;
     v->ci->_root        = _ci._root;
+    if(_ss(v)->_tracing) {
+        SQFunctionProto *f = _closure(_ci._closure)->_function;
+        _ss(v)->TraceBegin(v,SQ_TRACE_CALL,f->_name,f->_sourcename,f->_nlineinfos ? f->_lineinfos[0]._line : 0);
+    }
 
 
     for(SQInteger i=0;i<_ci._etraps;i++) {
@@ -190,12 +214,12 @@ bool SQGenerator::Resume(SQVM *v,SQObjectPtr &dest)
         et._stackbase += newbase;
         et._stacksize += newbase;
     }
+    SQObjectPtr *dst = &v->_stack._vals[v->_stackbase];
     SQObject _this = _stack._vals[0];
-    v->_stack[v->_stackbase] = type(_this) == OT_WEAKREF ? _weakref(_this)->_obj : _this;
-
+    dst[0] = type(_this) == OT_WEAKREF ? _weakref(_this)->_obj : _this;
+    //the new frame is above _top so its slots are null
     for(SQInteger n = 1; n<size; n++) {
-        v->_stack[v->_stackbase+n] = _stack._vals[n];
-        _stack._vals[n].Null();
+        _Swap(dst[n],_stack._vals[n]);
     }
 
     _state=eRunning;
@@ -276,9 +300,10 @@ SQClosure::~SQClosure()
 }
 
 #define _CHECK_IO(exp)  { if(!exp)return false; }
-bool SafeWrite(HSQUIRRELVM v,SQWRITEFUNC write,SQUserPointer up,SQUserPointer dest,SQInteger size)
+bool SafeWrite(HSQUIRRELVM v,SQWRITEFUNC write,SQUserPointer up,const void *src,SQInteger size)
 {
-    if(write(up,dest,size) != size) {
+    //the write function never modifies the buffer
+    if(write(up,const_cast<void *>(src),size) != size) {
         v->Raise_Error(_SC("io error (write function failure)"));
         return false;
     }
@@ -368,106 +393,503 @@ bool ReadObject(HSQUIRRELVM v,SQUserPointer up,SQREADFUNC read,SQObjectPtr &o)
     return true;
 }
 
-bool SQClosure::Save(SQVM *v,SQUserPointer up,SQWRITEFUNC write)
+//bytecode streams, version 2: a string pool shared by the whole module, an index with the
+//offset of every function body and a checksum of the payload. Counts and indexes are
+//varints, signed values are zigzag encoded. Only the main function is loaded eagerly,
+//nested ones are read from the payload the first time a closure is created for them
+enum SQBytecodeLiteral { SQBC_NULL, SQBC_FALSE, SQBC_TRUE, SQBC_INTEGER, SQBC_FLOAT, SQBC_STRING };
+
+static SQUnsignedInteger32 Adler32(const unsigned char *p,SQInteger n)
 {
-    _CHECK_IO(WriteTag(v,write,up,SQ_CLOSURESTREAM_HEAD));
-    _CHECK_IO(WriteTag(v,write,up,sizeof(SQChar)));
-    _CHECK_IO(WriteTag(v,write,up,sizeof(SQInteger)));
-    _CHECK_IO(WriteTag(v,write,up,sizeof(SQFloat)));
-    _CHECK_IO(_function->Save(v,up,write));
-    _CHECK_IO(WriteTag(v,write,up,SQ_CLOSURESTREAM_TAIL));
-    return true;
+    SQUnsignedInteger32 a = 1, b = 0;
+    while(n > 0) {
+        //5552 is the largest block that can't overflow b before the modulo
+        SQInteger block = n < 5552 ? n : 5552;
+        n -= block;
+        while(block--) { a += *p++; b += a; }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
 }
 
-bool SQClosure::Load(SQVM *v,SQUserPointer up,SQREADFUNC read,SQObjectPtr &ret)
+struct SQBytecodeWriter
 {
-    _CHECK_IO(CheckTag(v,read,up,SQ_CLOSURESTREAM_HEAD));
-    _CHECK_IO(CheckTag(v,read,up,sizeof(SQChar)));
-    _CHECK_IO(CheckTag(v,read,up,sizeof(SQInteger)));
-    _CHECK_IO(CheckTag(v,read,up,sizeof(SQFloat)));
-    SQObjectPtr func;
-    _CHECK_IO(SQFunctionProto::Load(v,up,read,func));
-    _CHECK_IO(CheckTag(v,read,up,SQ_CLOSURESTREAM_TAIL));
-    ret = SQClosure::Create(_ss(v),_funcproto(func),_table(v->_roottable)->GetWeakRef(OT_TABLE));
-    //FIXME: load an root for this closure
+    void Byte(unsigned char c) { _out->push_back(c); }
+    void UInt(SQUnsignedInteger n)
+    {
+        while(n >= 0x80) { Byte((unsigned char)(n | 0x80)); n >>= 7; }
+        Byte((unsigned char)n);
+    }
+    void Int(SQInteger n) { UInt(((SQUnsignedInteger)n << 1) ^ (SQUnsignedInteger)(n < 0 ? -1 : 0)); }
+    void Raw(const void *p,SQInteger size)
+    {
+        SQUnsignedInteger at = _out->size();
+        _out->resize(at + size);
+        if(size) memcpy(&(*_out)[at],p,size);
+    }
+    bool Object(const SQObjectPtr &o);
+    bool Func(SQFunctionProto *f);
+    bool Write(SQFunctionProto *main,SQUserPointer up,SQWRITEFUNC write);
+    SQVM *_v;
+    sqvector<unsigned char> *_out;
+    sqvector<unsigned char> _pool;
+    sqvector<unsigned char> _bodies;
+    SQObjectPtr _strings;
+    SQInteger _nstrings;
+    sqvector<SQFunctionProto*> _protos;
+    sqvector<SQInteger> _offsets;
+};
+
+bool SQBytecodeWriter::Object(const SQObjectPtr &o)
+{
+    switch(type(o)) {
+    case OT_NULL: Byte(SQBC_NULL); break;
+    case OT_BOOL: Byte(_integer(o) ? SQBC_TRUE : SQBC_FALSE); break;
+    case OT_INTEGER: Byte(SQBC_INTEGER); Int(_integer(o)); break;
+    case OT_FLOAT: Byte(SQBC_FLOAT); Raw(&_float(o),sizeof(SQFloat)); break;
+    case OT_STRING: {
+        SQObjectPtr idx;
+        if(!_table(_strings)->Get(o,idx)) {
+            idx = _nstrings++;
+            _table(_strings)->NewSlot(o,idx);
+            sqvector<unsigned char> *out = _out;
+            _out = &_pool;
+            UInt(_string(o)->_len);
+            Raw(_stringval(o),sq_rsl(_string(o)->_len));
+            _out = out;
+        }
+        Byte(SQBC_STRING);
+        UInt(_integer(idx));
+        }
+        break;
+    default:
+        _v->Raise_Error(_SC("cannot serialize a %s"),GetTypeName(o));
+        return false;
+    }
     return true;
 }
 
-SQFunctionProto::SQFunctionProto(SQSharedState *ss)
+bool SQBytecodeWriter::Func(SQFunctionProto *f)
 {
-    _stacksize=0;
-    _bgenerator=false;
-    INIT_CHAIN();ADD_TO_CHAIN(&_ss(this)->_gc_chain,this);
+    SQInteger i;
+    _CHECK_IO(f->LoadFunctions(_v));
+    _CHECK_IO(Object(f->_sourcename));
+    _CHECK_IO(Object(f->_name));
+    UInt(f->_nliterals);
+    UInt(f->_nparameters);
+    UInt(f->_noutervalues);
+    UInt(f->_nlocalvarinfos);
+    UInt(f->_nlineinfos);
+    UInt(f->_ndefaultparams);
+    UInt(f->_ninstructions);
+    UInt(f->_nfunctions);
+    for(i = 0; i < f->_nliterals; i++) _CHECK_IO(Object(f->_literals[i]));
+    for(i = 0; i < f->_nparameters; i++) _CHECK_IO(Object(f->_parameters[i]));
+    for(i = 0; i < f->_noutervalues; i++) {
+        UInt(f->_outervalues[i]._type);
+        _CHECK_IO(Object(f->_outervalues[i]._src));
+        _CHECK_IO(Object(f->_outervalues[i]._name));
+    }
+    for(i = 0; i < f->_nlocalvarinfos; i++) {
+        SQLocalVarInfo &lvi = f->_localvarinfos[i];
+        _CHECK_IO(Object(lvi._name));
+        UInt(lvi._pos);
+        UInt(lvi._start_op);
+        UInt(lvi._end_op);
+    }
+    //line infos are mostly small steps forward
+    SQLineInfo last = {0,0};
+    for(i = 0; i < f->_nlineinfos; i++) {
+        Int(f->_lineinfos[i]._line - last._line);
+        Int(f->_lineinfos[i]._op - last._op);
+        last = f->_lineinfos[i];
+    }
+    for(i = 0; i < f->_ndefaultparams; i++) UInt(f->_defaultparams[i]);
+    SQInstructionVec code;
+    Raw(_ss(_v)->GetOriginalCode(f,code),f->_ninstructions * sizeof(SQInstruction));
+    for(i = 0; i < f->_nfunctions; i++) {
+        UInt(_protos.size());
+        _protos.push_back(_funcproto(f->_functions[i]));
+    }
+    UInt(f->_stacksize);
+    Byte(f->_bgenerator ? 1 : 0);
+    UInt(f->_varparams);
+    return true;
 }
 
-SQFunctionProto::~SQFunctionProto()
+bool SQBytecodeWriter::Write(SQFunctionProto *main,SQUserPointer up,SQWRITEFUNC write)
 {
-    REMOVE_FROM_CHAIN(&_ss(this)->_gc_chain,this);
+    _strings = SQTable::Create(_ss(_v),0);
+    _nstrings = 0;
+    //functions are numbered breadth first, a function always comes after its parent
+    _protos.push_back(main);
+    _out = &_bodies;
+    for(SQUnsignedInteger i = 0; i < _protos.size(); i++) {
+        _offsets.push_back(_bodies.size());
+        _CHECK_IO(Func(_protos[i]));
+    }
+    sqvector<unsigned char> payload;
+    _out = &payload;
+    UInt(_nstrings);
+    Raw(_pool._vals,_pool.size());
+    UInt(_offsets.size());
+    for(SQUnsignedInteger i = 0; i < _offsets.size(); i++) UInt(_offsets[i]);
+    Raw(_bodies._vals,_bodies.size());
+    SQInteger size = payload.size();
+    _CHECK_IO(WriteTag(_v,write,up,SQ_BYTECODESTREAM_HEAD));
+    _CHECK_IO(WriteTag(_v,write,up,SQ_BYTECODE_VERSION));
+    _CHECK_IO(WriteTag(_v,write,up,sizeof(SQChar)));
+    _CHECK_IO(WriteTag(_v,write,up,sizeof(SQInteger)));
+    _CHECK_IO(WriteTag(_v,write,up,sizeof(SQFloat)));
+    _CHECK_IO(WriteTag(_v,write,up,Adler32(payload._vals,size)));
+    _CHECK_IO(SafeWrite(_v,write,up,&size,sizeof(size)));
+    _CHECK_IO(SafeWrite(_v,write,up,payload._vals,size));
+    return true;
 }
 
-bool SQFunctionProto::Save(SQVM *v,SQUserPointer up,SQWRITEFUNC write)
+struct SQBytecodeReader
 {
-    SQInteger i,nliterals = _nliterals,nparameters = _nparameters;
-    SQInteger noutervalues = _noutervalues,nlocalvarinfos = _nlocalvarinfos;
-    SQInteger nlineinfos=_nlineinfos,ninstructions = _ninstructions,nfunctions=_nfunctions;
-    SQInteger ndefaultparams = _ndefaultparams;
-    _CHECK_IO(WriteTag(v,write,up,SQ_CLOSURESTREAM_PART));
-    _CHECK_IO(WriteObject(v,up,write,_sourcename));
-    _CHECK_IO(WriteObject(v,up,write,_name));
-    _CHECK_IO(WriteTag(v,write,up,SQ_CLOSURESTREAM_PART));
-    _CHECK_IO(SafeWrite(v,write,up,&nliterals,sizeof(nliterals)));
-    _CHECK_IO(SafeWrite(v,write,up,&nparameters,sizeof(nparameters)));
-    _CHECK_IO(SafeWrite(v,write,up,&noutervalues,sizeof(noutervalues)));
-    _CHECK_IO(SafeWrite(v,write,up,&nlocalvarinfos,sizeof(nlocalvarinfos)));
-    _CHECK_IO(SafeWrite(v,write,up,&nlineinfos,sizeof(nlineinfos)));
-    _CHECK_IO(SafeWrite(v,write,up,&ndefaultparams,sizeof(ndefaultparams)));
-    _CHECK_IO(SafeWrite(v,write,up,&ninstructions,sizeof(ninstructions)));
-    _CHECK_IO(SafeWrite(v,write,up,&nfunctions,sizeof(nfunctions)));
-    _CHECK_IO(WriteTag(v,write,up,SQ_CLOSURESTREAM_PART));
-    for(i=0;i<nliterals;i++){
-        _CHECK_IO(WriteObject(v,up,write,_literals[i]));
+    bool Fail()
+    {
+        _v->Raise_Error(_SC("invalid or corrupted closure stream"));
+        return false;
+    }
+    bool Byte(unsigned char &c)
+    {
+        if(_p == _end) return Fail();
+        c = *_p++;
+        return true;
     }
+    bool UInt(SQUnsignedInteger &n)
+    {
+        unsigned char c;
+        SQInteger shift = 0;
+        n = 0;
+        do {
+            if(shift >= (SQInteger)(sizeof(SQUnsignedInteger) * 8)) return Fail();
+            _CHECK_IO(Byte(c));
+            n |= (SQUnsignedInteger)(c & 0x7F) << shift;
+            shift += 7;
+        } while(c & 0x80);
+        return true;
+    }
+    bool Int(SQInteger &n)
+    {
+        SQUnsignedInteger u;
+        _CHECK_IO(UInt(u));
+        n = (SQInteger)(u >> 1) ^ -(SQInteger)(u & 1);
+        return true;
+    }
+    //a count of elements that take at least one byte each, so a corrupted
+    //count can't make the reader allocate more than what is left
+    bool Count(SQInteger &n)
+    {
+        SQUnsignedInteger u;
+        _CHECK_IO(UInt(u));
+        if(u > (SQUnsignedInteger)(_end - _p)) return Fail();
+        n = (SQInteger)u;
+        return true;
+    }
+    bool Raw(void *dest,SQInteger size)
+    {
+        if(size > _end - _p) return Fail();
+        if(size) memcpy(dest,_p,size);
+        _p += size;
+        return true;
+    }
+    bool Object(SQObjectPtr &o);
+    SQVM *_v;
+    SQBytecodeImage *_img;
+    const unsigned char *_p;
+    const unsigned char *_end;
+};
+
+bool SQBytecodeReader::Object(SQObjectPtr &o)
+{
+    unsigned char t;
+    _CHECK_IO(Byte(t));
+    switch(t) {
+    case SQBC_NULL: o.Null(); break;
+    case SQBC_FALSE: o = false; break;
+    case SQBC_TRUE: o = true; break;
+    case SQBC_INTEGER: {
+        SQInteger n;
+        _CHECK_IO(Int(n));
+        o = n;
+        }
+        break;
+    case SQBC_FLOAT: {
+        SQFloat f;
+        _CHECK_IO(Raw(&f,sizeof(f)));
+        o = f;
+        }
+        break;
+    case SQBC_STRING: {
+        SQUnsignedInteger idx;
+        _CHECK_IO(UInt(idx));
+        if(idx >= _img->_strings.size()) return Fail();
+        SQFrozenString &s = _img->_strings[idx];
+        o = SQString::Create(_ss(_v),(const SQChar *)&_img->_data[s._offset],s._len);
+        }
+        break;
+    default:
+        return Fail();
+    }
+    return true;
+}
 
-    _CHECK_IO(WriteTag(v,write,up,SQ_CLOSURESTREAM_PART));
-    for(i=0;i<nparameters;i++){
-        _CHECK_IO(WriteObject(v,up,write,_parameters[i]));
+bool SQBytecodeImage::LoadFunction(SQVM *v,SQInteger idx,SQObjectPtr &ret)
+{
+    SQBytecodeReader r;
+    SQInteger i,nliterals,nparameters,noutervalues,nlocalvarinfos,nlineinfos,ndefaultparams,ninstructions,nfunctions;
+    SQUnsignedInteger n;
+    SQObjectPtr sourcename,name;
+    r._v = v;
+    r._img = this;
+    r._p = _data._vals + _functions[idx];
+    r._end = _data._vals + _data.size();
+    if(!r.Object(sourcename) || !r.Object(name)
+        || !r.Count(nliterals) || !r.Count(nparameters) || !r.Count(noutervalues)
+        || !r.Count(nlocalvarinfos) || !r.Count(nlineinfos) || !r.Count(ndefaultparams)
+        || !r.Count(ninstructions) || !r.Count(nfunctions))
+        return false;
+    SQFunctionProto *f = SQFunctionProto::Create(_ss(v),ninstructions,nliterals,nparameters,
+            nfunctions,noutervalues,nlineinfos,nlocalvarinfos,ndefaultparams);
+    SQObjectPtr proto = f; //gets released if everything fails
+    f->_sourcename = sourcename;
+    f->_name = name;
+    for(i = 0; i < nliterals; i++) _CHECK_IO(r.Object(f->_literals[i]));
+    for(i = 0; i < nparameters; i++) _CHECK_IO(r.Object(f->_parameters[i]));
+    for(i = 0; i < noutervalues; i++) {
+        _CHECK_IO(r.UInt(n));
+        if(n > otOUTER) return r.Fail();
+        f->_outervalues[i]._type = (SQOuterType)n;
+        _CHECK_IO(r.Object(f->_outervalues[i]._src));
+        _CHECK_IO(r.Object(f->_outervalues[i]._name));
+    }
+    for(i = 0; i < nlocalvarinfos; i++) {
+        SQLocalVarInfo &lvi = f->_localvarinfos[i];
+        _CHECK_IO(r.Object(lvi._name));
+        _CHECK_IO(r.UInt(lvi._pos));
+        _CHECK_IO(r.UInt(lvi._start_op));
+        _CHECK_IO(r.UInt(lvi._end_op));
+    }
+    SQLineInfo last = {0,0};
+    for(i = 0; i < nlineinfos; i++) {
+        SQInteger dline,dop;
+        _CHECK_IO(r.Int(dline));
+        _CHECK_IO(r.Int(dop));
+        last._line += dline;
+        last._op += dop;
+        f->_lineinfos[i] = last;
+    }
+    for(i = 0; i < ndefaultparams; i++) {
+        _CHECK_IO(r.UInt(n));
+        f->_defaultparams[i] = (SQInteger)n;
+    }
+    _CHECK_IO(r.Raw(f->_instructions,ninstructions * sizeof(SQInstruction)));
+    if(nfunctions) f->_image = this;
+    for(i = 0; i < nfunctions; i++) {
+        //only functions that come after this one, so a corrupted index can't make a cycle
+        _CHECK_IO(r.UInt(n));
+        if(n <= (SQUnsignedInteger)idx || n >= _functions.size()) return r.Fail();
+        f->_functions[i] = (SQInteger)n;
+        AddRef();
     }
+    unsigned char gen;
+    _CHECK_IO(r.UInt(n));
+    f->_stacksize = (SQInteger)n;
+    _CHECK_IO(r.Byte(gen));
+    f->_bgenerator = gen ? true : false;
+    _CHECK_IO(r.UInt(n));
+    f->_varparams = (SQInteger)n;
+    ret = f;
+    return true;
+}
 
-    _CHECK_IO(WriteTag(v,write,up,SQ_CLOSURESTREAM_PART));
-    for(i=0;i<noutervalues;i++){
-        _CHECK_IO(SafeWrite(v,write,up,&_outervalues[i]._type,sizeof(SQUnsignedInteger)));
-        _CHECK_IO(WriteObject(v,up,write,_outervalues[i]._src));
-        _CHECK_IO(WriteObject(v,up,write,_outervalues[i]._name));
+bool SQBytecodeImage::Load(SQVM *v,SQUserPointer up,SQREADFUNC read,SQObjectPtr &ret)
+{
+    SQUnsignedInteger32 checksum;
+    SQInteger size;
+    _CHECK_IO(CheckTag(v,read,up,SQ_BYTECODE_VERSION));
+    _CHECK_IO(CheckTag(v,read,up,sizeof(SQChar)));
+    _CHECK_IO(CheckTag(v,read,up,sizeof(SQInteger)));
+    _CHECK_IO(CheckTag(v,read,up,sizeof(SQFloat)));
+    _CHECK_IO(SafeRead(v,read,up,&checksum,sizeof(checksum)));
+    _CHECK_IO(SafeRead(v,read,up,&size,sizeof(size)));
+    if(size < 0) {
+        v->Raise_Error(_SC("invalid or corrupted closure stream"));
+        return false;
+    }
+    SQBytecodeImage *img;
+    sq_new(img,SQBytecodeImage);
+    img->_refcount = 1;
+    img->_ss = _ss(v);
+    img->_ss->_bytecodeimages++;
+    img->_data.resize(size);
+    bool ok = SafeRead(v,read,up,img->_data._vals,size);
+    if(ok && Adler32(img->_data._vals,size) != checksum) {
+        v->Raise_Error(_SC("the closure stream is corrupted (checksum mismatch)"));
+        ok = false;
+    }
+    SQBytecodeReader r;
+    r._v = v;
+    r._img = img;
+    r._p = img->_data._vals;
+    r._end = img->_data._vals + size;
+    SQInteger i,n;
+    if(ok) ok = r.Count(n);
+    for(i = 0; ok && i < n; i++) {
+        SQUnsignedInteger len;
+        ok = r.UInt(len);
+        if(ok && len > (SQUnsignedInteger)(r._end - r._p) / sizeof(SQChar)) ok = r.Fail();
+        if(ok) {
+            SQFrozenString s;
+            s._offset = r._p - img->_data._vals;
+            s._len = (SQInteger)len;
+            img->_strings.push_back(s);
+            r._p += sq_rsl(len);
+        }
+    }
+    if(ok) ok = r.Count(n) && (n > 0 ? true : r.Fail());
+    for(i = 0; ok && i < n; i++) {
+        SQUnsignedInteger offset;
+        ok = r.UInt(offset);
+        img->_functions.push_back((SQInteger)offset);
     }
+    //offsets are relative to the first body
+    SQInteger bodies = r._p - img->_data._vals;
+    for(i = 0; ok && i < (SQInteger)img->_functions.size(); i++) {
+        if((SQUnsignedInteger)img->_functions[i] >= (SQUnsignedInteger)(size - bodies)) ok = r.Fail();
+        img->_functions[i] += bodies;
+    }
+    if(ok) ok = img->LoadFunction(v,0,ret);
+    img->Release();
+    return ok;
+}
 
-    _CHECK_IO(WriteTag(v,write,up,SQ_CLOSURESTREAM_PART));
-    for(i=0;i<nlocalvarinfos;i++){
-        SQLocalVarInfo &lvi=_localvarinfos[i];
-        _CHECK_IO(WriteObject(v,up,write,lvi._name));
-        _CHECK_IO(SafeWrite(v,write,up,&lvi._pos,sizeof(SQUnsignedInteger)));
-        _CHECK_IO(SafeWrite(v,write,up,&lvi._start_op,sizeof(SQUnsignedInteger)));
-        _CHECK_IO(SafeWrite(v,write,up,&lvi._end_op,sizeof(SQUnsignedInteger)));
+void SQBytecodeImage::Release()
+{
+    if(--_refcount == 0) {
+        _ss->_bytecodeimages--;
+        SQBytecodeImage *img = this;
+        sq_delete(img,SQBytecodeImage);
     }
+}
 
-    _CHECK_IO(WriteTag(v,write,up,SQ_CLOSURESTREAM_PART));
-    _CHECK_IO(SafeWrite(v,write,up,_lineinfos,sizeof(SQLineInfo)*nlineinfos));
+bool SQFunctionProto::LoadFunction(SQVM *v,SQInteger i)
+{
+    SQObjectPtr f;
+    _CHECK_IO(_image->LoadFunction(v,_integer(_functions[i]),f));
+    _functions[i] = f;
+    _image->Release();
+    return true;
+}
 
-    _CHECK_IO(WriteTag(v,write,up,SQ_CLOSURESTREAM_PART));
-    _CHECK_IO(SafeWrite(v,write,up,_defaultparams,sizeof(SQInteger)*ndefaultparams));
+SQLazyBody *SQLazyBody::Create(SQSharedState *ss,const SQChar *source,SQInteger size,SQInteger line,SQInteger column,bool lineinfo)
+{
+    SQLazyBody *body = (SQLazyBody *)sq_vm_malloc(sizeof(SQLazyBody) + sq_rsl(size));
+    body->_size = size;
+    body->_line = line;
+    body->_column = column;
+    body->_lineinfo = lineinfo;
+    body->_source = (SQChar *)(body + 1);
+    memcpy(body->_source,source,sq_rsl(size));
+    ss->_lazybodies++;
+    return body;
+}
+
+void SQLazyBody::Release(SQSharedState *ss)
+{
+    ss->_lazybodies--;
+    sq_vm_free(this,sizeof(SQLazyBody) + sq_rsl(_size));
+}
+
+bool SQFunctionProto::LoadBody(SQVM *v,bool raiseerror)
+{
+#ifndef NO_COMPILER
+    SQObjectPtr o;
+    _CHECK_IO(CompileBody(v,this,o,raiseerror));
+    //the parameters, outers and default params are the ones of the lazy function
+    SQFunctionProto *f = _funcproto(o);
+    _stacksize = f->_stacksize;
+    _bgenerator = f->_bgenerator;
+    _ninstructions = f->_ninstructions;
+    _instructions = f->_instructions;
+    _nliterals = f->_nliterals;
+    _literals = f->_literals;
+    _nfunctions = f->_nfunctions;
+    _functions = f->_functions;
+    _nlineinfos = f->_nlineinfos;
+    _lineinfos = f->_lineinfos;
+    _nlocalvarinfos = f->_nlocalvarinfos;
+    _localvarinfos = f->_localvarinfos;
+    _body = o;
+    _lazy->Release(_ss(v));
+    _lazy = NULL;
+#endif
+    return true;
+}
+
+bool SQFunctionProto::LoadFunctions(SQVM *v)
+{
+    if(_lazy) _CHECK_IO(LoadBody(v));
+    for(SQInteger i = 0; i < _nfunctions; i++) {
+        if(type(_functions[i]) == OT_INTEGER) _CHECK_IO(LoadFunction(v,i));
+    }
+    return true;
+}
 
-    _CHECK_IO(WriteTag(v,write,up,SQ_CLOSURESTREAM_PART));
-    _CHECK_IO(SafeWrite(v,write,up,_instructions,sizeof(SQInstruction)*ninstructions));
+bool SQClosure::Save(SQVM *v,SQUserPointer up,SQWRITEFUNC write)
+{
+    SQBytecodeWriter w;
+    w._v = v;
+    return w.Write(_function,up,write);
+}
 
-    _CHECK_IO(WriteTag(v,write,up,SQ_CLOSURESTREAM_PART));
-    for(i=0;i<nfunctions;i++){
-        _CHECK_IO(_funcproto(_functions[i])->Save(v,up,write));
+bool SQClosure::Load(SQVM *v,SQUserPointer up,SQREADFUNC read,SQObjectPtr &ret)
+{
+    SQUnsignedInteger32 head;
+    SQObjectPtr func;
+    _CHECK_IO(SafeRead(v,read,up,&head,sizeof(head)));
+    if(head == SQ_BYTECODESTREAM_HEAD) {
+        _CHECK_IO(SQBytecodeImage::Load(v,up,read,func));
+        ret = SQClosure::Create(_ss(v),_funcproto(func),_table(v->_roottable)->GetWeakRef(OT_TABLE));
+        return true;
     }
-    _CHECK_IO(SafeWrite(v,write,up,&_stacksize,sizeof(_stacksize)));
-    _CHECK_IO(SafeWrite(v,write,up,&_bgenerator,sizeof(_bgenerator)));
-    _CHECK_IO(SafeWrite(v,write,up,&_varparams,sizeof(_varparams)));
+    //version 1 streams
+    if(head != SQ_CLOSURESTREAM_HEAD) {
+        v->Raise_Error(_SC("invalid or corrupted closure stream"));
+        return false;
+    }
+    _CHECK_IO(CheckTag(v,read,up,sizeof(SQChar)));
+    _CHECK_IO(CheckTag(v,read,up,sizeof(SQInteger)));
+    _CHECK_IO(CheckTag(v,read,up,sizeof(SQFloat)));
+    _CHECK_IO(SQFunctionProto::Load(v,up,read,func));
+    _CHECK_IO(CheckTag(v,read,up,SQ_CLOSURESTREAM_TAIL));
+    ret = SQClosure::Create(_ss(v),_funcproto(func),_table(v->_roottable)->GetWeakRef(OT_TABLE));
+    //FIXME: load an root for this closure
     return true;
 }
 
+SQFunctionProto::SQFunctionProto(SQSharedState *ss)
+{
+    _stacksize=0;
+    _bgenerator=false;
+    _frozen=NULL;
+    _patchedcode=NULL;
+    _coverage=NULL;
+    _image=NULL;
+    _lazy=NULL;
+    INIT_CHAIN();ADD_TO_CHAIN(&_ss(this)->_gc_chain,this);
+}
+
+SQFunctionProto::~SQFunctionProto()
+{
+    REMOVE_FROM_CHAIN(&_ss(this)->_gc_chain,this);
+}
+
 bool SQFunctionProto::Load(SQVM *v,SQUserPointer up,SQREADFUNC read,SQObjectPtr &ret)
 {
     SQInteger i, nliterals,nparameters;
@@ -550,6 +972,1349 @@ bool SQFunctionProto::Load(SQVM *v,SQUserPointer up,SQREADFUNC read,SQObjectPtr
     return true;
 }
 
+#define _FROZEN_ALLOC(type,n) ((n) ? (type*)sq_vm_malloc((n)*sizeof(type)) : NULL)
+#define _FROZEN_FREE(type,p,n) if(p) sq_vm_free((p),(n)*sizeof(type))
+
+static bool FreezeObject(SQVM *v,SQFrozenProto *img,SQTable *strings,const SQObjectPtr &o,SQFrozenObject &fo)
+{
+    fo._type = type(o);
+    switch(type(o)) {
+    case OT_NULL: fo._nval = 0; break;
+    case OT_BOOL: fo._nval = _integer(o) ? 1 : 0; break;
+    case OT_INTEGER: fo._nval = _integer(o); break;
+    case OT_FLOAT: fo._fval = _float(o); break;
+    case OT_STRING: {
+        SQObjectPtr idx;
+        if(!strings->Get(o,idx)) {
+            SQFrozenString fs;
+            fs._offset = img->_chars.size();
+            fs._len = _string(o)->_len;
+            img->_chars.resize(fs._offset + fs._len);
+            if(fs._len) memcpy(&img->_chars[fs._offset],_stringval(o),fs._len * sizeof(SQChar));
+            idx = (SQInteger)img->_strings.size();
+            img->_strings.push_back(fs);
+            strings->NewSlot(o,idx);
+        }
+        fo._nval = _integer(idx);
+        }
+        break;
+    default:
+        v->Raise_Error(_SC("cannot freeze a function holding a %s"),GetTypeName(o));
+        return false;
+    }
+    return true;
+}
+
+static bool FreezeFunc(SQVM *v,SQFrozenProto *img,SQTable *strings,SQFunctionProto *f,SQFrozenFunc &ff)
+{
+    SQInteger i;
+    _CHECK_IO(f->LoadFunctions(v));
+    ff._stacksize = f->_stacksize;
+    ff._bgenerator = f->_bgenerator;
+    ff._varparams = f->_varparams;
+    ff._ninstructions = f->_ninstructions;
+    ff._instructions = _FROZEN_ALLOC(SQInstruction,f->_ninstructions);
+    SQInstructionVec code;
+    memcpy(ff._instructions,_ss(v)->GetOriginalCode(f,code),f->_ninstructions * sizeof(SQInstruction));
+    ff._nlineinfos = f->_nlineinfos;
+    ff._lineinfos = _FROZEN_ALLOC(SQLineInfo,f->_nlineinfos);
+    if(ff._lineinfos) memcpy(ff._lineinfos,f->_lineinfos,f->_nlineinfos * sizeof(SQLineInfo));
+    ff._ndefaultparams = f->_ndefaultparams;
+    ff._defaultparams = _FROZEN_ALLOC(SQInteger,f->_ndefaultparams);
+    if(ff._defaultparams) memcpy(ff._defaultparams,f->_defaultparams,f->_ndefaultparams * sizeof(SQInteger));
+    _CHECK_IO(FreezeObject(v,img,strings,f->_sourcename,ff._sourcename));
+    _CHECK_IO(FreezeObject(v,img,strings,f->_name,ff._name));
+    ff._nliterals = f->_nliterals;
+    ff._literals = _FROZEN_ALLOC(SQFrozenObject,f->_nliterals);
+    for(i = 0; i < f->_nliterals; i++) {
+        _CHECK_IO(FreezeObject(v,img,strings,f->_literals[i],ff._literals[i]));
+    }
+    ff._nparameters = f->_nparameters;
+    ff._parameters = _FROZEN_ALLOC(SQFrozenObject,f->_nparameters);
+    for(i = 0; i < f->_nparameters; i++) {
+        _CHECK_IO(FreezeObject(v,img,strings,f->_parameters[i],ff._parameters[i]));
+    }
+    ff._noutervalues = f->_noutervalues;
+    ff._outervalues = _FROZEN_ALLOC(SQFrozenOuterVar,f->_noutervalues);
+    for(i = 0; i < f->_noutervalues; i++) {
+        ff._outervalues[i]._type = f->_outervalues[i]._type;
+        _CHECK_IO(FreezeObject(v,img,strings,f->_outervalues[i]._name,ff._outervalues[i]._name));
+        _CHECK_IO(FreezeObject(v,img,strings,f->_outervalues[i]._src,ff._outervalues[i]._src));
+    }
+    ff._nlocalvarinfos = f->_nlocalvarinfos;
+    ff._localvarinfos = _FROZEN_ALLOC(SQFrozenLocalVarInfo,f->_nlocalvarinfos);
+    for(i = 0; i < f->_nlocalvarinfos; i++) {
+        SQLocalVarInfo &lvi = f->_localvarinfos[i];
+        SQFrozenLocalVarInfo &flvi = ff._localvarinfos[i];
+        flvi._start_op = lvi._start_op;
+        flvi._end_op = lvi._end_op;
+        flvi._pos = lvi._pos;
+        _CHECK_IO(FreezeObject(v,img,strings,lvi._name,flvi._name));
+    }
+    ff._functions = _FROZEN_ALLOC(SQFrozenFunc,f->_nfunctions);
+    if(ff._functions) memset(ff._functions,0,f->_nfunctions * sizeof(SQFrozenFunc));
+    ff._nfunctions = f->_nfunctions;
+    for(i = 0; i < f->_nfunctions; i++) {
+        _CHECK_IO(FreezeFunc(v,img,strings,_funcproto(f->_functions[i]),ff._functions[i]));
+    }
+    return true;
+}
+
+static void ReleaseFrozenFunc(SQFrozenFunc &ff,bool mapped)
+{
+    for(SQInteger i = 0; i < ff._nfunctions; i++) ReleaseFrozenFunc(ff._functions[i],mapped);
+    _FROZEN_FREE(SQFrozenFunc,ff._functions,ff._nfunctions);
+    //the arrays of a mapped image live in its buffer
+    if(mapped) return;
+    _FROZEN_FREE(SQInstruction,ff._instructions,ff._ninstructions);
+    _FROZEN_FREE(SQLineInfo,ff._lineinfos,ff._nlineinfos);
+    _FROZEN_FREE(SQInteger,ff._defaultparams,ff._ndefaultparams);
+    _FROZEN_FREE(SQFrozenObject,ff._literals,ff._nliterals);
+    _FROZEN_FREE(SQFrozenObject,ff._parameters,ff._nparameters);
+    _FROZEN_FREE(SQFrozenOuterVar,ff._outervalues,ff._noutervalues);
+    _FROZEN_FREE(SQFrozenLocalVarInfo,ff._localvarinfos,ff._nlocalvarinfos);
+}
+
+static void ThawObject(const SQFrozenObject &fo,SQObjectPtr *strings,SQObjectPtr &o)
+{
+    switch(fo._type) {
+    case OT_BOOL: o = fo._nval ? true : false; break;
+    case OT_INTEGER: o = fo._nval; break;
+    case OT_FLOAT: o = fo._fval; break;
+    case OT_STRING: o = strings[fo._nval]; break;
+    default: o.Null(); break;
+    }
+}
+
+static SQFunctionProto *ThawFunc(SQSharedState *ss,SQFrozenProto *img,SQFrozenFunc &ff,SQObjectPtr *strings)
+{
+    SQInteger i;
+    SQFunctionProto *f = SQFunctionProto::Create(ss,0,ff._nliterals,ff._nparameters,
+            ff._nfunctions,ff._noutervalues,0,ff._nlocalvarinfos,0);
+    f->_frozen = img;
+    img->AddRef();
+    f->_ninstructions = ff._ninstructions;
+    f->_instructions = ff._instructions;
+    f->_nlineinfos = ff._nlineinfos;
+    f->_lineinfos = ff._lineinfos;
+    f->_ndefaultparams = ff._ndefaultparams;
+    f->_defaultparams = ff._defaultparams;
+    f->_stacksize = ff._stacksize;
+    f->_bgenerator = ff._bgenerator;
+    f->_varparams = ff._varparams;
+    ThawObject(ff._sourcename,strings,f->_sourcename);
+    ThawObject(ff._name,strings,f->_name);
+    for(i = 0; i < ff._nliterals; i++) ThawObject(ff._literals[i],strings,f->_literals[i]);
+    for(i = 0; i < ff._nparameters; i++) ThawObject(ff._parameters[i],strings,f->_parameters[i]);
+    for(i = 0; i < ff._noutervalues; i++) {
+        SQOuterVar &ov = f->_outervalues[i];
+        ov._type = ff._outervalues[i]._type;
+        ThawObject(ff._outervalues[i]._name,strings,ov._name);
+        ThawObject(ff._outervalues[i]._src,strings,ov._src);
+    }
+    for(i = 0; i < ff._nlocalvarinfos; i++) {
+        SQLocalVarInfo &lvi = f->_localvarinfos[i];
+        SQFrozenLocalVarInfo &flvi = ff._localvarinfos[i];
+        ThawObject(flvi._name,strings,lvi._name);
+        lvi._start_op = flvi._start_op;
+        lvi._end_op = flvi._end_op;
+        lvi._pos = flvi._pos;
+    }
+    for(i = 0; i < ff._nfunctions; i++) f->_functions[i] = ThawFunc(ss,img,ff._functions[i],strings);
+    return f;
+}
+
+SQFrozenProto *SQFrozenProto::Create(SQVM *v,SQFunctionProto *func)
+{
+    SQFrozenProto *img;
+    sq_new(img,SQFrozenProto);
+    img->_refcount = 1;
+    img->_buf = NULL;
+    img->_bufsize = 0;
+    img->_hook = NULL;
+    memset(&img->_main,0,sizeof(SQFrozenFunc));
+    //maps every distinct string to its slot in the pool
+    SQObjectPtr strings = SQTable::Create(_ss(v),0);
+    if(!FreezeFunc(v,img,_table(strings),func,img->_main)) {
+        img->Release();
+        return NULL;
+    }
+    img->_nstrings = img->_strings.size();
+    img->_strtab = img->_strings._vals;
+    img->_chartab = img->_chars._vals;
+    return img;
+}
+
+SQFunctionProto *SQFrozenProto::Thaw(SQSharedState *ss)
+{
+    //every string of the image is interned once in the state
+    sqvector<SQObjectPtr> strings;
+    strings.resize(_nstrings);
+    for(SQInteger i = 0; i < _nstrings; i++) {
+        strings[i] = SQString::Create(ss,_chartab + _strtab[i]._offset,_strtab[i]._len);
+    }
+    return ThawFunc(ss,this,_main,strings._vals);
+}
+
+void SQFrozenProto::AddRef()
+{
+    sq_atomic_inc(&_refcount);
+}
+
+void SQFrozenProto::Release()
+{
+    if(sq_atomic_dec(&_refcount) == 0) {
+        ReleaseFrozenFunc(_main,_buf != NULL);
+        if(_hook) _hook(_buf,_bufsize);
+        SQFrozenProto *img = this;
+        sq_delete(img,SQFrozenProto);
+    }
+}
+
+//mappable images: the frozen arrays are laid out in one aligned buffer, pointers
+//become offsets from its start so a file can be mapped and used without copies
+#define SQ_MAPPED_VERSION 1
+#define SQ_MAPPED_LAYOUT ((SQUnsignedInteger32)(sizeof(SQChar)|(sizeof(SQInteger)<<8)|(sizeof(SQFloat)<<16)|(sizeof(SQInstruction)<<24)))
+#define SQ_MAPPED_ALIGN 8
+
+struct SQMappedHead
+{
+    unsigned short _tag;
+    unsigned short _version;
+    SQUnsignedInteger32 _layout;
+    SQInteger _size;
+    SQInteger _nstrings;
+    SQInteger _strings;
+    SQInteger _nchars;
+    SQInteger _chars;
+    SQInteger _main;
+};
+
+//a SQFrozenFunc with offsets in place of pointers
+struct SQMappedFunc
+{
+    SQFrozenObject _sourcename;
+    SQFrozenObject _name;
+    SQInteger _stacksize;
+    SQInteger _bgenerator;
+    SQInteger _varparams;
+    SQInteger _ninstructions;
+    SQInteger _instructions;
+    SQInteger _nlineinfos;
+    SQInteger _lineinfos;
+    SQInteger _ndefaultparams;
+    SQInteger _defaultparams;
+    SQInteger _nliterals;
+    SQInteger _literals;
+    SQInteger _nparameters;
+    SQInteger _parameters;
+    SQInteger _noutervalues;
+    SQInteger _outervalues;
+    SQInteger _nlocalvarinfos;
+    SQInteger _localvarinfos;
+    SQInteger _nfunctions;
+    SQInteger _functions;
+};
+
+struct SQMappedWriter
+{
+    //appends n zeroed bytes at an aligned offset and returns the offset
+    SQInteger Reserve(SQInteger n)
+    {
+        SQInteger offset = (_buf.size() + (SQ_MAPPED_ALIGN - 1)) & ~(SQInteger)(SQ_MAPPED_ALIGN - 1);
+        _buf.resize(offset + n,0);
+        return offset;
+    }
+    SQInteger Append(const void *p,SQInteger n)
+    {
+        SQInteger offset = Reserve(n);
+        if(n) memcpy(&_buf[offset],p,n);
+        return offset;
+    }
+    //the padding of the frozen structures is zeroed so equal images are equal files
+    static SQFrozenObject Clean(const SQFrozenObject &fo)
+    {
+        SQFrozenObject ret;
+        memset(&ret,0,sizeof(ret));
+        ret._type = fo._type;
+        if(fo._type == OT_FLOAT) ret._fval = fo._fval;
+        else ret._nval = fo._nval;
+        return ret;
+    }
+    void Func(const SQFrozenFunc &ff,SQInteger at);
+    sqvector<unsigned char> _buf;
+};
+
+void SQMappedWriter::Func(const SQFrozenFunc &ff,SQInteger at)
+{
+    SQInteger i;
+    SQMappedFunc mf;
+    memset(&mf,0,sizeof(mf));
+    mf._sourcename = Clean(ff._sourcename);
+    mf._name = Clean(ff._name);
+    mf._stacksize = ff._stacksize;
+    mf._bgenerator = ff._bgenerator ? 1 : 0;
+    mf._varparams = ff._varparams;
+    mf._ninstructions = ff._ninstructions;
+    mf._instructions = Append(ff._instructions,ff._ninstructions * sizeof(SQInstruction));
+    mf._nlineinfos = ff._nlineinfos;
+    mf._lineinfos = Append(ff._lineinfos,ff._nlineinfos * sizeof(SQLineInfo));
+    mf._ndefaultparams = ff._ndefaultparams;
+    mf._defaultparams = Append(ff._defaultparams,ff._ndefaultparams * sizeof(SQInteger));
+    mf._nliterals = ff._nliterals;
+    mf._literals = Reserve(ff._nliterals * sizeof(SQFrozenObject));
+    for(i = 0; i < ff._nliterals; i++) {
+        SQFrozenObject fo = Clean(ff._literals[i]);
+        memcpy(&_buf[mf._literals + i * sizeof(SQFrozenObject)],&fo,sizeof(fo));
+    }
+    mf._nparameters = ff._nparameters;
+    mf._parameters = Reserve(ff._nparameters * sizeof(SQFrozenObject));
+    for(i = 0; i < ff._nparameters; i++) {
+        SQFrozenObject fo = Clean(ff._parameters[i]);
+        memcpy(&_buf[mf._parameters + i * sizeof(SQFrozenObject)],&fo,sizeof(fo));
+    }
+    mf._noutervalues = ff._noutervalues;
+    mf._outervalues = Reserve(ff._noutervalues * sizeof(SQFrozenOuterVar));
+    for(i = 0; i < ff._noutervalues; i++) {
+        SQFrozenOuterVar fov;
+        memset(&fov,0,sizeof(fov));
+        fov._type = ff._outervalues[i]._type;
+        fov._name = Clean(ff._outervalues[i]._name);
+        fov._src = Clean(ff._outervalues[i]._src);
+        memcpy(&_buf[mf._outervalues + i * sizeof(SQFrozenOuterVar)],&fov,sizeof(fov));
+    }
+    mf._nlocalvarinfos = ff._nlocalvarinfos;
+    mf._localvarinfos = Reserve(ff._nlocalvarinfos * sizeof(SQFrozenLocalVarInfo));
+    for(i = 0; i < ff._nlocalvarinfos; i++) {
+        SQFrozenLocalVarInfo flvi;
+        memset(&flvi,0,sizeof(flvi));
+        flvi._name = Clean(ff._localvarinfos[i]._name);
+        flvi._start_op = ff._localvarinfos[i]._start_op;
+        flvi._end_op = ff._localvarinfos[i]._end_op;
+        flvi._pos = ff._localvarinfos[i]._pos;
+        memcpy(&_buf[mf._localvarinfos + i * sizeof(SQFrozenLocalVarInfo)],&flvi,sizeof(flvi));
+    }
+    //children always come after their parent, this is what keeps a mapped tree acyclic
+    mf._nfunctions = ff._nfunctions;
+    mf._functions = Reserve(ff._nfunctions * sizeof(SQMappedFunc));
+    for(i = 0; i < ff._nfunctions; i++) {
+        Func(ff._functions[i],mf._functions + i * sizeof(SQMappedFunc));
+    }
+    memcpy(&_buf[at],&mf,sizeof(mf));
+}
+
+bool SQFrozenProto::Write(SQVM *v,SQUserPointer up,SQWRITEFUNC write)
+{
+    SQMappedWriter w;
+    SQMappedHead head;
+    memset(&head,0,sizeof(head));
+    w.Reserve(sizeof(SQMappedHead));
+    head._tag = SQ_MAPPED_STREAM_TAG;
+    head._version = SQ_MAPPED_VERSION;
+    head._layout = SQ_MAPPED_LAYOUT;
+    head._nstrings = _nstrings;
+    head._strings = w.Append(_strtab,_nstrings * sizeof(SQFrozenString));
+    head._nchars = 0;
+    for(SQInteger i = 0; i < _nstrings; i++) {
+        if(_strtab[i]._offset + _strtab[i]._len > head._nchars) head._nchars = _strtab[i]._offset + _strtab[i]._len;
+    }
+    head._chars = w.Append(_chartab,head._nchars * sizeof(SQChar));
+    head._main = w.Reserve(sizeof(SQMappedFunc));
+    w.Func(_main,head._main);
+    w.Reserve(0);
+    head._size = w._buf.size();
+    memcpy(&w._buf[0],&head,sizeof(head));
+    return SafeWrite(v,write,up,w._buf._vals,head._size);
+}
+
+struct SQMappedReader
+{
+    bool Check(bool cond)
+    {
+        if(!cond) _v->Raise_Error(_SC("invalid or corrupted bytecode image"));
+        return cond;
+    }
+    //true if n elements of the given size fit at offset
+    bool Range(SQInteger offset,SQInteger n,SQInteger size)
+    {
+        return Check(offset >= 0 && n >= 0 && (offset % SQ_MAPPED_ALIGN) == 0
+            && offset <= _size && n <= (_size - offset) / size);
+    }
+    template<typename T> bool Array(SQInteger offset,SQInteger n,T *&p)
+    {
+        _CHECK_IO(Range(offset,n,sizeof(T)));
+        p = n ? (T*)(_base + offset) : NULL;
+        return true;
+    }
+    //the enums are read as integers, the buffer could hold any value
+    static SQUnsignedInteger32 Enum(const void *p)
+    {
+        SQUnsignedInteger32 n;
+        memcpy(&n,p,sizeof(n));
+        return n;
+    }
+    bool Object(const SQFrozenObject &fo)
+    {
+        switch(Enum(&fo._type)) {
+        case OT_NULL: case OT_BOOL: case OT_INTEGER: case OT_FLOAT: return true;
+        case OT_STRING: return Check(fo._nval >= 0 && fo._nval < _nstrings);
+        default: return Check(false);
+        }
+    }
+    bool Func(SQInteger at,SQFrozenFunc &ff);
+    SQVM *_v;
+    unsigned char *_base;
+    SQInteger _size;
+    SQInteger _nstrings;
+};
+
+bool SQMappedReader::Func(SQInteger at,SQFrozenFunc &ff)
+{
+    SQInteger i;
+    SQMappedFunc *mf;
+    _CHECK_IO(Array(at,1,mf));
+    _CHECK_IO((Object(mf->_sourcename) && Object(mf->_name)));
+    ff._sourcename = mf->_sourcename;
+    ff._name = mf->_name;
+    ff._stacksize = mf->_stacksize;
+    ff._bgenerator = mf->_bgenerator ? true : false;
+    ff._varparams = mf->_varparams;
+    _CHECK_IO(Array(mf->_instructions,mf->_ninstructions,ff._instructions));
+    ff._ninstructions = mf->_ninstructions;
+    _CHECK_IO(Array(mf->_lineinfos,mf->_nlineinfos,ff._lineinfos));
+    ff._nlineinfos = mf->_nlineinfos;
+    _CHECK_IO(Array(mf->_defaultparams,mf->_ndefaultparams,ff._defaultparams));
+    ff._ndefaultparams = mf->_ndefaultparams;
+    _CHECK_IO(Array(mf->_literals,mf->_nliterals,ff._literals));
+    ff._nliterals = mf->_nliterals;
+    for(i = 0; i < ff._nliterals; i++) _CHECK_IO(Object(ff._literals[i]));
+    _CHECK_IO(Array(mf->_parameters,mf->_nparameters,ff._parameters));
+    ff._nparameters = mf->_nparameters;
+    for(i = 0; i < ff._nparameters; i++) _CHECK_IO(Object(ff._parameters[i]));
+    _CHECK_IO(Array(mf->_outervalues,mf->_noutervalues,ff._outervalues));
+    ff._noutervalues = mf->_noutervalues;
+    for(i = 0; i < ff._noutervalues; i++) {
+        _CHECK_IO(Check(Enum(&ff._outervalues[i]._type) <= otOUTER));
+        _CHECK_IO((Object(ff._outervalues[i]._name) && Object(ff._outervalues[i]._src)));
+    }
+    _CHECK_IO(Array(mf->_localvarinfos,mf->_nlocalvarinfos,ff._localvarinfos));
+    ff._nlocalvarinfos = mf->_nlocalvarinfos;
+    for(i = 0; i < ff._nlocalvarinfos; i++) _CHECK_IO(Object(ff._localvarinfos[i]._name));
+    SQMappedFunc *children;
+    _CHECK_IO(Array(mf->_functions,mf->_nfunctions,children));
+    _CHECK_IO(Check(mf->_nfunctions == 0 || mf->_functions > at));
+    ff._functions = _FROZEN_ALLOC(SQFrozenFunc,mf->_nfunctions);
+    if(ff._functions) memset(ff._functions,0,mf->_nfunctions * sizeof(SQFrozenFunc));
+    ff._nfunctions = mf->_nfunctions;
+    for(i = 0; i < ff._nfunctions; i++) {
+        _CHECK_IO(Func(mf->_functions + i * sizeof(SQMappedFunc),ff._functions[i]));
+    }
+    return true;
+}
+
+SQFrozenProto *SQFrozenProto::Map(SQVM *v,SQUserPointer buf,SQInteger size,SQRELEASEHOOK hook)
+{
+    SQMappedReader r;
+    SQMappedHead *head = (SQMappedHead *)buf;
+    r._v = v;
+    r._base = (unsigned char *)buf;
+    r._size = size;
+    r._nstrings = 0;
+    if(((size_t)buf % SQ_MAPPED_ALIGN) != 0) {
+        v->Raise_Error(_SC("the buffer of a bytecode image must be aligned to %d bytes"),SQ_MAPPED_ALIGN);
+        return NULL;
+    }
+    if(!r.Check(size >= (SQInteger)sizeof(SQMappedHead) && head->_tag == SQ_MAPPED_STREAM_TAG)) return NULL;
+    if(head->_version != SQ_MAPPED_VERSION || head->_layout != SQ_MAPPED_LAYOUT) {
+        v->Raise_Error(_SC("the bytecode image was built for a different version or configuration"));
+        return NULL;
+    }
+    SQFrozenString *strtab;
+    SQChar *chartab;
+    if(!r.Check(head->_size == size)
+        || !r.Array(head->_strings,head->_nstrings,strtab)
+        || !r.Array(head->_chars,head->_nchars,chartab)) return NULL;
+    for(SQInteger i = 0; i < head->_nstrings; i++) {
+        if(!r.Check(strtab[i]._offset >= 0 && strtab[i]._len >= 0
+            && strtab[i]._offset <= head->_nchars && strtab[i]._len <= head->_nchars - strtab[i]._offset)) return NULL;
+    }
+    r._nstrings = head->_nstrings;
+    SQFrozenProto *img;
+    sq_new(img,SQFrozenProto);
+    img->_refcount = 1;
+    img->_nstrings = head->_nstrings;
+    img->_strtab = strtab;
+    img->_chartab = chartab;
+    img->_buf = buf;
+    img->_bufsize = size;
+    img->_hook = NULL;
+    memset(&img->_main,0,sizeof(SQFrozenFunc));
+    if(!r.Func(head->_main,img->_main)) {
+        //the buffer still belongs to the caller
+        img->Release();
+        return NULL;
+    }
+    img->_hook = hook;
+    return img;
+}
+
+//whole heap images: the objects reachable from the roots of a VM are numbered and written
+//twice, first what is needed to allocate them and then their content, so cycles and shared
+//objects come back as they were. Native objects can't be written, they are referred to by
+//the key they have in a table of permanents and looked up by key when the image is read
+#define SQ_HEAPSTREAM_HEAD (('S'<<24)|('Q'<<16)|('H'<<8)|('P'))
+
+//objects are allocated in this order, each one only needs the ones of the previous ranks
+static SQInteger HeapRank(SQObjectType t)
+{
+    switch(t) {
+    case OT_STRING: return 0;
+    case OT_FUNCPROTO: return 1;
+    case OT_CLASS: case OT_GENERATOR: return 3;
+    case OT_INSTANCE: return 4;
+    default: return 2;
+    }
+}
+
+static bool CheckHeapTag(SQVM *v,SQREADFUNC read,SQUserPointer up,SQUnsignedInteger32 tag)
+{
+    SQUnsignedInteger32 t;
+    _CHECK_IO(SafeRead(v,read,up,&t,sizeof(t)));
+    if(t != tag) {
+        v->Raise_Error(_SC("invalid or corrupted heap image"));
+        return false;
+    }
+    return true;
+}
+
+struct SQHeapWriter
+{
+    SQHeapWriter(SQVM *v,SQTable *perms,SQUserPointer up,SQWRITEFUNC write);
+    bool Collect(const SQObject &o);
+    bool Write();
+    bool WriteInt(SQInteger n) { return SafeWrite(_v,_write,_up,&n,sizeof(n)); }
+    bool WriteRef(const SQObject &o);
+    bool WriteShell(const SQObject &o);
+    bool WriteBody(const SQObject &o);
+    bool WriteProto(SQFunctionProto *f);
+    SQVM *_v;
+    SQTable *_perms;
+    SQUserPointer _up;
+    SQWRITEFUNC _write;
+    SQObjectPtr _ids;
+    SQObjectPtr _permids;
+    SQObjectPtr _natives;
+    sqvector<SQObject> _objects;
+    sqvector<SQObject> _permanents;
+    sqvector<SQObject> _pending;
+};
+
+SQHeapWriter::SQHeapWriter(SQVM *v,SQTable *perms,SQUserPointer up,SQWRITEFUNC write)
+{
+    SQObjectPtr key,val,tmp;
+    SQInteger ridx = 0;
+    _v = v;
+    _perms = perms;
+    _up = up;
+    _write = write;
+    _ids = SQTable::Create(_ss(v),0);
+    _permids = SQTable::Create(_ss(v),0);
+    //a native function that is not a permanent (bound to an env for instance) is rebuilt
+    //from the permanent that has the same C function
+    _natives = SQTable::Create(_ss(v),0);
+    while((ridx = perms->Next(false,ridx,key,val)) != -1) {
+        if(type(key) != OT_NATIVECLOSURE) continue;
+        SQObjectPtr fn((SQUserPointer)_nativeclosure(key)->_function);
+        if(!_table(_natives)->Get(fn,tmp)) _table(_natives)->NewSlot(fn,key);
+    }
+}
+
+bool SQHeapWriter::Collect(const SQObject &o)
+{
+    SQObjectPtr tmp;
+    if(type(o) == OT_WEAKREF)
+        return Collect(_weakref(o)->_obj);
+    if(!ISREFCOUNTED(type(o)) && type(o) != OT_USERPOINTER)
+        return true;
+    if(_table(_ids)->Get(o,tmp) || _table(_permids)->Get(o,tmp))
+        return true;
+    if(_perms->Get(o,tmp)) {
+        _table(_permids)->NewSlot(o,(SQInteger)_permanents.size());
+        _permanents.push_back(o);
+        return true;
+    }
+    switch(type(o)) {
+    case OT_USERPOINTER: case OT_THREAD:
+        _v->Raise_Error(_SC("cannot write a %s that is not a permanent"),IdType2Name(type(o)));
+        return false;
+    case OT_NATIVECLOSURE:
+        if(!_table(_natives)->Get(SQObjectPtr((SQUserPointer)_nativeclosure(o)->_function),tmp)) {
+            SQObjectPtr &name = _nativeclosure(o)->_name;
+            _v->Raise_Error(_SC("cannot write the native function '%s', it is not a permanent"),
+                type(name) == OT_STRING ? _stringval(name) : _SC("unknown"));
+            return false;
+        }
+        break;
+    case OT_OUTER:
+        if(_outer(o)->_valptr != &_outer(o)->_value) {
+            _v->Raise_Error(_SC("cannot write the free variables of a running function"));
+            return false;
+        }
+        break;
+    case OT_GENERATOR:
+        if(_generator(o)->_state == SQGenerator::eRunning) {
+            _v->Raise_Error(_SC("cannot write a running generator"));
+            return false;
+        }
+        break;
+    case OT_FUNCPROTO:
+        _CHECK_IO(_funcproto(o)->LoadFunctions(_v));
+        break;
+    case OT_USERDATA: case OT_CLASS: case OT_INSTANCE: {
+        bool native;
+        if(type(o) == OT_USERDATA) native = _userdata(o)->_hook || _userdata(o)->_typetag;
+        else if(type(o) == OT_CLASS) native = _class(o)->_hook || _class(o)->_typetag;
+        else native = _instance(o)->_hook || (!_instance(o)->_class->_udsize && _instance(o)->_userpointer);
+        if(native) {
+            _v->Raise_Error(_SC("cannot write a %s holding native data that is not a permanent"),IdType2Name(type(o)));
+            return false;
+        }
+        }
+        break;
+    default: break;
+    }
+    _table(_ids)->NewSlot(o,(SQInteger)_objects.size());
+    _objects.push_back(o);
+    _pending.push_back(o);
+    if(type(o) == OT_NATIVECLOSURE)
+        return Collect(tmp);
+    return true;
+}
+
+bool SQHeapWriter::WriteRef(const SQObject &o)
+{
+    SQUnsignedInteger32 t = (SQUnsignedInteger32)type(o);
+    SQObjectPtr idx;
+    _CHECK_IO(SafeWrite(_v,_write,_up,&t,sizeof(t)));
+    switch(type(o)) {
+    case OT_NULL:
+        return true;
+    case OT_BOOL: case OT_INTEGER:
+        return WriteInt(_integer(o));
+    case OT_FLOAT: {
+        SQFloat f = _float(o);
+        return SafeWrite(_v,_write,_up,&f,sizeof(f));
+        }
+    case OT_WEAKREF:
+        return WriteRef(_weakref(o)->_obj);
+    default:
+        //permanents get negative ids
+        if(_table(_permids)->Get(o,idx))
+            return WriteInt(-1 - _integer(idx));
+        _table(_ids)->Get(o,idx);
+        return WriteInt(_integer(idx));
+    }
+}
+
+bool SQHeapWriter::WriteShell(const SQObject &o)
+{
+    SQUnsignedInteger32 t = (SQUnsignedInteger32)type(o);
+    _CHECK_IO(SafeWrite(_v,_write,_up,&t,sizeof(t)));
+    switch(type(o)) {
+    case OT_STRING:
+        _CHECK_IO(WriteInt(_string(o)->_len));
+        _CHECK_IO(SafeWrite(_v,_write,_up,_stringval(o),sq_rsl(_string(o)->_len)));
+        break;
+    case OT_FUNCPROTO: {
+        SQFunctionProto *f = _funcproto(o);
+        _CHECK_IO(WriteInt(f->_ninstructions));
+        _CHECK_IO(WriteInt(f->_nliterals));
+        _CHECK_IO(WriteInt(f->_nparameters));
+        _CHECK_IO(WriteInt(f->_nfunctions));
+        _CHECK_IO(WriteInt(f->_noutervalues));
+        _CHECK_IO(WriteInt(f->_nlineinfos));
+        _CHECK_IO(WriteInt(f->_nlocalvarinfos));
+        _CHECK_IO(WriteInt(f->_ndefaultparams));
+        }
+        break;
+    case OT_TABLE:
+        _CHECK_IO(WriteInt(_table(o)->CountUsed()));
+        break;
+    case OT_ARRAY:
+        _CHECK_IO(WriteInt(_array(o)->Size()));
+        break;
+    case OT_CLOSURE:
+        _CHECK_IO(WriteRef(SQObjectPtr(_closure(o)->_function)));
+        break;
+    case OT_NATIVECLOSURE: {
+        SQObjectPtr base;
+        _table(_natives)->Get(SQObjectPtr((SQUserPointer)_nativeclosure(o)->_function),base);
+        _CHECK_IO(WriteRef(base));
+        _CHECK_IO(WriteInt(_nativeclosure(o)->_noutervalues));
+        }
+        break;
+    case OT_USERDATA:
+        _CHECK_IO(WriteInt(_userdata(o)->_size));
+        _CHECK_IO(SafeWrite(_v,_write,_up,(SQUserPointer)sq_aligning(_userdata(o) + 1),_userdata(o)->_size));
+        break;
+    case OT_CLASS:
+        _CHECK_IO(WriteRef(SQObjectPtr(_class(o)->_members)));
+        break;
+    case OT_GENERATOR:
+        _CHECK_IO(WriteInt(_generator(o)->_state));
+        _CHECK_IO(WriteRef(_generator(o)->_closure));
+        break;
+    case OT_INSTANCE: {
+        SQInstance *inst = _instance(o);
+        _CHECK_IO(WriteRef(SQObjectPtr(inst->_class)));
+        _CHECK_IO(WriteInt(inst->_class->_defaultvalues.size()));
+        _CHECK_IO(WriteInt(inst->_class->_udsize));
+        if(inst->_class->_udsize) _CHECK_IO(SafeWrite(_v,_write,_up,inst->_userpointer,inst->_class->_udsize));
+        }
+        break;
+    default: break;
+    }
+    return true;
+}
+
+bool SQHeapWriter::WriteProto(SQFunctionProto *f)
+{
+    SQInteger i;
+    _CHECK_IO(WriteRef(f->_sourcename));
+    _CHECK_IO(WriteRef(f->_name));
+    for(i = 0; i < f->_nliterals; i++) _CHECK_IO(WriteRef(f->_literals[i]));
+    for(i = 0; i < f->_nparameters; i++) _CHECK_IO(WriteRef(f->_parameters[i]));
+    for(i = 0; i < f->_noutervalues; i++) {
+        _CHECK_IO(WriteInt(f->_outervalues[i]._type));
+        _CHECK_IO(WriteRef(f->_outervalues[i]._src));
+        _CHECK_IO(WriteRef(f->_outervalues[i]._name));
+    }
+    for(i = 0; i < f->_nlocalvarinfos; i++) {
+        SQLocalVarInfo &lvi = f->_localvarinfos[i];
+        _CHECK_IO(WriteRef(lvi._name));
+        _CHECK_IO(WriteInt(lvi._pos));
+        _CHECK_IO(WriteInt(lvi._start_op));
+        _CHECK_IO(WriteInt(lvi._end_op));
+    }
+    _CHECK_IO(SafeWrite(_v,_write,_up,f->_lineinfos,sizeof(SQLineInfo)*f->_nlineinfos));
+    _CHECK_IO(SafeWrite(_v,_write,_up,f->_defaultparams,sizeof(SQInteger)*f->_ndefaultparams));
+    SQInstructionVec code;
+    _CHECK_IO(SafeWrite(_v,_write,_up,_ss(_v)->GetOriginalCode(f,code),sizeof(SQInstruction)*f->_ninstructions));
+    for(i = 0; i < f->_nfunctions; i++) _CHECK_IO(WriteRef(f->_functions[i]));
+    _CHECK_IO(WriteInt(f->_stacksize));
+    _CHECK_IO(WriteInt(f->_bgenerator ? 1 : 0));
+    _CHECK_IO(WriteInt(f->_varparams));
+    return true;
+}
+
+bool SQHeapWriter::WriteBody(const SQObject &o)
+{
+    SQInteger i;
+    switch(type(o)) {
+    case OT_FUNCPROTO:
+        return WriteProto(_funcproto(o));
+    case OT_TABLE: {
+        SQObjectPtr key,val;
+        SQInteger ridx = 0;
+        _CHECK_IO(WriteRef(_table(o)->_delegate ? SQObjectPtr(_table(o)->_delegate) : SQObjectPtr()));
+        _CHECK_IO(WriteInt(_table(o)->CountUsed()));
+        while((ridx = _table(o)->Next(true,ridx,key,val)) != -1) {
+            _CHECK_IO(WriteRef(key));
+            _CHECK_IO(WriteRef(val));
+        }
+        }
+        break;
+    case OT_ARRAY:
+        for(i = 0; i < _array(o)->Size(); i++) _CHECK_IO(WriteRef(_array(o)->_values[i]));
+        break;
+    case OT_CLOSURE: {
+        SQClosure *c = _closure(o);
+        SQFunctionProto *f = c->_function;
+        _CHECK_IO(WriteRef(SQObjectPtr(c->_root)));
+        _CHECK_IO(WriteRef(c->_env ? SQObjectPtr(c->_env) : SQObjectPtr()));
+        _CHECK_IO(WriteRef(c->_base ? SQObjectPtr(c->_base) : SQObjectPtr()));
+        for(i = 0; i < f->_noutervalues; i++) _CHECK_IO(WriteRef(c->_outervalues[i]));
+        for(i = 0; i < f->_ndefaultparams; i++) _CHECK_IO(WriteRef(c->_defaultparams[i]));
+        }
+        break;
+    case OT_NATIVECLOSURE: {
+        SQNativeClosure *c = _nativeclosure(o);
+        _CHECK_IO(WriteRef(c->_env ? SQObjectPtr(c->_env) : SQObjectPtr()));
+        _CHECK_IO(WriteRef(c->_name));
+        _CHECK_IO(WriteInt(c->_nparamscheck));
+        _CHECK_IO(WriteInt(c->_typecheck.size()));
+        for(i = 0; i < (SQInteger)c->_typecheck.size(); i++) _CHECK_IO(WriteInt(c->_typecheck[i]));
+        for(i = 0; i < (SQInteger)c->_noutervalues; i++) _CHECK_IO(WriteRef(c->_outervalues[i]));
+        }
+        break;
+    case OT_OUTER:
+        _CHECK_IO(WriteRef(_outer(o)->_value));
+        break;
+    case OT_USERDATA:
+        _CHECK_IO(WriteRef(_userdata(o)->_delegate ? SQObjectPtr(_userdata(o)->_delegate) : SQObjectPtr()));
+        break;
+    case OT_CLASS: {
+        SQClass *c = _class(o);
+        _CHECK_IO(WriteRef(c->_base ? SQObjectPtr(c->_base) : SQObjectPtr()));
+        _CHECK_IO(WriteInt(c->_defaultvalues.size()));
+        for(i = 0; i < (SQInteger)c->_defaultvalues.size(); i++) {
+            _CHECK_IO(WriteRef(c->_defaultvalues[i].val));
+            _CHECK_IO(WriteRef(c->_defaultvalues[i].attrs));
+        }
+        _CHECK_IO(WriteInt(c->_methods.size()));
+        for(i = 0; i < (SQInteger)c->_methods.size(); i++) {
+            _CHECK_IO(WriteRef(c->_methods[i].val));
+            _CHECK_IO(WriteRef(c->_methods[i].attrs));
+        }
+        for(i = 0; i < MT_LAST; i++) _CHECK_IO(WriteRef(c->_metamethods[i]));
+        _CHECK_IO(WriteRef(c->_attributes));
+        _CHECK_IO(WriteInt(c->_locked ? 1 : 0));
+        _CHECK_IO(WriteInt(c->_constructoridx));
+        _CHECK_IO(WriteInt(c->_udsize));
+        }
+        break;
+    case OT_GENERATOR: {
+        SQGenerator *g = _generator(o);
+        if(g->_state == SQGenerator::eDead)
+            break;
+        //the instruction pointers are written as offsets in the code of the function
+        SQInstruction *code = _closure(g->_ci._closure)->_function->_instructions;
+        _CHECK_IO(WriteInt(g->_stack.size()));
+        for(i = 0; i < (SQInteger)g->_stack.size(); i++) _CHECK_IO(WriteRef(g->_stack[i]));
+        _CHECK_IO(WriteRef(g->_ci._closure));
+        _CHECK_IO(WriteInt(g->_ci._ip - code));
+        _CHECK_IO(WriteInt(g->_ci._etraps));
+        _CHECK_IO(WriteInt(g->_ci._target));
+        _CHECK_IO(WriteInt(g->_ci._ncalls));
+        _CHECK_IO(WriteInt(g->_ci._root));
+        _CHECK_IO(WriteInt(g->_ci._nvargs));
+        _CHECK_IO(WriteInt(g->_ci._stackvargv));
+        _CHECK_IO(WriteInt(g->_etraps.size()));
+        for(i = 0; i < (SQInteger)g->_etraps.size(); i++) {
+            SQExceptionTrap &et = g->_etraps[i];
+            _CHECK_IO(WriteInt(et._stackbase));
+            _CHECK_IO(WriteInt(et._stacksize));
+            _CHECK_IO(WriteInt(et._ip - code));
+            _CHECK_IO(WriteInt(et._extarget));
+        }
+        }
+        break;
+    case OT_INSTANCE:
+        for(i = 0; i < (SQInteger)_instance(o)->_class->_defaultvalues.size(); i++)
+            _CHECK_IO(WriteRef(_instance(o)->_values[i]));
+        break;
+    default: break;
+    }
+    return true;
+}
+
+bool SQHeapWriter::Write()
+{
+    SQSharedState *ss = _ss(_v);
+    sqvector<SQObject> children,sorted;
+    SQUnsignedInteger i;
+    SQInteger rank;
+    _CHECK_IO(Collect(_v->_roottable));
+    _CHECK_IO(Collect(ss->_registry));
+    _CHECK_IO(Collect(ss->_consts));
+    while(_pending.size()) {
+        SQObject o = _pending.back();
+        _pending.pop_back();
+        children.resize(0);
+        GetObjectChildren(o,children);
+        for(i = 0; i < children.size(); i++) _CHECK_IO(Collect(children[i]));
+    }
+    for(rank = 0; rank <= 4; rank++) {
+        for(i = 0; i < _objects.size(); i++) {
+            if(HeapRank(type(_objects[i])) == rank) {
+                _table(_ids)->NewSlot(_objects[i],(SQInteger)sorted.size());
+                sorted.push_back(_objects[i]);
+            }
+        }
+    }
+    _objects.copy(sorted);
+    _CHECK_IO(WriteTag(_v,_write,_up,SQ_HEAPSTREAM_HEAD));
+    _CHECK_IO(WriteTag(_v,_write,_up,sizeof(SQChar)));
+    _CHECK_IO(WriteTag(_v,_write,_up,sizeof(SQInteger)));
+    _CHECK_IO(WriteTag(_v,_write,_up,sizeof(SQFloat)));
+    _CHECK_IO(WriteInt(_permanents.size()));
+    for(i = 0; i < _permanents.size(); i++) {
+        SQObjectPtr key;
+        _perms->Get(_permanents[i],key);
+        _CHECK_IO(WriteObject(_v,_up,_write,key));
+    }
+    _CHECK_IO(WriteTag(_v,_write,_up,SQ_CLOSURESTREAM_PART));
+    _CHECK_IO(WriteInt(_objects.size()));
+    for(i = 0; i < _objects.size(); i++) _CHECK_IO(WriteShell(_objects[i]));
+    _CHECK_IO(WriteTag(_v,_write,_up,SQ_CLOSURESTREAM_PART));
+    for(i = 0; i < _objects.size(); i++) _CHECK_IO(WriteBody(_objects[i]));
+    _CHECK_IO(WriteTag(_v,_write,_up,SQ_CLOSURESTREAM_PART));
+    _CHECK_IO(WriteRef(_v->_roottable));
+    _CHECK_IO(WriteRef(ss->_registry));
+    _CHECK_IO(WriteRef(ss->_consts));
+    _CHECK_IO(WriteTag(_v,_write,_up,SQ_CLOSURESTREAM_TAIL));
+    return true;
+}
+
+bool WriteHeap(SQVM *v,SQTable *permanents,SQUserPointer up,SQWRITEFUNC write)
+{
+    SQHeapWriter w(v,permanents,up,write);
+    return w.Write();
+}
+
+struct SQHeapReader
+{
+    SQHeapReader(SQVM *v,SQTable *perms,SQUserPointer up,SQREADFUNC read);
+    bool Corrupted();
+    bool Read();
+    bool ReadInt(SQInteger &n) { return SafeRead(_v,_read,_up,&n,sizeof(n)); }
+    bool ReadSize(SQInteger &n);
+    bool ReadRef(SQObjectPtr &o);
+    bool ReadRef(SQObjectPtr &o,SQObjectType t,bool nullable);
+    bool ReadShell(SQObjectPtr &o);
+    bool ReadBody(SQObjectPtr &o);
+    bool ReadProto(SQFunctionProto *f);
+    SQVM *_v;
+    SQSharedState *_ss;
+    SQTable *_perms;
+    SQUserPointer _up;
+    SQREADFUNC _read;
+    SQObjectPtrVec _objects;
+    SQObjectPtrVec _permanents;
+};
+
+SQHeapReader::SQHeapReader(SQVM *v,SQTable *perms,SQUserPointer up,SQREADFUNC read)
+{
+    _v = v;
+    _ss = _ss(v);
+    _perms = perms;
+    _up = up;
+    _read = read;
+}
+
+bool SQHeapReader::Corrupted()
+{
+    _v->Raise_Error(_SC("invalid or corrupted heap image"));
+    return false;
+}
+
+bool SQHeapReader::ReadSize(SQInteger &n)
+{
+    _CHECK_IO(ReadInt(n));
+    if(n < 0) return Corrupted();
+    return true;
+}
+
+bool SQHeapReader::ReadRef(SQObjectPtr &o)
+{
+    SQUnsignedInteger32 t;
+    SQInteger n;
+    _CHECK_IO(SafeRead(_v,_read,_up,&t,sizeof(t)));
+    switch((SQObjectType)t) {
+    case OT_NULL:
+        o.Null();
+        break;
+    case OT_BOOL:
+        _CHECK_IO(ReadInt(n));
+        o = n ? true : false;
+        break;
+    case OT_INTEGER:
+        _CHECK_IO(ReadInt(n));
+        o = n;
+        break;
+    case OT_FLOAT: {
+        SQFloat f;
+        _CHECK_IO(SafeRead(_v,_read,_up,&f,sizeof(f)));
+        o = f;
+        }
+        break;
+    case OT_WEAKREF: {
+        SQObjectPtr target;
+        _CHECK_IO(ReadRef(target));
+        if(ISREFCOUNTED(type(target))) {
+            o = _refcounted(target)->GetWeakRef(type(target));
+        }
+        else {
+            //the object was already collected when the image was written
+            SQWeakRef *w;
+            sq_new(w,SQWeakRef);
+            w->_obj._type = OT_NULL;
+            w->_obj._unVal.pRefCounted = NULL;
+            o = w;
+        }
+        }
+        break;
+    default:
+        _CHECK_IO(ReadInt(n));
+        if(n < 0) {
+            if(-1 - n >= (SQInteger)_permanents.size()) return Corrupted();
+            o = _permanents[-1 - n];
+        }
+        else {
+            if(n >= (SQInteger)_objects.size()) return Corrupted();
+            o = _objects[n];
+        }
+        if(type(o) != (SQObjectType)t) return Corrupted();
+        break;
+    }
+    return true;
+}
+
+bool SQHeapReader::ReadRef(SQObjectPtr &o,SQObjectType t,bool nullable)
+{
+    _CHECK_IO(ReadRef(o));
+    if(type(o) != t && !(nullable && type(o) == OT_NULL)) return Corrupted();
+    return true;
+}
+
+bool SQHeapReader::ReadShell(SQObjectPtr &o)
+{
+    SQUnsignedInteger32 t;
+    SQObjectPtr tmp;
+    SQInteger n;
+    _CHECK_IO(SafeRead(_v,_read,_up,&t,sizeof(t)));
+    switch((SQObjectType)t) {
+    case OT_STRING:
+        _CHECK_IO(ReadSize(n));
+        _CHECK_IO(SafeRead(_v,_read,_up,_ss->GetScratchPad(sq_rsl(n)),sq_rsl(n)));
+        o = SQString::Create(_ss,_ss->GetScratchPad(-1),n);
+        break;
+    case OT_FUNCPROTO: {
+        SQInteger sizes[8];
+        for(n = 0; n < 8; n++) _CHECK_IO(ReadSize(sizes[n]));
+        o = SQFunctionProto::Create(_ss,sizes[0],sizes[1],sizes[2],sizes[3],sizes[4],sizes[5],sizes[6],sizes[7]);
+        }
+        break;
+    case OT_TABLE:
+        _CHECK_IO(ReadSize(n));
+        o = SQTable::Create(_ss,n);
+        break;
+    case OT_ARRAY:
+        _CHECK_IO(ReadSize(n));
+        o = SQArray::Create(_ss,n);
+        break;
+    case OT_CLOSURE:
+        //the root is set with the content of the closure, the image can hold other roots
+        _CHECK_IO(ReadRef(tmp,OT_FUNCPROTO,false));
+        o = SQClosure::Create(_ss,_funcproto(tmp),_table(_ss->_registry)->GetWeakRef(OT_TABLE));
+        break;
+    case OT_NATIVECLOSURE:
+        _CHECK_IO(ReadRef(tmp,OT_NATIVECLOSURE,false));
+        _CHECK_IO(ReadSize(n));
+        o = SQNativeClosure::Create(_ss,_nativeclosure(tmp)->_function,n);
+        break;
+    case OT_OUTER: {
+        SQOuter *outer = SQOuter::Create(_ss,NULL);
+        outer->_valptr = &outer->_value;
+        o = outer;
+        }
+        break;
+    case OT_USERDATA: {
+        _CHECK_IO(ReadSize(n));
+        SQUserData *ud = SQUserData::Create(_ss,n);
+        o = ud;
+        _CHECK_IO(SafeRead(_v,_read,_up,(SQUserPointer)sq_aligning(ud + 1),n));
+        }
+        break;
+    case OT_CLASS: {
+        //the members table is shared with the instances, it is bound right away
+        _CHECK_IO(ReadRef(tmp,OT_TABLE,false));
+        SQClass *c = SQClass::Create(_ss,NULL);
+        o = c;
+        __ObjRelease(c->_members);
+        c->_members = _table(tmp);
+        __ObjAddRef(c->_members);
+        }
+        break;
+    case OT_GENERATOR:
+        _CHECK_IO(ReadInt(n));
+        if(n != SQGenerator::eSuspended && n != SQGenerator::eDead) return Corrupted();
+        _CHECK_IO(ReadRef(tmp,OT_CLOSURE,n == SQGenerator::eDead));
+        o = SQGenerator::Create(_ss,type(tmp) == OT_CLOSURE ? _closure(tmp) : NULL);
+        _generator(o)->_state = (SQGenerator::SQGeneratorState)n;
+        break;
+    case OT_INSTANCE: {
+        SQInteger nvalues,udsize;
+        _CHECK_IO(ReadRef(tmp,OT_CLASS,false));
+        _CHECK_IO(ReadSize(nvalues));
+        _CHECK_IO(ReadSize(udsize));
+        SQClass *c = _class(tmp);
+        //the classes of the image are still empty, permanent ones must match the image
+        SQInteger nctor = c->_defaultvalues.size();
+        if(nctor && (nctor != nvalues || c->_udsize != udsize)) {
+            _v->Raise_Error(_SC("a permanent class does not match the heap image"));
+            return false;
+        }
+        SQInteger size = udsize + sq_aligning(sizeof(SQInstance) + (sizeof(SQObjectPtr)*(nvalues > 0 ? nvalues - 1 : 0)));
+        SQInstance *inst = (SQInstance *)SQ_MALLOC(size);
+        new (inst) SQInstance(_ss,c,size);
+        for(n = nctor; n < nvalues; n++) new (&inst->_values[n]) SQObjectPtr();
+        o = inst;
+        if(udsize) {
+            inst->_userpointer = ((unsigned char *)inst) + (size - udsize);
+            _CHECK_IO(SafeRead(_v,_read,_up,inst->_userpointer,udsize));
+        }
+        }
+        break;
+    default:
+        return Corrupted();
+    }
+    return true;
+}
+
+bool SQHeapReader::ReadProto(SQFunctionProto *f)
+{
+    SQInteger i,n;
+    _CHECK_IO(ReadRef(f->_sourcename));
+    _CHECK_IO(ReadRef(f->_name));
+    for(i = 0; i < f->_nliterals; i++) _CHECK_IO(ReadRef(f->_literals[i]));
+    for(i = 0; i < f->_nparameters; i++) _CHECK_IO(ReadRef(f->_parameters[i]));
+    for(i = 0; i < f->_noutervalues; i++) {
+        SQOuterVar &ov = f->_outervalues[i];
+        _CHECK_IO(ReadInt(n));
+        ov._type = (SQOuterType)n;
+        _CHECK_IO(ReadRef(ov._src));
+        _CHECK_IO(ReadRef(ov._name));
+    }
+    for(i = 0; i < f->_nlocalvarinfos; i++) {
+        SQLocalVarInfo &lvi = f->_localvarinfos[i];
+        _CHECK_IO(ReadRef(lvi._name));
+        _CHECK_IO(ReadInt(n)); lvi._pos = n;
+        _CHECK_IO(ReadInt(n)); lvi._start_op = n;
+        _CHECK_IO(ReadInt(n)); lvi._end_op = n;
+    }
+    _CHECK_IO(SafeRead(_v,_read,_up,f->_lineinfos,sizeof(SQLineInfo)*f->_nlineinfos));
+    _CHECK_IO(SafeRead(_v,_read,_up,f->_defaultparams,sizeof(SQInteger)*f->_ndefaultparams));
+    _CHECK_IO(SafeRead(_v,_read,_up,f->_instructions,sizeof(SQInstruction)*f->_ninstructions));
+    for(i = 0; i < f->_nfunctions; i++) _CHECK_IO(ReadRef(f->_functions[i],OT_FUNCPROTO,false));
+    _CHECK_IO(ReadInt(f->_stacksize));
+    _CHECK_IO(ReadInt(n));
+    f->_bgenerator = n ? true : false;
+    _CHECK_IO(ReadInt(f->_varparams));
+    return true;
+}
+
+bool SQHeapReader::ReadBody(SQObjectPtr &o)
+{
+    SQObjectPtr tmp,key;
+    SQInteger i,n;
+    switch(type(o)) {
+    case OT_FUNCPROTO:
+        return ReadProto(_funcproto(o));
+    case OT_TABLE:
+        _CHECK_IO(ReadRef(tmp,OT_TABLE,true));
+        if(type(tmp) == OT_TABLE && !_table(o)->SetDelegate(_table(tmp))) return Corrupted();
+        _CHECK_IO(ReadSize(n));
+        for(i = 0; i < n; i++) {
+            _CHECK_IO(ReadRef(key));
+            _CHECK_IO(ReadRef(tmp));
+            if(type(key) == OT_NULL) return Corrupted();
+            _table(o)->NewSlot(key,tmp);
+        }
+        break;
+    case OT_ARRAY:
+        for(i = 0; i < _array(o)->Size(); i++) _CHECK_IO(ReadRef(_array(o)->_values[i]));
+        break;
+    case OT_CLOSURE: {
+        SQClosure *c = _closure(o);
+        SQFunctionProto *f = c->_function;
+        _CHECK_IO(ReadRef(tmp,OT_WEAKREF,false));
+        c->SetRoot(_weakref(tmp));
+        _CHECK_IO(ReadRef(tmp,OT_WEAKREF,true));
+        if(type(tmp) == OT_WEAKREF) {
+            c->_env = _weakref(tmp);
+            __ObjAddRef(c->_env);
+        }
+        _CHECK_IO(ReadRef(tmp,OT_CLASS,true));
+        if(type(tmp) == OT_CLASS) {
+            c->_base = _class(tmp);
+            __ObjAddRef(c->_base);
+        }
+        for(i = 0; i < f->_noutervalues; i++) _CHECK_IO(ReadRef(c->_outervalues[i]));
+        for(i = 0; i < f->_ndefaultparams; i++) _CHECK_IO(ReadRef(c->_defaultparams[i]));
+        }
+        break;
+    case OT_NATIVECLOSURE: {
+        SQNativeClosure *c = _nativeclosure(o);
+        _CHECK_IO(ReadRef(tmp,OT_WEAKREF,true));
+        if(type(tmp) == OT_WEAKREF) {
+            c->_env = _weakref(tmp);
+            __ObjAddRef(c->_env);
+        }
+        _CHECK_IO(ReadRef(c->_name));
+        _CHECK_IO(ReadInt(c->_nparamscheck));
+        _CHECK_IO(ReadSize(n));
+        c->_typecheck.resize(n);
+        for(i = 0; i < n; i++) _CHECK_IO(ReadInt(c->_typecheck[i]));
+        for(i = 0; i < (SQInteger)c->_noutervalues; i++) _CHECK_IO(ReadRef(c->_outervalues[i]));
+        }
+        break;
+    case OT_OUTER:
+        _CHECK_IO(ReadRef(_outer(o)->_value));
+        break;
+    case OT_USERDATA:
+        _CHECK_IO(ReadRef(tmp,OT_TABLE,true));
+        if(type(tmp) == OT_TABLE) _userdata(o)->SetDelegate(_table(tmp));
+        break;
+    case OT_CLASS: {
+        SQClass *c = _class(o);
+        _CHECK_IO(ReadRef(tmp,OT_CLASS,true));
+        if(type(tmp) == OT_CLASS) {
+            c->_base = _class(tmp);
+            __ObjAddRef(c->_base);
+        }
+        _CHECK_IO(ReadSize(n));
+        c->_defaultvalues.resize(n);
+        for(i = 0; i < n; i++) {
+            _CHECK_IO(ReadRef(c->_defaultvalues[i].val));
+            _CHECK_IO(ReadRef(c->_defaultvalues[i].attrs));
+        }
+        _CHECK_IO(ReadSize(n));
+        c->_methods.resize(n);
+        for(i = 0; i < n; i++) {
+            _CHECK_IO(ReadRef(c->_methods[i].val));
+            _CHECK_IO(ReadRef(c->_methods[i].attrs));
+        }
+        for(i = 0; i < MT_LAST; i++) _CHECK_IO(ReadRef(c->_metamethods[i]));
+        _CHECK_IO(ReadRef(c->_attributes));
+        _CHECK_IO(ReadInt(n));
+        c->_locked = n ? true : false;
+        _CHECK_IO(ReadInt(c->_constructoridx));
+        _CHECK_IO(ReadSize(c->_udsize));
+        }
+        break;
+    case OT_GENERATOR: {
+        SQGenerator *g = _generator(o);
+        if(g->_state == SQGenerator::eDead)
+            break;
+        _CHECK_IO(ReadSize(n));
+        g->_stack.resize(n);
+        for(i = 0; i < n; i++) _CHECK_IO(ReadRef(g->_stack[i]));
+        _CHECK_IO(ReadRef(g->_ci._closure,OT_CLOSURE,false));
+        SQFunctionProto *f = _closure(g->_ci._closure)->_function;
+        _CHECK_IO(ReadInt(n));
+        if(n < 0 || n > f->_ninstructions) return Corrupted();
+        g->_ci._ip = f->_instructions + n;
+        g->_ci._literals = f->_literals;
+        g->_ci._generator = NULL;
+        g->_ci._prevstkbase = 0;
+        g->_ci._prevtop = 0;
+        _CHECK_IO(ReadInt(n)); g->_ci._etraps = (SQInt32)n;
+        _CHECK_IO(ReadInt(n)); g->_ci._target = (SQInt32)n;
+        _CHECK_IO(ReadInt(n)); g->_ci._ncalls = (SQInt32)n;
+        _CHECK_IO(ReadInt(n)); g->_ci._root = (SQBool)n;
+        _CHECK_IO(ReadInt(n)); g->_ci._nvargs = (SQInt32)n;
+        _CHECK_IO(ReadInt(n)); g->_ci._stackvargv = (SQBool)n;
+        _CHECK_IO(ReadSize(n));
+        if(n != g->_ci._etraps) return Corrupted();
+        for(i = 0; i < n; i++) {
+            SQInteger stackbase,stacksize,ip,extarget;
+            _CHECK_IO(ReadInt(stackbase));
+            _CHECK_IO(ReadInt(stacksize));
+            _CHECK_IO(ReadInt(ip));
+            _CHECK_IO(ReadInt(extarget));
+            if(ip < 0 || ip > f->_ninstructions) return Corrupted();
+            g->_etraps.push_back(SQExceptionTrap(stacksize,stackbase,f->_instructions + ip,extarget));
+        }
+        }
+        break;
+    case OT_INSTANCE: {
+        SQInstance *inst = _instance(o);
+        for(i = 0; i < (SQInteger)inst->_class->_defaultvalues.size(); i++) _CHECK_IO(ReadRef(inst->_values[i]));
+        }
+        break;
+    default: break;
+    }
+    return true;
+}
+
+bool SQHeapReader::Read()
+{
+    SQObjectPtr root,registry,consts;
+    SQInteger i,n;
+    _CHECK_IO(CheckHeapTag(_v,_read,_up,SQ_HEAPSTREAM_HEAD));
+    _CHECK_IO(CheckHeapTag(_v,_read,_up,sizeof(SQChar)));
+    _CHECK_IO(CheckHeapTag(_v,_read,_up,sizeof(SQInteger)));
+    _CHECK_IO(CheckHeapTag(_v,_read,_up,sizeof(SQFloat)));
+    _CHECK_IO(ReadSize(n));
+    _permanents.resize(n);
+    for(i = 0; i < n; i++) {
+        SQObjectPtr key;
+        _CHECK_IO(ReadObject(_v,_up,_read,key));
+        if(!_perms->Get(key,_permanents[i])) {
+            _v->Raise_Error(_SC("the permanent '%s' does not exist"),type(key) == OT_STRING ? _stringval(key) : GetTypeName(key));
+            return false;
+        }
+    }
+    _CHECK_IO(CheckHeapTag(_v,_read,_up,SQ_CLOSURESTREAM_PART));
+    _CHECK_IO(ReadSize(n));
+    _objects.resize(n);
+    for(i = 0; i < n; i++) _CHECK_IO(ReadShell(_objects[i]));
+    _CHECK_IO(CheckHeapTag(_v,_read,_up,SQ_CLOSURESTREAM_PART));
+    for(i = 0; i < n; i++) _CHECK_IO(ReadBody(_objects[i]));
+    _CHECK_IO(CheckHeapTag(_v,_read,_up,SQ_CLOSURESTREAM_PART));
+    _CHECK_IO(ReadRef(root,OT_TABLE,false));
+    _CHECK_IO(ReadRef(registry,OT_TABLE,false));
+    _CHECK_IO(ReadRef(consts,OT_TABLE,false));
+    _CHECK_IO(CheckHeapTag(_v,_read,_up,SQ_CLOSURESTREAM_TAIL));
+    _v->_roottable = root;
+    _ss->_registry = registry;
+    _ss->_consts = consts;
+    return true;
+}
+
+bool ReadHeap(SQVM *v,SQTable *permanents,SQUserPointer up,SQREADFUNC read)
+{
+    SQHeapReader r(v,permanents,up,read);
+    return r.Read();
+}
+
+static void CollectPermanents(SQSharedState *ss,SQTable *perms,SQTable *seen,SQTable *t,sqvector<SQChar> &path,bool byname)
+{
+    SQObjectPtr key,val,tmp;
+    SQInteger ridx = 0, len = path.size();
+    while((ridx = t->Next(false,ridx,key,val)) != -1) {
+        if(type(key) != OT_STRING || seen->Get(val,tmp))
+            continue;
+        switch(type(val)) {
+        case OT_TABLE: case OT_NATIVECLOSURE: case OT_CLASS: case OT_USERDATA:
+        case OT_INSTANCE: case OT_THREAD: case OT_USERPOINTER:
+            break;
+        default:
+            continue;
+        }
+        seen->NewSlot(val,true);
+        path.resize(len);
+        if(len) path.push_back(_SC('.'));
+        for(SQInteger i = 0; i < _string(key)->_len; i++) path.push_back(_stringval(key)[i]);
+        if(type(val) == OT_TABLE) {
+            CollectPermanents(ss,perms,seen,_table(val),path,byname);
+            continue;
+        }
+        SQObjectPtr name = SQString::Create(ss,path._vals,path.size());
+        if(byname) perms->NewSlot(name,val);
+        else perms->NewSlot(val,name);
+    }
+    path.resize(len);
+}
+
+void CollectPermanents(SQVM *v,SQTable *permanents,bool byname)
+{
+    //the native objects found through the tables of the root table and of the registry
+    //are keyed by their path, like "print" or "@registry.std_stream"
+    SQSharedState *ss = _ss(v);
+    SQObjectPtr seen = SQTable::Create(ss,0);
+    sqvector<SQChar> path;
+    const SQChar *registry = _SC("@registry");
+    _table(seen)->NewSlot(ss->_registry,true);
+    if(type(v->_roottable) == OT_TABLE) {
+        _table(seen)->NewSlot(v->_roottable,true);
+        CollectPermanents(ss,permanents,_table(seen),_table(v->_roottable),path,byname);
+    }
+    for(SQInteger i = 0; registry[i]; i++) path.push_back(registry[i]);
+    CollectPermanents(ss,permanents,_table(seen),_table(ss->_registry),path,byname);
+}
+
 #ifndef NO_GARBAGE_COLLECTOR
 
 #define START_MARK()    if(!(_uiRef&MARK_FLAG)){ \
@@ -634,6 +2399,7 @@ void SQFunctionProto::Mark(SQCollectable **chain)
     START_MARK()
         for(SQInteger i = 0; i < _nliterals; i++) SQSharedState::MarkObject(_literals[i], chain);
         for(SQInteger k = 0; k < _nfunctions; k++) SQSharedState::MarkObject(_functions[k], chain);
+        SQSharedState::MarkObject(_body, chain);
     END_MARK()
 }
 
@@ -13,6 +13,8 @@
 #define SQ_CLOSURESTREAM_HEAD (('S'<<24)|('Q'<<16)|('I'<<8)|('R'))
 #define SQ_CLOSURESTREAM_PART (('P'<<24)|('A'<<16)|('R'<<8)|('T'))
 #define SQ_CLOSURESTREAM_TAIL (('T'<<24)|('A'<<16)|('I'<<8)|('L'))
+#define SQ_BYTECODESTREAM_HEAD (('S'<<24)|('Q'<<16)|('B'<<8)|('C'))
+#define SQ_BYTECODE_VERSION 2
 
 struct SQSharedState;
 
@@ -84,10 +86,15 @@ enum SQMetaMethod{
 
 #define MINPOWER2 4
 
+struct SQFrozenData;
+
 struct SQRefCounted
 {
     SQUnsignedInteger _uiRef;
-    struct SQWeakRef *_weakref;
+    union {
+        struct SQWeakRef *_weakref;
+        SQFrozenData *_frozendata; //the graph of a frozen object, whose weak references are never cached
+    };
     SQRefCounted() { _uiRef = 0; _weakref = NULL; }
     virtual ~SQRefCounted();
     SQWeakRef *GetWeakRef(SQObjectType type);
@@ -105,31 +112,53 @@ struct SQWeakRef : SQRefCounted
 
 struct SQObjectPtr;
 
+//frozen objects are immortal and shared between states, their refcount is never written
+#define SQ_IMMORTAL_FLAG 0x40000000
+#define _isimmortal(p) ((p)->_uiRef&SQ_IMMORTAL_FLAG)
+//sealed template objects are immortal too, but their strings are interned in the states spawned from the template
+#define SQ_TEMPLATE_FLAG 0x20000000
+#define _istemplate(p) ((p)->_uiRef&SQ_TEMPLATE_FLAG)
+
+//the references to a frozen object are counted, atomically, on the whole graph
+#define _isfrozengraph(p) (((p)->_uiRef&(SQ_IMMORTAL_FLAG|SQ_TEMPLATE_FLAG)) == SQ_IMMORTAL_FLAG && (p)->_frozendata)
+void ImmortalAddRef(SQRefCounted *p);
+void ImmortalRelease(SQRefCounted *p);
+
 #define __AddRef(type,unval) if(ISREFCOUNTED(type)) \
         { \
-            unval.pRefCounted->_uiRef++; \
+            if(!_isimmortal(unval.pRefCounted)) unval.pRefCounted->_uiRef++; \
+            else ImmortalAddRef(unval.pRefCounted); \
         }
 
-#define __Release(type,unval) if(ISREFCOUNTED(type) && ((--unval.pRefCounted->_uiRef)==0))  \
+#define __Release(type,unval) if(ISREFCOUNTED(type)) \
         {   \
-            unval.pRefCounted->Release();   \
+            if(!_isimmortal(unval.pRefCounted)) { \
+                if((--unval.pRefCounted->_uiRef)==0) unval.pRefCounted->Release(); \
+            } \
+            else ImmortalRelease(unval.pRefCounted); \
         }
 
 #define __ObjRelease(obj) { \
     if((obj)) { \
-        (obj)->_uiRef--; \
-        if((obj)->_uiRef == 0) \
-            (obj)->Release(); \
+        if(!_isimmortal(obj)) { \
+            (obj)->_uiRef--; \
+            if((obj)->_uiRef == 0) \
+                (obj)->Release(); \
+        } \
+        else ImmortalRelease(obj); \
         (obj) = NULL;   \
     } \
 }
 
 #define __ObjAddRef(obj) { \
-    (obj)->_uiRef++; \
+    if(!_isimmortal(obj)) (obj)->_uiRef++; \
+    else ImmortalAddRef(obj); \
 }
 
 #define type(obj) ((obj)._type)
 #define is_delegable(t) (type(t)&SQOBJECT_DELEGABLE)
+#define is_frozen(o) (ISREFCOUNTED(type(o)) && _isimmortal((o)._unVal.pRefCounted))
+#define is_frozenstring(o) (type(o) == OT_STRING && ((o)._unVal.pString->_uiRef&(SQ_IMMORTAL_FLAG|SQ_TEMPLATE_FLAG)) == SQ_IMMORTAL_FLAG)
 #define raw_type(obj) _RAW_TYPE((obj)._type)
 
 #define _integer(obj) ((obj)._unVal.nInteger)
@@ -172,7 +201,7 @@ struct SQObjectPtr;
         _type=type; \
         _unVal.sym = x; \
         assert(_unVal.pTable); \
-        _unVal.pRefCounted->_uiRef++; \
+        __ObjAddRef(_unVal.pRefCounted); \
     } \
     inline SQObjectPtr& operator=(_class *x) \
     {  \
@@ -183,7 +212,7 @@ struct SQObjectPtr;
         _type = type; \
         SQ_REFOBJECT_INIT() \
         _unVal.sym = x; \
-        _unVal.pRefCounted->_uiRef++; \
+        __ObjAddRef(_unVal.pRefCounted); \
         __Release(tOldType,unOldVal); \
         return *this; \
     }
@@ -348,6 +377,11 @@ typedef sqvector<SQObjectPtr> SQObjectPtrVec;
 typedef sqvector<SQInteger> SQIntVec;
 const SQChar *GetTypeName(const SQObjectPtr &obj1);
 const SQChar *IdType2Name(SQObjectType type);
+void GetObjectChildren(const SQObject &o,sqvector<SQObject> &children);
+void CollectPermanents(SQVM *v,SQTable *permanents,bool byname);
+bool WriteHeap(SQVM *v,SQTable *permanents,SQUserPointer up,SQWRITEFUNC write);
+bool ReadHeap(SQVM *v,SQTable *permanents,SQUserPointer up,SQREADFUNC read);
+bool SafeWrite(HSQUIRRELVM v,SQWRITEFUNC write,SQUserPointer up,const void *src,SQInteger size);
 
 
 
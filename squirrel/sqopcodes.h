@@ -99,9 +99,30 @@ enum SQOpcode
     _OP_THROW=              0x39,
     _OP_NEWSLOTA=           0x3A,
     _OP_GETBASE=            0x3B,
-    _OP_CLOSE=              0x3C
+    _OP_CLOSE=              0x3C,
+    _OP_VARGC=              0x3D,
+    _OP_GETVARG=            0x3E,
+    _OP_VARGV=              0x3F,
+    //superinstructions, the most frequent adjacent pairs of a training corpus.
+    //only the first instruction of the pair is replaced, the handler
+    //executes the second one too when its operands allow a fast path
+    _OP_LOADINT_JCMP=       0x40,
+    _OP_LOADINT_ADD=        0x41,
+    _OP_LOADINT_SUB=        0x42,
+    _OP_PINCL_JMP=          0x43,
+    _OP_PREPCALLK_CALL=     0x44,
+    //patched over the first instruction of a line by sq_setbreakpoint,
+    //the original opcode is kept by the shared state
+    _OP_BREAK=              0x45
 };
 
+#define SQ_NUM_OPCODES (_OP_BREAK+1)
+
+//SQ_OPCODE_CYCLES implies SQ_OPCODE_STATS
+#if defined(SQ_OPCODE_CYCLES) && !defined(SQ_OPCODE_STATS)
+#define SQ_OPCODE_STATS
+#endif
+
 struct SQInstructionDesc {
     const SQChar *name;
 };
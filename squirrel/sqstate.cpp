@@ -21,6 +21,25 @@ SQSharedState::SQSharedState()
     _notifyallexceptions = false;
     _foreignptr = NULL;
     _releasehook = NULL;
+    _template = NULL;
+    _bytecodeimages = 0;
+    _lazybodies = 0;
+    _lazycompilation = false;
+    _samplepending = 0;
+    _runningvm = NULL;
+    _samplehook = NULL;
+    _samplehookup = NULL;
+    _nextbreakpointid = 1;
+    _breakhook = NULL;
+    _breakhookup = NULL;
+    _coverageenabled = false;
+    _tracing = false;
+    _tracecount = 0;
+    _tracestart = 0.0;
+#ifdef SQ_OPCODE_STATS
+    memset(_opcount,0,sizeof(_opcount));
+    memset(_opcycles,0,sizeof(_opcycles));
+#endif
 }
 
 #define newsysstring(s) {   \
@@ -98,6 +117,7 @@ void SQSharedState::Init()
 #endif
     _stringtable = (SQStringTable*)SQ_MALLOC(sizeof(SQStringTable));
     new (_stringtable) SQStringTable(this);
+    if(_template) _stringtable->_parent = _ss(_template->_vm)->_stringtable;
     sq_new(_metamethods,SQObjectPtrVec);
     sq_new(_systemstrings,SQObjectPtrVec);
     sq_new(_types,SQObjectPtrVec);
@@ -142,6 +162,21 @@ void SQSharedState::Init()
     _constructoridx = SQString::Create(this,_SC("constructor"));
     _registry = SQTable::Create(this,0);
     _consts = SQTable::Create(this,0);
+    if(_template) {
+        //the default delegates of a template are sealed, they are shared as they are
+        SQSharedState *tss = _ss(_template->_vm);
+        _table_default_delegate = tss->_table_default_delegate;
+        _array_default_delegate = tss->_array_default_delegate;
+        _string_default_delegate = tss->_string_default_delegate;
+        _number_default_delegate = tss->_number_default_delegate;
+        _closure_default_delegate = tss->_closure_default_delegate;
+        _generator_default_delegate = tss->_generator_default_delegate;
+        _thread_default_delegate = tss->_thread_default_delegate;
+        _class_default_delegate = tss->_class_default_delegate;
+        _instance_default_delegate = tss->_instance_default_delegate;
+        _weakref_default_delegate = tss->_weakref_default_delegate;
+        return;
+    }
     _table_default_delegate = CreateDefaultDelegate(this,_table_default_delegate_funcz);
     _array_default_delegate = CreateDefaultDelegate(this,_array_default_delegate_funcz);
     _string_default_delegate = CreateDefaultDelegate(this,_string_default_delegate_funcz);
@@ -157,6 +192,13 @@ void SQSharedState::Init()
 SQSharedState::~SQSharedState()
 {
     if(_releasehook) { _releasehook(_foreignptr,0); _releasehook = NULL; }
+    //the functions released from now on don't need to flush their coverage
+    while(!_coverageprotos.empty()) {
+        SQFunctionProto *f = _coverageprotos.back();
+        SQ_FREE(f->_coverage,(f->_ninstructions + 7) / 8);
+        f->_coverage = NULL;
+        _coverageprotos.pop_back();
+    }
     _constructoridx.Null();
     _table(_registry)->Finalize();
     _table(_consts)->Finalize();
@@ -181,6 +223,10 @@ SQSharedState::~SQSharedState()
     _instance_default_delegate.Null();
     _weakref_default_delegate.Null();
     _refs_table.Finalize();
+    for(SQUnsignedInteger i = 0; i < _breakpoints.size(); i++) __ObjRelease(_breakpoints[i]._proto);
+    _breakpoints.resize(0);
+    _tracing = false;
+    _trace.resize(0);
 #ifndef NO_GARBAGE_COLLECTOR
     SQCollectable *t = _gc_chain;
     SQCollectable *nx = NULL;
@@ -201,14 +247,645 @@ SQSharedState::~SQSharedState()
         _gc_chain->Release();
     }
 #endif
+    for(SQUnsignedInteger i = 0; i < _coveragefiles.size(); i++) sq_delete(_coveragefiles[i],SQCoverageFile);
 
     sq_delete(_types,SQObjectPtrVec);
     sq_delete(_systemstrings,SQObjectPtrVec);
     sq_delete(_metamethods,SQObjectPtrVec);
     sq_delete(_stringtable,SQStringTable);
     if(_scratchpad)SQ_FREE(_scratchpad,_scratchpadsize);
+    if(_template) _template->Release();
+}
+
+
+//returns the opcode replaced by the breakpoint at ip, -1 if there is none
+SQInteger SQSharedState::GetBreakpoint(const SQInstruction *ip,SQInteger *id)
+{
+    for(SQUnsignedInteger i = 0; i < _breakpoints.size(); i++) {
+        SQBreakpoint &bp = _breakpoints[i];
+        if(bp._proto->_instructions + bp._op == ip) {
+            if(id) *id = bp._id;
+            return bp._origop;
+        }
+    }
+    return -1;
+}
+
+//the code of f without its breakpoints, copied in 'copy' only if it has any
+const SQInstruction *SQSharedState::GetOriginalCode(SQFunctionProto *f,SQInstructionVec &copy)
+{
+    for(SQUnsignedInteger i = 0; i < _breakpoints.size(); i++) {
+        SQBreakpoint &bp = _breakpoints[i];
+        if(bp._proto->_instructions != f->_instructions) continue;
+        if(copy.empty()) {
+            copy.resize(f->_ninstructions);
+            memcpy(copy._vals,f->_instructions,f->_ninstructions * sizeof(SQInstruction));
+        }
+        copy[bp._op].op = bp._origop;
+    }
+    return copy.empty() ? f->_instructions : copy._vals;
+}
+
+static SQString *FreezeString(SQString *s)
+{
+    SQString *t = (SQString *)SQ_MALLOC(sq_rsl(s->_len)+sizeof(SQString));
+    new (t) SQString;
+    t->_sharedstate = NULL;
+    memcpy(t->_val,s->_val,sq_rsl(s->_len + 1));
+    t->_len = s->_len;
+    t->_hash = s->_hash;
+    t->_next = NULL;
+    return t;
+}
+
+static bool FreezeObject(SQVM *v,SQFrozenData *fd,SQTable *done,const SQObjectPtr &o,SQObjectPtr &ret)
+{
+    switch(type(o)) {
+    case OT_NULL: case OT_BOOL: case OT_INTEGER: case OT_FLOAT:
+        ret = o;
+        return true;
+    case OT_STRING: case OT_TABLE: case OT_ARRAY:
+        break;
+    default:
+        v->Raise_Error(_SC("cannot freeze a %s"),GetTypeName(o));
+        return false;
+    }
+    //shared and cyclic references are frozen once
+    if(done->Get(o,ret)) return true;
+    switch(type(o)) {
+    case OT_STRING:
+        ret = FreezeString(_string(o));
+        fd->_objects.push_back(ret);
+        done->NewSlot(o,ret);
+        break;
+    case OT_TABLE: {
+        SQTable *t = SQTable::Create(_ss(v),_table(o)->CountUsed());
+        ret = t;
+        fd->_objects.push_back(ret);
+        done->NewSlot(o,ret);
+        SQObjectPtr key,val,fkey,fval;
+        SQInteger ridx = 0;
+        while((ridx = _table(o)->Next(false,ridx,key,val)) != -1) {
+            if(!FreezeObject(v,fd,done,key,fkey) || !FreezeObject(v,fd,done,val,fval))
+                return false;
+            t->NewSlot(fkey,fval);
+        }
+        }
+        break;
+    case OT_ARRAY: {
+        SQInteger size = _array(o)->Size();
+        SQArray *a = SQArray::Create(_ss(v),size);
+        ret = a;
+        fd->_objects.push_back(ret);
+        done->NewSlot(o,ret);
+        SQObjectPtr val,fval;
+        for(SQInteger i = 0; i < size; i++) {
+            _array(o)->Get(i,val);
+            if(!FreezeObject(v,fd,done,val,fval))
+                return false;
+            a->Set(i,fval);
+        }
+        }
+        break;
+    default: break;
+    }
+    return true;
+}
+
+SQFrozenData *SQFrozenData::Create(SQVM *v,const SQObjectPtr &o)
+{
+    SQFrozenData *fd;
+    sq_new(fd,SQFrozenData);
+    fd->_refcount = 1;
+    fd->_root._type = OT_NULL;
+    bool ok;
+    {
+        SQObjectPtr done = SQTable::Create(_ss(v),0);
+        SQObjectPtr root;
+        ok = FreezeObject(v,fd,_table(done),o,root);
+        fd->_root = root;
+        //detaches the new objects from the state, from now on refcounts and the GC ignore them
+        for(SQUnsignedInteger i = 0; i < fd->_objects.size(); i++) {
+            SQObject &obj = fd->_objects[i];
+#ifndef NO_GARBAGE_COLLECTOR
+            if(type(obj) != OT_STRING) {
+                SQCollectable *c = (SQCollectable *)_refcounted(obj);
+                SQCollectable::RemoveFromChain(&_ss(v)->_gc_chain,c);
+                c->_sharedstate = NULL;
+            }
+            _refcounted(obj)->_uiRef = SQ_IMMORTAL_FLAG|MARK_FLAG;
+#else
+            _refcounted(obj)->_uiRef = SQ_IMMORTAL_FLAG;
+#endif
+        }
+    }
+    if(!ok) {
+        fd->Release();
+        return NULL;
+    }
+    //from now on every reference to an object of the copy, from any state, is counted on fd
+    for(SQUnsignedInteger i = 0; i < fd->_objects.size(); i++)
+        _refcounted(fd->_objects[i])->_frozendata = fd;
+    return fd;
+}
+
+//sealed template objects and the objects of a copy being freed are not counted
+void ImmortalAddRef(SQRefCounted *p)
+{
+    if(_isfrozengraph(p)) p->_frozendata->AddRef();
+}
+
+void ImmortalRelease(SQRefCounted *p)
+{
+    if(_isfrozengraph(p)) p->_frozendata->Release();
+}
+
+void SQFrozenData::AddRef()
+{
+    sq_atomic_inc(&_refcount);
+}
+
+void SQFrozenData::Release()
+{
+    if(sq_atomic_dec(&_refcount) != 0)
+        return;
+    SQUnsignedInteger i, n = _objects.size();
+    //the references between the objects of the copy are not counted
+    for(i = 0; i < n; i++) _refcounted(_objects[i])->_frozendata = NULL;
+    //the objects only reference each other, they are emptied before any of them is freed
+    for(i = 0; i < n; i++) {
+        if(type(_objects[i]) == OT_TABLE) _table(_objects[i])->Finalize();
+        else if(type(_objects[i]) == OT_ARRAY) _array(_objects[i])->Finalize();
+    }
+    for(i = 0; i < n; i++) {
+        SQObject &obj = _objects[i];
+        if(type(obj) == OT_STRING) {
+            SQString *s = _string(obj);
+            SQInteger slen = s->_len;
+            s->~SQString();
+            SQ_FREE(s,sizeof(SQString) + sq_rsl(slen));
+        }
+        else {
+            _refcounted(obj)->Release();
+        }
+    }
+    SQFrozenData *fd = this;
+    sq_delete(fd,SQFrozenData);
+}
+
+#ifndef NO_GARBAGE_COLLECTOR
+#define SQ_SEALED_FLAGS (SQ_IMMORTAL_FLAG|SQ_TEMPLATE_FLAG|MARK_FLAG)
+#else
+#define SQ_SEALED_FLAGS (SQ_IMMORTAL_FLAG|SQ_TEMPLATE_FLAG)
+#endif
+
+static bool SealObject(SQVM *v,sqvector<SQRefCounted*> &sealed,sqvector<SQObject> &pending,const SQObject &o)
+{
+    if(!ISREFCOUNTED(type(o)) || _isimmortal(_refcounted(o)))
+        return true;
+    SQRELEASEHOOK hook = NULL;
+    switch(type(o)) {
+    case OT_GENERATOR: case OT_THREAD:
+        v->Raise_Error(_SC("a template cannot hold objects of type '%s'"),IdType2Name(type(o)));
+        return false;
+    case OT_OUTER:
+        if(_outer(o)->_valptr != &_outer(o)->_value) {
+            v->Raise_Error(_SC("a template cannot hold the free variables of a running function"));
+            return false;
+        }
+        break;
+    case OT_USERDATA: hook = _userdata(o)->_hook; break;
+    case OT_CLASS: hook = _class(o)->_hook; break;
+    case OT_INSTANCE: hook = _instance(o)->_hook; break;
+    default: break;
+    }
+    if(hook) {
+        //the native resource would be released by every VM spawned from the template
+        v->Raise_Error(_SC("a template cannot hold objects of type '%s' with a release hook"),IdType2Name(type(o)));
+        return false;
+    }
+    _refcounted(o)->_uiRef |= SQ_SEALED_FLAGS;
+    sealed.push_back(_refcounted(o));
+    pending.push_back(o);
+    return true;
+}
+
+void GetObjectChildren(const SQObject &o,sqvector<SQObject> &children)
+{
+    SQInteger i;
+    switch(type(o)) {
+    case OT_TABLE: {
+        SQObjectPtr key,val;
+        SQInteger ridx = 0;
+        if(_table(o)->_delegate) children.push_back(SQObjectPtr(_table(o)->_delegate));
+        while((ridx = _table(o)->Next(true,ridx,key,val)) != -1) {
+            children.push_back(key);
+            children.push_back(val);
+        }
+        }
+        break;
+    case OT_ARRAY:
+        for(i = 0; i < _array(o)->Size(); i++) children.push_back(_array(o)->_values[i]);
+        break;
+    case OT_CLOSURE: {
+        SQClosure *c = _closure(o);
+        SQFunctionProto *f = c->_function;
+        children.push_back(SQObjectPtr(f));
+        if(c->_env) children.push_back(SQObjectPtr(c->_env));
+        if(c->_root) children.push_back(SQObjectPtr(c->_root));
+        if(c->_base) children.push_back(SQObjectPtr(c->_base));
+        for(i = 0; i < f->_noutervalues; i++) children.push_back(c->_outervalues[i]);
+        for(i = 0; i < f->_ndefaultparams; i++) children.push_back(c->_defaultparams[i]);
+        }
+        break;
+    case OT_NATIVECLOSURE: {
+        SQNativeClosure *c = _nativeclosure(o);
+        if(c->_env) children.push_back(SQObjectPtr(c->_env));
+        children.push_back(c->_name);
+        for(i = 0; i < (SQInteger)c->_noutervalues; i++) children.push_back(c->_outervalues[i]);
+        }
+        break;
+    case OT_OUTER:
+        children.push_back(_outer(o)->_value);
+        break;
+    case OT_USERDATA:
+        if(_userdata(o)->_delegate) children.push_back(SQObjectPtr(_userdata(o)->_delegate));
+        break;
+    case OT_CLASS: {
+        SQClass *c = _class(o);
+        children.push_back(SQObjectPtr(c->_members));
+        if(c->_base) children.push_back(SQObjectPtr(c->_base));
+        for(i = 0; i < (SQInteger)c->_defaultvalues.size(); i++) {
+            children.push_back(c->_defaultvalues[i].val);
+            children.push_back(c->_defaultvalues[i].attrs);
+        }
+        for(i = 0; i < (SQInteger)c->_methods.size(); i++) {
+            children.push_back(c->_methods[i].val);
+            children.push_back(c->_methods[i].attrs);
+        }
+        for(i = 0; i < MT_LAST; i++) children.push_back(c->_metamethods[i]);
+        children.push_back(c->_attributes);
+        }
+        break;
+    case OT_INSTANCE: {
+        SQInstance *inst = _instance(o);
+        children.push_back(SQObjectPtr(inst->_class));
+        for(i = 0; i < (SQInteger)inst->_class->_defaultvalues.size(); i++) children.push_back(inst->_values[i]);
+        }
+        break;
+    case OT_GENERATOR: {
+        SQGenerator *g = _generator(o);
+        children.push_back(g->_closure);
+        children.push_back(g->_ci._closure);
+        for(i = 0; i < (SQInteger)g->_stack.size(); i++) children.push_back(g->_stack[i]);
+        }
+        break;
+    case OT_WEAKREF:
+        children.push_back(_weakref(o)->_obj);
+        break;
+    case OT_FUNCPROTO: {
+        SQFunctionProto *f = _funcproto(o);
+        children.push_back(f->_sourcename);
+        children.push_back(f->_name);
+        for(i = 0; i < f->_nliterals; i++) children.push_back(f->_literals[i]);
+        for(i = 0; i < f->_nparameters; i++) children.push_back(f->_parameters[i]);
+        for(i = 0; i < f->_nfunctions; i++) children.push_back(f->_functions[i]);
+        for(i = 0; i < f->_noutervalues; i++) {
+            children.push_back(f->_outervalues[i]._name);
+            children.push_back(f->_outervalues[i]._src);
+        }
+        for(i = 0; i < f->_nlocalvarinfos; i++) children.push_back(f->_localvarinfos[i]._name);
+        }
+        break;
+    default: break;
+    }
 }
 
+//a sealed prototype is shared by the spawned VMs and can't load its nested functions or
+//compile its body later. They are loaded before anything is sealed: the strings they hold could already be sealed
+//and a reference taken after sealing would not be counted
+static bool LoadReachableFunctions(SQVM *v)
+{
+    SQSharedState *ss = _ss(v);
+    SQObjectPtr visited = SQTable::Create(ss,0),tmp;
+    sqvector<SQObject> pending,children;
+    pending.push_back(v->_roottable);
+    pending.push_back(ss->_registry);
+    pending.push_back(ss->_consts);
+    pending.push_back(v->_errorhandler);
+    pending.push_back(v->_debughook_closure);
+    while(pending.size()) {
+        SQObject o = pending.back();
+        pending.pop_back();
+        if(!ISREFCOUNTED(type(o)) || type(o) == OT_STRING || _table(visited)->Get(o,tmp))
+            continue;
+        _table(visited)->NewSlot(o,true);
+        if(type(o) == OT_FUNCPROTO && !_funcproto(o)->LoadFunctions(v))
+            return false;
+        children.resize(0);
+        GetObjectChildren(o,children);
+        for(SQUnsignedInteger i = 0; i < children.size(); i++) pending.push_back(children[i]);
+    }
+    return true;
+}
+
+SQVMTemplate *SQVMTemplate::Create(SQVM *v)
+{
+    if((_ss(v)->_bytecodeimages || _ss(v)->_lazybodies) && !LoadReachableFunctions(v))
+        return NULL;
+    SQVMTemplate *tpl;
+    sq_new(tpl,SQVMTemplate);
+    tpl->_refcount = 1;
+    tpl->_vm = v;
+    SQSharedState *ss = _ss(v);
+    sqvector<SQObject> pending,children;
+    //everything reachable from the roots of the VM becomes immortal; the pointers collected
+    //in children are plain copies so the refcounts are left exactly as they were
+    bool ok = SealObject(v,tpl->_sealed,pending,v->_roottable)
+        && SealObject(v,tpl->_sealed,pending,ss->_registry)
+        && SealObject(v,tpl->_sealed,pending,ss->_consts)
+        && SealObject(v,tpl->_sealed,pending,v->_errorhandler)
+        && SealObject(v,tpl->_sealed,pending,v->_debughook_closure)
+        && SealObject(v,tpl->_sealed,pending,ss->_table_default_delegate)
+        && SealObject(v,tpl->_sealed,pending,ss->_array_default_delegate)
+        && SealObject(v,tpl->_sealed,pending,ss->_string_default_delegate)
+        && SealObject(v,tpl->_sealed,pending,ss->_number_default_delegate)
+        && SealObject(v,tpl->_sealed,pending,ss->_closure_default_delegate)
+        && SealObject(v,tpl->_sealed,pending,ss->_generator_default_delegate)
+        && SealObject(v,tpl->_sealed,pending,ss->_thread_default_delegate)
+        && SealObject(v,tpl->_sealed,pending,ss->_class_default_delegate)
+        && SealObject(v,tpl->_sealed,pending,ss->_instance_default_delegate)
+        && SealObject(v,tpl->_sealed,pending,ss->_weakref_default_delegate);
+    while(ok && pending.size()) {
+        SQObject o = pending.back();
+        pending.pop_back();
+        children.resize(0);
+        GetObjectChildren(o,children);
+        for(SQUnsignedInteger i = 0; ok && i < children.size(); i++)
+            ok = SealObject(v,tpl->_sealed,pending,children[i]);
+    }
+    if(!ok) {
+        for(SQUnsignedInteger i = 0; i < tpl->_sealed.size(); i++) tpl->_sealed[i]->_uiRef &= ~SQ_SEALED_FLAGS;
+        sq_delete(tpl,SQVMTemplate);
+        return NULL;
+    }
+    return tpl;
+}
+
+static bool IsSharedSealed(const SQObject &o)
+{
+    if(!ISREFCOUNTED(type(o)) || !_istemplate(_refcounted(o)) || type(o) == OT_STRING || type(o) == OT_FUNCPROTO)
+        return true;
+    if(type(o) == OT_NATIVECLOSURE) {
+        //a native function is only shared if it has no state of its own that a VM could modify
+        SQNativeClosure *c = _nativeclosure(o);
+        if(c->_env) return false;
+        for(SQUnsignedInteger i = 0; i < c->_noutervalues; i++) {
+            const SQObject &val = c->_outervalues[i];
+            if(ISREFCOUNTED(type(val)) && _istemplate(_refcounted(val)) && type(val) != OT_STRING && type(val) != OT_FUNCPROTO)
+                return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+static void CopySealedObject(SQSharedState *ss,SQTable *memo,sqvector<SQObject> &pending,const SQObject &o,SQObjectPtr &ret)
+{
+    if(IsSharedSealed(o)) {
+        //strings, function prototypes, frozen data and plain native functions are shared
+        ret = o;
+        return;
+    }
+    if(type(o) == OT_WEAKREF) {
+        SQObject &target = _weakref(o)->_obj;
+        if(ISREFCOUNTED(type(target))) {
+            SQObjectPtr t;
+            CopySealedObject(ss,memo,pending,target,t);
+            ret = _refcounted(t)->GetWeakRef(type(t));
+        }
+        else {
+            SQWeakRef *w;
+            sq_new(w,SQWeakRef);
+            w->_obj._type = OT_NULL;
+            w->_obj._unVal.pRefCounted = NULL;
+            ret = w;
+        }
+        return;
+    }
+    if(memo->Get(o,ret))
+        return;
+    //creates an empty copy, filled once it is taken from the pending list
+    switch(type(o)) {
+    case OT_TABLE:
+        ret = SQTable::Create(ss,_table(o)->CountUsed());
+        break;
+    case OT_ARRAY:
+        ret = SQArray::Create(ss,_array(o)->Size());
+        break;
+    case OT_CLOSURE: {
+        SQObjectPtr root;
+        CopySealedObject(ss,memo,pending,SQObjectPtr(_closure(o)->_root),root);
+        ret = SQClosure::Create(ss,_closure(o)->_function,_weakref(root));
+        }
+        break;
+    case OT_NATIVECLOSURE:
+        ret = SQNativeClosure::Create(ss,_nativeclosure(o)->_function,_nativeclosure(o)->_noutervalues);
+        break;
+    case OT_OUTER: {
+        SQOuter *outer = SQOuter::Create(ss,NULL);
+        outer->_valptr = &outer->_value;
+        ret = outer;
+        }
+        break;
+    case OT_USERDATA: {
+        SQUserData *src = _userdata(o);
+        SQUserData *ud = SQUserData::Create(ss,src->_size);
+        memcpy((SQUserPointer)sq_aligning(ud + 1),(SQUserPointer)sq_aligning(src + 1),src->_size);
+        ud->_typetag = src->_typetag;
+        ret = ud;
+        }
+        break;
+    case OT_CLASS: {
+        //the members table is shared with the instances, it is bound right away
+        SQClass *c = SQClass::Create(ss,NULL);
+        SQObjectPtr members;
+        ret = c;
+        CopySealedObject(ss,memo,pending,SQObjectPtr(_class(o)->_members),members);
+        __ObjRelease(c->_members);
+        c->_members = _table(members);
+        __ObjAddRef(c->_members);
+        }
+        break;
+    case OT_INSTANCE: {
+        SQInstance *src = _instance(o);
+        SQObjectPtr cls;
+        CopySealedObject(ss,memo,pending,SQObjectPtr(src->_class),cls);
+        SQInteger size = src->_memsize;
+        SQInstance *inst = (SQInstance *)SQ_MALLOC(size);
+        new (inst) SQInstance(ss,src,size);
+        inst->_class = _class(cls);
+        __ObjAddRef(inst->_class);
+        inst->_delegate = inst->_class->_members;
+        SQInteger udsize = src->_class->_udsize;
+        if(udsize) {
+            inst->_userpointer = ((unsigned char *)inst) + (size - udsize);
+            memcpy(inst->_userpointer,src->_userpointer,udsize);
+        }
+        else {
+            inst->_userpointer = src->_userpointer;
+        }
+        ret = inst;
+        }
+        break;
+    default:
+        assert(0);
+        break;
+    }
+    memo->NewSlot(o,ret);
+    pending.push_back(o);
+}
+
+static void FillSealedObject(SQSharedState *ss,SQTable *memo,sqvector<SQObject> &pending,const SQObject &o)
+{
+    SQObjectPtr dst,tmp;
+    SQInteger i;
+    memo->Get(o,dst);
+    switch(type(o)) {
+    case OT_TABLE: {
+        SQObjectPtr key,val,ckey,cval;
+        SQInteger ridx = 0;
+        while((ridx = _table(o)->Next(true,ridx,key,val)) != -1) {
+            CopySealedObject(ss,memo,pending,key,ckey);
+            CopySealedObject(ss,memo,pending,val,cval);
+            _table(dst)->NewSlot(ckey,cval);
+        }
+        if(_table(o)->_delegate) {
+            CopySealedObject(ss,memo,pending,SQObjectPtr(_table(o)->_delegate),tmp);
+            _table(dst)->SetDelegate(_table(tmp));
+        }
+        }
+        break;
+    case OT_ARRAY:
+        for(i = 0; i < _array(o)->Size(); i++)
+            CopySealedObject(ss,memo,pending,_array(o)->_values[i],_array(dst)->_values[i]);
+        break;
+    case OT_CLOSURE: {
+        SQClosure *src = _closure(o), *c = _closure(dst);
+        SQFunctionProto *f = src->_function;
+        if(src->_env) {
+            CopySealedObject(ss,memo,pending,SQObjectPtr(src->_env),tmp);
+            c->_env = _weakref(tmp);
+            __ObjAddRef(c->_env);
+        }
+        if(src->_base) {
+            CopySealedObject(ss,memo,pending,SQObjectPtr(src->_base),tmp);
+            c->_base = _class(tmp);
+            __ObjAddRef(c->_base);
+        }
+        for(i = 0; i < f->_noutervalues; i++) CopySealedObject(ss,memo,pending,src->_outervalues[i],c->_outervalues[i]);
+        for(i = 0; i < f->_ndefaultparams; i++) CopySealedObject(ss,memo,pending,src->_defaultparams[i],c->_defaultparams[i]);
+        }
+        break;
+    case OT_NATIVECLOSURE: {
+        SQNativeClosure *src = _nativeclosure(o), *c = _nativeclosure(dst);
+        if(src->_env) {
+            CopySealedObject(ss,memo,pending,SQObjectPtr(src->_env),tmp);
+            c->_env = _weakref(tmp);
+            __ObjAddRef(c->_env);
+        }
+        c->_name = src->_name;
+        c->_typecheck.copy(src->_typecheck);
+        c->_nparamscheck = src->_nparamscheck;
+        for(i = 0; i < (SQInteger)src->_noutervalues; i++) CopySealedObject(ss,memo,pending,src->_outervalues[i],c->_outervalues[i]);
+        }
+        break;
+    case OT_OUTER:
+        CopySealedObject(ss,memo,pending,_outer(o)->_value,_outer(dst)->_value);
+        break;
+    case OT_USERDATA:
+        if(_userdata(o)->_delegate) {
+            CopySealedObject(ss,memo,pending,SQObjectPtr(_userdata(o)->_delegate),tmp);
+            _userdata(dst)->SetDelegate(_table(tmp));
+        }
+        break;
+    case OT_CLASS: {
+        SQClass *src = _class(o), *c = _class(dst);
+        if(src->_base) {
+            CopySealedObject(ss,memo,pending,SQObjectPtr(src->_base),tmp);
+            c->_base = _class(tmp);
+            __ObjAddRef(c->_base);
+        }
+        c->_defaultvalues.resize(src->_defaultvalues.size());
+        for(i = 0; i < (SQInteger)src->_defaultvalues.size(); i++) {
+            CopySealedObject(ss,memo,pending,src->_defaultvalues[i].val,c->_defaultvalues[i].val);
+            CopySealedObject(ss,memo,pending,src->_defaultvalues[i].attrs,c->_defaultvalues[i].attrs);
+        }
+        c->_methods.resize(src->_methods.size());
+        for(i = 0; i < (SQInteger)src->_methods.size(); i++) {
+            CopySealedObject(ss,memo,pending,src->_methods[i].val,c->_methods[i].val);
+            CopySealedObject(ss,memo,pending,src->_methods[i].attrs,c->_methods[i].attrs);
+        }
+        for(i = 0; i < MT_LAST; i++) CopySealedObject(ss,memo,pending,src->_metamethods[i],c->_metamethods[i]);
+        CopySealedObject(ss,memo,pending,src->_attributes,c->_attributes);
+        c->_typetag = src->_typetag;
+        c->_locked = src->_locked;
+        c->_constructoridx = src->_constructoridx;
+        c->_udsize = src->_udsize;
+        }
+        break;
+    case OT_INSTANCE: {
+        SQInstance *src = _instance(o), *inst = _instance(dst);
+        for(i = 0; i < (SQInteger)src->_class->_defaultvalues.size(); i++)
+            CopySealedObject(ss,memo,pending,src->_values[i],inst->_values[i]);
+        }
+        break;
+    default: break;
+    }
+}
+
+void SQVMTemplate::Instantiate(SQVM *v)
+{
+    SQSharedState *ss = _ss(v), *tss = _ss(_vm);
+    ss->_printfunc = tss->_printfunc;
+    ss->_errorfunc = tss->_errorfunc;
+    ss->_compilererrorhandler = tss->_compilererrorhandler;
+    ss->_debuginfo = tss->_debuginfo;
+    ss->_notifyallexceptions = tss->_notifyallexceptions;
+    v->_debughook = _vm->_debughook;
+    v->_debughook_native = _vm->_debughook_native;
+    //the sealed heap is only read, any number of VMs can be spawned from it at once
+    SQObjectPtr memo = SQTable::Create(ss,0);
+    sqvector<SQObject> pending;
+    CopySealedObject(ss,_table(memo),pending,_vm->_roottable,v->_roottable);
+    CopySealedObject(ss,_table(memo),pending,tss->_registry,ss->_registry);
+    CopySealedObject(ss,_table(memo),pending,tss->_consts,ss->_consts);
+    CopySealedObject(ss,_table(memo),pending,_vm->_errorhandler,v->_errorhandler);
+    CopySealedObject(ss,_table(memo),pending,_vm->_debughook_closure,v->_debughook_closure);
+    while(pending.size()) {
+        SQObject o = pending.back();
+        pending.pop_back();
+        FillSealedObject(ss,_table(memo),pending,o);
+    }
+}
+
+void SQVMTemplate::AddRef()
+{
+    sq_atomic_inc(&_refcount);
+}
+
+void SQVMTemplate::Release()
+{
+    if(sq_atomic_dec(&_refcount) != 0)
+        return;
+    //no VM spawned from the template is alive anymore, the sealed VM is closed as usual
+    for(SQUnsignedInteger i = 0; i < _sealed.size(); i++) _sealed[i]->_uiRef &= ~SQ_SEALED_FLAGS;
+    SQSharedState *ss = _ss(_vm);
+    _thread(ss->_root_vm)->Finalize();
+    sq_delete(ss,SQSharedState);
+    SQVMTemplate *tpl = this;
+    sq_delete(tpl,SQVMTemplate);
+}
 
 SQInteger SQSharedState::GetMetaMethodIdxByName(const SQObjectPtr &name)
 {
@@ -261,6 +938,7 @@ void SQSharedState::RunMark(SQVM* SQ_UNUSED_ARG(vm),SQCollectable **tchain)
     MarkObject(_class_default_delegate,tchain);
     MarkObject(_instance_default_delegate,tchain);
     MarkObject(_weakref_default_delegate,tchain);
+    for(SQUnsignedInteger i = 0; i < _breakpoints.size(); i++) _breakpoints[i]._proto->Mark(tchain);
 
 }
 
@@ -322,6 +1000,7 @@ SQInteger SQSharedState::CollectGarbage(SQVM *vm)
 {
     SQInteger n = 0;
     SQCollectable *tchain = NULL;
+    if(_tracing) TraceBegin(vm,SQ_TRACE_GC,SQString::Create(this,_SC("collectgarbage")),SQObjectPtr(),0);
 
     RunMark(vm,&tchain);
 
@@ -343,9 +1022,11 @@ SQInteger SQSharedState::CollectGarbage(SQVM *vm)
     t = tchain;
     while(t) {
         t->UnMark();
+        if(t->GetType() == OT_THREAD && ((SQVM *)t)->_lightweight) ((SQVM *)t)->ShrinkStack();
         t = t->_next;
     }
     _gc_chain = tchain;
+    if(_tracing) TraceEnd(vm,SQ_TRACE_GC);
 
     return n;
 }
@@ -421,6 +1102,15 @@ void RefTable::Mark(SQCollectable **chain)
 }
 #endif
 
+void RefTable::GetObjects(sqvector<SQObject> &objs)
+{
+    RefNode *nodes = (RefNode *)_nodes;
+    for(SQUnsignedInteger n = 0; n < _numofslots; n++) {
+        if(type(nodes->obj) != OT_NULL) objs.push_back(nodes->obj);
+        nodes++;
+    }
+}
+
 void RefTable::AddRef(SQObject &obj)
 {
     SQHash mainpos;
@@ -560,6 +1250,7 @@ void RefTable::AllocNodes(SQUnsignedInteger size)
 SQStringTable::SQStringTable(SQSharedState *ss)
 {
     _sharedstate = ss;
+    _parent = NULL;
     AllocNodes(4);
     _slotused = 0;
 }
@@ -581,12 +1272,20 @@ SQString *SQStringTable::Add(const SQChar *news,SQInteger len)
 {
     if(len<0)
         len = (SQInteger)scstrlen(news);
-    SQHash newhash = ::_hashstr(news,len);
+    return Add(news,len,::_hashstr(news,len));
+}
+
+//the hash must be _hashstr(news,len)
+SQString *SQStringTable::Add(const SQChar *news,SQInteger len,SQHash newhash)
+{
     SQHash h = newhash&(_numofslots-1);
-    SQString *s;
-    for (s = _strings[h]; s; s = s->_next){
-        if(s->_len == len && (!memcmp(news,s->_val,sq_rsl(len))))
-            return s; //found
+    SQString *s = Find(news,len,newhash);
+    if(s)
+        return s; //found
+    for(SQStringTable *p = _parent; p; p = p->_parent) {
+        //the strings sealed in a template are shared by the states spawned from it
+        if((s = p->Find(news,len,newhash)) && _istemplate(s))
+            return s;
     }
 
     SQString *t = (SQString *)SQ_MALLOC(sq_rsl(len)+sizeof(SQString));
@@ -604,6 +1303,15 @@ SQString *SQStringTable::Add(const SQChar *news,SQInteger len)
     return t;
 }
 
+SQString *SQStringTable::Find(const SQChar *news,SQInteger len,SQHash hash)
+{
+    for (SQString *s = _strings[hash&(_numofslots-1)]; s; s = s->_next){
+        if(s->_len == len && (!memcmp(news,s->_val,sq_rsl(len))))
+            return s;
+    }
+    return NULL;
+}
+
 void SQStringTable::Resize(SQInteger size)
 {
     SQInteger oldsize=_numofslots;
@@ -4,6 +4,7 @@
 
 #include "squtils.h"
 #include "sqobject.h"
+#include "sqopcodes.h"
 struct SQString;
 struct SQTable;
 //max number of character for a printed number
@@ -14,7 +15,10 @@ struct SQStringTable
     SQStringTable(SQSharedState*ss);
     ~SQStringTable();
     SQString *Add(const SQChar *,SQInteger len);
+    SQString *Add(const SQChar *,SQInteger len,SQHash hash);
     void Remove(SQString *);
+    SQString *Find(const SQChar *news,SQInteger len,SQHash hash);
+    SQStringTable *_parent; //the table of the template the state was spawned from
 private:
     void Resize(SQInteger size);
     void AllocNodes(SQInteger size);
@@ -39,6 +43,7 @@ struct RefTable {
     void Mark(SQCollectable **chain);
 #endif
     void Finalize();
+    void GetObjects(sqvector<SQObject> &objs);
 private:
     RefNode *Get(SQObject &obj,SQHash &mainpos,RefNode **prev,bool add);
     RefNode *Add(SQHash mainpos,SQObject &obj);
@@ -51,6 +56,69 @@ private:
     RefNode **_buckets;
 };
 
+//an instruction patched with _OP_BREAK
+struct SQBreakpoint {
+    SQInteger _id;
+    SQFunctionProto *_proto; //holds a reference to the patched function
+    SQInteger _op; //index of the instruction in _proto
+    unsigned char _origop;
+};
+typedef sqvector<SQBreakpoint> SQBreakpointVec;
+
+//the hits are kept in an array indexed by line
+#define SQ_COVERAGE_MAXLINE 0xFFFFFF
+
+//the hits of the lines of a source file, -1 for the lines without code
+struct SQCoverageFile {
+    SQObjectPtr _name;
+    sqvector<SQInteger> _hits;
+};
+
+enum SQTraceCategory {
+    SQ_TRACE_CALL,
+    SQ_TRACE_NATIVE,
+    SQ_TRACE_GC,
+    SQ_TRACE_COMPILE
+};
+
+//a begin or end event of the trace, the name and the source are only kept by the begin events
+struct SQTraceEvent {
+    double _time; //microseconds
+    SQVM *_thread;
+    SQObjectPtr _name;
+    SQObjectPtr _source;
+    SQInteger _line;
+    unsigned char _cat;
+    unsigned char _phase;
+};
+
+//a deeply immutable graph of tables, arrays and strings that belongs to no state;
+//its objects are immortal, so any number of states and threads can read them at once
+struct SQFrozenData
+{
+    static SQFrozenData *Create(SQVM *v,const SQObjectPtr &o);
+    void AddRef();
+    void Release();
+
+    long _refcount;
+    SQObject _root;
+    sqvector<SQObject> _objects;
+};
+
+//a VM sealed to be the image of new VMs; its heap is immortal and never modified again,
+//the VMs spawned from it share its strings and function prototypes and copy everything else
+struct SQVMTemplate
+{
+    static SQVMTemplate *Create(SQVM *v);
+    void Instantiate(SQVM *v);
+    void AddRef();
+    void Release();
+
+    long _refcount;
+    SQVM *_vm;
+    sqvector<SQRefCounted*> _sealed;
+};
+
 #define ADD_STRING(ss,str,len) ss->_stringtable->Add(str,len)
 #define REMOVE_STRING(ss,bstr) ss->_stringtable->Remove(bstr)
 
@@ -111,6 +179,41 @@ public:
     bool _notifyallexceptions;
     SQUserPointer _foreignptr;
     SQRELEASEHOOK _releasehook;
+    SQInteger _bytecodeimages; //bytecode images with functions not loaded yet
+    SQInteger _lazybodies; //function bodies not compiled yet
+    bool _lazycompilation;
+    //set by sq_requestsample, the VM calls _samplehook at the next call or loop back edge
+    volatile SQInt32 _samplepending;
+    //the innermost VM in Execute, the threads it runs spend its budget
+    SQVM *_runningvm;
+    SQSAMPLEHOOK _samplehook;
+    SQUserPointer _samplehookup;
+    SQBreakpointVec _breakpoints;
+    SQInteger _nextbreakpointid;
+    SQBREAKHOOK _breakhook;
+    SQUserPointer _breakhookup;
+    SQInteger GetBreakpoint(const SQInstruction *ip,SQInteger *id);
+    const SQInstruction *GetOriginalCode(SQFunctionProto *f,SQInstructionVec &copy);
+    //set by sq_enablecoverage, the functions that execute an _OP_LINE get a bitmap
+    bool _coverageenabled;
+    sqvector<SQFunctionProto*> _coverageprotos;
+    sqvector<SQCoverageFile*> _coveragefiles;
+    bool StartCoverage(SQFunctionProto *f);
+    void FlushCoverage(SQFunctionProto *f);
+    void ReleaseCoverage(SQFunctionProto *f);
+    SQCoverageFile *GetCoverageFile(const SQObjectPtr &name);
+    //set by sq_starttrace, _trace is a ring of the last events
+    bool _tracing;
+    sqvector<SQTraceEvent> _trace;
+    SQUnsignedInteger _tracecount;
+    double _tracestart;
+    void TraceBegin(SQVM *v,SQInteger cat,const SQObjectPtr &name,const SQObjectPtr &source,SQInteger line);
+    void TraceEnd(SQVM *v,SQInteger cat);
+#ifdef SQ_OPCODE_STATS
+    SQUnsignedInteger _opcount[SQ_NUM_OPCODES];
+    SQUnsignedInteger _opcycles[SQ_NUM_OPCODES];
+#endif
+    SQVMTemplate *_template;
 private:
     SQChar *_scratchpad;
     SQInteger _scratchpadsize;
@@ -17,6 +17,7 @@ struct SQString : public SQRefCounted
     ~SQString(){}
 public:
     static SQString *Create(SQSharedState *ss, const SQChar *, SQInteger len = -1 );
+    static SQString *Create(SQSharedState *ss, const SQChar *, SQInteger len, SQHash hash);
     SQInteger Next(const SQObjectPtr &refpos, SQObjectPtr &outkey, SQObjectPtr &outval);
     void Release();
     SQSharedState *_sharedstate;
@@ -21,7 +21,7 @@ SQTable::SQTable(SQSharedState *ss,SQInteger nInitialSize)
 void SQTable::Remove(const SQObjectPtr &key)
 {
 
-    _HashNode *n = _Get(key, HashObj(key) & (_numofnodes - 1));
+    _HashNode *n = _Find(key, HashObj(key) & (_numofnodes - 1));
     if (n) {
         n->val.Null();
         n->key.Null();
@@ -105,11 +105,25 @@ SQTable *SQTable::Clone()
     return nt;
 }
 
+SQTable::_HashNode *SQTable::_GetByContent(const SQObjectPtr &key,SQHash hash)
+{
+    SQString *s = _string(key);
+    _HashNode *n = &_nodes[hash];
+    do{
+        if(type(n->key) == OT_STRING) {
+            SQString *k = _string(n->key);
+            if(k->_hash == s->_hash && k->_len == s->_len && !memcmp(k->_val,s->_val,sq_rsl(s->_len)))
+                return n;
+        }
+    }while((n = n->next));
+    return NULL;
+}
+
 bool SQTable::Get(const SQObjectPtr &key,SQObjectPtr &val)
 {
     if(type(key) == OT_NULL)
         return false;
-    _HashNode *n = _Get(key, HashObj(key) & (_numofnodes - 1));
+    _HashNode *n = _Find(key, HashObj(key) & (_numofnodes - 1));
     if (n) {
         val = _realval(n->val);
         return true;
@@ -120,7 +134,7 @@ bool SQTable::NewSlot(const SQObjectPtr &key,const SQObjectPtr &val)
 {
     assert(type(key) != OT_NULL);
     SQHash h = HashObj(key) & (_numofnodes - 1);
-    _HashNode *n = _Get(key, h);
+    _HashNode *n = _Find(key, h);
     if (n) {
         n->val = val;
         return false;
@@ -194,7 +208,7 @@ SQInteger SQTable::Next(bool getweakrefs,const SQObjectPtr &refpos, SQObjectPtr
 
 bool SQTable::Set(const SQObjectPtr &key, const SQObjectPtr &val)
 {
-    _HashNode *n = _Get(key, HashObj(key) & (_numofnodes - 1));
+    _HashNode *n = _Find(key, HashObj(key) & (_numofnodes - 1));
     if (n) {
         n->val = val;
         return true;
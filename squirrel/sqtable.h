@@ -73,6 +73,15 @@ public:
         }while((n = n->next));
         return NULL;
     }
+    //frozen strings are not interned in any state, they are matched by content
+    _HashNode *_GetByContent(const SQObjectPtr &key,SQHash hash);
+    inline _HashNode *_Find(const SQObjectPtr &key,SQHash hash)
+    {
+        _HashNode *n = _Get(key,hash);
+        if(!n && type(key) == OT_STRING && (_isimmortal(this) || is_frozenstring(key)))
+            n = _GetByContent(key,hash);
+        return n;
+    }
     //for compiler use
     inline bool GetStr(const SQChar* key,SQInteger keylen,SQObjectPtr &val)
     {
@@ -99,6 +108,7 @@ public:
     SQInteger Next(bool getweakrefs,const SQObjectPtr &refpos, SQObjectPtr &outkey, SQObjectPtr &outval);
 
     SQInteger CountUsed(){ return _usednodes;}
+    SQInteger NodesSize(){ return _numofnodes * sizeof(_HashNode);}
     void Clear();
     void Release()
     {
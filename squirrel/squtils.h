@@ -12,10 +12,57 @@ void sq_vm_free(void *p,SQUnsignedInteger size);
 #define SQ_FREE(__ptr,__size) sq_vm_free((__ptr),(__size));
 #define SQ_REALLOC(__ptr,__oldsize,__size) sq_vm_realloc((__ptr),(__oldsize),(__size));
 
+//reference counts of objects shared between threads
+#ifdef _MSC_VER
+#include <intrin.h>
+#define sq_atomic_inc(__p) _InterlockedIncrement((__p))
+#define sq_atomic_dec(__p) _InterlockedDecrement((__p))
+#else
+#define sq_atomic_inc(__p) __atomic_add_fetch((__p),1,__ATOMIC_ACQ_REL)
+#define sq_atomic_dec(__p) __atomic_sub_fetch((__p),1,__ATOMIC_ACQ_REL)
+#endif
+
 #define sq_aligning(v) (((size_t)(v) + (SQ_ALIGNMENT-1)) & (~(SQ_ALIGNMENT-1)))
 
+#define SQ_ARENA_BUCKETS 32
+
+//bump allocator for short lived blocks, they are all freed at once when it is destroyed.
+//Blocks are rounded to powers of two; the ones given back are kept in a free list per size
+//and reused before the arena grows
+struct SQArena
+{
+    SQArena();
+    ~SQArena();
+    void *Alloc(SQUnsignedInteger size);
+    void *Realloc(void *p,SQUnsignedInteger oldsize,SQUnsignedInteger size);
+    void Free(void *p,SQUnsignedInteger size);
+private:
+    struct Chunk { Chunk *_next; SQUnsignedInteger _size; };
+    struct FreeBlock { FreeBlock *_next; };
+    Chunk *_chunks;
+    char *_top;
+    char *_end;
+    FreeBlock *_free[SQ_ARENA_BUCKETS];
+};
+
+//allocators of sqvector, the default one is stateless and uses the VM allocator
+struct sqvmallocator
+{
+    void *_vecrealloc(void *p,SQUnsignedInteger oldsize,SQUnsignedInteger size) { return SQ_REALLOC(p,oldsize,size); }
+    void _vecfree(void *p,SQUnsignedInteger size) { SQ_FREE(p,size); }
+};
+
+//takes the memory from an arena
+struct sqarenaallocator
+{
+    sqarenaallocator(SQArena *arena = NULL) { _arena = arena; }
+    void *_vecrealloc(void *p,SQUnsignedInteger oldsize,SQUnsignedInteger size) { return _arena->Realloc(p,oldsize,size); }
+    void _vecfree(void *p,SQUnsignedInteger size) { _arena->Free(p,size); }
+    SQArena *_arena;
+};
+
 //sqvector mini vector class, supports objects by value
-template<typename T> class sqvector
+template<typename T,typename A = sqvmallocator> class sqvector : private A
 {
 public:
     sqvector()
@@ -24,11 +71,17 @@ public:
         _size = 0;
         _allocated = 0;
     }
-    sqvector(const sqvector<T>& v)
+    explicit sqvector(const A &a) : A(a)
+    {
+        _vals = NULL;
+        _size = 0;
+        _allocated = 0;
+    }
+    sqvector(const sqvector<T,A>& v) : A(v)
     {
         copy(v);
     }
-    void copy(const sqvector<T>& v)
+    void copy(const sqvector<T,A>& v)
     {
         if(_size) {
             resize(0); //destroys all previous stuff
@@ -47,7 +100,7 @@ public:
         if(_allocated) {
             for(SQUnsignedInteger i = 0; i < _size; i++)
                 _vals[i].~T();
-            SQ_FREE(_vals, (_allocated * sizeof(T)));
+            A::_vecfree(_vals, (_allocated * sizeof(T)));
         }
     }
     void reserve(SQUnsignedInteger newsize) { _realloc(newsize); }
@@ -106,7 +159,7 @@ private:
     void _realloc(SQUnsignedInteger newsize)
     {
         newsize = (newsize > 0)?newsize:4;
-        _vals = (T*)SQ_REALLOC(_vals, _allocated * sizeof(T), newsize * sizeof(T));
+        _vals = (T*)A::_vecrealloc(_vals, _allocated * sizeof(T), newsize * sizeof(T));
         _allocated = newsize;
     }
     SQUnsignedInteger _size;
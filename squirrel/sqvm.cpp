@@ -14,6 +14,19 @@
 #include "sqarray.h"
 #include "sqclass.h"
 
+#ifdef SQ_OPCODE_CYCLES
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#define SQ_READCYCLES() ((SQUnsignedInteger)__rdtsc())
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <x86intrin.h>
+#define SQ_READCYCLES() ((SQUnsignedInteger)__rdtsc())
+#else
+//no time stamp counter, only the executions are counted
+#undef SQ_OPCODE_CYCLES
+#endif
+#endif
+
 #define TOP() (_stack._vals[_top-1])
 #define TARGET _stack._vals[_stackbase+arg0]
 #define STK(a) _stack._vals[_stackbase+(a)]
@@ -114,6 +127,9 @@ SQVM::SQVM(SQSharedState *ss)
     _suspended_target = -1;
     _suspended_root = SQFalse;
     _suspended_traps = -1;
+    _suspended_budget = SQFalse;
+    _budget = SQ_BUDGET_MAXTICKS;
+    _budgetmode = SQ_BUDGET_NONE;
     _foreignptr = NULL;
     _nnativecalls = 0;
     _nmetamethodscall = 0;
@@ -125,6 +141,7 @@ SQVM::SQVM(SQSharedState *ss)
     _openouters = NULL;
     ci = NULL;
     _releasehook = NULL;
+    _lightweight = false;
     INIT_CHAIN();ADD_TO_CHAIN(&_ss(this)->_gc_chain,this);
 }
 
@@ -356,8 +373,13 @@ bool SQVM::Init(SQVM *friendvm, SQInteger stacksize)
     _stackbase = 0;
     _top = 0;
     if(!friendvm) {
-        _roottable = SQTable::Create(_ss(this), 0);
-        sq_base_register(this);
+        if(_ss(this)->_template) {
+            _ss(this)->_template->Instantiate(this);
+        }
+        else {
+            _roottable = SQTable::Create(_ss(this), 0);
+            sq_base_register(this);
+        }
     }
     else {
         _roottable = friendvm->_roottable;
@@ -372,13 +394,19 @@ bool SQVM::Init(SQVM *friendvm, SQInteger stacksize)
 }
 
 
+static void ReverseStack(SQObjectPtr *p,SQInteger n)
+{
+    for(SQInteger i = 0, j = n - 1; i < j; i++, j--) _Swap(p[i],p[j]);
+}
+
 bool SQVM::StartCall(SQClosure *closure,SQInteger target,SQInteger args,SQInteger stackbase,bool tailcall)
 {
     SQFunctionProto *func = closure->_function;
+    if(func->_lazy && !func->LoadBody(this)) return false;
 
     SQInteger paramssize = func->_nparameters;
-    const SQInteger newtop = stackbase + func->_stacksize;
     SQInteger nargs = args;
+    SQInteger nstackvargs = -1;
     if(func->_varparams)
     {
         paramssize--;
@@ -389,15 +417,29 @@ bool SQVM::StartCall(SQClosure *closure,SQInteger target,SQInteger args,SQIntege
 
         //dumpstack(stackbase);
         SQInteger nvargs = nargs - paramssize;
-        SQArray *arr = SQArray::Create(_ss(this),nvargs);
-        SQInteger pbase = stackbase+paramssize;
-        for(SQInteger n = 0; n < nvargs; n++) {
-            arr->_values[n] = _stack._vals[pbase];
-            _stack._vals[pbase].Null();
-            pbase++;
+        if(func->_varparams == vpSTACK && !func->_bgenerator) {
+            //leaves the extra args where they are and moves the frame above them
+            if(nvargs) {
+                SQObjectPtr *p = &_stack._vals[stackbase];
+                ReverseStack(p, paramssize);
+                ReverseStack(p + paramssize, nvargs);
+                ReverseStack(p, paramssize + nvargs);
+                stackbase += nvargs;
+            }
+            _stack._vals[stackbase+paramssize].Null();
+            nstackvargs = nvargs;
+        }
+        else {
+            SQArray *arr = SQArray::Create(_ss(this),nvargs);
+            SQInteger pbase = stackbase+paramssize;
+            for(SQInteger n = 0; n < nvargs; n++) {
+                arr->_values[n] = _stack._vals[pbase];
+                _stack._vals[pbase].Null();
+                pbase++;
 
+            }
+            _stack._vals[stackbase+paramssize] = arr;
         }
-        _stack._vals[stackbase+paramssize] = arr;
         //dumpstack(stackbase);
     }
     else if (paramssize != nargs) {
@@ -418,16 +460,27 @@ bool SQVM::StartCall(SQClosure *closure,SQInteger target,SQInteger args,SQIntege
         _stack._vals[stackbase] = closure->_env->_obj;
     }
 
-    if(!EnterFrame(stackbase, newtop, tailcall)) return false;
+    if(!EnterFrame(stackbase, stackbase + func->_stacksize, tailcall)) return false;
 
     ci->_closure  = closure;
+    ci->_nvargs   = (SQInt32)(nstackvargs > 0 ? nstackvargs : 0);
+    ci->_stackvargv = nstackvargs != -1 ? SQTrue : SQFalse;
     ci->_literals = func->_literals;
     ci->_ip       = func->_instructions;
     ci->_target   = (SQInt32)target;
 
+    if (_ss(this)->_tracing) {
+        //a tail call replaces the frame of the caller
+        if(tailcall) _ss(this)->TraceEnd(this,SQ_TRACE_CALL);
+        _ss(this)->TraceBegin(this,SQ_TRACE_CALL,func->_name,func->_sourcename,func->_nlineinfos ? func->_lineinfos[0]._line : 0);
+    }
     if (_debughook) {
         CallDebugHook(_SC('c'));
     }
+    if (_ss(this)->_samplepending) {
+        CallSampleHook();
+    }
+    _budget--;
 
     if (closure->_function->_bgenerator) {
         SQFunctionProto *f = closure->_function;
@@ -581,6 +634,18 @@ bool SQVM::FOREACH_OP(SQObjectPtr &o1,SQObjectPtr &o2,SQObjectPtr
 
 #define _GUARD(exp) { if(!exp) { SQ_THROW();} }
 
+#define _CHECK_BUDGET() { \
+    if(_budget <= 0) { \
+        if(!OutOfBudget()) { SQ_THROW(); } \
+        if(_suspended) { \
+            _suspended_root = ci->_root; \
+            _suspended_traps = traps; \
+            outres.Null(); \
+            return true; \
+        } \
+    } \
+}
+
 bool SQVM::CLOSURE_OP(SQObjectPtr &target, SQFunctionProto *func)
 {
     SQInteger nouters;
@@ -590,6 +655,9 @@ bool SQVM::CLOSURE_OP(SQObjectPtr &target, SQFunctionProto *func)
             SQOuterVar &v = func->_outervalues[i];
             switch(v._type){
             case otLOCAL:
+                if(ci->_stackvargv && _integer(v._src) == _closure(ci->_closure)->_function->_nparameters - 1) {
+                    BuildVargv(*ci,_stackbase);
+                }
                 FindOuter(closure->_outervalues[i], &STK(_integer(v._src)));
                 break;
             case otOUTER:
@@ -641,6 +709,11 @@ bool SQVM::IsEqual(const SQObjectPtr &o1,const SQObjectPtr &o2,bool &res)
 {
     if(type(o1) == type(o2)) {
         res = (_rawval(o1) == _rawval(o2));
+        //frozen strings are not interned in the state
+        if(!res && (is_frozenstring(o1) || is_frozenstring(o2))) {
+            SQString *s1 = _string(o1), *s2 = _string(o2);
+            res = s1->_hash == s2->_hash && s1->_len == s2->_len && !memcmp(s1->_val,s2->_val,sq_rsl(s1->_len));
+        }
     }
     else {
         if(sq_isnumeric(o1) && sq_isnumeric(o2)) {
@@ -668,13 +741,46 @@ bool SQVM::IsFalse(SQObjectPtr &o)
     return false;
 }
 extern SQInstructionDesc g_InstrDesc[];
+//a thread run from another VM (thread.call(), a scheduler task) spends the
+//budget of that VM and gives back the ticks left when it returns or suspends
+struct AutoBudget{
+    AutoBudget(SQVM *v) {
+        _v = v;
+        _caller = _ss(v)->_runningvm;
+        if(_caller == v) return; //a metamethod or a native calling back
+        _ss(v)->_runningvm = v;
+        if(_caller) {
+            v->_budget = _caller->_budget;
+            v->_budgetmode = _caller->_budgetmode;
+        }
+    }
+    ~AutoBudget() {
+        if(_caller == _v) return;
+        _ss(_v)->_runningvm = _caller;
+        if(_caller) _caller->_budget = _v->_budget;
+    }
+    SQVM *_v;
+    SQVM *_caller;
+};
+
 bool SQVM::Execute(SQObjectPtr &closure, SQInteger nargs, SQInteger stackbase,SQObjectPtr &outres, SQBool raiseerror,ExecutionType et)
 {
     if ((_nnativecalls + 1) > MAX_NATIVE_CALLS) { Raise_Error(_SC("Native stack overflow")); return false; }
     _nnativecalls++;
     AutoDec ad(&_nnativecalls);
+    AutoBudget ab(this);
     SQInteger traps = 0;
     CallInfo *prevci = ci;
+#ifdef SQ_OPCODE_STATS
+    SQUnsignedInteger *opcount = _ss(this)->_opcount;
+#endif
+#ifdef SQ_OPCODE_CYCLES
+    //the cycles of an instruction are the ones elapsed until the next one is fetched
+    SQUnsignedInteger *opcycles = _ss(this)->_opcycles;
+    SQUnsignedInteger opstart = 0;
+    SQInteger lastop = -1;
+#endif
+    SQInstruction _brk_; //the instruction under the breakpoint being executed
 
     switch(et) {
         case ET_CALL: {
@@ -697,6 +803,7 @@ bool SQVM::Execute(SQObjectPtr &closure, SQInteger nargs, SQInteger stackbase,SQ
             traps = _suspended_traps;
             ci->_root = _suspended_root;
             _suspended = SQFalse;
+            _suspended_budget = SQFalse;
             if(et  == ET_RESUME_THROW_VM) { SQ_THROW(); }
             break;
     }
@@ -706,12 +813,34 @@ exception_restore:
     {
         for(;;)
         {
-            const SQInstruction &_i_ = *ci->_ip++;
+            const SQInstruction *_pi_ = ci->_ip++;
+#ifdef SQ_OPCODE_STATS
+            opcount[_pi_->op]++;
+#endif
+#ifdef SQ_OPCODE_CYCLES
+            {
+                SQUnsignedInteger now = SQ_READCYCLES();
+                if(lastop >= 0) opcycles[lastop] += now - opstart;
+                opstart = now;
+                lastop = _pi_->op;
+            }
+#endif
             //dumpstack(_stackbase);
             //scprintf("\n[%d] %s %d %d %d %d\n",ci->_ip-_closure(ci->_closure)->_function->_instructions,g_InstrDesc[_i_.op].name,arg0,arg1,arg2,arg3);
+dispatch:
+            const SQInstruction &_i_ = *_pi_;
             switch(_i_.op)
             {
-            case _OP_LINE: if (_debughook) CallDebugHook(_SC('l'),arg1); continue;
+            case _OP_LINE:
+                if(_ss(this)->_coverageenabled) {
+                    SQFunctionProto *f = _closure(ci->_closure)->_function;
+                    SQUnsignedInteger op = (SQUnsignedInteger)(ci->_ip - f->_instructions) - 1;
+                    //a frame started before a breakpoint copied the code runs out of it
+                    if(op < (SQUnsignedInteger)f->_ninstructions && (f->_coverage || _ss(this)->StartCoverage(f)))
+                        f->_coverage[op >> 3] |= (unsigned char)(1 << (op & 7));
+                }
+                if (_debughook) CallDebugHook(_SC('l'),arg1);
+                continue;
             case _OP_LOAD: TARGET = ci->_literals[arg1]; continue;
             case _OP_LOADINT:
 #ifndef _SQ64
@@ -723,12 +852,15 @@ exception_restore:
             case _OP_DLOAD: TARGET = ci->_literals[arg1]; STK(arg2) = ci->_literals[arg3];continue;
             case _OP_TAILCALL:{
                 SQObjectPtr &t = STK(arg1);
+                if (type(t) == OT_CLOSURE && _closure(t)->_function->_lazy) _GUARD(_closure(t)->_function->LoadBody(this));
                 if (type(t) == OT_CLOSURE
                     && (!_closure(t)->_function->_bgenerator)){
                     SQObjectPtr clo = t;
-                    if(_openouters) CloseOuters(&(_stack._vals[_stackbase]));
-                    for (SQInteger i = 0; i < arg3; i++) STK(i) = STK(arg2 + i);
-                    _GUARD(StartCall(_closure(clo), ci->_target, arg3, _stackbase, true));
+                    SQInteger base = _stackbase - ci->_nvargs;
+                    if(_openouters) CloseOuters(&(_stack._vals[base]));
+                    for (SQInteger i = 0; i < arg3; i++) _stack._vals[base + i] = STK(arg2 + i);
+                    _GUARD(StartCall(_closure(clo), ci->_target, arg3, base, true));
+                    _CHECK_BUDGET();
                     continue;
                 }
                               }
@@ -737,6 +869,7 @@ exception_restore:
                     switch (type(clo)) {
                     case OT_CLOSURE:
                         _GUARD(StartCall(_closure(clo), sarg0, arg3, _stackbase+arg2, false));
+                        _CHECK_BUDGET();
                         continue;
                     case OT_NATIVECLOSURE: {
                         bool suspend;
@@ -744,6 +877,11 @@ exception_restore:
                         if(suspend){
                             _suspended = SQTrue;
                             _suspended_target = sarg0;
+                            if(_suspended_budget) {
+                                //sq_suspendbudget(), the call is made again on wakeup
+                                ci->_ip--;
+                                _suspended_target = -1;
+                            }
                             _suspended_root = ci->_root;
                             _suspended_traps = traps;
                             outres = clo;
@@ -766,6 +904,7 @@ exception_restore:
                                 stkbase = _stackbase+arg2;
                                 _stack._vals[stkbase] = inst;
                                 _GUARD(StartCall(_closure(clo), -1, arg3, stkbase, false));
+                                _CHECK_BUDGET();
                                 break;
                             case OT_NATIVECLOSURE:
                                 bool suspend;
@@ -868,7 +1007,14 @@ exception_restore:
                 continue;
             case _OP_LOADBOOL: TARGET = arg1?true:false; continue;
             case _OP_DMOVE: STK(arg0) = STK(arg1); STK(arg2) = STK(arg3); continue;
-            case _OP_JMP: ci->_ip += (sarg1); continue;
+            case _OP_JMP:
+                ci->_ip += (sarg1);
+                if(sarg1 < 0) {
+                    if(_ss(this)->_samplepending) CallSampleHook();
+                    _budget--;
+                    _CHECK_BUDGET();
+                }
+                continue;
             //case _OP_JNZ: if(!IsFalse(STK(arg0))) ci->_ip+=(sarg1); continue;
             case _OP_JCMP:
                 _GUARD(CMP_OP((CmpOP)arg3,STK(arg2),STK(arg0),temp_reg));
@@ -987,6 +1133,8 @@ exception_restore:
             case _OP_CLOSURE: {
                 SQClosure *c = ci->_closure._unVal.pClosure;
                 SQFunctionProto *fp = c->_function;
+                //nested functions of a bytecode stream are loaded on first use
+                if(type(fp->_functions[arg1]) != OT_FUNCPROTO && !fp->LoadFunction(this,arg1)) { SQ_THROW(); }
                 if(!CLOSURE_OP(TARGET,fp->_functions[arg1]._unVal.pFunctionProto)) { SQ_THROW(); }
                 continue;
             }
@@ -1052,6 +1200,104 @@ exception_restore:
             case _OP_CLOSE:
                 if(_openouters) CloseOuters(&(STK(arg1)));
                 continue;
+            case _OP_VARGC:
+                if(ci->_stackvargv) {
+                    TARGET = SQInteger(ci->_nvargs);
+                    ci->_ip += arg1;
+                }
+                continue;
+            case _OP_GETVARG:
+                if(ci->_stackvargv) {
+                    SQObjectPtr &idx = STK(arg2);
+                    if(type(idx) == OT_INTEGER && _integer(idx) >= 0 && _integer(idx) < ci->_nvargs) {
+                        TARGET = _stack._vals[_stackbase - ci->_nvargs + _integer(idx)];
+                        continue;
+                    }
+                    BuildVargv(*ci,_stackbase);
+                }
+                if (!Get(STK(arg1), STK(arg2), temp_reg, 0,arg1)) { SQ_THROW(); }
+                _Swap(TARGET,temp_reg);//TARGET = temp_reg;
+                continue;
+            case _OP_VARGV:
+                if(ci->_stackvargv) BuildVargv(*ci,_stackbase);
+                continue;
+            //superinstructions, when the fast path doesn't apply the second
+            //instruction is left to the next dispatch; it may also have been
+            //replaced by a breakpoint
+            case _OP_LOADINT_JCMP: {
+                TARGET = (SQInteger)sarg1;
+                const SQInstruction &_n_ = *ci->_ip;
+                SQObjectPtr &o1 = STK(_n_._arg2), &o2 = STK(_n_._arg0);
+                if(_n_.op != _OP_BREAK && type(o1) == OT_INTEGER && type(o2) == OT_INTEGER) {
+                    SQInteger i1 = _integer(o1), i2 = _integer(o2);
+                    bool res;
+                    switch(_n_._arg3) {
+                        case CMP_G: res = i1 > i2; break;
+                        case CMP_GE: res = i1 >= i2; break;
+                        case CMP_L: res = i1 < i2; break;
+                        case CMP_LE: res = i1 <= i2; break;
+                        default: continue;
+                    }
+                    ci->_ip++;
+                    if(!res) ci->_ip += *((const SQInt32 *)&_n_._arg1);
+                }
+                               }
+                continue;
+            case _OP_LOADINT_ADD:
+            case _OP_LOADINT_SUB: {
+                TARGET = (SQInteger)sarg1;
+                const SQInstruction &_n_ = *ci->_ip;
+                SQObjectPtr &o1 = STK(_n_._arg2), &o2 = STK(_n_._arg1);
+                if(_n_.op != _OP_BREAK && type(o1) == OT_INTEGER && type(o2) == OT_INTEGER) {
+                    ci->_ip++;
+                    STK(_n_._arg0) = _i_.op == _OP_LOADINT_ADD ? _integer(o1) + _integer(o2) : _integer(o1) - _integer(o2);
+                }
+                                  }
+                continue;
+            case _OP_PINCL_JMP: {
+                SQObjectPtr &a = STK(arg1);
+                if(type(a) == OT_INTEGER) {
+                    TARGET = a;
+                    a._unVal.nInteger = _integer(a) + sarg3;
+                }
+                else {
+                    SQObjectPtr o(sarg3); _GUARD(PLOCAL_INC('+',TARGET, STK(arg1), o));
+                }
+                if(ci->_ip->op == _OP_BREAK) continue;
+                SQInt32 offset = *((const SQInt32 *)&ci->_ip->_arg1);
+                ci->_ip += offset + 1;
+                if(offset < 0) {
+                    if(_ss(this)->_samplepending) CallSampleHook();
+                    _budget--;
+                    _CHECK_BUDGET();
+                }
+                                }
+                continue;
+            case _OP_PREPCALLK_CALL: {
+                SQObjectPtr &o = STK(arg2);
+                if (!Get(o, ci->_literals[arg1], temp_reg,0,arg2)) {
+                    SQ_THROW();
+                }
+                STK(arg3) = o;
+                _Swap(TARGET,temp_reg);//TARGET = temp_reg;
+                const SQInstruction &_n_ = *ci->_ip;
+                SQObjectPtr &clo = STK(_n_._arg1);
+                if(_n_.op != _OP_BREAK && type(clo) == OT_CLOSURE) {
+                    ci->_ip++;
+                    _GUARD(StartCall(_closure(clo), (SQInteger)*((const signed char *)&_n_._arg0), _n_._arg3, _stackbase+_n_._arg2, false));
+                    _CHECK_BUDGET();
+                }
+                                     }
+                continue;
+            case _OP_BREAK: {
+                SQInteger op = CallBreakHook(ci->_ip - 1);
+                if(op < 0) { Raise_Error(_SC("invalid breakpoint")); SQ_THROW(); }
+                //only the opcode was patched, the arguments are still valid
+                _brk_ = _i_;
+                _brk_.op = (unsigned char)op;
+                _pi_ = &_brk_;
+                goto dispatch;
+                            }
             }
 
         }
@@ -1135,6 +1381,44 @@ void SQVM::CallDebugHook(SQInteger type,SQInteger forcedline)
     _debughook = true;
 }
 
+//called when _budget drops to 0, returns false after raising the error of
+//SQ_BUDGET_THROW. a suspension is delayed until the VM is back in the outer
+//Execute, as sq_suspendvm() the budget can't suspend through native calls
+bool SQVM::OutOfBudget()
+{
+    switch(_budgetmode) {
+    case SQ_BUDGET_THROW:
+        Raise_Error(_SC("execution budget exhausted"));
+        return false;
+    case SQ_BUDGET_SUSPEND:
+        if(_nnativecalls == 1) {
+            _suspended = SQTrue;
+            _suspended_target = -1;
+            _suspended_budget = SQTrue;
+        }
+        return true;
+    default:
+        _budget = SQ_BUDGET_MAXTICKS;
+        return true;
+    }
+}
+
+void SQVM::CallSampleHook()
+{
+    SQSharedState *ss = _ss(this);
+    ss->_samplepending = 0;
+    if(ss->_samplehook) ss->_samplehook(this,ss->_samplehookup);
+}
+
+SQInteger SQVM::CallBreakHook(const SQInstruction *ip)
+{
+    SQSharedState *ss = _ss(this);
+    SQInteger id;
+    SQInteger op = ss->GetBreakpoint(ip,&id);
+    if(op >= 0 && ss->_breakhook) ss->_breakhook(this,id,ss->_breakhookup);
+    return op;
+}
+
 bool SQVM::CallNative(SQNativeClosure *nclosure, SQInteger nargs, SQInteger newbase, SQObjectPtr &retval, bool &suspend)
 {
     SQInteger nparamscheck = nclosure->_nparamscheck;
@@ -1165,6 +1449,7 @@ bool SQVM::CallNative(SQNativeClosure *nclosure, SQInteger nargs, SQInteger newb
 
     if(!EnterFrame(newbase, newtop, false)) return false;
     ci->_closure  = nclosure;
+    if(_ss(this)->_tracing) _ss(this)->TraceBegin(this,SQ_TRACE_NATIVE,nclosure->_name,SQObjectPtr(),0);
 
     SQInteger outers = nclosure->_noutervalues;
     for (SQInteger i = 0; i < outers; i++) {
@@ -1316,6 +1601,7 @@ SQInteger SQVM::FallBackGet(const SQObjectPtr &self,const SQObjectPtr &key,SQObj
 
 bool SQVM::Set(const SQObjectPtr &self,const SQObjectPtr &key,const SQObjectPtr &val,SQInteger selfidx)
 {
+    if(is_frozen(self)) { Raise_FrozenError(self); return false; }
     switch(type(self)){
     case OT_TABLE:
         if(_table(self)->Set(key,val)) return true;
@@ -1387,6 +1673,23 @@ bool SQVM::Clone(const SQObjectPtr &self,SQObjectPtr &target)
 {
     SQObjectPtr temp_reg;
     SQObjectPtr newobj;
+    if(is_frozen(self)) {
+        //the clone of a frozen object is a mutable copy owned by this state
+        if(type(self) == OT_TABLE) {
+            SQTable *t = SQTable::Create(_ss(this),_table(self)->CountUsed());
+            SQObjectPtr key,val;
+            SQInteger ridx = 0;
+            newobj = t;
+            while((ridx = _table(self)->Next(false,ridx,key,val)) != -1) NewSlot(newobj,key,val,false);
+        }
+        else {
+            SQArray *a = SQArray::Create(_ss(this),0);
+            newobj = a;
+            a->_values.copy(_array(self)->_values);
+        }
+        target = newobj;
+        return true;
+    }
     switch(type(self)){
     case OT_TABLE:
         newobj = _table(self)->Clone();
@@ -1440,6 +1743,12 @@ bool SQVM::NewSlotA(const SQObjectPtr &self,const SQObjectPtr &key,const SQObjec
 bool SQVM::NewSlot(const SQObjectPtr &self,const SQObjectPtr &key,const SQObjectPtr &val,bool bstatic)
 {
     if(type(key) == OT_NULL) { Raise_Error(_SC("null cannot be used as index")); return false; }
+    if(is_frozen(self)) { Raise_FrozenError(self); return false; }
+    if(is_frozenstring(key)) {
+        //slots are always created with the strings of the state
+        SQObjectPtr k = SQString::Create(_ss(this),_stringval(key),_string(key)->_len);
+        return NewSlot(self,k,val,bstatic);
+    }
     switch(type(self)) {
     case OT_TABLE: {
         bool rawcall = true;
@@ -1500,6 +1809,7 @@ bool SQVM::NewSlot(const SQObjectPtr &self,const SQObjectPtr &key,const SQObject
 
 bool SQVM::DeleteSlot(const SQObjectPtr &self,const SQObjectPtr &key,SQObjectPtr &res)
 {
+    if(is_frozen(self)) { Raise_FrozenError(self); return false; }
     switch(type(self)) {
     case OT_TABLE:
     case OT_INSTANCE:
@@ -1624,25 +1934,60 @@ bool SQVM::EnterFrame(SQInteger newbase, SQInteger newtop, bool tailcall)
         ci->_ncalls = 1;
         ci->_generator = NULL;
         ci->_root = SQFalse;
+        ci->_nvargs = 0;
+        ci->_stackvargv = SQFalse;
     }
     else {
+        ci->_prevstkbase += (SQInt32)(newbase - _stackbase);
         ci->_ncalls++;
     }
 
     _stackbase = newbase;
     _top = newtop;
-    if(newtop + MIN_STACK_OVERHEAD > (SQInteger)_stack.size()) {
+    if(newtop + MIN_STACK_HEADROOM > (SQInteger)_stack.size()) {
         if(_nmetamethodscall) {
+            if(newtop + MIN_STACK_OVERHEAD <= (SQInteger)_stack.size()) return true;
             Raise_Error(_SC("stack overflow, cannot resize stack while in a metamethod"));
             return false;
         }
-        _stack.resize(newtop + (MIN_STACK_OVERHEAD << 2));
+        SQInteger newsize = _stack.size() << 1;
+        if(newsize < newtop + MIN_STACK_HEADROOM) newsize = newtop + MIN_STACK_HEADROOM;
+        _stack.resize(newsize);
+        RelocateOuters();
+    }
+    return true;
+}
+
+bool SQVM::ShrinkStack()
+{
+    if((_callsstacksize && !_suspended) || _nmetamethodscall) return false;
+    //the frames below the current one can have a higher top
+    SQInteger maxtop = _top;
+    SQInteger base = _stackbase;
+    for(SQInteger i = _callsstacksize - 1; i >= 0; i--) {
+        CallInfo &c = _callsstack[i];
+        base -= c._prevstkbase;
+        if(base + c._prevtop > maxtop) maxtop = base + c._prevtop;
+    }
+    SQInteger newsize = maxtop + MIN_STACK_OVERHEAD;
+    if(newsize < (SQInteger)_stack.size()) {
+        _stack.resize(newsize);
+        _stack.shrinktofit();
         RelocateOuters();
     }
+    if(_callsstacksize < (_alloccallsstacksize >> 1)) {
+        SQInteger newcalls = _callsstacksize > 4 ? _callsstacksize : 4;
+        _callstackdata.resize(newcalls);
+        _callstackdata.shrinktofit();
+        _callsstack = &_callstackdata[0];
+        _alloccallsstacksize = newcalls;
+        ci = _callsstacksize ? &_callsstack[_callsstacksize-1] : NULL;
+    }
     return true;
 }
 
 void SQVM::LeaveFrame() {
+    if(_ss(this)->_tracing) _ss(this)->TraceEnd(this,type(ci->_closure) == OT_NATIVECLOSURE ? SQ_TRACE_NATIVE : SQ_TRACE_CALL);
     SQInteger last_top = _top;
     SQInteger last_stackbase = _stackbase;
     SQInteger css = --_callsstacksize;
@@ -1659,6 +2004,18 @@ void SQVM::LeaveFrame() {
     }
 }
 
+void SQVM::BuildVargv(CallInfo &info,SQInteger stackbase)
+{
+    SQInteger nvargs = info._nvargs;
+    SQArray *arr = SQArray::Create(_ss(this),nvargs);
+    SQObjectPtr *args = &_stack._vals[stackbase - nvargs];
+    for(SQInteger n = 0; n < nvargs; n++) {
+        _Swap(arr->_values[n],args[n]);
+    }
+    _stack._vals[stackbase + _closure(info._closure)->_function->_nparameters - 1] = arr;
+    info._stackvargv = SQFalse;
+}
+
 void SQVM::RelocateOuters()
 {
     SQOuter *p = _openouters;
@@ -6,6 +6,9 @@
 #include "sqobject.h"
 #define MAX_NATIVE_CALLS 100
 #define MIN_STACK_OVERHEAD 15
+//free slots kept above _top outside metamethods, where the stack cannot move.
+//idle threads are trimmed to MIN_STACK_OVERHEAD and get it back on wakeup
+#define MIN_STACK_HEADROOM (MIN_STACK_OVERHEAD << 2)
 
 #define SQ_SUSPEND_FLAG -666
 #define DONT_FALL_BACK 666
@@ -44,6 +47,8 @@ struct SQVM : public CHAINABLE_OBJ
         SQInt32 _target;
         SQInt32 _ncalls;
         SQBool _root;
+        SQInt32 _nvargs; //extra args left on the stack below _stackbase
+        SQBool _stackvargv; //vargv not built yet, read it from the stack
     };
 
 typedef sqvector<CallInfo> CallInfoVec;
@@ -63,8 +68,11 @@ public:
     //call a generic closure pure SQUIRREL or NATIVE
     bool Call(SQObjectPtr &closure, SQInteger nparams, SQInteger stackbase, SQObjectPtr &outres,SQBool raiseerror);
     SQRESULT Suspend();
+    bool OutOfBudget();
 
     void CallDebugHook(SQInteger type,SQInteger forcedline=0);
+    void CallSampleHook();
+    SQInteger CallBreakHook(const SQInstruction *ip);
     void CallErrorHandler(SQObjectPtr &e);
     bool Get(const SQObjectPtr &self, const SQObjectPtr &key, SQObjectPtr &dest, SQUnsignedInteger getflags, SQInteger selfidx);
     SQInteger FallBackGet(const SQObjectPtr &self,const SQObjectPtr &key,SQObjectPtr &dest);
@@ -85,11 +93,13 @@ public:
     void Raise_Error(const SQChar *s, ...);
     void Raise_Error(const SQObjectPtr &desc);
     void Raise_IdxError(const SQObjectPtr &o);
+    void Raise_FrozenError(const SQObjectPtr &o);
     void Raise_CompareError(const SQObject &o1, const SQObject &o2);
     void Raise_ParamTypeError(SQInteger nparam,SQInteger typemask,SQInteger type);
 
     void FindOuter(SQObjectPtr &target, SQObjectPtr *stackindex);
     void RelocateOuters();
+    void BuildVargv(CallInfo &info,SQInteger stackbase);
     void CloseOuters(SQObjectPtr *stackindex);
 
     bool TypeOf(const SQObjectPtr &obj1, SQObjectPtr &dest);
@@ -125,6 +135,7 @@ public:
     }
     bool EnterFrame(SQInteger newbase, SQInteger newtop, bool tailcall);
     void LeaveFrame();
+    bool ShrinkStack();
     void Release(){ sq_delete(this,SQVM); }
 ////////////////////////////////////////////////////////////////////////////
     //stack functions for the api
@@ -170,13 +181,21 @@ public:
     SQInteger _nnativecalls;
     SQInteger _nmetamethodscall;
     SQRELEASEHOOK _releasehook;
+    //the gc gives back the unused stack when idle or suspended
+    bool _lightweight;
     //suspend infos
     SQBool _suspended;
     SQBool _suspended_root;
     SQInteger _suspended_target;
     SQInteger _suspended_traps;
+    SQBool _suspended_budget; //suspended because the budget ran out
+    //decremented at every call and backward jump, see OutOfBudget()
+    SQInteger _budget;
+    SQInteger _budgetmode;
 };
 
+#define SQ_BUDGET_MAXTICKS ((SQInteger)(((SQUnsignedInteger)~0)>>1))
+
 struct AutoDec{
     AutoDec(SQInteger *n) { _n = n; }
     ~AutoDec() { (*_n)--; }
@@ -187,6 +206,8 @@ inline SQObjectPtr &stack_get(HSQUIRRELVM v,SQInteger idx){return ((idx>=0)?(v->
 
 #define _ss(_vm_) (_vm_)->_sharedstate
 
+#define _CHECK_NOT_FROZEN(v,o) { if(is_frozen(o)) { (v)->Raise_FrozenError(o); return SQ_ERROR; } }
+
 #ifndef NO_GARBAGE_COLLECTOR
 #define _opt_ss(_vm_) (_vm_)->_sharedstate
 #else